@@ -0,0 +1,678 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "../cnm.c"
+
+// Buffers are big enough to hold everything a generated source can produce
+#define BENCH_REGION_SIZE (64 * 1024 * 1024)
+#define BENCH_GLOBALS_SIZE (64 * 1024 * 1024)
+#define BENCH_CODE_SIZE (1024 * 1024)
+
+static uint8_t *bench_region;
+static uint8_t *bench_globals;
+static uint8_t *bench_code;
+
+// Shared scratch buffer for generated sources
+static char *bench_src;
+static size_t bench_srclen, bench_srccap;
+
+static void bench_errcb(int line, const char *verbose, const char *simple) {
+    fprintf(stderr, "\n%s", verbose);
+}
+
+// Current time in seconds
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static cnm_t *bench_cnm_init(void) {
+    cnm_t *cnm = cnm_init(bench_region, BENCH_REGION_SIZE,
+                          bench_code, BENCH_CODE_SIZE,
+                          bench_globals, BENCH_GLOBALS_SIZE);
+    cnm_set_errcb(cnm, bench_errcb);
+    return cnm;
+}
+
+// Append formatted text to the generated source buffer
+static void bench_src_printf(const char *fmt, ...) {
+    va_list args;
+    while (true) {
+        va_start(args, fmt);
+        const int len = vsnprintf(bench_src + bench_srclen, bench_srccap - bench_srclen,
+                                  fmt, args);
+        va_end(args);
+        if (bench_srclen + len < bench_srccap) {
+            bench_srclen += len;
+            return;
+        }
+
+        bench_srccap = bench_srccap ? bench_srccap * 2 : 4096;
+        bench_src = realloc(bench_src, bench_srccap);
+    }
+}
+
+static void bench_src_reset(void) {
+    bench_srclen = 0;
+    if (bench_src) bench_src[0] = '\0';
+}
+
+// Print out the result of one benchmark
+static void bench_report(const char *name, const char *what, double value, const char *unit) {
+    printf("%-32s %-24s %12.2f %s\n", name, what, value, unit);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Lexer benchmarks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Generates a source file that looks like a typical gameplay script
+static void bench_gen_lexer_src(size_t target_size) {
+    bench_src_reset();
+    for (int i = 0; bench_srclen < target_size; i++) {
+        bench_src_printf(
+            "struct entity_component_%d {\n"
+            "    unsigned int health_points;\n"
+            "    float position_x, position_y;\n"
+            "    char display_name[16];\n"
+            "    long long spawn_timer : 12;\n"
+            "};\n"
+            "\n"
+            "static const long long counter_%d = 0x%x + %d * 3 - (7 << 2);\n"
+            "const char *greeting_%d = \"hello adventurer\";\n"
+            "double weight_%d = %d.25;\n"
+            "\n", i, i, i, i, i, i, i);
+    }
+}
+
+// Lexes the whole generated source over and over and reports the throughput
+static double bench_lex_src(size_t *ntokens) {
+    double best = 1e30;
+    for (int run = 0; run < 10; run++) {
+        cnm_t *cnm = bench_cnm_init();
+        cnm_set_src(cnm, bench_src, "bench_lexer");
+
+        const double start = bench_now();
+        *ntokens = 0;
+        while (token_next(cnm)->type != TOKEN_EOF) ++*ntokens;
+        const double time = bench_now() - start;
+        if (time < best) best = time;
+    }
+
+    return bench_srclen / best / (1024 * 1024);
+}
+
+static void bench_lexer(void) {
+    bench_gen_lexer_src(8 * 1024 * 1024);
+
+    size_t ntokens;
+    bench_report("bench_lexer", "throughput", bench_lex_src(&ntokens), "MB/s");
+    bench_report("bench_lexer", "tokens", ntokens, "");
+}
+
+// Same as bench_lexer, but once per scanner implementation the cpu supports
+static void bench_lexer_scanners(void) {
+    const lex_scanners_t *impls[3] = { &lex_scanners_scalar };
+    const char *names[3] = { "scalar throughput" };
+    int nimpls = 1;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("sse2")) {
+        impls[nimpls] = &lex_scanners_sse2;
+        names[nimpls++] = "sse2 throughput";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impls[nimpls] = &lex_scanners_avx2;
+        names[nimpls++] = "avx2 throughput";
+    }
+#endif
+
+    bench_gen_lexer_src(8 * 1024 * 1024);
+    for (int i = 0; i < nimpls; i++) {
+        size_t ntokens;
+        lex_scan = *impls[i];
+        bench_report("bench_lexer_scanners", names[i], bench_lex_src(&ntokens), "MB/s");
+    }
+    lex_scanners_init();
+}
+
+// A dialogue table full of long, unique string literals with escapes, so
+// lexing time is dominated by decoding strings
+static void bench_lexer_strings(void) {
+    bench_src_reset();
+    for (int i = 0; bench_srclen < 8 * 1024 * 1024; i++) {
+        bench_src_printf("const char *dialogue_%d = \"[%d] Greetings, traveler! The road "
+                         "north is\\tdangerous,\\n\"\n"
+                         "    \"so keep your \\\"sword\\\" close and your torch lit.\\n\";\n"
+                         "const unsigned int *dialogue_wide_%d = U\"[%d] \u00bfD\u00f3nde "
+                         "est\u00e1 la taberna?\";\n", i, i, i, i);
+    }
+
+    size_t ntokens;
+    bench_report("bench_lexer_strings", "throughput", bench_lex_src(&ntokens), "MB/s");
+    bench_report("bench_lexer_strings", "tokens", ntokens, "");
+}
+
+// String tables in plain ascii, mostly ascii with some accents, and mostly
+// CJK, with each line in both a utf8 and a utf32 string
+static void bench_lexer_utf8(void) {
+    static const struct { const char *what, *text; } inputs[] = {
+        { "ascii throughput", "The merchant will buy your old sword for twelve gold coins." },
+        { "mixed throughput", "Le marchand ach\u00e8te ton \u00e9p\u00e9e pour douze pi\u00e8ces." },
+        { "cjk throughput", "\u5546\u4eba\u4f1a\u7528\u5341\u4e8c\u679a\u91d1\u5e01"
+                            "\u8d2d\u4e70\u4f60\u7684\u65e7\u5251\u3002\u5546\u4eba"
+                            "\u4f1a\u7528\u5341\u4e8c\u679a\u91d1\u5e01\u8d2d\u4e70" },
+    };
+
+    for (int i = 0; i < arrlen(inputs); i++) {
+        bench_src_reset();
+        for (int j = 0; bench_srclen < 8 * 1024 * 1024; j++) {
+            bench_src_printf("const char *line_%d = u8\"%d: %s\";\n"
+                             "const unsigned int *line_wide_%d = U\"%d: %s\";\n",
+                             j, j, inputs[i].text, j, j, inputs[i].text);
+        }
+
+        size_t ntokens;
+        bench_report("bench_lexer_utf8", inputs[i].what, bench_lex_src(&ntokens), "MB/s");
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Parser benchmarks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Compiles the generated source over and over and returns the best time in
+// seconds
+static double bench_parse_src(const char *fname) {
+    double best = 1e30;
+    for (int run = 0; run < 10; run++) {
+        cnm_t *cnm = bench_cnm_init();
+
+        const double start = bench_now();
+        if (!cnm_parse(cnm, bench_src, fname)) {
+            fprintf(stderr, "%s: failed to compile\n", fname);
+            exit(1);
+        }
+        const double time = bench_now() - start;
+        if (time < best) best = time;
+    }
+
+    return best;
+}
+
+// Lots of typedefs and globals with long, similar names so that compile time
+// is dominated by symbol lookups
+static void bench_symbols(void) {
+    const int nsymbols = 2000;
+
+    bench_src_reset();
+    for (int i = 0; i < nsymbols; i++) {
+        bench_src_printf("typedef unsigned int entity_component_handle_%d_t;\n", i);
+    }
+    for (int i = 0; i < nsymbols; i++) {
+        bench_src_printf("entity_component_handle_%d_t entity_component_global_%d = %d;\n",
+                         nsymbols - i - 1, i, i);
+    }
+
+    const double time = bench_parse_src("bench_symbols");
+    bench_report("bench_symbols", "compile time", time * 1000.0, "ms");
+    bench_report("bench_symbols", "throughput", bench_srclen / time / (1024 * 1024), "MB/s");
+}
+
+// A generated data table with lots of globals, so compile time is dominated
+// by redeclaration checks
+static void bench_globals10k(void) {
+    const int nglobals = 10000;
+
+    bench_src_reset();
+    for (int i = 0; i < nglobals; i++) {
+        bench_src_printf("const int data_table_entry_%d = %d;\n", i, i * 7);
+    }
+
+    const double time = bench_parse_src("bench_globals10k");
+    bench_report("bench_globals10k", "compile time", time * 1000.0, "ms");
+    bench_report("bench_globals10k", "throughput", bench_srclen / time / (1024 * 1024), "MB/s");
+}
+
+// Many structs that embed earlier structs, so compile time is dominated by
+// struct layout
+static void bench_structs(void) {
+    const int nstructs = 2000;
+
+    bench_src_reset();
+    bench_src_printf("struct component_0 { int id; };\n");
+    for (int i = 1; i < nstructs; i++) {
+        bench_src_printf("struct component_%d {\n"
+                         "    struct component_%d base;\n"
+                         "    struct component_%d parts[2];\n"
+                         "    struct component_%d *link;\n"
+                         "    double weight;\n"
+                         "};\n", i, i - 1, i / 2, i / 3);
+    }
+
+    const double time = bench_parse_src("bench_structs");
+    bench_report("bench_structs", "compile time", time * 1000.0, "ms");
+    bench_report("bench_structs", "throughput", bench_srclen / time / (1024 * 1024), "MB/s");
+}
+
+// Game state where small counters are declared between big lookup tables, so
+// the counters end up spread across the global buffer
+static void bench_globals_mixed(void) {
+    const int nblocks = 2000;
+
+    bench_src_reset();
+    for (int i = 0; i < nblocks; i++) {
+        bench_src_printf("char flag_%d = %d;\n"
+                         "double weight_%d = %d.5;\n"
+                         "char name_%d[5] = \"n%d\";\n"
+                         "short count_%d = %d;\n", i, i & 1, i, i, i, i % 1000, i, i);
+    }
+
+    cnm_t *cnm = bench_cnm_init();
+    if (!cnm_parse(cnm, bench_src, "bench_globals_mixed")) exit(1);
+    const size_t before = cnm_get_global_size(cnm);
+    const double start = bench_now();
+    const size_t saved = cnm_pack_globals(cnm);
+    const double pack = bench_now() - start;
+
+    const double time = bench_parse_src("bench_globals_mixed");
+    bench_report("bench_globals_mixed", "compile time", time * 1000.0, "ms");
+    bench_report("bench_globals_mixed", "pack time", pack * 1000.0, "ms");
+    bench_report("bench_globals_mixed", "globals", before / 1024.0, "KB");
+    bench_report("bench_globals_mixed", "bytes saved", saved / 1024.0, "KB");
+}
+
+static void bench_quiet_errcb(int line, const char *verbose, const char *simple) {
+}
+
+// A large file where every line produces a warning, so compile time is
+// dominated by building diagnostics
+static void bench_warnings(void) {
+    const int nlines = 20000;
+
+    bench_src_reset();
+    for (int i = 0; i < nlines; i++) {
+        bench_src_printf("const int data_table_entry_%d = %d;\nint;\n", i, i);
+    }
+
+    double best = 1e30;
+    for (int run = 0; run < 10; run++) {
+        cnm_t *cnm = bench_cnm_init();
+        cnm_set_errcb(cnm, bench_quiet_errcb);
+
+        const double start = bench_now();
+        if (!cnm_parse(cnm, bench_src, "bench_warnings")) exit(1);
+        const double time = bench_now() - start;
+        if (time < best) best = time;
+    }
+
+    bench_report("bench_warnings", "compile time", best * 1000.0, "ms");
+    bench_report("bench_warnings", "per warning", best * 1e9 / nlines, "ns");
+}
+
+static void *bench_chunkcb(void *user, void *chunk, size_t size) {
+    if (!size) {
+        free(chunk);
+        return NULL;
+    }
+    return malloc(size);
+}
+
+// The struct benchmark again, but starting from a small region that grows in
+// chunks, compared against the fixed region
+static void bench_chunks(void) {
+    const int nstructs = 2000;
+    static uint8_t region[64 * 1024];
+
+    bench_src_reset();
+    bench_src_printf("struct component_0 { int id; };\n");
+    for (int i = 1; i < nstructs; i++) {
+        bench_src_printf("struct component_%d {\n"
+                         "    struct component_%d base;\n"
+                         "    struct component_%d parts[2];\n"
+                         "    struct component_%d *link;\n"
+                         "    double weight;\n"
+                         "};\n", i, i - 1, i / 2, i / 3);
+    }
+
+    double best = 1e30;
+    size_t peak = 0;
+    for (int run = 0; run < 10; run++) {
+        cnm_t *cnm = cnm_init(region, sizeof(region), bench_code, BENCH_CODE_SIZE,
+                              bench_globals, BENCH_GLOBALS_SIZE);
+        cnm_set_errcb(cnm, bench_errcb);
+        cnm_set_chunkcb(cnm, bench_chunkcb, NULL, 64 * 1024);
+
+        const double start = bench_now();
+        if (!cnm_parse(cnm, bench_src, "bench_chunks")) exit(1);
+        const double time = bench_now() - start;
+        if (time < best) best = time;
+        peak = cnm_get_region_peak(cnm);
+        cnm_free_chunks(cnm);
+    }
+
+    bench_report("bench_chunks", "chunked compile time", best * 1000.0, "ms");
+    bench_report("bench_chunks", "fixed compile time", bench_parse_src("bench_chunks") * 1000.0,
+                 "ms");
+    bench_report("bench_chunks", "region peak", peak / 1024.0, "KB");
+}
+
+// Looks like a big header, lots of structs whose fields keep using the same
+// few types, so most field types are shared
+static void bench_header(void) {
+    const int nstructs = 2000;
+
+    bench_src_reset();
+    for (int i = 0; i < nstructs; i++) {
+        bench_src_printf("struct widget_%d {\n"
+                         "    unsigned int id;\n"
+                         "    const char *name;\n"
+                         "    const char *tooltip;\n"
+                         "    float rect[4];\n"
+                         "    float color[4];\n"
+                         "    int (*on_click)(int button, char *data);\n"
+                         "    int (*on_hover)(int button, char *data);\n"
+                         "    struct widget_%d *parent;\n"
+                         "};\n", i, i / 2);
+    }
+
+    cnm_t *cnm = bench_cnm_init();
+    if (!cnm_parse(cnm, bench_src, "bench_header")) exit(1);
+    const size_t peak = cnm_get_region_peak(cnm);
+    cnm_memstats_t st;
+    cnm_get_memstats(cnm, &st);
+
+    const double time = bench_parse_src("bench_header");
+    bench_report("bench_header", "compile time", time * 1000.0, "ms");
+    bench_report("bench_header", "throughput", bench_srclen / time / (1024 * 1024), "MB/s");
+    bench_report("bench_header", "region peak", peak / 1024.0, "KB");
+    bench_report("bench_header", "scratch peak", st.scratch.peak / 1024.0, "KB");
+    bench_report("bench_header", "types", st.by.types / 1024.0, "KB");
+    bench_report("bench_header", "fields", st.by.fields / 1024.0, "KB");
+    bench_report("bench_header", "idents", st.by.idents / 1024.0, "KB");
+    bench_report("bench_header", "snapshot", cnm_compact_size(cnm) / 1024.0, "KB");
+}
+
+// Many small script states on top of one shared engine header, so the cost
+// is per instance startup
+static void bench_instances(void) {
+    const int nstructs = 1000, ninstances = 200;
+    const size_t regionsz = 256 * 1024, globalsz = 4096;
+    const char *const script = "struct ai_state { struct entity_500 self; int mood; };"
+                               "struct entity_0 ai_target = { 7, 1.5 };"
+                               "int ai_ticks = 0;";
+
+    bench_src_reset();
+    bench_src_printf("struct entity_0 { int id; float health; };\n");
+    for (int i = 1; i < nstructs; i++) {
+        bench_src_printf("typedef struct entity_%d {\n"
+                         "    struct entity_%d base;\n"
+                         "    struct entity_%d *target;\n"
+                         "    float pos[3];\n"
+                         "} entity_%d_t;\n"
+                         "int entity_%d_update(struct entity_%d *self, float dt);\n",
+                         i, i - 1, i / 2, i, i, i);
+    }
+
+    cnm_t *engine = bench_cnm_init();
+    if (!cnm_parse(engine, bench_src, "bench_instances")) exit(1);
+
+    uint8_t *const region = malloc(regionsz);
+    uint8_t *const globals = malloc(globalsz);
+    double copy = 1e30, reparse = 1e30;
+    size_t used = 0;
+    for (int run = 0; run < 5; run++) {
+        const double start = bench_now();
+        for (int i = 0; i < ninstances; i++) {
+            cnm_t *cnm = cnm_init(region, regionsz, bench_code, BENCH_CODE_SIZE,
+                                  globals, globalsz);
+            cnm_set_errcb(cnm, bench_errcb);
+            if (!cnm_copy(cnm, engine) || !cnm_parse(cnm, script, "script")) exit(1);
+            used = cnm_get_region_peak(cnm);
+        }
+        const double time = (bench_now() - start) / ninstances;
+        if (time < copy) copy = time;
+    }
+    free(region);
+    free(globals);
+
+    // What every instance would have to do without sharing the header (this
+    // reuses the region the engine state is in)
+    for (int run = 0; run < 5; run++) {
+        const double start = bench_now();
+        cnm_t *cnm = bench_cnm_init();
+        if (!cnm_parse(cnm, bench_src, "bench_instances")
+            || !cnm_parse(cnm, script, "script")) exit(1);
+        const double time = bench_now() - start;
+        if (time < reparse) reparse = time;
+    }
+
+    bench_report("bench_instances", "startup (copy)", copy * 1e6, "us");
+    bench_report("bench_instances", "startup (reparse)", reparse * 1e6, "us");
+    bench_report("bench_instances", "region per copy", used / 1024.0, "KB");
+}
+
+// Looks like a localization table, lots of string literals where many of
+// them are repeated
+static void bench_strings(void) {
+    const int nstrings = 8000;
+
+    bench_src_reset();
+    for (int i = 0; i < nstrings; i++) {
+        bench_src_printf("const char *loc_line_%d = \"Dialogue line number %d, "
+                         "please translate me\";\n", i, i % (nstrings / 4));
+    }
+
+    cnm_t *cnm = bench_cnm_init();
+    if (!cnm_parse(cnm, bench_src, "bench_strings")) exit(1);
+    const size_t saved = cnm_get_strings_saved(cnm);
+
+    const double time = bench_parse_src("bench_strings");
+    bench_report("bench_strings", "compile time", time * 1000.0, "ms");
+    bench_report("bench_strings", "throughput", bench_srclen / time / (1024 * 1024), "MB/s");
+    bench_report("bench_strings", "globals saved", saved / 1024.0, "KB");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Execution benchmarks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Tight integer loop and a recursive function that is mostly calls
+static const char bench_exec_src[] =
+    "long bench_arith(int n) {\n"
+    "    long s = 0;\n"
+    "    for (int i = 0; i < n; i++) {\n"
+    "        s += i * 3 ^ i >> 2;\n"
+    "        if (s > 100000000) s -= 99999999;\n"
+    "    }\n"
+    "    return s;\n"
+    "}\n"
+    "int bench_fib(int n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return bench_fib(n - 1) + bench_fib(n - 2);\n"
+    "}\n";
+
+// Best time of a few runs of a function with one int parameter, either
+// natively or with the interpreter
+static double bench_exec_run(cnm_t *cnm, const char *name, bool interp, long arg,
+                             long long *result) {
+    void *const addr = cnm_fn_addr(cnm_get_fn(cnm, name));
+    double best = 1e30;
+    for (int run = 0; run < 3; run++) {
+        const double start = bench_now();
+        if (interp) {
+            *result = cnm_interp_call(addr, &(cnm_val_t){ .i = arg }).i;
+        } else {
+            long (*const fn)(int) = (long (*)(int))addr;
+            *result = fn(arg);
+        }
+        const double time = bench_now() - start;
+        if (time < best) best = time;
+    }
+    return best;
+}
+
+// Threaded code interpreter against the native backend (when there is one)
+static void bench_exec(void) {
+    const long arith_n = 20000000, fib_n = 27;
+    static const char *const names[] = { "native", "interp" };
+    double arith[2] = { 0 }, fib[2] = { 0 };
+    long long results[2][2];
+
+    uint8_t *exec = NULL;
+#ifdef CNM_MMAP
+    exec = mmap(NULL, BENCH_CODE_SIZE, PROT_EXEC | PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (exec == MAP_FAILED) exec = NULL;
+#endif
+    for (int interp = 0; interp < 2; interp++) {
+        cnm_t *cnm = cnm_init(bench_region, BENCH_REGION_SIZE,
+                              interp ? bench_code : exec, BENCH_CODE_SIZE,
+                              bench_globals, BENCH_GLOBALS_SIZE);
+        cnm_set_errcb(cnm, bench_errcb);
+        if (!interp && (!exec || !cnm_set_interp(cnm, false))) continue;
+        if (!cnm_set_interp(cnm, interp) || !cnm_parse(cnm, bench_exec_src, "bench_exec")) {
+            exit(1);
+        }
+        arith[interp] = bench_exec_run(cnm, "bench_arith", interp, arith_n, &results[interp][0]);
+        fib[interp] = bench_exec_run(cnm, "bench_fib", interp, fib_n, &results[interp][1]);
+        char what[32];
+        snprintf(what, sizeof(what), "arith loop (%s)", names[interp]);
+        bench_report("bench_exec", what, arith[interp] * 1000.0, "ms");
+        snprintf(what, sizeof(what), "fib calls (%s)", names[interp]);
+        bench_report("bench_exec", what, fib[interp] * 1000.0, "ms");
+    }
+    if (arith[0] && arith[1]) {
+        if (results[0][0] != results[1][0] || results[0][1] != results[1][1]) exit(1);
+        bench_report("bench_exec", "interp/native arith", arith[1] / arith[0], "x");
+        bench_report("bench_exec", "interp/native fib", fib[1] / fib[0], "x");
+    }
+#ifdef CNM_MMAP
+    if (exec) munmap(exec, BENCH_CODE_SIZE);
+#endif
+}
+
+// The same generated functions compiled at both tiers: how long that takes,
+// how much code comes out and how fast the arith loop of bench_exec runs
+static void bench_tiers(void) {
+    const int nfuncs = 1000;
+    const long arith_n = 20000000;
+    static const char *const names[] = { "optimize", "baseline" };
+
+    bench_src_reset();
+    for (int i = 0; i < nfuncs; i++) {
+        bench_src_printf("long bench_tier_%d(long n, long m) {\n"
+                         "    long s = %d, t = m;\n"
+                         "    for (long i = 0; i < n; i++) {\n"
+                         "        long u = i * %d + t;\n"
+                         "        if (u %% 3 == 0) s += u ^ m; else s -= u >> 2;\n"
+                         "        t = t + s & 1023;\n"
+                         "    }\n"
+                         "    return s + t;\n"
+                         "}\n", i, i, i + 1);
+    }
+
+    uint8_t *exec = NULL;
+#ifdef CNM_MMAP
+    exec = mmap(NULL, BENCH_CODE_SIZE, PROT_EXEC | PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (exec == MAP_FAILED) exec = NULL;
+#endif
+    for (int tier = CNM_TIER_OPTIMIZE; tier <= CNM_TIER_BASELINE; tier++) {
+        double best = 1e30;
+        cnm_memstats_t st;
+        for (int run = 0; run < 10; run++) {
+            cnm_t *cnm = bench_cnm_init();
+            const double start = bench_now();
+            if (!cnm_set_tier(cnm, tier) || !cnm_parse(cnm, bench_src, "bench_tiers")) exit(1);
+            const double time = bench_now() - start;
+            if (time < best) best = time;
+            cnm_get_memstats(cnm, &st);
+        }
+        char what[32];
+        snprintf(what, sizeof(what), "compile time (%s)", names[tier]);
+        bench_report("bench_tiers", what, best * 1000.0, "ms");
+        snprintf(what, sizeof(what), "per function (%s)", names[tier]);
+        bench_report("bench_tiers", what, best / nfuncs * 1e6, "us");
+        snprintf(what, sizeof(what), "code size (%s)", names[tier]);
+        bench_report("bench_tiers", what, st.code.used / 1024.0, "KB");
+        if (!exec) continue;
+
+        cnm_t *cnm = cnm_init(bench_region, BENCH_REGION_SIZE, exec, BENCH_CODE_SIZE,
+                              bench_globals, BENCH_GLOBALS_SIZE);
+        cnm_set_errcb(cnm, bench_errcb);
+        if (!cnm_set_interp(cnm, false) || !cnm_set_tier(cnm, tier)
+            || !cnm_parse(cnm, bench_exec_src, "bench_tiers")) {
+            exit(1);
+        }
+        long long result;
+        const double time = bench_exec_run(cnm, "bench_arith", false, arith_n, &result);
+        snprintf(what, sizeof(what), "arith loop (%s)", names[tier]);
+        bench_report("bench_tiers", what, time * 1000.0, "ms");
+    }
+#ifdef CNM_MMAP
+    if (exec) munmap(exec, BENCH_CODE_SIZE);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Bencher
+//
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*bench_pfn_t)(void);
+typedef struct bench_s {
+    bench_pfn_t pfn;
+    const char *name;
+} bench_t;
+
+// Helper macro for adding benchmarks
+#define BENCH(func_name) ((bench_t){ .pfn = func_name, .name = #func_name })
+
+// List of benchmark functions
+static bench_t benches[] = {
+    BENCH(bench_lexer),
+    BENCH(bench_lexer_scanners),
+    BENCH(bench_lexer_strings),
+    BENCH(bench_lexer_utf8),
+    BENCH(bench_symbols),
+    BENCH(bench_globals10k),
+    BENCH(bench_globals_mixed),
+    BENCH(bench_structs),
+    BENCH(bench_chunks),
+    BENCH(bench_header),
+    BENCH(bench_instances),
+    BENCH(bench_strings),
+    BENCH(bench_warnings),
+    BENCH(bench_exec),
+    BENCH(bench_tiers),
+};
+
+// Runs every benchmark, or only the ones whose names were passed on the
+// command line
+int main(int argc, char **argv) {
+    printf("cnm bencher\n\n");
+
+    bench_region = malloc(BENCH_REGION_SIZE);
+    bench_globals = malloc(BENCH_GLOBALS_SIZE);
+    bench_code = malloc(BENCH_CODE_SIZE);
+
+    for (int i = 0; i < arrlen(benches); i++) {
+        bool run = argc < 2;
+        for (int j = 1; j < argc; j++) run |= strcmp(argv[j], benches[i].name) == 0;
+        if (run) benches[i].pfn();
+    }
+
+    free(bench_src);
+    free(bench_code);
+    free(bench_globals);
+    free(bench_region);
+
+    return 0;
+}
@@ -1,4 +1,3 @@
-#include <ctype.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -6,6 +5,14 @@
 #include <string.h>
 #include <inttypes.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CNM_MMAP
+#endif
+
 #include "cnm.h"
 #include "cnm_ir.h"
 
@@ -14,7 +21,12 @@ typedef struct strview_s {
     size_t len;
 } strview_t;
 
+// Id of an interned identifier. Names are compared by id instead of by string
+// and 0 is used when something has no name
+typedef uint32_t ident_t;
+
 #define MAX_SCOPE_DEPTH 32
+#define MAX_FN_PARAMS 32
 
 // Create a string view from a string literal
 #define SV(s) ((strview_t){ .str = s, .len = sizeof(s) - 1 })
@@ -43,7 +55,27 @@ typedef struct strview_s {
     T3_2('<', TOKEN_LESS, '=', TOKEN_LESS_EQ, '<', TOKEN_SHIFT_L, '=', TOKEN_SHIFT_L_EQ) \
     T3_2('>', TOKEN_GREATER, '=', TOKEN_GREATER_EQ, '>', TOKEN_SHIFT_R, '=', TOKEN_SHIFT_R_EQ)
 
+// Keywords are lexed straight into their own token kind. The first and last
+// characters are spelled out so the keyword hash stays a constant expression
+#define KEYWORDS \
+    K(TOKEN_KW_INT, "int", 'i', 't') K(TOKEN_KW_BOOL, "bool", 'b', 'l') \
+    K(TOKEN_KW_CHAR, "char", 'c', 'r') K(TOKEN_KW_ENUM, "enum", 'e', 'm') \
+    K(TOKEN_KW_LONG, "long", 'l', 'g') K(TOKEN_KW_VOID, "void", 'v', 'd') \
+    K(TOKEN_KW_CONST, "const", 'c', 't') K(TOKEN_KW_FLOAT, "float", 'f', 't') \
+    K(TOKEN_KW_SHORT, "short", 's', 't') K(TOKEN_KW_UNION, "union", 'u', 'n') \
+    K(TOKEN_KW_DOUBLE, "double", 'd', 'e') K(TOKEN_KW_EXTERN, "extern", 'e', 'n') \
+    K(TOKEN_KW_SIGNED, "signed", 's', 'd') K(TOKEN_KW_STATIC, "static", 's', 'c') \
+    K(TOKEN_KW_STRUCT, "struct", 's', 't') K(TOKEN_KW_TYPEDEF, "typedef", 't', 'f') \
+    K(TOKEN_KW_UNSIGNED, "unsigned", 'u', 'd') K(TOKEN_KW_IF, "if", 'i', 'f') \
+    K(TOKEN_KW_DO, "do", 'd', 'o') K(TOKEN_KW_FOR, "for", 'f', 'r') \
+    K(TOKEN_KW_ELSE, "else", 'e', 'e') K(TOKEN_KW_BREAK, "break", 'b', 'k') \
+    K(TOKEN_KW_WHILE, "while", 'w', 'e') K(TOKEN_KW_RETURN, "return", 'r', 'n') \
+    K(TOKEN_KW_CONTINUE, "continue", 'c', 'e')
+
 typedef enum token_type_e {
+#define K(name, word, first, last) name,
+KEYWORDS
+#undef K
 #define T0(n1) n1,
 #define T1(c1, n1) n1,
 #define T2(c1, n1, c2, n2) n1, n2,
@@ -75,9 +107,17 @@ typedef struct token_s {
         int row, col;
     } end;
 
+    // Start of the source line that the token starts on (for diagnostics)
+    const char *line;
+
+    // Start of the source line that the token ends on, which is only another
+    // one for strings concatinated across lines
+    const char *endline;
+
     // Data associated with token type
     union {
         char *s; // TOKEN_STRING
+        ident_t id; // TOKEN_IDENT
         uint32_t c; // TOKEN_CHAR
         struct {
             int base;
@@ -139,6 +179,10 @@ typedef struct typeref_s {
 
 #define typeref_isvalid(tr) ((tr).type)
 
+// Handle of a canonical type (an index into the canonical type entries, starts
+// at 1). Metadata that outlives a declaration stores these instead of typerefs
+typedef uint32_t typehnd_t;
+
 // Simple size and alignment info of a type at runtime
 typedef struct typeinf_s {
     size_t size;
@@ -147,11 +191,10 @@ typedef struct typeinf_s {
 
 // Field of a struct.
 typedef struct field_s {
-    strview_t name;
-    size_t offs; // Offset from begining of struct
-    size_t bit_offs; // Used in bitfields
-    typeref_t type; // Actual base type (plus bit field width)
-    struct field_s *next, *last; // Next field (fields are stored in reverse order)
+    ident_t name;
+    typehnd_t type; // Actual base type (plus bit field width)
+    uint32_t offs; // Offset from begining of struct
+    uint32_t bit_offs; // Used in bitfields
 } field_t;
 
 typedef enum userty_class_e {
@@ -161,7 +204,7 @@ typedef enum userty_class_e {
 } userty_class_t;
 
 typedef struct userty_s {
-    strview_t name;
+    ident_t name;
 
     userty_class_t type;
 
@@ -180,13 +223,22 @@ typedef struct userty_s {
     uint8_t data[];
 } userty_t;
 
-typedef struct cnm_struct_s {
-    // Fields
-    field_t *fields, *end;
+// A type ID of the base state that points at a different type in a state
+// made by cnm_copy (a base type that got defined or moved after the copy)
+typedef struct userty_over_s {
+    int typeid;
+    userty_t *u;
+    struct userty_over_s *next;
+} userty_over_t;
+
+typedef struct field_list_s {
+    // Fields in declaration order, in one array in the static region
+    field_t *fields;
+    uint32_t nfields;
 } field_list_t;
 
 typedef struct variant_s {
-    strview_t name;
+    ident_t name;
 
     // What number the enum variant has associated with it
     union {
@@ -195,7 +247,7 @@ typedef struct variant_s {
     } id; // Unsigned or not based on base enum type
 } variant_t;
 
-typedef struct cnm_enum_s {
+typedef struct enum_s {
     // What the default enum type is
     type_t type;
 
@@ -207,27 +259,111 @@ typedef struct cnm_enum_s {
 // Typedefs don't have type IDs assocciated with them since typedefs are
 // substituted out for their real type during parsing of types in the source.
 typedef struct typedef_s {
-    strview_t name;
-    typeref_t type;
+    ident_t name;
+    typehnd_t type;
     int typedef_id;
 
     // What scope ID this type is a part of
     int scope;
-
-    // Next typedef in the typedef list
-    struct typedef_s *next;
 } typedef_t;
 
-// String entries are refrences to strings stored in the code segement
+// Interned identifier, stored in the static region (in an array indexed by
+// id). The string itself points into the source it was lexed from
+typedef struct ident_ent_s {
+    const char *str;
+    uint32_t len;
+    uint32_t hash;
+
+    // Next identifier in the same hash bucket
+    ident_t next;
+
+    // Type ID + 1 of the struct, union or enum with this name, 0 if none
+    uint32_t tag;
+} ident_ent_t;
+
+// String entries are refrences to strings stored in the globals buffer. The
+// entries themselves live in the static region
 typedef struct strent_s {
+    // Next string in the same hash bucket
     struct strent_s *next;
-    char str[];
+
+    uint32_t hash;
+    uint32_t len; // Including the null terminator
+    char *str;
 } strent_t;
 
+// Canonical type entries. Every distinct sequence of type layers that outlives
+// a declaration is stored once in the static region, so equal types share the
+// same layers. Canonical layers are never written to
+typedef struct typeent_s {
+    // Next type in the same hash bucket
+    typehnd_t next;
+
+    uint32_t hash;
+    uint32_t size; // How many layers there are
+    type_t type[];
+} typeent_t;
+
+// Kinds of names in a snapshot. Tags are kept apart from the rest like in C
+typedef enum snapkind_e {
+    SNAP_TAG,
+    SNAP_FN,
+    SNAP_VAR,
+} snapkind_t;
+
+// Named entry of a snapshot. Everything in a snapshot refers to the rest of it
+// by offsets from its start, so it can be moved around freely
+typedef struct snapsym_s {
+    uint32_t hash;
+    uint32_t next; // Next symbol in the same hash bucket (index + 1)
+    uint32_t name; // Offset of the NUL terminated name
+    uint32_t len;
+    snapkind_t kind;
+    uint32_t rec; // Offset of the userty_t, func_t or global address
+} snapsym_t;
+
+// Compact snapshot header. It's followed by copies of the userty_t and func_t
+// records (without names, types or next pointers), the global addresses, the
+// symbols, the bucket heads and the names
+struct cnm_snap_s {
+    uint32_t size;
+    uint32_t nsyms;
+    uint32_t nbuckets; // Always a power of 2
+    uint32_t syms, buckets; // Offsets of the symbols and of the bucket heads
+};
+
+// What static region memory is used for (see cnm_get_memstats)
+typedef enum memcat_e {
+    MEM_TYPES, // User types, enum variants and canonical type layers
+    MEM_FIELDS,
+    MEM_TYPEDEFS,
+    MEM_FUNCS,
+    MEM_VARS,
+    MEM_STRINGS, // String literal entries (the strings are in the globals buffer)
+    MEM_IDENTS,
+    MEM_COUNT,
+} memcat_t;
+
+// Extra region memory from the chunk callback
+typedef struct chunk_s {
+    struct chunk_s *next;
+    size_t size; // Size of mem
+
+    // Bytes used in the normal region before this chunk (normal chunks only)
+    size_t base;
+    uint8_t mem[];
+} chunk_t;
+
+// Position in the normal region that it can be released back to
+typedef struct region_mark_s {
+    uint8_t *next;
+    chunk_t *chunk;
+} region_mark_t;
+
 // A named variable in the current scope
 typedef struct scope_s {
-    strview_t name;
-    typeref_t type;
+    ident_t name;
+    typehnd_t type;
 
     // What scope is this variable apart of?
     int scope;
@@ -236,17 +372,24 @@ typedef struct scope_s {
     // location at compile time, otherwise this variable is unsused
     void *abs_addr;
 
+    // IR value that a local variable holds at the point being compiled
+    ir_val_t val;
+
     // The next scope refrence. This one is 'later' than that
     struct scope_s *next;
+
+    // Next variable in the same hash bucket. Variables always come before
+    // the ones they shadow
+    struct scope_s *hnext;
 } scope_t;
 
 // Represents functions in cscript that can be called
 struct cnm_fn_s {
     // The name of the function
-    strview_t name;
+    ident_t name;
 
     // Type of the function
-    typeref_t type;
+    typehnd_t type;
 
     // Actual address of the code of the function
     void *addr;
@@ -256,6 +399,14 @@ struct cnm_fn_s {
 };
 typedef struct cnm_fn_s func_t;
 
+// Names of the parameters of a function declarator, so that its definition can
+// bring them into scope. n is how many parameters there are, even if there
+// were too many to keep
+typedef struct fnparams_s {
+    ident_t names[MAX_FN_PARAMS];
+    uint32_t n;
+} fnparams_t;
+
 // A refrence to a variable in the current program. Since this is IR, it could
 // be on the stack or in a register so there is no associated location
 // information with this
@@ -279,6 +430,9 @@ typedef struct {
 
     // Pointer to the actual scope data of this variable
     scope_t *scope;
+
+    // IR value that holds it at runtime if it isn't a literal
+    ir_val_t ir;
 } valref_t;
 
 // Precedence levels of an expression going from evaluated last (comma) to
@@ -322,6 +476,11 @@ struct cnm_s {
         // If set to non-NULL, all refrences to buf are offset to point to here
         void *real_addr;
         uint8_t *ptr; // grows upward like how instructions are exectued
+
+        // Functions are compiled to threaded code for the interpreter instead
+        // of to machine code
+        bool interp;
+        cnm_tier_t tier; // See cnm_set_tier
     } code;
 
     // Where to store globals
@@ -331,14 +490,17 @@ struct cnm_s {
 
         uint8_t *next; // Where the next global will be allocated (grows up)
         uint8_t *strnext; // Where next string goes (grows down)
+        size_t peak; // Most bytes used by globals (not strings) at once
     } globals;
 
     struct {
         // Logical 'file' name
         const char *fname;
 
-        // Begining of the source
-        const char *src;
+        // Begining of the source and one past its last char. The source
+        // doesn't have to be null terminated, chars at or past end are read
+        // as '\0' instead (see lex_at)
+        const char *src, *end;
 
         // Where we are in the source code
         token_t tok;
@@ -354,22 +516,76 @@ struct cnm_s {
     // Number of errors encountered
     int nerrs;
 
+    // State whose type environment this one shares (see cnm_copy), NULL if
+    // none. It is never written to, so the tables below only hold what was
+    // declared after the copy and fall back to the base for the rest
+    const cnm_t *base;
+
     // Custom type info
     struct {
         userty_t *types;
-        typedef_t *typedefs;
         int gid, typedef_gid;
+
+        // Type and typedef IDs below these belong to the base
+        int first, typedef_first;
+
+        // Typedefs indexed by typedef ID - typedef_first (lives in the static
+        // region)
+        typedef_t **typedefs;
+        int typedef_cap;
+
+        // User types indexed by type ID - first (lives in the static region)
+        userty_t **byid;
+        int cap;
+
+        // Base types that were changed in this state
+        userty_over_t *over;
     } type;
 
-    // Functions in scope
+    // Functions in scope. The ones from the base come last and are shared
     func_t *funcs;
+    const func_t *base_funcs;
 
     // Variables in scope
     scope_t *vars;
 
+    // Hash table of the variables in scope by name (buckets live in the static
+    // region)
+    struct {
+        scope_t **buckets;
+        int bits;
+    } varmap;
+
     // What the current scope level is (grows up)
     int scope;
 
+    // IR of the function being compiled, in the normal region
+    struct {
+        ir_func_t f;
+
+        // Block that instructions are added to
+        uint32_t block;
+
+        // Phi inputs as (phi, block, value) until ir_finish puts them in the
+        // order of the predecessors of each block
+        uint32_t *phiins;
+        uint32_t nphiins, phiincap;
+    } ir;
+
+    // Function whose body is being compiled
+    struct {
+        func_t *func;
+        typeref_t ret; // Its return type
+        void *addr; // Where its code is going to be, for calls to itself
+
+        // Set when the block that is being added to can't be reached, like
+        // after a return
+        bool dead;
+
+        // Innermost loop that break and continue go to, NULL if there is none
+        struct stmt_loop_s *loop;
+    } fn;
+
     struct {
         // Where the next allocation will be served (grows up)
         uint8_t *next;
@@ -377,10 +593,55 @@ struct cnm_s {
         // Where the current static (infinite lifetime) allocation is being
         // served (grows down, starts at top)
         uint8_t *curr_static;
+
+        // How far next and curr_static can grow. While both are in the region
+        // these point at each other, otherwise at the edge of their chunk or
+        // of the part of the region that the other one left behind
+        uint8_t *const *end;
+        uint8_t *const *static_end;
+        uint8_t *chunk_end, *static_start;
+        uint8_t *region_next, *region_static;
+
+        // Chunks from the chunk callback (NULL means the region itself). The
+        // normal chunks are kept in order so they can be reused after being
+        // released, the static ones are newest first.
+        chunk_t *chunk, *chunks;
+        chunk_t *static_chunk;
+        size_t static_base; // Static bytes used before the current chunk
+        size_t peak; // Most bytes used at once as of the last release
+        size_t scratch_peak; // Same but only for normal allocations
+        size_t bycat[MEM_COUNT]; // Static bytes by what they were for
+
+        cnm_chunk_cb_t cb;
+        void *user;
+        size_t chunksz;
     } alloc;
 
-    // String entries
-    strent_t *strs;
+    // String entries, hashed by their contents
+    struct {
+        strent_t **buckets;
+        uint32_t nbuckets, count;
+
+        // Bytes of the globals buffer saved by reusing strings
+        size_t saved;
+    } strs;
+
+    // Identifier interner (buckets and entries live in the static region)
+    struct {
+        ident_t *buckets;
+        ident_ent_t *ents; // Indexed by id - first
+        uint32_t nbuckets, count;
+        ident_t first; // Ids up to this one belong to the base
+    } idents;
+
+    // Canonical type layers (see typeent_t). The entry array is indexed by
+    // handle and grown with the buckets like the identifier interner
+    struct {
+        typehnd_t *buckets;
+        typeent_t **ents; // Indexed by handle - first
+        uint32_t nbuckets, count;
+        typehnd_t first; // Handles up to this one belong to the base
+    } types;
 
     // The actual buffer we use to allocate from
     size_t buflen;
@@ -389,6 +650,8 @@ struct cnm_s {
 
 static bool expr_parse(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
                        prec_t prec, const typeref_t *expected_type);
+static bool expr_call(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                      func_t *func, bool shared);
 
 static expr_parse_prefix_t expr_char;
 static expr_parse_prefix_t expr_str;
@@ -398,9 +661,16 @@ static expr_parse_prefix_t expr_double;
 static expr_parse_infix_t expr_arith;
 static expr_parse_prefix_t expr_prefix_arith;
 static expr_parse_prefix_t expr_group;
+static expr_parse_prefix_t expr_ident;
+static expr_parse_infix_t expr_assign;
+static expr_parse_prefix_t expr_prefix_step;
+static expr_parse_infix_t expr_postfix_step;
+static expr_parse_infix_t expr_compare;
+static expr_parse_infix_t expr_logic;
 
 static expr_rule_t expr_rules[TOKEN_MAX] = {
     [TOKEN_PAREN_L] = { .prefix_prec = PREC_FACTOR, .prefix = expr_group },
+    [TOKEN_IDENT] = { .prefix_prec = PREC_FACTOR, .prefix = expr_ident },
     [TOKEN_INT] = { .prefix_prec = PREC_FACTOR, .prefix = expr_int },
     [TOKEN_CHAR] = { .prefix_prec = PREC_FACTOR, .prefix = expr_char },
     [TOKEN_STRING] = { .prefix_prec = PREC_FACTOR, .prefix = expr_str },
@@ -419,6 +689,29 @@ static expr_rule_t expr_rules[TOKEN_MAX] = {
     [TOKEN_BIT_XOR] = { .infix_prec = PREC_BIT_OR, .infix = expr_arith },
     [TOKEN_SHIFT_L] = { .infix_prec = PREC_SHIFT, .infix = expr_arith },
     [TOKEN_SHIFT_R] = { .infix_prec = PREC_SHIFT, .infix = expr_arith },
+    [TOKEN_EQ_EQ] = { .infix_prec = PREC_EQUALITY, .infix = expr_compare },
+    [TOKEN_NOT_EQ] = { .infix_prec = PREC_EQUALITY, .infix = expr_compare },
+    [TOKEN_LESS] = { .infix_prec = PREC_COMPARE, .infix = expr_compare },
+    [TOKEN_LESS_EQ] = { .infix_prec = PREC_COMPARE, .infix = expr_compare },
+    [TOKEN_GREATER] = { .infix_prec = PREC_COMPARE, .infix = expr_compare },
+    [TOKEN_GREATER_EQ] = { .infix_prec = PREC_COMPARE, .infix = expr_compare },
+    [TOKEN_AND] = { .infix_prec = PREC_AND, .infix = expr_logic },
+    [TOKEN_OR] = { .infix_prec = PREC_OR, .infix = expr_logic },
+    [TOKEN_PLUS_DBL] = { .infix_prec = PREC_POSTFIX, .infix = expr_postfix_step,
+                         .prefix_prec = PREC_PREFIX, .prefix = expr_prefix_step },
+    [TOKEN_MINUS_DBL] = { .infix_prec = PREC_POSTFIX, .infix = expr_postfix_step,
+                          .prefix_prec = PREC_PREFIX, .prefix = expr_prefix_step },
+    [TOKEN_ASSIGN] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_PLUS_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_MINUS_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_TIMES_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_DIVIDE_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_MODULO_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_AND_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_OR_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_BIT_XOR_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_SHIFT_L_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
+    [TOKEN_SHIFT_R_EQ] = { .infix_prec = PREC_ASSIGN, .infix = expr_assign },
 };
 
 static inline bool strview_eq(const strview_t lhs, const strview_t rhs) {
@@ -442,7 +735,7 @@ static strview_t strview_cat_str(char *to, size_t len, const strview_t from) {
 
 // Print out error to the error callback in the cnm state
 static void cnm_doerr(cnm_t *cnm, bool critical, const char *desc) {
-    static char buf[512];
+    char buf[512];
 
     // Only increase error count if critical
     cnm->nerrs += critical;
@@ -460,9 +753,9 @@ static void cnm_doerr(cnm_t *cnm, bool critical, const char *desc) {
 
     // Get the source code line
     {
-        const char *l = cnm->s.src;
-        for (int line = 1; line != cnm->s.tok.start.row; line += *l++ == '\n');
-        for (; *l != '\n' && *l != '\0' && len < sizeof(buf); buf[len++] = *l++);
+        const char *l = cnm->s.tok.line;
+        for (; l < cnm->s.end && *l != '\n' && *l != '\0' && len < sizeof(buf);
+             buf[len++] = *l++);
         if (len == sizeof(buf)) goto overflow;
     }
 
@@ -486,39 +779,155 @@ static inline size_t align_size(size_t x, size_t alignment) {
     return ((x - 1) / alignment + 1) * alignment;
 }
 
+// Number of bytes used by normal allocations in the region (and chunks)
+static size_t region_scratch_used(const cnm_t *cnm) {
+    const chunk_t *const c = cnm->alloc.chunk;
+    return c ? c->base + (cnm->alloc.next - c->mem) : cnm->alloc.next - cnm->buf;
+}
+
+// Number of bytes used by static allocations in the region (and chunks)
+static size_t region_static_used(const cnm_t *cnm) {
+    const chunk_t *const sc = cnm->alloc.static_chunk;
+    const uint8_t *const top = sc ? sc->mem + sc->size : cnm->buf + cnm->buflen;
+    return cnm->alloc.static_base + (top - cnm->alloc.curr_static);
+}
+
+// Number of bytes used in the region (and chunks) right now
+static inline size_t region_used(const cnm_t *cnm) {
+    return region_scratch_used(cnm) + region_static_used(cnm);
+}
+
+// Get a new chunk with at least size bytes from the chunk callback
+static chunk_t *chunk_new(cnm_t *cnm, size_t size) {
+    if (size < cnm->alloc.chunksz) size = cnm->alloc.chunksz;
+    chunk_t *const c = cnm->alloc.cb(cnm->alloc.user, NULL, sizeof(chunk_t) + size);
+    if (!c) {
+        cnm_doerr(cnm, true, "ran out of region memory");
+        return NULL;
+    }
+    *c = (chunk_t){ .size = size };
+    return c;
+}
+
+static void *cnm_alloc(cnm_t *cnm, size_t size, size_t align);
+static void *cnm_alloc_static(cnm_t *cnm, size_t size, size_t align, memcat_t cat);
+
+// Move normal allocations to the next chunk, since the current one is full
+static void *cnm_alloc_chunk(cnm_t *cnm, size_t size, size_t align) {
+    if (!cnm->alloc.cb) {
+        cnm_doerr(cnm, true, "ran out of region memory");
+        return NULL;
+    }
+
+    // Static allocations can use what we leave behind in the region
+    chunk_t **const link = cnm->alloc.chunk ? &cnm->alloc.chunk->next : &cnm->alloc.chunks;
+    const size_t used = cnm->alloc.chunk
+        ? cnm->alloc.chunk->base + (cnm->alloc.next - cnm->alloc.chunk->mem)
+        : cnm->alloc.next - cnm->buf;
+    if (!cnm->alloc.chunk) {
+        cnm->alloc.region_next = cnm->alloc.next;
+        if (!cnm->alloc.static_chunk) cnm->alloc.static_end = &cnm->alloc.region_next;
+    }
+
+    // Reuse the next chunk if it was released and is big enough
+    chunk_t *c = *link;
+    if (!c || c->size < size + align) {
+        if (!(c = chunk_new(cnm, size + align))) return NULL;
+        c->next = *link;
+        *link = c;
+    }
+
+    c->base = used;
+    cnm->alloc.chunk = c;
+    cnm->alloc.next = c->mem;
+    cnm->alloc.chunk_end = c->mem + c->size;
+    cnm->alloc.end = &cnm->alloc.chunk_end;
+    return cnm_alloc(cnm, size, align);
+}
+
+// Move static allocations to a new chunk, since the current one is full
+static void *cnm_alloc_static_chunk(cnm_t *cnm, size_t size, size_t align, memcat_t cat) {
+    if (!cnm->alloc.cb) {
+        cnm_doerr(cnm, true, "ran out of region memory");
+        return NULL;
+    }
+
+    chunk_t *c = cnm->alloc.static_chunk;
+    const uint8_t *const top = c ? c->mem + c->size : cnm->buf + cnm->buflen;
+    if (!(c = chunk_new(cnm, size + align))) return NULL;
+
+    // Normal allocations can use what we leave behind in the region
+    if (!cnm->alloc.static_chunk) {
+        cnm->alloc.region_static = cnm->alloc.curr_static;
+        if (!cnm->alloc.chunk) cnm->alloc.end = &cnm->alloc.region_static;
+    }
+
+    cnm->alloc.static_base += top - cnm->alloc.curr_static;
+    c->next = cnm->alloc.static_chunk;
+    cnm->alloc.static_chunk = c;
+    cnm->alloc.curr_static = c->mem + c->size;
+    cnm->alloc.static_start = c->mem;
+    cnm->alloc.static_end = &cnm->alloc.static_start;
+    return cnm_alloc_static(cnm, size, align, cat);
+}
+
 // Allocate memory in the cnm state region
 // Grows up
 static void *cnm_alloc(cnm_t *cnm, size_t size, size_t align) {
     // Align the next alloc pointer
-    cnm->alloc.next = (uint8_t *)(((uintptr_t)(cnm->alloc.next - 1) / align + 1) * align);
+    uint8_t *const ptr = (uint8_t *)(((uintptr_t)(cnm->alloc.next - 1) / align + 1) * align);
 
     // Check memory overflow
-    if (cnm->alloc.next + size > cnm->alloc.curr_static) {
-        cnm_doerr(cnm, true, "ran out of region memory");
-        return NULL;
-    }
+    if (ptr + size > *cnm->alloc.end) return cnm_alloc_chunk(cnm, size, align);
 
     // Return new pointer
-    void *const ptr = cnm->alloc.next;
-    cnm->alloc.next += size;
+    cnm->alloc.next = ptr + size;
     return ptr;
 }
 
 // Allocate memory in the cnm state region statically (IE whole program time)
-// This region grows downward
-static void *cnm_alloc_static(cnm_t *cnm, size_t size, size_t align) {
-    // Align the next alloc pointer
-    cnm->alloc.curr_static = (uint8_t *)(
-        (uintptr_t)(cnm->alloc.curr_static - size) / align * align);
-
+// This region grows downward. cat is only used for memory stats
+static void *cnm_alloc_static(cnm_t *cnm, size_t size, size_t align, memcat_t cat) {
     // Check memory overflow
-    if (cnm->alloc.curr_static <= cnm->alloc.next) {
-        cnm_doerr(cnm, true, "ran out of region memory");
-        return NULL;
+    if (size >= (size_t)(cnm->alloc.curr_static - *cnm->alloc.static_end)) {
+        return cnm_alloc_static_chunk(cnm, size, align, cat);
     }
 
+    // Align the next alloc pointer
+    uint8_t *const ptr = (uint8_t *)((uintptr_t)(cnm->alloc.curr_static - size) / align * align);
+    if (ptr <= *cnm->alloc.static_end) return cnm_alloc_static_chunk(cnm, size, align, cat);
+
     // Return new pointer
-    return cnm->alloc.curr_static;
+    cnm->alloc.curr_static = ptr;
+    cnm->alloc.bycat[cat] += size;
+    return ptr;
+}
+
+// Get the current position of the normal region to release back to later
+static inline region_mark_t cnm_mark(const cnm_t *cnm) {
+    return (region_mark_t){ .next = cnm->alloc.next, .chunk = cnm->alloc.chunk };
+}
+
+// Free everything allocated in the normal region since the mark was made
+static void cnm_release(cnm_t *cnm, region_mark_t mark) {
+    const size_t scratch = region_scratch_used(cnm), used = scratch + region_static_used(cnm);
+    if (used > cnm->alloc.peak) cnm->alloc.peak = used;
+    if (scratch > cnm->alloc.scratch_peak) cnm->alloc.scratch_peak = scratch;
+
+    cnm->alloc.next = mark.next;
+    if (mark.chunk == cnm->alloc.chunk) return;
+
+    // Going back to an earlier chunk (which keeps the later ones for reuse)
+    cnm->alloc.chunk = mark.chunk;
+    if (mark.chunk) {
+        cnm->alloc.chunk_end = mark.chunk->mem + mark.chunk->size;
+        cnm->alloc.end = &cnm->alloc.chunk_end;
+    } else if (cnm->alloc.static_chunk) {
+        cnm->alloc.end = &cnm->alloc.region_static;
+    } else {
+        cnm->alloc.end = &cnm->alloc.curr_static;
+        cnm->alloc.static_end = &cnm->alloc.next;
+    }
 }
 
 // Allocate memory in the global buffer
@@ -554,17 +963,584 @@ static void *cnm_alloc_global(cnm_t *cnm, size_t size, size_t align) {
     // Return new pointer
     void *const ptr = cnm->globals.next;
     cnm->globals.next += size;
+    if ((size_t)(cnm->globals.next - cnm->globals.buf) > cnm->globals.peak) {
+        cnm->globals.peak = cnm->globals.next - cnm->globals.buf;
+    }
     return ptr;
 }
 
+// Smallest interner bucket table, always a power of 2
+#define IDENT_MIN_BUCKETS 16
+
+// Ids are indices into the entry array, starting at 1 so they are never 0.
+// Ids from the base are looked up there and can't be changed
+static inline const ident_ent_t *ident_get(const cnm_t *cnm, ident_t id) {
+    while (id <= cnm->idents.first) cnm = cnm->base;
+    return &cnm->idents.ents[id - cnm->idents.first];
+}
+
+// Same as ident_get but only for ids that this state interned itself
+static inline ident_ent_t *ident_get_own(cnm_t *cnm, ident_t id) {
+    return &cnm->idents.ents[id - cnm->idents.first];
+}
+
+// Get the string of an identifier, empty if there is no identifier
+static strview_t ident_str(const cnm_t *cnm, ident_t id) {
+    if (!id) return (strview_t){0};
+    const ident_ent_t *ent = ident_get(cnm, id);
+    return (strview_t){ .str = ent->str, .len = ent->len };
+}
+
+// FNV-1a
+static uint32_t hash_bytes(const void *data, size_t len) {
+    const uint8_t *const bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Same as ident_find but only looks at what this state interned itself
+static ident_t ident_find_own(const cnm_t *cnm, const char *str, size_t len, uint32_t hash) {
+    if (!cnm->idents.nbuckets) return 0;
+
+    ident_t id = cnm->idents.buckets[hash & (cnm->idents.nbuckets - 1)];
+    while (id) {
+        const ident_ent_t *ent = &cnm->idents.ents[id - cnm->idents.first];
+        if (ent->hash == hash && ent->len == len && memcmp(ent->str, str, len) == 0) {
+            return id;
+        }
+        id = ent->next;
+    }
+    return 0;
+}
+
+// Returns the id of an identifier or 0 if it has never been interned
+static ident_t ident_find(const cnm_t *cnm, const char *str, size_t len, uint32_t hash) {
+    const ident_t id = cnm->base ? ident_find(cnm->base, str, len, hash) : 0;
+    return id ? id : ident_find_own(cnm, str, len, hash);
+}
+
+// Double the number of buckets and entries in the interner. The old tables
+// are left behind in the static region, which in total are never more than
+// the new tables
+static bool ident_grow(cnm_t *cnm) {
+    const uint32_t nbuckets = cnm->idents.nbuckets
+        ? cnm->idents.nbuckets * 2 : IDENT_MIN_BUCKETS;
+    ident_t *buckets = cnm_alloc_static(cnm, sizeof(ident_t) * nbuckets, sizeof(ident_t),
+                                        MEM_IDENTS);
+    if (!buckets) return false;
+    memset(buckets, 0, sizeof(ident_t) * nbuckets);
+
+    // The load factor is at most 1, so there are at most nbuckets entries
+    ident_ent_t *ents = cnm_alloc_static(cnm, sizeof(ident_ent_t) * (nbuckets + 1),
+                                         sizeof(void *), MEM_IDENTS);
+    if (!ents) return false;
+    const uint32_t count = cnm->idents.count - cnm->idents.first;
+    if (count) memcpy(ents + 1, cnm->idents.ents + 1, sizeof(ident_ent_t) * count);
+    cnm->idents.ents = ents;
+
+    // Rehash all of the old entries
+    for (uint32_t i = 0; i < cnm->idents.nbuckets; i++) {
+        ident_t id = cnm->idents.buckets[i];
+        while (id) {
+            ident_ent_t *ent = ident_get_own(cnm, id);
+            const ident_t next = ent->next;
+            ent->next = buckets[ent->hash & (nbuckets - 1)];
+            buckets[ent->hash & (nbuckets - 1)] = id;
+            id = next;
+        }
+    }
+
+    cnm->idents.buckets = buckets;
+    cnm->idents.nbuckets = nbuckets;
+    return true;
+}
+
+// Add an identifier to this state's own interner without looking for it first.
+// Returns 0 if we ran out of memory
+static ident_t ident_add(cnm_t *cnm, const char *str, size_t len, uint32_t hash) {
+    // Keep the load factor at or below 1
+    if (cnm->idents.count - cnm->idents.first >= cnm->idents.nbuckets
+        && !ident_grow(cnm)) return 0;
+
+    const ident_t id = ++cnm->idents.count;
+    ident_ent_t *const ent = ident_get_own(cnm, id);
+    ident_t *const bucket = &cnm->idents.buckets[hash & (cnm->idents.nbuckets - 1)];
+    *ent = (ident_ent_t){
+        .str = str,
+        .len = len,
+        .hash = hash,
+        .next = *bucket,
+    };
+    *bucket = id;
+    return id;
+}
+
+// Get the id of an identifier, adding it to the interner if it's new.
+// Returns 0 if we ran out of memory
+static ident_t ident_intern(cnm_t *cnm, const char *str, size_t len, uint32_t hash) {
+    const ident_t id = ident_find(cnm, str, len, hash);
+    return id ? id : ident_add(cnm, str, len, hash);
+}
+
+// Type ID + 1 of the struct, union or enum named id, 0 if there is none. An
+// identifier from the base can have a different tag here, in which case this
+// state interned its own copy of it (that ident_find never returns) to hold it
+static uint32_t ident_tag(const cnm_t *cnm, ident_t id) {
+    const ident_ent_t *const ent = ident_get(cnm, id);
+    if (id > cnm->idents.first) return ent->tag;
+    const ident_t own = ident_find_own(cnm, ent->str, ent->len, ent->hash);
+    return own ? ident_get(cnm, own)->tag : ident_tag(cnm->base, id);
+}
+
+// Returns false if we ran out of memory
+static bool ident_set_tag(cnm_t *cnm, ident_t id, uint32_t tag) {
+    if (id <= cnm->idents.first) {
+        const ident_ent_t *const ent = ident_get(cnm, id);
+        id = ident_find_own(cnm, ent->str, ent->len, ent->hash);
+        if (!id && !(id = ident_add(cnm, ent->str, ent->len, ent->hash))) return false;
+    }
+    ident_get_own(cnm, id)->tag = tag;
+    return true;
+}
+
+// Whether id is a copy of a base identifier made by ident_set_tag
+static inline bool ident_is_shadow(const cnm_t *cnm, ident_t id) {
+    if (!cnm->base || id <= cnm->idents.first) return false;
+    const ident_ent_t *const ent = ident_get(cnm, id);
+    return ident_find(cnm, ent->str, ent->len, ent->hash) != id;
+}
+
+// Smallest string entry bucket table, always a power of 2
+#define STRENT_MIN_BUCKETS 16
+
+// Double the number of buckets for string entries. Like the interner, the old
+// table is left behind in the static region
+static bool strent_grow(cnm_t *cnm) {
+    const uint32_t nbuckets = cnm->strs.nbuckets ? cnm->strs.nbuckets * 2 : STRENT_MIN_BUCKETS;
+    strent_t **buckets = cnm_alloc_static(cnm, sizeof(strent_t *) * nbuckets,
+                                          sizeof(strent_t *), MEM_STRINGS);
+    if (!buckets) return false;
+    memset(buckets, 0, sizeof(strent_t *) * nbuckets);
+
+    // Rehash all of the old entries
+    for (uint32_t i = 0; i < cnm->strs.nbuckets; i++) {
+        strent_t *ent = cnm->strs.buckets[i];
+        while (ent) {
+            strent_t *const next = ent->next;
+            ent->next = buckets[ent->hash & (nbuckets - 1)];
+            buckets[ent->hash & (nbuckets - 1)] = ent;
+            ent = next;
+        }
+    }
+
+    cnm->strs.buckets = buckets;
+    cnm->strs.nbuckets = nbuckets;
+    return true;
+}
+
+// Find a string with the same bytes (which can include null characters for
+// utf32 strings) and an alignment that works for align. len includes the null
+// terminator. Returns NULL if there is no such string
+static const strent_t *strent_find(const cnm_t *cnm, const char *str, size_t len,
+                                   size_t align, uint32_t hash) {
+    if (!cnm->strs.nbuckets) return NULL;
+
+    const strent_t *ent = cnm->strs.buckets[hash & (cnm->strs.nbuckets - 1)];
+    for (; ent; ent = ent->next) {
+        if (ent->hash != hash || ent->len != len) continue;
+        if ((uintptr_t)ent->str % align || memcmp(ent->str, str, len)) continue;
+        return ent;
+    }
+    return NULL;
+}
+
+// Add a string in the globals buffer as a new string entry. Returns NULL if we
+// ran out of memory
+static const strent_t *strent_add(cnm_t *cnm, char *str, size_t len, uint32_t hash) {
+    // Keep the load factor at or below 1
+    if (cnm->strs.count >= cnm->strs.nbuckets && !strent_grow(cnm)) return NULL;
+
+    strent_t *ent = cnm_alloc_static(cnm, sizeof(strent_t), sizeof(void *), MEM_STRINGS);
+    if (!ent) return NULL;
+
+    strent_t **const bucket = &cnm->strs.buckets[hash & (cnm->strs.nbuckets - 1)];
+    *ent = (strent_t){
+        .next = *bucket,
+        .hash = hash,
+        .len = len,
+        .str = str,
+    };
+    *bucket = ent;
+    cnm->strs.count++;
+    return ent;
+}
+
+// Smallest variable hash table and how many bytes of region memory there
+// should be per bucket
+#define VARMAP_MIN_BITS 3
+#define VARMAP_REGION_PER_BUCKET (sizeof(scope_t) * 8)
+
+// Allocate the variable hash table. Since variables can only ever take up the
+// region, the table is sized from it once instead of growing
+static bool varmap_init(cnm_t *cnm) {
+    int bits = VARMAP_MIN_BITS;
+    while ((cnm->buflen / VARMAP_REGION_PER_BUCKET) >> (bits + 1)) bits++;
+
+    const size_t size = sizeof(scope_t *) << bits;
+    cnm->varmap.buckets = cnm_alloc_static(cnm, size, sizeof(scope_t *), MEM_VARS);
+    if (!cnm->varmap.buckets) return false;
+    memset(cnm->varmap.buckets, 0, size);
+    cnm->varmap.bits = bits;
+    return true;
+}
+
+static inline scope_t **varmap_bucket(const cnm_t *cnm, ident_t name) {
+    return &cnm->varmap.buckets[(name * 2654435769u) >> (32 - cnm->varmap.bits)];
+}
+
+// Find the innermost variable with this name or NULL if there isn't one
+static scope_t *varmap_find(const cnm_t *cnm, ident_t name) {
+    scope_t *var = *varmap_bucket(cnm, name);
+    while (var && var->name != name) var = var->hnext;
+    return var;
+}
+
+// Add a variable to the current scope. It will shadow any variable with the
+// same name in outer scopes
+static void varmap_add(cnm_t *cnm, scope_t *var) {
+    scope_t **const bucket = varmap_bucket(cnm, var->name);
+    var->scope = cnm->scope;
+    var->next = cnm->vars;
+    var->hnext = *bucket;
+    *bucket = var;
+    cnm->vars = var;
+}
+
+// Enter a new block scope
+static bool scope_push(cnm_t *cnm) {
+    if (cnm->scope + 1 >= MAX_SCOPE_DEPTH) {
+        cnm_doerr(cnm, true, "too many nested scopes");
+        return false;
+    }
+    cnm->scope++;
+    return true;
+}
+
+// Leave the current block scope and bring back anything it shadowed. Variables
+// are removed newest first, so each one is still at the head of its bucket
+static void scope_pop(cnm_t *cnm) {
+    while (cnm->vars && cnm->vars->scope == cnm->scope) {
+        *varmap_bucket(cnm, cnm->vars->name) = cnm->vars->hnext;
+        cnm->vars = cnm->vars->next;
+    }
+    cnm->scope--;
+}
+
+// Character classes used by the lexer. These are used instead of the ctype.h
+// functions since those are locale dependent and are not inlined.
+typedef enum charclass_e {
+    CHAR_SPACE          = 1 << 0, // ' ', \t, \n, \v, \f, \r
+    CHAR_IDENT_START    = 1 << 1, // a-z, A-Z, _
+    CHAR_IDENT          = 1 << 2, // a-z, A-Z, 0-9, _
+    CHAR_DIGIT          = 1 << 3, // 0-9
+    CHAR_XDIGIT         = 1 << 4, // 0-9, a-f, A-F
+    CHAR_NUMBER         = 1 << 5, // a-z, A-Z, 0-9, . (body of number literals)
+    CHAR_PUNCT          = 1 << 6, // First character of an operator token
+} charclass_t;
+
+static const uint8_t lex_chars[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+    ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+    ['a' ... 'f'] = CHAR_IDENT_START | CHAR_IDENT | CHAR_XDIGIT | CHAR_NUMBER,
+    ['A' ... 'F'] = CHAR_IDENT_START | CHAR_IDENT | CHAR_XDIGIT | CHAR_NUMBER,
+    ['g' ... 'z'] = CHAR_IDENT_START | CHAR_IDENT | CHAR_NUMBER,
+    ['G' ... 'Z'] = CHAR_IDENT_START | CHAR_IDENT | CHAR_NUMBER,
+    ['_'] = CHAR_IDENT_START | CHAR_IDENT,
+    ['0' ... '9'] = CHAR_IDENT | CHAR_DIGIT | CHAR_XDIGIT | CHAR_NUMBER,
+#define T0(n1)
+#define T1(c1, n1) [c1] = CHAR_PUNCT,
+#define T2(c1, n1, c2, n2) [c1] = CHAR_PUNCT,
+#define T3(c1, n1, c2, n2, c3, n3) [c1] = CHAR_PUNCT,
+#define T3_2(c1, n1, c2, n2, c3, n3, c4, n4) [c1] = CHAR_PUNCT,
+TOKENS
+#undef T3_2
+#undef T3
+#undef T2
+#undef T1
+#undef T0
+    // '.' starts both the dot token and fractional numbers
+    ['.'] = CHAR_PUNCT | CHAR_NUMBER,
+};
+
+// Returns true if the character c is in any of the character classes
+#define lex_is(c, classes) (lex_chars[(uint8_t)(c)] & (classes))
+
+// Source char at p, or '\0' at or past the end of the source like there was a
+// null terminator
+#define lex_at(cnm, p) ((const char *)(p) < (cnm)->s.end ? *(p) : '\0')
+
+// Locale independent tolower
+static inline char lex_tolower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Scanners for the long runs of characters in the source (whitespace,
+// identifiers and string contents). These have vectorized versions that are
+// chosen at runtime in lex_scanners_init, with the scalar versions used as a
+// fallback. They all stop at end (the end of the source). The vectorized
+// versions only ever do aligned loads so they never read across a page
+// boundary past the end of the source.
+typedef struct lex_scanners_s {
+    // Returns number of whitespace chars at src, and updates the row and column
+    size_t (*space)(const char *src, const char *end, int *row, int *col);
+
+    // Returns number of identifier chars at src
+    size_t (*ident)(const char *src, const char *end);
+
+    // Returns number of chars at src before a '"', '\\', '\n', '\0', or a
+    // non-ascii char. These are all plain ascii chars that need no decoding.
+    size_t (*string)(const char *src, const char *end);
+} lex_scanners_t;
+
+static size_t lex_scalar_space(const char *src, const char *end, int *row, int *col) {
+    const char *const start = src;
+    for (; src < end && lex_is(*src, CHAR_SPACE); ++src) {
+        ++*col;
+        if (*src == '\n') {
+            *col = 1;
+            ++*row;
+        }
+    }
+    return src - start;
+}
+
+static size_t lex_scalar_ident(const char *src, const char *end) {
+    size_t len = 0;
+    while (src + len < end && lex_is(src[len], CHAR_IDENT)) ++len;
+    return len;
+}
+
+static size_t lex_scalar_string(const char *src, const char *end) {
+    size_t len = 0;
+    for (uint8_t c; src + len < end && (c = src[len]) != '\"' && c != '\\' && c != '\n'
+                    && c != '\0'; ++len) {
+        if (c >= 0x80) break;
+    }
+    return len;
+}
+
+static const lex_scanners_t lex_scanners_scalar = {
+    .space = lex_scalar_space,
+    .ident = lex_scalar_ident,
+    .string = lex_scalar_string,
+};
+
+// Scanners currently in use
+static lex_scanners_t lex_scan = {
+    .space = lex_scalar_space,
+    .ident = lex_scalar_ident,
+    .string = lex_scalar_string,
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// Creates the scanners for a vector extension. Each scanner loads whole
+// aligned blocks and works off of bitmasks with one bit per byte in the block.
+// The first block is masked so that chars before src are ignored, chars at or
+// past end are treated as stopping chars and no block starting at or past end
+// is loaded.
+//  isa: name of the extension (prefix of the functions)
+//  width: number of bytes per block
+//  vec: vector type
+//  load: aligned load of one block
+//  space_mask, ident_mask, string_mask: return bitmasks of the whitespace,
+//      identifier, and string stopping chars (including non-ascii chars)
+//  nl_mask: returns a bitmask of the '\n' chars
+// Aligned blocks can read past the end of the source (but never past its
+// page), so the scanners are left out of address sanitizing.
+#define LEX_SIMD_PAST_END(block, end, width, all) \
+    ((size_t)((end) - (block)) < (width) ? ((all) << ((end) - (block))) & (all) : 0)
+#define LEX_SIMD_SCANNERS(isa, width, vec, load, space_mask, nl_mask, ident_mask, \
+                          string_mask) \
+    __attribute__((target(#isa), no_sanitize_address)) \
+    static size_t lex_##isa##_space(const char *src, const char *end, int *row, int *col) { \
+        const char *block = (const char *)((uintptr_t)src & ~(uintptr_t)(width - 1)); \
+        const uint32_t all = ~(uint32_t)0 >> (32 - width); \
+        uint32_t valid = (all << (src - block)) & all; \
+        while (true) { \
+            if (block >= end) return end - src; \
+            const vec v = load((const vec *)block); \
+            const uint32_t stop = (~space_mask(v) | LEX_SIMD_PAST_END(block, end, width, all)) \
+                & valid; \
+            const int nspace = stop ? __builtin_ctz(stop) : width; \
+            const uint32_t nl = nl_mask(v) & valid \
+                & (nspace < 32 ? ((uint32_t)1 << nspace) - 1 : ~0u); \
+            \
+            /* Count the new lines in the block to get the new row and column */ \
+            if (nl) { \
+                *row += __builtin_popcount(nl); \
+                *col = nspace - (31 - __builtin_clz(nl)); \
+            } else { \
+                *col += nspace - __builtin_ctz(valid); \
+            } \
+            \
+            if (stop) return block + nspace - src; \
+            block += width; \
+            valid = all; \
+        } \
+    } \
+    __attribute__((target(#isa), no_sanitize_address)) \
+    static size_t lex_##isa##_ident(const char *src, const char *end) { \
+        const char *block = (const char *)((uintptr_t)src & ~(uintptr_t)(width - 1)); \
+        const uint32_t all = ~(uint32_t)0 >> (32 - width); \
+        uint32_t valid = (all << (src - block)) & all; \
+        while (true) { \
+            if (block >= end) return end - src; \
+            const uint32_t stop = (~ident_mask(load((const vec *)block)) \
+                | LEX_SIMD_PAST_END(block, end, width, all)) & valid; \
+            if (stop) return block + __builtin_ctz(stop) - src; \
+            block += width; \
+            valid = all; \
+        } \
+    } \
+    __attribute__((target(#isa), no_sanitize_address)) \
+    static size_t lex_##isa##_string(const char *src, const char *end) { \
+        const char *block = (const char *)((uintptr_t)src & ~(uintptr_t)(width - 1)); \
+        const uint32_t all = ~(uint32_t)0 >> (32 - width); \
+        uint32_t valid = (all << (src - block)) & all; \
+        while (true) { \
+            if (block >= end) return end - src; \
+            const uint32_t stop = (string_mask(load((const vec *)block)) \
+                | LEX_SIMD_PAST_END(block, end, width, all)) & valid; \
+            if (stop) return block + __builtin_ctz(stop) - src; \
+            block += width; \
+            valid = all; \
+        } \
+    }
+
+// Returns a mask of the bytes in v that are in the range [lo, hi]
+#define LEX_SIMD_RANGE(v, lo, hi, set1, sub, min, cmpeq) \
+    ({ \
+        const __typeof__(v) _t = sub(v, set1(lo)); \
+        cmpeq(min(_t, set1((hi) - (lo))), _t); \
+    })
+
+#define LEX_SSE2_RANGE(v, lo, hi) \
+    LEX_SIMD_RANGE(v, lo, hi, _mm_set1_epi8, _mm_sub_epi8, _mm_min_epu8, _mm_cmpeq_epi8)
+#define LEX_SSE2_EQ(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define LEX_SSE2_MASK(m) ((uint32_t)_mm_movemask_epi8(m))
+
+#define LEX_SSE2_SPACE(v) \
+    LEX_SSE2_MASK(_mm_or_si128(LEX_SSE2_RANGE(v, '\t', '\r'), LEX_SSE2_EQ(v, ' ')))
+#define LEX_SSE2_NL(v) LEX_SSE2_MASK(LEX_SSE2_EQ(v, '\n'))
+#define LEX_SSE2_IDENT(v) \
+    LEX_SSE2_MASK(_mm_or_si128(_mm_or_si128( \
+        LEX_SSE2_RANGE(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'), \
+        LEX_SSE2_RANGE(v, '0', '9')), LEX_SSE2_EQ(v, '_')))
+#define LEX_SSE2_STRING(v) \
+    (LEX_SSE2_MASK(_mm_or_si128( \
+        _mm_or_si128(LEX_SSE2_EQ(v, '\"'), LEX_SSE2_EQ(v, '\\')), \
+        _mm_or_si128(LEX_SSE2_EQ(v, '\n'), LEX_SSE2_EQ(v, '\0')))) | LEX_SSE2_MASK(v))
+
+LEX_SIMD_SCANNERS(sse2, 16, __m128i, _mm_load_si128, LEX_SSE2_SPACE, LEX_SSE2_NL,
+                  LEX_SSE2_IDENT, LEX_SSE2_STRING)
+
+#define LEX_AVX2_RANGE(v, lo, hi) \
+    LEX_SIMD_RANGE(v, lo, hi, _mm256_set1_epi8, _mm256_sub_epi8, _mm256_min_epu8, \
+                   _mm256_cmpeq_epi8)
+#define LEX_AVX2_EQ(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define LEX_AVX2_MASK(m) ((uint32_t)_mm256_movemask_epi8(m))
+
+#define LEX_AVX2_SPACE(v) \
+    LEX_AVX2_MASK(_mm256_or_si256(LEX_AVX2_RANGE(v, '\t', '\r'), LEX_AVX2_EQ(v, ' ')))
+#define LEX_AVX2_NL(v) LEX_AVX2_MASK(LEX_AVX2_EQ(v, '\n'))
+#define LEX_AVX2_IDENT(v) \
+    LEX_AVX2_MASK(_mm256_or_si256(_mm256_or_si256( \
+        LEX_AVX2_RANGE(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'), \
+        LEX_AVX2_RANGE(v, '0', '9')), LEX_AVX2_EQ(v, '_')))
+#define LEX_AVX2_STRING(v) \
+    (LEX_AVX2_MASK(_mm256_or_si256( \
+        _mm256_or_si256(LEX_AVX2_EQ(v, '\"'), LEX_AVX2_EQ(v, '\\')), \
+        _mm256_or_si256(LEX_AVX2_EQ(v, '\n'), LEX_AVX2_EQ(v, '\0')))) | LEX_AVX2_MASK(v))
+
+LEX_SIMD_SCANNERS(avx2, 32, __m256i, _mm256_load_si256, LEX_AVX2_SPACE, LEX_AVX2_NL,
+                  LEX_AVX2_IDENT, LEX_AVX2_STRING)
+
+static const lex_scanners_t lex_scanners_sse2 = {
+    .space = lex_sse2_space,
+    .ident = lex_sse2_ident,
+    .string = lex_sse2_string,
+};
+static const lex_scanners_t lex_scanners_avx2 = {
+    .space = lex_avx2_space,
+    .ident = lex_avx2_ident,
+    .string = lex_avx2_string,
+};
+#endif
+
+// Pick the fastest scanners that the cpu supports. This runs once before main,
+// so states that are used on different threads never see lex_scan change
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void lex_scanners_init(void) {
+    const lex_scanners_t *scan = &lex_scanners_scalar;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) scan = &lex_scanners_avx2;
+    else if (__builtin_cpu_supports("sse2")) scan = &lex_scanners_sse2;
+#endif
+    lex_scan = *scan;
+}
+
+// Identifiers shorter than this are lexed without the scanners
+#define LEX_SHORT_IDENT 8
+
+// Perfect hash over the keyword length and its first and last characters.
+// Adding a keyword that collides shows up in test_lexer_keywords
+#define LEX_KEYWORD_HASH(len, first, last) ((((len) << 3) + ((first) << 2) + (last)) & 127)
+
+typedef struct keyword_s {
+    const char *word;
+    uint8_t len;
+    uint8_t type;
+} keyword_t;
+
+static const keyword_t lex_keywords[128] = {
+#define K(name, str, first, last) \
+    [LEX_KEYWORD_HASH(sizeof(str) - 1, first, last)] = { \
+        .word = str, .len = sizeof(str) - 1, .type = name, \
+    },
+KEYWORDS
+#undef K
+};
+
 // Lex a identifier
 static token_t *token_ident(cnm_t *cnm) {
     cnm->s.tok.type = TOKEN_IDENT;
 
     // Consume alphanumeric and _
-    while (isalnum(cnm->s.tok.src.str[cnm->s.tok.src.len])
-           || cnm->s.tok.src.str[cnm->s.tok.src.len] == '_') {
-        ++cnm->s.tok.src.len;
+    // Most identifiers are short so only use the scanner on longer ones
+    const char *const str = cnm->s.tok.src.str;
+    size_t len = cnm->s.tok.src.len;
+    while (len < LEX_SHORT_IDENT && lex_is(lex_at(cnm, str + len), CHAR_IDENT)) ++len;
+    if (len == LEX_SHORT_IDENT) len += lex_scan.ident(str + len, cnm->s.end);
+    cnm->s.tok.src.len = len;
+
+    // Turn keywords into their own tokens so the parser never compares them
+    const keyword_t *kw = &lex_keywords[LEX_KEYWORD_HASH(len, (uint8_t)str[0],
+                                                         (uint8_t)str[len - 1])];
+    if (kw->len == len && memcmp(kw->word, str, len) == 0) {
+        cnm->s.tok.type = kw->type;
+    } else {
+        // Everything else is interned so names can be compared by id
+        cnm->s.tok.id = ident_intern(cnm, str, len, hash_bytes(str, len));
+        if (!cnm->s.tok.id) {
+            cnm->s.tok.type = TOKEN_EOF;
+            return &cnm->s.tok;
+        }
     }
 
     // Set end of token
@@ -582,6 +1558,35 @@ static bool token_utf8_single_validation(uint8_t cp) {
     return cp < 0x80;
 }
 
+// Decodes the utf8 encoded code point at src into out. Truncated sequences
+// (including ones cut off by end), overlong encodings, and invalid code points
+// are rejected. Returns the number of bytes in the encoding, or 0 if it is
+// malformed.
+static size_t utf8_decode(const uint8_t *src, const uint8_t *end, uint32_t *out) {
+    uint32_t min;
+    size_t len;
+    if (src[0] < 0x80) {
+        *out = src[0];
+        return 1;
+    } else if ((src[0] & 0xE0) == 0xC0) {
+        *out = src[0] & 0x1F, len = 2, min = 0x80;
+    } else if ((src[0] & 0xF0) == 0xE0) {
+        *out = src[0] & 0x0F, len = 3, min = 0x800;
+    } else if ((src[0] & 0xF8) == 0xF0) {
+        *out = src[0] & 0x07, len = 4, min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (len > (size_t)(end - src)) return 0;
+
+    for (size_t i = 1; i < len; i++) {
+        if ((src[i] & 0xC0) != 0x80) return 0;
+        *out = *out << 6 | (src[i] & 0x3F);
+    }
+    if (*out < min || !token_utf32_validation(*out)) return 0;
+    return len;
+}
+
 // Find size of string token
 static size_t token_strlen(token_t *tok) {
     if (tok->suffix[0] != 'U') {
@@ -600,29 +1605,27 @@ static size_t token_strlen(token_t *tok) {
 // ☺ is 1 column, while \u263A is 6 columns
 static size_t lex_char(cnm_t *cnm, const uint8_t **str, uint8_t out[4], size_t *nsrc_cols) {
     // Lex normal character (no escape sequence)
-    if (**str != '\\') {
+    const uint8_t first = lex_at(cnm, *str);
+    if (first != '\\') {
         if (nsrc_cols) *nsrc_cols = 1;
 
-        // UTF-8 formatting (straight copying bytes)
-        if ((**str & 0x80) == 0x00) {
-            if (!(out[0] = *(*str)++)) goto eof_error;
+        // ASCII is copied straight over
+        if (first < 0x80) {
+            if (!(out[0] = first)) goto eof_error;
+            ++(*str);
             return 1;
-        } else if ((**str & 0xE0) == 0xC0) {
-            if (!(out[0] = *(*str)++)) goto eof_error;
-            if (!(out[1] = *(*str)++)) goto eof_error;
-            return 2;
-        } else if ((**str & 0xF0) == 0xE0) {
-            if (!(out[0] = *(*str)++)) goto eof_error;
-            if (!(out[1] = *(*str)++)) goto eof_error;
-            if (!(out[2] = *(*str)++)) goto eof_error;
-            return 3;
-        } else if ((**str & 0xF8) == 0xF0) {
-            if (!(out[0] = *(*str)++)) goto eof_error;
-            if (!(out[1] = *(*str)++)) goto eof_error;
-            if (!(out[2] = *(*str)++)) goto eof_error;
-            if (!(out[3] = *(*str)++)) goto eof_error;
-            return 4;
         }
+
+        // UTF-8 formatting (validated, then straight copying bytes)
+        uint32_t c;
+        const size_t len = utf8_decode(*str, (const uint8_t *)cnm->s.end, &c);
+        if (!len) {
+            cnm_doerr(cnm, true, "malformed utf8 in character literal");
+            goto error;
+        }
+        memcpy(out, *str, len);
+        *str += len;
+        return len;
     }
 
     // This is an escape sequence
@@ -630,7 +1633,8 @@ static size_t lex_char(cnm_t *cnm, const uint8_t **str, uint8_t out[4], size_t *
     bool multi_byte;    // if this is a multi-byte (utf8) codepoint
 
     if (nsrc_cols) *nsrc_cols = 2;
-    switch (*++(*str)) {
+    ++(*str);
+    switch (lex_at(cnm, *str)) {
     // Check for eof
     case '\0': goto eof_error;
 
@@ -659,8 +1663,7 @@ static size_t lex_char(cnm_t *cnm, const uint8_t **str, uint8_t out[4], size_t *
     case 'x':
         base = 16;
         nchrs = 1;
-        for (; (tolower((*str)[nchrs]) >= 'a' && tolower((*str)[nchrs]) <= 'f')
-               || ((*str)[nchrs] >= '0' && (*str)[nchrs] <= '9'); nchrs++);
+        for (; lex_is(lex_at(cnm, *str + nchrs), CHAR_XDIGIT); nchrs++);
         nchrs--;
         if (!nchrs) {
             cnm_doerr(cnm, true, "\\x used with no following hex digits");
@@ -689,11 +1692,11 @@ static size_t lex_char(cnm_t *cnm, const uint8_t **str, uint8_t out[4], size_t *
     ++(*str);
     uint32_t result = 0, pow = 1;
     for (int i = nchrs - 1; i >= 0; i--) {
-        const char c = tolower((*str)[i]);
+        const char c = lex_tolower(lex_at(cnm, *str + i));
         uint32_t digit = c - '0';
         if (c >= 'a' && c <= 'f' && base == 16) {
             digit = c - 'a' + 10;
-        } else if (!isdigit(c)) {
+        } else if (!lex_is(c, CHAR_DIGIT)) {
             cnm_doerr(cnm, true, "malformed character literal char is invalid");
             goto error;
         }
@@ -728,7 +1731,7 @@ static size_t lex_char(cnm_t *cnm, const uint8_t **str, uint8_t out[4], size_t *
             out[0] = 0xF0 | (result >> 18 & 0x07);
             out[1] = 0x80 | (result >> 12 & 0x3F);
             out[2] = 0x80 | (result >> 6 & 0x3F);
-            out[4] = 0x80 | (result & 0x3F);
+            out[3] = 0x80 | (result & 0x3F);
             return 4;
         }
     } else {
@@ -747,24 +1750,13 @@ error:
 // Set the token's string value (which is a uint32_t)
 // Convert from UTF8 to codepoint
 static bool utf8_buf_to_utf32(cnm_t *cnm, uint8_t buf[4], uint32_t *out) {
-    *out = 0;
-    if ((buf[0] & 0x80) == 0x00) {
+    // ASCII is always a valid code point
+    if (buf[0] < 0x80) {
         *out = buf[0];
-    } else if ((buf[0] & 0xE0) == 0xC0) {
-        *out |= (buf[0] & 0x1F) << 6;
-        *out |= buf[1] & 0x3F;
-    } else if ((buf[0] & 0xF0) == 0xE0) {
-        *out |= (buf[0] & 0x0F) << 12;
-        *out |= (buf[1] & 0x3F) << 6;
-        *out |= buf[2] & 0x3F;
-    } else if ((buf[0] & 0xF8) == 0xF0) {
-        *out |= (buf[0] & 0x07) << 18;
-        *out |= (buf[1] & 0x3F) << 12;
-        *out |= (buf[2] & 0x3F) << 6;
-        *out |= buf[3] & 0x3F;
-    }
-
-    if (!token_utf32_validation(*out)) {
+        return true;
+    }
+
+    if (!utf8_decode(buf, buf + 4, out)) {
         cnm_doerr(cnm, true, "malformed character literal, invalid utf32");
         return false;
     }
@@ -772,23 +1764,74 @@ static bool utf8_buf_to_utf32(cnm_t *cnm, uint8_t buf[4], uint32_t *out) {
     return true;
 }
 
+// Widens a run of ascii chars into utf32 code units (which buf doesn't have to
+// be aligned for)
+static void lex_widen_ascii(char *buf, const uint8_t *src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        const uint32_t c = src[i];
+        memcpy(buf + i * sizeof(c), &c, sizeof(c));
+    }
+}
+
 // Lexes a single string so only the hello" part of "hello""world" 
 // The src pointer should point to the start of the contents of the string
 // Returns the length of the source of the string (including final " char)
-// Puts the length of the string buffer into outlen (if its not NULL)
-static size_t lex_single_string(cnm_t *cnm, const uint8_t *src, char *buf,
+// Decodes the string into buf, which can hold cap bytes, and puts the
+// decoded length into outlen (if its not NULL)
+static size_t lex_single_string(cnm_t *cnm, const uint8_t *src, char *buf, size_t cap,
                                 size_t *outlen, size_t *outncols) {
     const uint8_t *const src_start = src;
     uint8_t char_buf[4];
     size_t len = 0;
 
     // Consume all characters
+    const bool wide = cnm->s.tok.suffix[0] == 'U';
     if (outncols) *outncols = 0;
-    while (*src != '\"') {
-        if (*src == '\0') {
+    while (lex_at(cnm, src) != '\"') {
+        // Copy runs of ascii characters that don't need any decoding all at
+        // once. Escapes and other characters are decoded one by one below.
+        const size_t run = lex_scan.string((const char *)src, cnm->s.end);
+        if (wide) {
+            if (len + run * 4 > cap) goto overflow;
+            lex_widen_ascii(buf + len, src, run);
+            len += run * 4;
+        } else {
+            if (len + run > cap) goto overflow;
+            memcpy(buf + len, src, run);
+            len += run;
+        }
+        if (outncols) *outncols += run;
+        src += run;
+        const uint8_t next = lex_at(cnm, src);
+        if (next == '\"') break;
+
+        // Only at the first non-ascii char do we fall back to validating (and
+        // for utf32 strings, converting) utf8 one code point at a time
+        if (next >= 0x80 && cnm->s.tok.suffix[0] != '\0') {
+            uint32_t c;
+            size_t n;
+            for (; (uint8_t)lex_at(cnm, src) >= 0x80; src += n) {
+                if (!(n = utf8_decode(src, (const uint8_t *)cnm->s.end, &c))) {
+                    cnm_doerr(cnm, true, "malformed utf8 in string");
+                    goto error_out;
+                }
+                if (len + 4 > cap) goto overflow;
+                if (wide) {
+                    memcpy(buf + len, &c, sizeof(c));
+                    len += sizeof(c);
+                } else {
+                    memcpy(buf + len, src, n);
+                    len += n;
+                }
+                if (outncols) ++*outncols;
+            }
+            continue;
+        }
+
+        if (next == '\0') {
             cnm_doerr(cnm, true, "unexpected eof while parsing string");
             goto error_out;
-        } else if (*src == '\n') {
+        } else if (next == '\n') {
             cnm_doerr(cnm, true, "unexpected new line while parsing string");
             goto error_out;
         }
@@ -803,15 +1846,17 @@ static size_t lex_single_string(cnm_t *cnm, const uint8_t *src, char *buf,
             goto error_out;
         }
 
-        if (cnm->s.tok.suffix[0] == 'U') {
+        if (wide) {
             // Handle utf-32
             uint32_t c;
             if (!utf8_buf_to_utf32(cnm, char_buf, &c)) goto error_out;
-            if (buf) memcpy(buf + len, &c, sizeof(c));
+            if (len + sizeof(c) > cap) goto overflow;
+            memcpy(buf + len, &c, sizeof(c));
             len += 4;
         } else {
             // Handle single byte or utf-8 encodings
-            if (buf) memcpy(buf + len, char_buf, char_len);
+            if (len + char_len > cap) goto overflow;
+            memcpy(buf + len, char_buf, char_len);
             len += char_len;
         }
     }
@@ -821,6 +1866,8 @@ static size_t lex_single_string(cnm_t *cnm, const uint8_t *src, char *buf,
     if (outncols) ++*outncols;
     return src - src_start;
 
+overflow:
+    cnm_doerr(cnm, true, "ran out of globals memory");
 error_out:
     cnm->s.tok.type = TOKEN_EOF;
     return 0;
@@ -838,18 +1885,21 @@ static void token_eat_literal_prefix(cnm_t *cnm) {
 static token_t *token_string(cnm_t *cnm) {
     token_eat_literal_prefix(cnm);
 
-    size_t buflen = 0;
-    const uint8_t *const start = (const uint8_t *)cnm->s.tok.src.str;
-    const uint8_t *curr = start;
+    const uint8_t *curr = (const uint8_t *)cnm->s.tok.src.str;
 
     // To revert the end spot and length if there wasn't another string to concatinate
     int row_backup, col_backup;
     size_t len_backup;
+    const char *endline_backup;
 
-    // To revert global allocation buffer in case this string is already present
-    uint8_t *const global_ptr = cnm->globals.next;
+    // The string is decoded in one pass into the bottom of the free globals
+    // memory, and only moved up into the string area once we know its size
+    // and that it isn't a duplicate
+    char *const buf = (char *)cnm->globals.next;
+    const size_t cap = cnm->globals.strnext - cnm->globals.next;
+    size_t buflen = 0;
 
-    // Get the length of the string token and the length of the stored string
+    // Decode every string that is concatinated together
     cnm->s.tok.type = TOKEN_STRING;
     cnm->s.tok.src.len = 0;
     do {
@@ -858,7 +1908,7 @@ static token_t *token_string(cnm_t *cnm) {
         cnm->s.tok.src.len++;
 
         size_t _buflen, _ncols, _srclen =
-            lex_single_string(cnm, curr, NULL, &_buflen, &_ncols);
+            lex_single_string(cnm, curr, buf + buflen, cap - buflen, &_buflen, &_ncols);
         if (!_srclen) goto error_scenario;
 
         cnm->s.tok.src.len += _srclen, curr += _srclen, buflen += _buflen;
@@ -866,56 +1916,42 @@ static token_t *token_string(cnm_t *cnm) {
 
         // Skip whitespace until we find the next string to concatinate (if there is one)
         row_backup = cnm->s.tok.end.row, col_backup = cnm->s.tok.end.col;
-        len_backup = cnm->s.tok.src.len;
-        while (isspace(*curr)) {
-            cnm->s.tok.src.len++;
-            cnm->s.tok.end.col++;
-            if (*curr == '\n') {
-                cnm->s.tok.end.row++;
-                cnm->s.tok.end.col = 1;
-            }
-            ++curr;
+        len_backup = cnm->s.tok.src.len, endline_backup = cnm->s.tok.endline;
+        const size_t nspace = lex_scan.space((const char *)curr, cnm->s.end,
+                                             &cnm->s.tok.end.row, &cnm->s.tok.end.col);
+        cnm->s.tok.src.len += nspace, curr += nspace;
+
+        // Same as in token_next, the next string can be on another line
+        if (cnm->s.tok.end.row != row_backup) {
+            cnm->s.tok.endline = (const char *)curr - (cnm->s.tok.end.col - 1);
         }
-    } while (*curr == '\"');
+    } while (lex_at(cnm, curr) == '\"');
     cnm->s.tok.end.row = row_backup, cnm->s.tok.end.col = col_backup;
-    cnm->s.tok.src.len = len_backup;
-
-    // Allocate space for the null terminator
-    buflen += cnm->s.tok.suffix[0] == 'U' ? 4 : 1;
-
-    // Allocate space for the string
-    strent_t *ent = cnm_alloc_string(cnm, sizeof(strent_t) + buflen, sizeof(void *));
-    if (!ent) goto error_scenario;
-    char *buf = ent->str;
-    size_t bufloc = 0;
+    cnm->s.tok.src.len = len_backup, cnm->s.tok.endline = endline_backup;
 
-    // Fill out the new string buffer string by string
-    curr = start;
-    do {
-        curr++;
-
-        size_t len;
-        curr += lex_single_string(cnm, curr, buf + bufloc, &len, NULL);
-        bufloc += len;
-        while (isspace(*curr)) ++curr;
-    } while (*curr == '\"');
-    if (cnm->s.tok.suffix[0] == 'U') memset(buf + bufloc, 0, 4);
-    else buf[bufloc] = '\0';
-    
-    // Test to see if there is already a string with these contents
-    for (strent_t *iter = cnm->strs; iter; iter = iter->next) {
-        if (strcmp(iter->str, buf)) continue;
+    // Add the null terminator
+    const size_t align = cnm->s.tok.suffix[0] == 'U' ? 4 : 1;
+    if (buflen + align > cap) {
+        cnm_doerr(cnm, true, "ran out of globals memory");
+        goto error_scenario;
+    }
+    memset(buf + buflen, 0, align);
+    buflen += align;
 
-        // We found exact copy of the string, so use that string instead
-        cnm->globals.next = global_ptr;
-        cnm->s.tok.s = iter->str;
+    // Use the existing copy of the string if there is one
+    const uint32_t hash = hash_bytes(buf, buflen);
+    const strent_t *ent = strent_find(cnm, buf, buflen, align, hash);
+    if (ent) {
+        cnm->strs.saved += buflen;
+        cnm->s.tok.s = ent->str;
         return &cnm->s.tok;
     }
 
-    // String has not been found so add it to the string entries list
-    if (!ent) goto error_scenario;
-    ent->next = cnm->strs;
-    cnm->strs = ent;
+    // Otherwise move it into the string area (which can overlap with buf)
+    char *str = cnm_alloc_string(cnm, buflen, align);
+    if (!str) goto error_scenario;
+    memmove(str, buf, buflen);
+    if (!(ent = strent_add(cnm, str, buflen, hash))) goto error_scenario;
     cnm->s.tok.s = ent->str;
     return &cnm->s.tok;
 
@@ -938,7 +1974,7 @@ static token_t *token_char(cnm_t *cnm) {
     cnm->s.tok.src.len = (uintptr_t)c - (uintptr_t)cnm->s.tok.src.str;
 
     // Error out
-    if (cnm->s.tok.src.str[cnm->s.tok.src.len] != '\'') {
+    if (lex_at(cnm, cnm->s.tok.src.str + cnm->s.tok.src.len) != '\'') {
         cnm_doerr(cnm, true, "expected ending \' after character");
         cnm->s.tok.type = TOKEN_EOF;
         return &cnm->s.tok;
@@ -960,40 +1996,52 @@ error:
     return &cnm->s.tok;
 }
 
+// Longest number literal (with its suffix)
+#define LEX_MAX_NUMBER 127
+
 // Parse a TOKEN_INT or TOKEN_DOUBLE
 static token_t *token_number(cnm_t *cnm) {
     // Look for dot that signifies double and consume token length
     cnm->s.tok.type = TOKEN_INT;
-    while (isalnum(cnm->s.tok.src.str[cnm->s.tok.src.len])
-           || cnm->s.tok.src.str[cnm->s.tok.src.len] == '.') {
-        if (cnm->s.tok.src.str[cnm->s.tok.src.len] == '.') {
-            cnm->s.tok.type = TOKEN_DOUBLE;
-        }
-        ++cnm->s.tok.src.len;
+    for (char c; lex_is(c = lex_at(cnm, cnm->s.tok.src.str + cnm->s.tok.src.len), CHAR_NUMBER);
+         ++cnm->s.tok.src.len) {
+        if (c == '.') cnm->s.tok.type = TOKEN_DOUBLE;
+    }
+
+    // The number is converted from a null terminated copy since the source
+    // doesn't have to have a null terminator after it
+    char num[LEX_MAX_NUMBER + 1];
+    const size_t len = cnm->s.tok.src.len;
+    if (len > LEX_MAX_NUMBER) {
+        cnm_doerr(cnm, true, "number literal is too long");
+        cnm->s.tok.type = TOKEN_EOF;
+        return &cnm->s.tok;
     }
+    memcpy(num, cnm->s.tok.src.str, len);
+    num[len] = '\0';
 
     // Get the the actual contents and parse suffix
     char *end;
     if (cnm->s.tok.type == TOKEN_INT) {
         size_t suffix_len = 0;
 
-        if (cnm->s.tok.src.len > 2 && cnm->s.tok.src.str[0] == '0') {
-            if (tolower(cnm->s.tok.src.str[1]) == 'x') cnm->s.tok.i.base = 16;
-            else if (tolower(cnm->s.tok.src.str[1]) == 'b') cnm->s.tok.i.base = 2;
-        } else if (cnm->s.tok.src.len > 1 && cnm->s.tok.src.str[0] == '0') {
+        if (len > 2 && num[0] == '0') {
+            if (lex_tolower(num[1]) == 'x') cnm->s.tok.i.base = 16;
+            else if (lex_tolower(num[1]) == 'b') cnm->s.tok.i.base = 2;
+        } else if (len > 1 && num[0] == '0') {
             cnm->s.tok.i.base = 8;
         } else {
             cnm->s.tok.i.base = 10;
         }
 
-        cnm->s.tok.i.n = strtoumax(cnm->s.tok.src.str + (cnm->s.tok.i.base == 2 ? 2 : 0),
-                                   &end, cnm->s.tok.i.base);
+        cnm->s.tok.i.n = strtoumax(num + (cnm->s.tok.i.base == 2 ? 2 : 0), &end,
+                                   cnm->s.tok.i.base);
 
         // Get suffix
         cnm->s.tok.suffix[suffix_len] = '\0';
 
         // Look for optional 'u'
-        if (tolower(*end) == 'u') {
+        if (lex_tolower(*end) == 'u') {
             cnm->s.tok.suffix[suffix_len++] = 'u';
             cnm->s.tok.suffix[suffix_len] = '\0';
             end++;
@@ -1001,17 +2049,17 @@ static token_t *token_number(cnm_t *cnm) {
         
         // Look for optional 2 l's
         for (int i = 0; i < 2; i++) {
-            if (tolower(*end) == 'l') {
+            if (lex_tolower(*end) == 'l') {
                 cnm->s.tok.suffix[suffix_len++] = 'l';
                 cnm->s.tok.suffix[suffix_len] = '\0';
                 end++;
             }
         }
     } else {
-        cnm->s.tok.f = strtod(cnm->s.tok.src.str, &end);
+        cnm->s.tok.f = strtod(num, &end);
 
         // Look for optional 'f'
-        if (tolower(*end) == 'f') {
+        if (lex_tolower(*end) == 'f') {
             cnm->s.tok.suffix[0] = 'f';
             cnm->s.tok.suffix[1] = '\0';
             end++;
@@ -1021,7 +2069,7 @@ static token_t *token_number(cnm_t *cnm) {
     }
 
     // Check for other characters after the suffix/numbers and error if so
-    if (end != cnm->s.tok.src.str + cnm->s.tok.src.len) {
+    if (end != num + len) {
         cnm_doerr(cnm, true, "invalid number literal format, extra chars after digits");
         cnm->s.tok.type = TOKEN_EOF;
         return &cnm->s.tok;
@@ -1037,57 +2085,44 @@ static token_t *token_next(cnm_t *cnm) {
     if (cnm->s.tok.type == TOKEN_EOF) return &cnm->s.tok;
 
     // Skip whitespace
-    cnm->s.tok.src.str += cnm->s.tok.src.len;
-    cnm->s.tok.start.row = cnm->s.tok.end.row;
-    cnm->s.tok.start.col = cnm->s.tok.end.col;
-    for (; isspace(*cnm->s.tok.src.str); ++cnm->s.tok.src.str) {
-        ++cnm->s.tok.start.col;
-        if (*cnm->s.tok.src.str == '\n') {
-            cnm->s.tok.start.col = 1;
-            ++cnm->s.tok.start.row;
-        }
-    }
+    const char *src = cnm->s.tok.src.str + cnm->s.tok.src.len;
+    int row = cnm->s.tok.end.row, col = cnm->s.tok.end.col;
+    if (lex_is(lex_at(cnm, src), CHAR_SPACE)) {
+        // Tokens are most often seperated by a single space
+        if (*src == ' ' && !lex_is(lex_at(cnm, src + 1), CHAR_SPACE)) ++src, ++col;
+        else src += lex_scan.space(src, cnm->s.end, &row, &col);
+
+        // Past a new line everything in the line before src was whitespace,
+        // which is one byte per column
+        if (row != cnm->s.tok.end.row) cnm->s.tok.endline = src - (col - 1);
+    }
+    cnm->s.tok.line = cnm->s.tok.endline;
+    cnm->s.tok.src.str = src;
     cnm->s.tok.src.len = 1;
-    cnm->s.tok.end.row = cnm->s.tok.start.row;
-    cnm->s.tok.end.col = cnm->s.tok.start.col;
-    
-    switch (cnm->s.tok.src.str[0]) {
-    // Special tokens
-    case '0': case '1': case '2': case '3': case '4':
-    case '5': case '6': case '7': case '8': case '9':
-        return token_number(cnm);
-    case '\"':
-        return token_string(cnm);
-    case '\'':
-        return token_char(cnm);
-    case '\0':
-        cnm->s.tok.type = TOKEN_EOF;
-        cnm->s.tok.src.len = 0;
-        break;
-    default:
-        // Unknown character
-        if (!isalpha(cnm->s.tok.src.str[0]) && cnm->s.tok.src.str[0] != '_') {
-            cnm_doerr(cnm, true, "unknown character while lexing");
-            cnm->s.tok.type = TOKEN_EOF;
-            return &cnm->s.tok;
-        }
-
+    cnm->s.tok.start.row = cnm->s.tok.end.row = row;
+    cnm->s.tok.start.col = cnm->s.tok.end.col = col;
+
+    // Identifiers and operators are by far the most common tokens, so look at
+    // the character class first before falling back to the special tokens
+    const char first = lex_at(cnm, src);
+    const uint8_t class = lex_chars[(uint8_t)first];
+    if (class & CHAR_IDENT_START) {
         // Prefix strings/characters
-        if (cnm->s.tok.src.str[0] == 'u' && cnm->s.tok.src.str[1] == '8') {
+        if (first == 'u' && lex_at(cnm, src + 1) == '8') {
             cnm->s.tok.suffix[0] = 'u';
             cnm->s.tok.suffix[1] = '8';
             cnm->s.tok.suffix[2] = '\0';
-            if (cnm->s.tok.src.str[2] == '"') {
+            if (lex_at(cnm, src + 2) == '"') {
                 return token_string(cnm);
-            } else if (cnm->s.tok.src.str[2] == '\'') {
+            } else if (lex_at(cnm, src + 2) == '\'') {
                 return token_char(cnm);
             }
-        } else if (cnm->s.tok.src.str[0] == 'U') {
+        } else if (first == 'U') {
             cnm->s.tok.suffix[0] = 'U';
             cnm->s.tok.suffix[1] = '\0';
-            if (cnm->s.tok.src.str[1] == '"') {
+            if (lex_at(cnm, src + 1) == '"') {
                 return token_string(cnm);
-            } else if (cnm->s.tok.src.str[1] == '\'') {
+            } else if (lex_at(cnm, src + 1) == '\'') {
                 return token_char(cnm);
             }
         }
@@ -1095,7 +2130,29 @@ static token_t *token_next(cnm_t *cnm) {
         // Identifiers
         cnm->s.tok.suffix[0] = '\0';
         return token_ident(cnm);
+    } else if (class & CHAR_DIGIT) {
+        return token_number(cnm);
+    } else if (!(class & CHAR_PUNCT)) {
+        switch (first) {
+        case '\"':
+            cnm->s.tok.suffix[0] = '\0';
+            return token_string(cnm);
+        case '\'':
+            cnm->s.tok.suffix[0] = '\0';
+            return token_char(cnm);
+        case '\0':
+            cnm->s.tok.type = TOKEN_EOF;
+            cnm->s.tok.src.len = 0;
+            return &cnm->s.tok;
+        default:
+            // Unknown character
+            cnm_doerr(cnm, true, "unknown character while lexing");
+            cnm->s.tok.type = TOKEN_EOF;
+            return &cnm->s.tok;
+        }
+    }
 
+    switch (first) {
     // Simple tokens
 #define T0(n1)
 #define T1(c1, n1) \
@@ -1105,7 +2162,7 @@ static token_t *token_next(cnm_t *cnm) {
 #define T2(c1, n1, c2, n2) \
     case c1: \
         cnm->s.tok.type = n1; \
-        if (cnm->s.tok.src.str[1] == c2) { \
+        if (lex_at(cnm, src + 1) == c2) { \
             cnm->s.tok.type = n2; \
             cnm->s.tok.src.len = 2; \
         } \
@@ -1113,10 +2170,10 @@ static token_t *token_next(cnm_t *cnm) {
 #define T3(c1, n1, c2, n2, c3, n3) \
     case c1: \
         cnm->s.tok.type = n1; \
-        if (cnm->s.tok.src.str[1] == c2) { \
+        if (lex_at(cnm, src + 1) == c2) { \
             cnm->s.tok.type = n2; \
             cnm->s.tok.src.len = 2; \
-        } else if (cnm->s.tok.src.str[1] == c3) { \
+        } else if (lex_at(cnm, src + 1) == c3) { \
             cnm->s.tok.type = n3; \
             cnm->s.tok.src.len = 2; \
         } \
@@ -1124,13 +2181,13 @@ static token_t *token_next(cnm_t *cnm) {
 #define T3_2(c1, n1, c2, n2, c3, n3, c4, n4) \
     case c1: \
         cnm->s.tok.type = n1; \
-        if (cnm->s.tok.src.str[1] == c2) { \
+        if (lex_at(cnm, src + 1) == c2) { \
             cnm->s.tok.type = n2; \
             cnm->s.tok.src.len = 2; \
-        } else if (cnm->s.tok.src.str[1] == c3) { \
+        } else if (lex_at(cnm, src + 1) == c3) { \
             cnm->s.tok.type = n3; \
             cnm->s.tok.src.len = 2; \
-            if (cnm->s.tok.src.str[2] == c4) { \
+            if (lex_at(cnm, src + 2) == c4) { \
                 cnm->s.tok.type = n4; \
                 cnm->s.tok.src.len = 3; \
             } \
@@ -1149,7 +2206,7 @@ TOKENS
 }
 
 static typeref_t type_parse(cnm_t *cnm, const type_t *base,
-                            strview_t *name, bool allow_bitfields);
+                            ident_t *name, bool allow_bitfields);
 static bool type_parse_declspec(cnm_t *cnm, type_t *type, bool *istypedef);
 
 // Returns true if this ast node can be used in an arithmetic operation
@@ -1198,6 +2255,118 @@ static bool type_is_pod(const type_t type) {
     }
 }
 
+// Smallest capacity of the type ID array
+#define USERTY_MIN_CAP 8
+
+// Get the user type with this type ID or NULL if there is none
+static userty_t *userty_get(const cnm_t *cnm, int typeid) {
+    if (typeid >= cnm->type.first) {
+        typeid -= cnm->type.first;
+        return typeid < cnm->type.cap ? cnm->type.byid[typeid] : NULL;
+    }
+    for (const userty_over_t *o = cnm->type.over; o; o = o->next) {
+        if (o->typeid == typeid) return o->u;
+    }
+    return typeid >= 0 && cnm->base ? userty_get(cnm->base, typeid) : NULL;
+}
+
+// Make sure that the type ID array can hold the type ID. The array is doubled
+// and the old one is left behind in the static region
+static bool userty_reserve(cnm_t *cnm, int typeid) {
+    typeid -= cnm->type.first;
+    if (typeid < cnm->type.cap) return true;
+
+    int cap = cnm->type.cap ? cnm->type.cap : USERTY_MIN_CAP;
+    while (cap <= typeid) cap *= 2;
+    userty_t **byid = cnm_alloc_static(cnm, sizeof(userty_t *) * cap, sizeof(userty_t *),
+                                       MEM_TYPES);
+    if (!byid) return false;
+    memset(byid, 0, sizeof(userty_t *) * cap);
+    if (cnm->type.cap) memcpy(byid, cnm->type.byid, sizeof(userty_t *) * cnm->type.cap);
+
+    cnm->type.byid = byid;
+    cnm->type.cap = cap;
+    return true;
+}
+
+// Point a type ID at a user type. Returns false if we ran out of memory
+static bool userty_set(cnm_t *cnm, int typeid, userty_t *u) {
+    if (typeid >= cnm->type.first) {
+        if (!userty_reserve(cnm, typeid)) return false;
+        cnm->type.byid[typeid - cnm->type.first] = u;
+        return true;
+    }
+
+    // IDs of the base are overridden instead
+    for (userty_over_t *o = cnm->type.over; o; o = o->next) {
+        if (o->typeid != typeid) continue;
+        o->u = u;
+        return true;
+    }
+    userty_over_t *const o = cnm_alloc_static(cnm, sizeof(userty_over_t), sizeof(void *),
+                                              MEM_TYPES);
+    if (!o) return false;
+    *o = (userty_over_t){ .typeid = typeid, .u = u, .next = cnm->type.over };
+    cnm->type.over = o;
+    return true;
+}
+
+// Returns a user type that can be changed. Types that belong to the base are
+// copied into this state first (with room for size bytes of data), everything
+// that used their type ID sees the copy from then on. NULL if we ran out of
+// memory
+static userty_t *userty_own(cnm_t *cnm, userty_t *u, size_t size) {
+    if (!cnm->base || u->typeid >= cnm->type.first) return u;
+    for (const userty_over_t *o = cnm->type.over; o; o = o->next) {
+        if (o->u == u) return u;
+    }
+
+    const size_t used = u->type == USER_ENUM ? sizeof(enum_t) : sizeof(field_list_t);
+    if (size < used) size = used;
+    userty_t *const copy = cnm_alloc_static(cnm, sizeof(userty_t) + size, sizeof(void *),
+                                            MEM_TYPES);
+    if (!copy) return NULL;
+    memcpy(copy, u, sizeof(userty_t) + used);
+    memset(copy->data + used, 0, size - used);
+    copy->next = cnm->type.types;
+    cnm->type.types = copy;
+    return userty_set(cnm, u->typeid, copy) ? copy : NULL;
+}
+
+// Same as userty_reserve but for the typedef ID array
+static bool typedef_reserve(cnm_t *cnm, int typedef_id) {
+    typedef_id -= cnm->type.typedef_first;
+    if (typedef_id < cnm->type.typedef_cap) return true;
+
+    int cap = cnm->type.typedef_cap ? cnm->type.typedef_cap : USERTY_MIN_CAP;
+    while (cap <= typedef_id) cap *= 2;
+    typedef_t **typedefs = cnm_alloc_static(cnm, sizeof(typedef_t *) * cap,
+                                            sizeof(typedef_t *), MEM_TYPEDEFS);
+    if (!typedefs) return false;
+    if (cnm->type.typedef_cap) {
+        memcpy(typedefs, cnm->type.typedefs, sizeof(typedef_t *) * cnm->type.typedef_cap);
+    }
+
+    cnm->type.typedefs = typedefs;
+    cnm->type.typedef_cap = cap;
+    return true;
+}
+
+// Get the typedef with this typedef ID
+static inline typedef_t *typedef_get(const cnm_t *cnm, int typedef_id) {
+    while (typedef_id < cnm->type.typedef_first) cnm = cnm->base;
+    return cnm->type.typedefs[typedef_id - cnm->type.typedef_first];
+}
+
+// Find the newest typedef with a name, NULL if there is none
+static typedef_t *typedef_find(const cnm_t *cnm, ident_t name) {
+    for (int id = cnm->type.typedef_gid - 1; id >= cnm->type.typedef_first; id--) {
+        typedef_t *const td = cnm->type.typedefs[id - cnm->type.typedef_first];
+        if (td->name == name) return td;
+    }
+    return cnm->base ? typedef_find(cnm->base, name) : NULL;
+}
+
 static typeinf_t type_getinf(cnm_t *cnm, const type_t *type) {
     switch (type->class) {
     case TYPE_VOID: return (typeinf_t){ .size = 0, .align = 1 };
@@ -1226,12 +2395,10 @@ static typeinf_t type_getinf(cnm_t *cnm, const type_t *type) {
         inf.size *= type->n;
         return inf;
     }
-    case TYPE_USER:
-        for (userty_t *u = cnm->type.types; u; u = u->next) {
-            if (u->typeid != type->n) continue;
-            return u->inf;
-        }
-        return (typeinf_t){0};
+    case TYPE_USER: {
+        const userty_t *u = userty_get(cnm, type->n);
+        return u ? u->inf : (typeinf_t){0};
+    }
     default:
         return (typeinf_t){ .size = 0, .align = 1 };
     }
@@ -1248,6 +2415,9 @@ static bool type_eq(const typeref_t a, const typeref_t b, bool test_toplvl) {
     // If sizes aren't equal, can skip rest
     if (a.size != b.size) return false;
 
+    // Canonical types are equal if they are the same layers
+    if (a.type == b.type) return true;
+
     for (int i = 0; i < a.size; i++) {
         // Check class
         if (a.type[i].class != b.type[i].class) return false;
@@ -1282,11 +2452,125 @@ static bool type_eq(const typeref_t a, const typeref_t b, bool test_toplvl) {
 
 // Promotes a type to atleast type of int. Behavior is undefined if the type is
 // not already an arithmetic type
-static inline void type_promote_to_int(typeref_t *ref) {
-    if (ref->type[0].class < TYPE_INT) {
-        ref->type[0].class = TYPE_INT;
-        ref->type[0].n = 32;
+static inline void type_promote_to_int(type_t *type) {
+    if (type->class < TYPE_INT || type->class == TYPE_BOOL) {
+        type->class = TYPE_INT;
+        type->n = 32;
+    }
+}
+
+// Smallest canonical type bucket table, always a power of 2
+#define TYPEENT_MIN_BUCKETS 16
+
+// Double the number of buckets for canonical types. Like the interner, the old
+// tables are left behind in the static region
+static bool typeent_grow(cnm_t *cnm) {
+    const uint32_t nbuckets = cnm->types.nbuckets ? cnm->types.nbuckets * 2 : TYPEENT_MIN_BUCKETS;
+    typehnd_t *buckets = cnm_alloc_static(cnm, sizeof(typehnd_t) * nbuckets, sizeof(typehnd_t),
+                                          MEM_TYPES);
+    if (!buckets) return false;
+    memset(buckets, 0, sizeof(typehnd_t) * nbuckets);
+
+    // The load factor is at most 1, so there are at most nbuckets entries
+    typeent_t **ents = cnm_alloc_static(cnm, sizeof(typeent_t *) * (nbuckets + 1),
+                                        sizeof(typeent_t *), MEM_TYPES);
+    if (!ents) return false;
+    const uint32_t count = cnm->types.count - cnm->types.first;
+    if (count) memcpy(ents + 1, cnm->types.ents + 1, sizeof(typeent_t *) * count);
+    cnm->types.ents = ents;
+
+    // Rehash all of the old entries
+    for (uint32_t i = 0; i < cnm->types.nbuckets; i++) {
+        typehnd_t h = cnm->types.buckets[i];
+        while (h) {
+            typeent_t *const ent = ents[h - cnm->types.first];
+            const typehnd_t next = ent->next;
+            ent->next = buckets[ent->hash & (nbuckets - 1)];
+            buckets[ent->hash & (nbuckets - 1)] = h;
+            h = next;
+        }
+    }
+
+    cnm->types.buckets = buckets;
+    cnm->types.nbuckets = nbuckets;
+    return true;
+}
+
+// Get the layers of a canonical type
+static inline typeref_t type_get(const cnm_t *cnm, typehnd_t h) {
+    while (h <= cnm->types.first) cnm = cnm->base;
+    const typeent_t *const ent = cnm->types.ents[h - cnm->types.first];
+    return (typeref_t){ .type = (type_t *)ent->type, .size = ent->size };
+}
+
+// Get the handle of some type layers or 0 if they were never interned
+static typehnd_t type_find(const cnm_t *cnm, const type_t *layers, size_t size,
+                           uint32_t hash) {
+    if (cnm->base) {
+        const typehnd_t h = type_find(cnm->base, layers, size, hash);
+        if (h) return h;
+    }
+    if (!cnm->types.nbuckets) return 0;
+
+    typehnd_t h = cnm->types.buckets[hash & (cnm->types.nbuckets - 1)];
+    while (h) {
+        const typeent_t *const ent = cnm->types.ents[h - cnm->types.first];
+        if (ent->hash == hash && ent->size == size
+            && memcmp(ent->type, layers, sizeof(type_t) * size) == 0) return h;
+        h = ent->next;
     }
+    return 0;
+}
+
+// Get the handle of the canonical copy of some type layers, adding it if there
+// is none yet. The layers can be in released normal region memory since they
+// are copied before anything else is allocated. Returns 0 if we ran out of
+// memory
+static typehnd_t type_intern(cnm_t *cnm, const type_t *layers, size_t size) {
+    const size_t bytes = sizeof(type_t) * size;
+    const uint32_t hash = hash_bytes(layers, bytes);
+    const typehnd_t found = type_find(cnm, layers, size, hash);
+    if (found) return found;
+
+    typeent_t *ent = cnm_alloc_static(cnm, sizeof(typeent_t) + bytes, sizeof(typehnd_t),
+                                      MEM_TYPES);
+    if (!ent) return 0;
+    memmove(ent->type, layers, bytes); // can overlap with released memory
+    ent->hash = hash;
+    ent->size = size;
+
+    // Keep the load factor at or below 1
+    if (cnm->types.count - cnm->types.first >= cnm->types.nbuckets
+        && !typeent_grow(cnm)) return 0;
+    const typehnd_t h = ++cnm->types.count;
+    typehnd_t *const bucket = &cnm->types.buckets[hash & (cnm->types.nbuckets - 1)];
+    ent->next = *bucket;
+    *bucket = h;
+    cnm->types.ents[h - cnm->types.first] = ent;
+    return h;
+}
+
+// Point a typeref at the canonical copy of some type layers
+static inline bool typeref_set(cnm_t *cnm, typeref_t *ref, const type_t *layers, size_t size) {
+    const typehnd_t h = type_intern(cnm, layers, size);
+    if (h) *ref = type_get(cnm, h);
+    return h != 0;
+}
+
+// Point a typeref at the canonical copy of its layers
+static inline bool typeref_intern(cnm_t *cnm, typeref_t *ref) {
+    return typeref_set(cnm, ref, ref->type, ref->size);
+}
+
+// Set the length of the top array layer of a typeref. Since the layers might
+// be canonical, this points the typeref at a canonical copy with the new length
+static bool typeref_set_arrlen(cnm_t *cnm, typeref_t *ref, unsigned int n) {
+    type_t *layers = cnm_alloc(cnm, sizeof(type_t) * ref->size, sizeof(type_t));
+    if (!layers) return false;
+    memcpy(layers, ref->type, sizeof(type_t) * ref->size);
+    layers[0].n = n;
+    ref->type = layers;
+    return typeref_intern(cnm, ref);
 }
 
 // Helper struct for type_parse_declspec
@@ -1482,29 +2766,33 @@ static bool type_parse_declspec_user(cnm_t *cnm, type_t *type, bool docolon, use
    
     // Look for struct with name that matches current token
     userty_t *u;
-    for (u = cnm->type.types; u; u = u->next) {
+    const ident_t name = cnm->s.tok.type == TOKEN_IDENT ? cnm->s.tok.id : 0;
+    const uint32_t tag = name ? ident_tag(cnm, name) : 0;
+    if (tag) {
         // Return already existing struct if we can
-        if (strview_eq(u->name, cnm->s.tok.src)) {
-            type->n = u->typeid;
-            if (token_next(cnm)->type == TOKEN_BRACE_L
-                || (docolon && cnm->s.tok.type == TOKEN_COLON)) {
-                goto parse_def;
-            }
-            return true;
+        u = userty_get(cnm, tag - 1);
+        type->n = u->typeid;
+        if (token_next(cnm)->type == TOKEN_BRACE_L
+            || (docolon && cnm->s.tok.type == TOKEN_COLON)) {
+            goto parse_def;
         }
+        return true;
     }
 
     // Create a new userty if we've checked all structs already
-    if (!(u = cnm_alloc_static(cnm, sizeof(userty_t) + tysize, sizeof(void *)))) {
+    if (!userty_reserve(cnm, cnm->type.gid)) return false;
+    if (!(u = cnm_alloc_static(cnm, sizeof(userty_t) + tysize, sizeof(void *), MEM_TYPES))) {
         return false;
     }
     *u = (userty_t){ .typeid = cnm->type.gid++ };
     u->next = cnm->type.types;
     cnm->type.types = u;
+    cnm->type.byid[u->typeid - cnm->type.first] = u;
     memset(u->data, 0, tysize);
     type->n = u->typeid;
-    if (cnm->s.tok.type == TOKEN_IDENT) {
-        u->name = cnm->s.tok.src;
+    if (name) {
+        u->name = name;
+        if (!ident_set_tag(cnm, name, u->typeid + 1)) return false;
         token_next(cnm);
     }
     if (cnm->s.tok.type != TOKEN_BRACE_L
@@ -1517,49 +2805,134 @@ parse_def:
         return false;
     }
 
+    // Forward declarations from the base are defined in a copy
+    if (!(u = userty_own(cnm, u, tysize))) return false;
     *outu = u;
     return true;
 }
 
+// Fields are gathered in a list in the normal region until the closing brace
+// since the lexer can intern identifiers in the static region in between them
+typedef struct field_node_s {
+    struct field_node_s *prev;
+    field_t f;
+} field_node_t;
+
 // Allocate new field member and add it to the list
-static field_t *field_alloc(cnm_t *cnm, field_list_t *s) {
-    field_t *f = cnm_alloc_static(cnm, sizeof(field_t), sizeof(void *));
-    if (!f) return NULL;
+static field_t *field_alloc(cnm_t *cnm, field_node_t **fields, uint32_t *nfields) {
+    field_node_t *node = cnm_alloc(cnm, sizeof(field_node_t), sizeof(void *));
+    if (!node) return NULL;
+    *node = (field_node_t){ .prev = *fields };
+    *fields = node;
+    ++*nfields;
+    return &node->f;
+}
+
+// Move the gathered fields to one array in the static region in declaration
+// order (the list is newest first)
+static bool field_list_move_to_static(cnm_t *cnm, field_list_t *s, const field_node_t *fields,
+                                      uint32_t nfields) {
+    s->fields = cnm_alloc_static(cnm, sizeof(field_t) * nfields, sizeof(uint32_t), MEM_FIELDS);
+    if (!s->fields) return false;
+    s->nfields = nfields;
+    for (; fields; fields = fields->prev) s->fields[--nfields] = fields->f;
+    return true;
+}
+
+// Find a field by name, NULL if there is none
+static field_t *field_find(const field_list_t *s, ident_t name) {
+    for (uint32_t i = 0; i < s->nfields; i++) {
+        if (s->fields[i].name == name) return &s->fields[i];
+    }
+    return NULL;
+}
+
+// Calculate the offsets of all the fields and the size of the struct in one
+// pass (without the padding at the end). Zero width bitfields only align the
+// next field so they are dropped
+static void struct_layout(cnm_t *cnm, userty_t *u, field_list_t *s) {
+    // Info so that we can store bitfields correctly
+    struct {
+        typeinf_t inf; // size and alignment of current type
+        int offs; // what bit field to allocate to next
+        int byte_offs; // what byte offset this is at
+    } bit = {0};
 
-    f->next = s->fields;
-    f->last = NULL;
-    if (f->next) f->next->last = f;
-    s->fields = f;
+    uint32_t nfields = 0;
+    for (uint32_t i = 0; i < s->nfields; i++) {
+        field_t f = s->fields[i];
+        const type_t *const ftype = type_get(cnm, f.type).type;
+        const typeinf_t inf = type_getinf(cnm, ftype);
+
+        const bool bit_overflow = type_is_int(*ftype)
+            && bit.offs + ftype->n > bit.inf.size * 8;
+
+        if (type_is_int(*ftype) && ftype->n == 0) {
+            // Align here, but don't do any size and also delete this field
+            u->inf.size = align_size(u->inf.size, inf.align);
+            if (inf.align > u->inf.align) u->inf.align = inf.align;
+            bit.inf = (typeinf_t){0};
+            bit.offs = 0;
+            bit.byte_offs = u->inf.size;
+            continue;
+        } else if (inf.size != bit.inf.size || inf.align != bit.inf.align
+                   || bit_overflow) {
+            // Allocate new area if bitfield is for different size type or
+            // the bitfeild would overflow int boundaries
+            u->inf.size = align_size(u->inf.size, inf.align);
+            f.offs = u->inf.size;
+            bit.byte_offs = u->inf.size;
+            u->inf.size += inf.size;
+            if (inf.align > u->inf.align) u->inf.align = inf.align;
+            f.bit_offs = 0;
+
+            // Set new bitfield offset
+            if (type_is_int(*ftype) && ftype->n < inf.size * 8) {
+                bit.inf = inf;
+                bit.offs = ftype->n;
+            } else {
+                bit.inf = (typeinf_t){0};
+                bit.offs = 0;
+            }
+        } else {
+            // Allocate it to the same integer but in different bit position
+            f.bit_offs = bit.offs;
+            f.offs = bit.byte_offs;
+            bit.offs += ftype->n;
 
-    return f;
+            if (bit.offs >= bit.inf.size * 8) {
+                bit.inf = (typeinf_t){0};
+                bit.offs = 0;
+            }
+        }
+        s->fields[nfields++] = f;
+    }
+    s->nfields = nfields;
 }
 
 // Get the full type data
-static bool field_set_type(cnm_t *cnm, field_t *f,
+static bool field_set_type(cnm_t *cnm, field_t *f, typeref_t *type,
                            const bool not_defined_new_type, const type_t *base) {
-    f->type = type_parse(cnm, base, &f->name, true);
-    if (!f->type.size) {
+    *type = type_parse(cnm, base, &f->name, true);
+    if (!type->size) {
         cnm_doerr(cnm, true, "field %s can not have 0 size, it's base type might"
                              "also be undefined");
         return false;
     }
-    if (!f->name.str && not_defined_new_type
-        && !(type_is_int(*f->type.type) && f->type.type->n == 0)) {
+    if (!f->name && not_defined_new_type
+        && !(type_is_int(*type->type) && type->type->n == 0)) {
         cnm_doerr(cnm, false, "declaration does not declare name");
     }
     return true;
 }
 
 // Move typeref from normal region to static region
-// Move type data to static region
-static bool typeref_move_to_static(cnm_t *cnm, field_t *f, uint8_t *const stack_ptr) {
-    cnm->alloc.next = stack_ptr; // free old data
-    type_t *buf = cnm_alloc_static(cnm, sizeof(type_t) * f->type.size,
-                                   sizeof(type_t));
-    if (!buf) return false;
-    memmove(buf, f->type.type, sizeof(type_t) * f->type.size); // move to new spot
-    f->type.type = buf;
-
+// Move type data to static region and give the field its handle
+static bool typeref_move_to_static(cnm_t *cnm, field_t *f, typeref_t *type,
+                                   region_mark_t mark) {
+    cnm_release(cnm, mark); // free old data
+    if (!(f->type = type_intern(cnm, type->type, type->size))) return false;
+    *type = type_get(cnm, f->type);
     return true;
 }
 
@@ -1576,12 +2949,9 @@ static bool type_parse_declspec_struct(cnm_t *cnm, type_t *type, bool *istypedef
     // s now points to a new struct that we must fill out the members of
     *s = (field_list_t){0};
 
-    // Info so that we can store bitfields correctly
-    struct {
-        typeinf_t inf; // size and alignment of current type
-        int offs; // what bit field to allocate to next
-        int byte_offs; // what byte offset this is at
-    } bit = {0};
+    const region_mark_t fields_mark = cnm_mark(cnm);
+    field_node_t *fields = NULL;
+    uint32_t nfields = 0;
 
     // Now add members to the field
     while (cnm->s.tok.type != TOKEN_BRACE_R) {
@@ -1603,71 +2973,16 @@ static bool type_parse_declspec_struct(cnm_t *cnm, type_t *type, bool *istypedef
 
         // Get derived type(s) and name(s)
         while (true) {
-            // Use this so that the field can be destroyed if its a bitfield aligner
-            uint8_t *const static_stack = cnm->alloc.curr_static;
-
-            field_t *f = field_alloc(cnm, s);
+            field_t *f = field_alloc(cnm, &fields, &nfields);
             if (!f) return false;
 
             // Save normal stack pointer for afterwards when we copy buffers over to
             // static region
-            uint8_t *const stack_ptr = cnm->alloc.next;
-
-            if (!field_set_type(cnm, f, not_defined_new_type, &base)) return false;
-            if (!typeref_move_to_static(cnm, f, stack_ptr)) return false;
-
-            // Get offset and new struct size and alignment
-            typeinf_t inf = type_getinf(cnm, f->type.type);
-
-            const bool bit_overflow = type_is_int(*f->type.type)
-                && bit.offs + f->type.type->n > bit.inf.size * 8;
-
-            if (type_is_int(*f->type.type) && f->type.type->n == 0) {
-                // Align here, but don't do any size and also delete this field
-                u->inf.size = align_size(u->inf.size, inf.align);
-                if (inf.align > u->inf.align) u->inf.align = inf.align;
-                bit.inf = (typeinf_t){0};
-                bit.offs = 0;
-                bit.byte_offs = u->inf.size;
-
-                // Free the field
-                s->fields = f->next;
-                if (f->next) f->next->last = NULL;
-                cnm->alloc.curr_static = static_stack;
-                f = NULL;
-            } else if (inf.size != bit.inf.size || inf.align != bit.inf.align
-                       || bit_overflow) {
-                // Allocate new area if bitfield is for different size type or
-                // the bitfeild would overflow int boundaries
-                u->inf.size = align_size(u->inf.size, inf.align);
-                f->offs = u->inf.size;
-                bit.byte_offs = u->inf.size;
-                u->inf.size += inf.size;
-                if (inf.align > u->inf.align) u->inf.align = inf.align;
-                f->bit_offs = 0;
-
-                // Set new bitfield offset
-                if (type_is_int(*f->type.type) && f->type.type->n < inf.size * 8) {
-                    bit.inf = inf;
-                    bit.offs = f->type.type->n;
-                } else {
-                    bit.inf = (typeinf_t){0};
-                    bit.offs = 0;
-                }
-            } else {
-                // Allocate it to the same integer but in different bit position
-                f->bit_offs = bit.offs;
-                f->offs = bit.byte_offs;
-                bit.offs += f->type.type->n;
-
-                if (bit.offs >= bit.inf.size * 8) {
-                    bit.inf = (typeinf_t){0};
-                    bit.offs = 0;
-                }
-            }
+            const region_mark_t mark = cnm_mark(cnm);
 
-            // Set end pointer of structs field
-            if (f && !s->end) s->end = f;
+            typeref_t ftype;
+            if (!field_set_type(cnm, f, &ftype, not_defined_new_type, &base)) return false;
+            if (!typeref_move_to_static(cnm, f, &ftype, mark)) return false;
 
             // Consume ',' token
             if (cnm->s.tok.type != TOKEN_COMMA) break;
@@ -1682,7 +2997,12 @@ static bool type_parse_declspec_struct(cnm_t *cnm, type_t *type, bool *istypedef
         token_next(cnm);
     }
 
-    if (!s->fields) {
+    // Now that all of the fields are known, lay them out
+    if (!field_list_move_to_static(cnm, s, fields, nfields)) return false;
+    cnm_release(cnm, fields_mark);
+    struct_layout(cnm, u, s);
+
+    if (!s->nfields) {
         cnm_doerr(cnm, true, "can not have structure with no fields");
         return false;
     }
@@ -1709,7 +3029,7 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
         token_next(cnm);
 
         // Save pointer so we can free this type since its stored directly in enum
-        uint8_t *const stack_ptr = cnm->alloc.next;
+        const region_mark_t mark = cnm_mark(cnm);
         
         // Get type data (base type)
         type_t base;
@@ -1721,11 +3041,11 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
         }
 
         // Get fully derived type
-        strview_t name;
+        ident_t name;
         typeref_t type = type_parse(cnm, &base, &name, false);
 
         // Make sure they don't use names in override type or define multiple times
-        if (name.str) {
+        if (name) {
             cnm_doerr(cnm, true, "can not have name for enum override type");
             return false;
         }
@@ -1742,7 +3062,7 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
         e->type = type.type[0];
 
         // Reset stack and consume '{'
-        cnm->alloc.next = stack_ptr;
+        cnm_release(cnm, mark);
         if (cnm->s.tok.type != TOKEN_BRACE_L) {
             cnm_doerr(cnm, true, "expect enum definition after enum override type");
             return false;
@@ -1756,9 +3076,13 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
 
     u->inf = type_getinf(cnm, &e->type);
 
-    // Align variant area
-    if (!cnm_alloc_static(cnm, 0, sizeof(void *))) return false;
-    e->variants = (variant_t *)cnm->alloc.curr_static;
+    // Variants are gathered in a list in the normal region first since the
+    // lexer can intern identifiers in the static region in between them
+    const region_mark_t variants_mark = cnm_mark(cnm);
+    struct variant_node_s {
+        struct variant_node_s *prev;
+        variant_t v;
+    } *variants = NULL;
 
     // Current variant id
     union {
@@ -1769,8 +3093,11 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
     // Process enum variants
     while (cnm->s.tok.type != TOKEN_BRACE_R) {
         // Allocate new variant
-        if (!cnm_alloc_static(cnm, sizeof(variant_t), 1)) return false;
-        variant_t *v = --e->variants;
+        struct variant_node_s *node = cnm_alloc(cnm, sizeof(*node), sizeof(void *));
+        if (!node) return false;
+        node->prev = variants;
+        variants = node;
+        variant_t *v = &node->v;
         e->nvariants++;
 
         // Make sure variant name is here
@@ -1778,7 +3105,7 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
             cnm_doerr(cnm, true, "expected enum variant name");
             return false;
         }
-        v->name = cnm->s.tok.src;
+        v->name = cnm->s.tok.id;
 
         // Consume non '=' token and advance
         if (token_next(cnm)->type != TOKEN_ASSIGN) {
@@ -1790,7 +3117,7 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
 
         // Set variant number to custom number and reset stack position
         token_next(cnm);
-        uint8_t *const stack_ptr = cnm->alloc.next;
+        const region_mark_t mark = cnm_mark(cnm);
 
         // Get number
         valref_t val;
@@ -1803,6 +3130,7 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
         // Set number
         if (type_is_unsigned(*val.type.type)) variant_id.u = val.literal.u;
         else variant_id.i = val.literal.i;
+        cnm_release(cnm, mark);
         if (type_is_unsigned(e->type)) v->id.u = variant_id.u++;
         else v->id.i = variant_id.i++;
 
@@ -1815,6 +3143,13 @@ static bool type_parse_declspec_enum(cnm_t *cnm, type_t *type, bool *istypedef,
         return false;
     }
 
+    // Move the variants to the static region (last variant first)
+    e->variants = cnm_alloc_static(cnm, sizeof(variant_t) * e->nvariants, sizeof(void *),
+                                   MEM_TYPES);
+    if (!e->variants) return false;
+    for (size_t i = 0; variants; variants = variants->prev) e->variants[i++] = variants->v;
+    cnm_release(cnm, variants_mark);
+
     token_next(cnm);
     return true;
 }
@@ -1831,15 +3166,12 @@ static bool type_parse_declspec_union(cnm_t *cnm, type_t *type, bool *istypedef,
     // u now points to a new union that we must fill out the members of
     *u = (field_list_t){0};
 
-    bool any_fields = false;
+    const region_mark_t fields_mark = cnm_mark(cnm);
+    field_node_t *fields = NULL;
+    uint32_t nfields = 0;
 
-    // Now calculate union size. Don't process fields since you can access
-    // union fields anyways in cnm script.
+    // Now gather the fields, their size is calculated once they are all known
     while (cnm->s.tok.type != TOKEN_BRACE_R) {
-        // Save normal stack pointer for afterwards when we copy buffers over to
-        // static region
-        uint8_t *const stack_ptr = cnm->alloc.next;
-
         userty_t *const old_userty = cnm->type.types;
 
         // Get type data (base type)
@@ -1854,45 +3186,45 @@ static bool type_parse_declspec_union(cnm_t *cnm, type_t *type, bool *istypedef,
         const bool not_defined_new_type = cnm->type.types == old_userty;
 
         while (true) {
-            field_t *f = field_alloc(cnm, u);
-
-            if (!field_set_type(cnm, f, not_defined_new_type, &base)) return false;
-            if (!typeref_move_to_static(cnm, f, stack_ptr)) return false;
+            field_t *f = field_alloc(cnm, &fields, &nfields);
+            if (!f) return false;
 
-            // Get offset and new struct size and alignment
-            typeinf_t inf = type_getinf(cnm, f->type.type);
-            if (inf.size > t->inf.size) t->inf.size = inf.size;
-            if (inf.align > t->inf.align) t->inf.align = inf.align;
-            
-            // Set more field parameters
-            f->bit_offs = 0;
-            f->offs = 0;
+            // Save normal stack pointer for afterwards when we copy buffers over to
+            // static region
+            const region_mark_t mark = cnm_mark(cnm);
 
-            // Set end var
-            if (!u->end) u->end = f;
+            typeref_t ftype;
+            if (!field_set_type(cnm, f, &ftype, not_defined_new_type, &base)) return false;
+            if (!typeref_move_to_static(cnm, f, &ftype, mark)) return false;
 
             // Consume ',' token
             if (cnm->s.tok.type != TOKEN_COMMA) break;
             token_next(cnm);
         }
 
-        cnm->alloc.next = stack_ptr; // free old data
-
         // Consume ';' token
         if (cnm->s.tok.type != TOKEN_SEMICOLON) {
             cnm_doerr(cnm, true, "expected ';' after union field");
             return false;
         }
         token_next(cnm);
-
-        any_fields = true;
     }
 
-    if (!any_fields) {
+    if (!nfields) {
         cnm_doerr(cnm, true, "can not have union with no fields");
         return false;
     }
-    
+
+    // Every field starts at the begining, so the union is as big as its
+    // biggest field
+    if (!field_list_move_to_static(cnm, u, fields, nfields)) return false;
+    cnm_release(cnm, fields_mark);
+    for (uint32_t i = 0; i < u->nfields; i++) {
+        const typeinf_t inf = type_getinf(cnm, type_get(cnm, u->fields[i].type).type);
+        if (inf.size > t->inf.size) t->inf.size = inf.size;
+        if (inf.align > t->inf.align) t->inf.align = inf.align;
+    }
+
     token_next(cnm);
     return true;
 }
@@ -1901,9 +3233,8 @@ static bool type_parse_declspec_ident(cnm_t *cnm, type_t *type, bool *istypedef,
     type->class = TYPE_TYPEDEF;
 
     // Look for typedef with name that matches current token
-    for (typedef_t *t = cnm->type.typedefs; t; t = t->next) {
-        // Return already existing union if we can
-        if (!strview_eq(t->name, cnm->s.tok.src)) continue;
+    const typedef_t *const t = typedef_find(cnm, cnm->s.tok.id);
+    if (t) {
         type->n = t->typedef_id;
         token_next(cnm);
         return true;
@@ -1920,55 +3251,45 @@ typedef bool(*declspec_parser_pfn_t)(cnm_t *cnm, type_t *type, bool *istypedef,
 // It will return NULL if cnm token is not pointing at a typedef or declspec
 static declspec_parser_pfn_t cnm_at_declspec(cnm_t *cnm) {
     // All keywords that are valid for a declaration specifier
-    static const struct {
-        declspec_parser_pfn_t pfn;
-        strview_t word;
-    } keywords[] = {
-        { .pfn = type_parse_declspec_int, .word = SV("int") },
-        { .pfn = type_parse_declspec_bool, .word = SV("bool") },
-        { .pfn = type_parse_declspec_char, .word = SV("char") },
-        { .pfn = type_parse_declspec_enum, .word = SV("enum") },
-        { .pfn = type_parse_declspec_long, .word = SV("long") },
-        { .pfn = type_parse_declspec_void, .word = SV("void") },
-        { .pfn = type_parse_declspec_const, .word = SV("const") },
-        { .pfn = type_parse_declspec_float, .word = SV("float") },
-        { .pfn = type_parse_declspec_short, .word = SV("short") },
-        { .pfn = type_parse_declspec_union, .word = SV("union") },
-        { .pfn = type_parse_declspec_double, .word = SV("double") },
-        { .pfn = type_parse_declspec_extern, .word = SV("extern") },
-        { .pfn = type_parse_declspec_signed, .word = SV("signed") },
-        { .pfn = type_parse_declspec_static, .word = SV("static") },
-        { .pfn = type_parse_declspec_struct, .word = SV("struct") },
-        { .pfn = type_parse_declspec_typedef, .word = SV("typedef") },
-        { .pfn = type_parse_declspec_unsigned, .word = SV("unsigned") },
+    static const declspec_parser_pfn_t keywords[] = {
+        [TOKEN_KW_INT] = type_parse_declspec_int,
+        [TOKEN_KW_BOOL] = type_parse_declspec_bool,
+        [TOKEN_KW_CHAR] = type_parse_declspec_char,
+        [TOKEN_KW_ENUM] = type_parse_declspec_enum,
+        [TOKEN_KW_LONG] = type_parse_declspec_long,
+        [TOKEN_KW_VOID] = type_parse_declspec_void,
+        [TOKEN_KW_CONST] = type_parse_declspec_const,
+        [TOKEN_KW_FLOAT] = type_parse_declspec_float,
+        [TOKEN_KW_SHORT] = type_parse_declspec_short,
+        [TOKEN_KW_UNION] = type_parse_declspec_union,
+        [TOKEN_KW_DOUBLE] = type_parse_declspec_double,
+        [TOKEN_KW_EXTERN] = type_parse_declspec_extern,
+        [TOKEN_KW_SIGNED] = type_parse_declspec_signed,
+        [TOKEN_KW_STATIC] = type_parse_declspec_static,
+        [TOKEN_KW_STRUCT] = type_parse_declspec_struct,
+        [TOKEN_KW_TYPEDEF] = type_parse_declspec_typedef,
+        [TOKEN_KW_UNSIGNED] = type_parse_declspec_unsigned,
     };
 
     // Look for keywords
+    if (cnm->s.tok.type < arrlen(keywords)) return keywords[cnm->s.tok.type];
     if (cnm->s.tok.type != TOKEN_IDENT) return NULL;
-    for (int i = 0; i < arrlen(keywords); i++) {
-        if (strview_eq(cnm->s.tok.src, keywords[i].word)) return keywords[i].pfn;
-    }
 
     // Look for typedefs
-    for (typedef_t *def = cnm->type.typedefs; def; def = def->next) {
-        if (!strview_eq(def->name, cnm->s.tok.src)) continue;
-        return type_parse_declspec_ident;
-    }
+    if (typedef_find(cnm, cnm->s.tok.id)) return type_parse_declspec_ident;
 
     // Unknown identifier
     return NULL;
 }
 
-static typedef_t *type_get_typedef(cnm_t *cnm, const type_t *type) {
-    typedef_t *t;
-    for (t = cnm->type.typedefs; t->typedef_id != type->n; t = t->next);
-    return t;
+static inline typedef_t *type_get_typedef(cnm_t *cnm, const type_t *type) {
+    return typedef_get(cnm, type->n);
 }
 
 // Validate state and make integers unsigned
 static bool declspec_apply_options(cnm_t *cnm, type_t *type, declspec_options_t *options) {
     if (type->class == TYPE_TYPEDEF) {
-        type_t *newtype = type_get_typedef(cnm, type)->type.type;
+        const type_t *newtype = type_get(cnm, type_get_typedef(cnm, type)->type).type;
         if (type_is_arith(*newtype)) *type = *newtype;
     }
 
@@ -2061,14 +3382,14 @@ static bool type_parse_qual_only(cnm_t *cnm, type_t *type, bool const_only) {
     type->isextern = false;
 
     // Accumulate type qualifiers only
-    while (cnm->s.tok.type == TOKEN_IDENT) {
-        if (strview_eq(cnm->s.tok.src, SV("const"))) {
+    while (true) {
+        if (cnm->s.tok.type == TOKEN_KW_CONST) {
             if (type->isconst) {
                 cnm_doerr(cnm, true, "duplicate 'const'");
                 return false;
             }
             type->isconst = true;
-        } else if (strview_eq(cnm->s.tok.src, SV("static"))) {
+        } else if (cnm->s.tok.type == TOKEN_KW_STATIC) {
             if (type->isstatic) {
                 cnm_doerr(cnm, true, "duplicate 'static'");
                 return false;
@@ -2078,7 +3399,7 @@ static bool type_parse_qual_only(cnm_t *cnm, type_t *type, bool const_only) {
                 return false;
             }
             type->isstatic = true;
-        } else if (strview_eq(cnm->s.tok.src, SV("extern"))) {
+        } else if (cnm->s.tok.type == TOKEN_KW_EXTERN) {
             if (type->isextern) {
                 cnm_doerr(cnm, true, "duplicate 'extern'");
                 return false;
@@ -2103,43 +3424,55 @@ static bool type_parse_qual_only(cnm_t *cnm, type_t *type, bool const_only) {
     return true;
 }
 
+// Add n type layers (copied from src if its not NULL) to the end of a typeref
+// on the top of the normal region. If they don't fit in the current chunk, the
+// whole typeref is moved to the next one. Returns the first new layer
+static type_t *typeref_push(cnm_t *cnm, typeref_t *ref, const type_t *src, int n) {
+    uint8_t *const end = (uint8_t *)(ref->type + ref->size);
+    if (end == cnm->alloc.next && end + sizeof(type_t) * n <= *cnm->alloc.end) {
+        cnm->alloc.next = end + sizeof(type_t) * n;
+    } else {
+        type_t *type = cnm_alloc(cnm, sizeof(type_t) * (ref->size + n), sizeof(type_t));
+        if (!type) return NULL;
+        memcpy(type, ref->type, sizeof(type_t) * ref->size);
+        ref->type = type;
+    }
+
+    type_t *const layers = ref->type + ref->size;
+    if (src) memcpy(layers, src, sizeof(type_t) * n);
+    ref->size += n;
+    return layers;
+}
+
 // Helper function to add pointers in reverse order to a typeref thats on the
 // top of the stack
 static bool type_parse_add_ref_pointers(cnm_t *cnm, typeref_t *ref, type_t *ptrs, int nptrs) {
-    for (; nptrs;) {
-        if (!cnm_alloc(cnm, sizeof(type_t), 1)) return false;
-        ref->type[ref->size++] = ptrs[--nptrs];
+    while (nptrs) {
+        if (!typeref_push(cnm, ref, &ptrs[--nptrs], 1)) return false;
     }
     return true;
 }
 
 // Expand typedefs
 static bool type_parse_append_base(cnm_t *cnm, typeref_t *type, const type_t *base) {
-    if (base->class != TYPE_TYPEDEF) {
-        if (!cnm_alloc(cnm, sizeof(type_t), 1)) return false;
-        type->type[type->size++] = *base;
-        return true;
-    }
+    if (base->class != TYPE_TYPEDEF) return typeref_push(cnm, type, base, 1) != NULL;
 
-    typedef_t *t = type_get_typedef(cnm, base);
-    if (!cnm_alloc(cnm, sizeof(type_t) * t->type.size, 1)) return false;
-    memcpy(type->type + type->size, t->type.type, sizeof(type_t) * t->type.size);
-    type->size += t->type.size;
-
-    return true;
+    const typeref_t ref = type_get(cnm, type_get_typedef(cnm, base)->type);
+    return typeref_push(cnm, type, ref.type, ref.size) != NULL;
 }
 
 // Helper for type_parse function that will change depending on whether or not
 // it is a function parameter
 static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
-                               strview_t *name, bool isparam,
+                               ident_t *name, fnparams_t *params, bool isparam,
                                bool allow_bitfields) {
     // First align the allocation area
     typeref_t ref = { .type = cnm_alloc(cnm, 0, sizeof(type_t)) };
     if (!ref.type) goto return_error;
 
-    // Set to name to NULL just in case there is no name here
-    if (name) *name = (strview_t){0};
+    // Set to name to 0 just in case there is no name here
+    if (name) *name = 0;
+    if (params) params->n = 0;
 
     // Save pointers processed and what 'group' we are on here so we can
     // parse with the correct associativity and precedence
@@ -2172,7 +3505,7 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
 
     // Is there a name?
     if (cnm->s.tok.type == TOKEN_IDENT) {
-        if (name) *name = cnm->s.tok.src;
+        if (name) *name = cnm->s.tok.id;
         token_next(cnm);
     }
 
@@ -2180,8 +3513,8 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
     while (true) {
         if (cnm->s.tok.type == TOKEN_BRACK_L) {
             // Create new type layer and set it to array
-            if (!cnm_alloc(cnm, sizeof(type_t), 1)) goto return_error;
-            type_t *type = ref.type + ref.size++;
+            type_t *type = typeref_push(cnm, &ref, NULL, 1);
+            if (!type) goto return_error;
             *type = (type_t){ .class = TYPE_ARR };
             if (isparam) type->class = TYPE_PTR;
 
@@ -2194,7 +3527,7 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
             }
 
             // Get size and store alloc pointer so we can free
-            uint8_t *const stack_ptr = cnm->alloc.next;
+            const region_mark_t mark = cnm_mark(cnm);
             valref_t val;
             if (!expr_parse(cnm, &val, false, false, PREC_FULL, NULL)) goto return_error;
             if (!val.isliteral) {
@@ -2216,7 +3549,7 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
 
             // Set array size and free ast nodes
             type->n = val.literal.u;
-            cnm->alloc.next = stack_ptr;
+            cnm_release(cnm, mark);
 
             // Check for ending ']'
             if (cnm->s.tok.type != TOKEN_BRACK_R) {
@@ -2225,20 +3558,26 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
             }
             token_next(cnm);
         } else if (cnm->s.tok.type == TOKEN_PAREN_L) {
-            // Create new type layer and set it to function
-            if (!cnm_alloc(cnm, sizeof(type_t), 1)) goto return_error;
-            type_t *fntype = ref.type + ref.size++;
-            *fntype = (type_t){ .class = TYPE_FN };
+            // Create new type layer and set it to function. The layers are
+            // refered to by index since the typeref can move while parsing
+            // the parameters
+            const int fnidx = ref.size;
+            if (!typeref_push(cnm, &ref, &(type_t){ .class = TYPE_FN }, 1)) goto return_error;
+
+            // Only the names of the parameters of the declared function itself
+            // are kept, not the ones of functions it returns
+            fnparams_t *const names = fnidx == 0 ? params : NULL;
 
             // Consume parameters
             token_next(cnm);
             while (cnm->s.tok.type != TOKEN_PAREN_R) {
-                fntype->n++; // Increase the number of parameters in this func
+                ref.type[fnidx].n++; // Increase the number of parameters in this func
 
                 // Allocate the argument header
-                if (!cnm_alloc(cnm, sizeof(type_t), 1)) goto return_error;
-                type_t *arg = ref.type + ref.size++;
-                *arg = (type_t){ .class = TYPE_FN_ARG };
+                const int argidx = ref.size;
+                if (!typeref_push(cnm, &ref, &(type_t){ .class = TYPE_FN_ARG }, 1)) {
+                    goto return_error;
+                }
               
                 // Get base type
                 type_t base;
@@ -2250,16 +3589,21 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
                 }
 
                 // Get the full derived parameter type
-                typeref_t argref = type_parse_ex(cnm, &base, NULL, true, false);
+                ident_t argname;
+                typeref_t argref = type_parse_ex(cnm, &base, &argname, NULL, true, false);
                 if (!argref.type) goto return_error;
+                if (names && names->n < MAX_FN_PARAMS) names->names[names->n] = argname;
+                if (names) names->n++;
                 if (!argref.size) {
                     cnm_doerr(cnm, true, "expected function parameter");
                     goto return_error;
                 }
                 
-                // Set the argument's header's length
-                arg->n = argref.size;
-                ref.size += argref.size;
+                // Set the argument's header's length and add the parameter's
+                // layers (which are already in place unless one of them moved)
+                ref.type[argidx].n = argref.size;
+                if (argref.type == ref.type + ref.size) ref.size += argref.size;
+                else if (!typeref_push(cnm, &ref, argref.type, argref.size)) goto return_error;
 
                 if (cnm->s.tok.type == TOKEN_COMMA) {
                     if (token_next(cnm)->type == TOKEN_PAREN_R) {
@@ -2318,7 +3662,7 @@ static typeref_t type_parse_ex(cnm_t *cnm, const type_t *base,
             cnm_doerr(cnm, true, "bitfield width must be positive");
             goto return_error;
         }
-        if (val.literal.i == 0 && name && name->str) {
+        if (val.literal.i == 0 && name && *name) {
             cnm_doerr(cnm, true, "bitfield width with 0 width");
             goto return_error;
         }
@@ -2344,783 +3688,3575 @@ return_error:
 // the parameter base is a pointer to 1 type_t struct that represents the
 // base type
 static typeref_t type_parse(cnm_t *cnm, const type_t *base,
-                            strview_t *name, bool allow_bitfields) {
-    return type_parse_ex(cnm, base, name, false, allow_bitfields);
+                            ident_t *name, bool allow_bitfields) {
+    return type_parse_ex(cnm, base, name, NULL, false, allow_bitfields);
 }
 
-// Generates code and data for the expression being parsed
-static bool expr_parse(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                       prec_t prec, const typeref_t *expected_type) {
-    // Consume a prefix/unary ast node like an integer literal
-    expr_rule_t *rule = &expr_rules[cnm->s.tok.type];
-    if (!rule->prefix || prec > rule->prefix_prec) {
-        cnm_doerr(cnm, true, "expected expression");
+// Smallest capacity of the IR arrays
+#define IR_MIN_CAP 16
+
+// Make room for n more items in one of the IR arrays. They live in the normal
+// region and are doubled, the old copies are left behind until the function
+// is done. Returns false if we ran out of memory
+static bool ir_reserve(cnm_t *cnm, void *arrp, uint32_t *cap, uint32_t count, uint32_t n,
+                       size_t itemsz) {
+    if (count + n <= *cap) return true;
+
+    uint32_t newcap = *cap ? *cap * 2 : IR_MIN_CAP;
+    while (newcap < count + n) newcap *= 2;
+    void *const arr = cnm_alloc(cnm, itemsz * newcap, sizeof(void *));
+    if (!arr) return false;
+    if (count) memcpy(arr, *(void **)arrp, itemsz * count);
+    *(void **)arrp = arr;
+    *cap = newcap;
+    return true;
+}
+
+// Add an instruction to the end of the current block. Returns its value, 0 if
+// we ran out of memory
+static ir_val_t ir_emit(cnm_t *cnm, ir_op_t op, typeclass_t type,
+                        uint32_t a, uint32_t b, uint32_t c) {
+    ir_func_t *const f = &cnm->ir.f;
+    if (!ir_reserve(cnm, &f->insts, &f->instcap, f->ninsts, 1, sizeof(ir_inst_t))) return 0;
+    f->insts[f->ninsts] = (ir_inst_t){ .op = op, .type = type, .a = a, .b = b, .c = c };
+    f->blocks[cnm->ir.block].ninsts++;
+    return f->ninsts++;
+}
+
+// Same as ir_emit but for instructions with an immediate
+static ir_val_t ir_emit_imm(cnm_t *cnm, ir_op_t op, typeclass_t type, uint64_t imm) {
+    return ir_emit(cnm, op, type, 0, (uint32_t)imm, (uint32_t)(imm >> 32));
+}
+
+// Make a new empty block that can be jumped to before it is started. Returns
+// false if we ran out of memory
+static bool ir_block_new(cnm_t *cnm, uint32_t *block) {
+    ir_func_t *const f = &cnm->ir.f;
+    if (!ir_reserve(cnm, &f->blocks, &f->blockcap, f->nblocks, 1, sizeof(ir_block_t))) {
         return false;
     }
-    if (!rule->prefix(cnm, out, gencode, gendata, expected_type)) return false;
+    f->blocks[f->nblocks] = (ir_block_t){0};
+    *block = f->nblocks++;
+    return true;
+}
 
-    // Continue to consume binary operators that fall under this precedence level
-    rule = &expr_rules[cnm->s.tok.type];
-    while (rule->infix && prec <= rule->infix_prec) {
-        valref_t tmp;
-        if (!rule->infix(cnm, &tmp, gencode, gendata, out, expected_type)) return false;
-        *out = tmp;
-        rule = &expr_rules[cnm->s.tok.type];
-    }
+// Instructions are added to block from now on. The block before it has to be
+// terminated since the instructions of a block are next to each other
+static void ir_block_start(cnm_t *cnm, uint32_t block) {
+    cnm->ir.f.blocks[block].first = cnm->ir.f.ninsts;
+    cnm->ir.block = block;
+}
 
+// Start the IR of a new function with an entry block. Returns false if we ran
+// out of memory
+static bool ir_begin(cnm_t *cnm, uint32_t nparams) {
+    cnm->ir.f = (ir_func_t){ .nparams = nparams };
+    cnm->ir.nphiins = cnm->ir.phiincap = 0;
+    cnm->ir.phiins = NULL;
+
+    // Instruction 0 is a placeholder so that no value is 0
+    ir_func_t *const f = &cnm->ir.f;
+    uint32_t entry;
+    if (!ir_reserve(cnm, &f->insts, &f->instcap, 0, 1, sizeof(ir_inst_t))) return false;
+    f->insts[f->ninsts++] = (ir_inst_t){ .op = IR_NOP, .type = TYPE_VOID };
+    if (!ir_block_new(cnm, &entry)) return false;
+    ir_block_start(cnm, entry);
     return true;
 }
 
-// Constant fold cast an valref to the to type
-static bool valref_cast_literal(cnm_t *cnm, valref_t *val, typeref_t cast_to) {
-    type_t *from = val->type.type, *to = cast_to.type;
+// Add a phi to the start of the current block. Its inputs are added with
+// ir_phi_add
+static inline ir_val_t ir_phi(cnm_t *cnm, typeclass_t type) {
+    return ir_emit(cnm, IR_PHI, type, 0, 0, cnm->ir.block);
+}
 
-    if (!type_is_pod(*from) || !type_is_pod(*to)) {
-        cnm_doerr(cnm, true, "can only do casting between pod data types");
-        return false;
-    }
+// The phi is val when coming from block. Returns false if we ran out of memory
+static bool ir_phi_add(cnm_t *cnm, ir_val_t phi, uint32_t block, ir_val_t val) {
+    if (!ir_reserve(cnm, &cnm->ir.phiins, &cnm->ir.phiincap, cnm->ir.nphiins, 3,
+                    sizeof(uint32_t))) return false;
+    uint32_t *const in = cnm->ir.phiins + cnm->ir.nphiins;
+    in[0] = phi, in[1] = block, in[2] = val;
+    cnm->ir.nphiins += 3;
+    return true;
+}
 
-    // Cache information about from and to types
-    const bool fp_to = type_is_fp(*cast_to.type), fp_from = type_is_fp(*val->type.type),
-        u_from = type_is_unsigned(*val->type.type) || val->type.type->class == TYPE_PTR,
-        f_to = cast_to.type[0].class == TYPE_FLOAT,
-        f_from = val->type.type[0].class == TYPE_FLOAT;
+// Add a slot to the argument array. Returns false if we ran out of memory
+static inline bool ir_args_reserve(cnm_t *cnm, uint32_t n) {
+    ir_func_t *const f = &cnm->ir.f;
+    return ir_reserve(cnm, &f->args, &f->argcap, f->nargs, n, sizeof(uint32_t));
+}
 
-    val->type = cast_to;
+// Put the blocks that a block jumps to into succs. Returns how many there are
+static uint32_t ir_succs(const ir_func_t *f, uint32_t block, uint32_t succs[2]) {
+    const ir_block_t *const b = &f->blocks[block];
+    if (!b->ninsts) return 0;
+    const ir_inst_t *const term = &f->insts[b->first + b->ninsts - 1];
+    if (term->op == IR_JMP) {
+        succs[0] = term->a;
+        return 1;
+    }
+    if (term->op != IR_BR) return 0;
+    succs[0] = term->b, succs[1] = term->c;
+    return 2;
+}
 
-    // Convert to or convert from and to float types
-    if (to->class == TYPE_BOOL) {
-        if (fp_from) val->literal.u = !!(f_from ? val->literal.f : val->literal.d);
-        else val->literal.u = !!val->literal.u;
-    } else if (fp_to && !fp_from) {
-        if (f_to) val->literal.f = u_from ? val->literal.u : val->literal.i;
-        else val->literal.d = u_from ? val->literal.u : val->literal.i;
-    } else if (!fp_to && fp_from) {
-        if (u_from) val->literal.u = f_from ? val->literal.f : val->literal.d;
-        else val->literal.i = f_from ? val->literal.f : val->literal.d;
-    } else if (f_to != f_from) {
-        if (f_to) val->literal.f = val->literal.d;
-        else val->literal.d = val->literal.f;
+// How many values an instruction uses, see ir_operand
+static uint32_t ir_noperands(const ir_inst_t *inst) {
+    switch ((ir_op_t)inst->op) {
+    case IR_NOP: case IR_CONST: case IR_GLOBAL: case IR_PARAM: case IR_JMP:
+    case IR_OP_COUNT:
+        return 0;
+    case IR_CALL: return 1 + inst->c;
+    case IR_PHI: return inst->b;
+    case IR_RET: return inst->a != 0;
+    case IR_LOAD: case IR_NEG: case IR_NOT: case IR_BNOT: case IR_CAST: case IR_BR:
+        return 1;
+    default: return 2;
+    }
+}
+
+// The i-th value that an instruction uses. The callee of a call comes before
+// its arguments and the arguments of a phi are in the order of the
+// predecessors of its block
+static ir_val_t ir_operand(const ir_func_t *f, const ir_inst_t *inst, uint32_t i) {
+    switch ((ir_op_t)inst->op) {
+    case IR_CALL: return i ? f->args[inst->b + i - 1] : inst->a;
+    case IR_PHI: return f->args[inst->a + i];
+    default: return i ? inst->b : inst->a;
     }
+}
 
-enforce_width:
-    if (to->class == TYPE_FLOAT || to->class == TYPE_DOUBLE || to->class == TYPE_PTR
-        || to->class == TYPE_LONG || to->class == TYPE_LLONG
-        || to->class == TYPE_ULONG || to->class == TYPE_ULLONG) {
-        return true;
-    } else if (to->class == TYPE_BOOL) {
-        val->literal.u = !!val->literal.u;
-        return true;
+// Count how many times every value is used as an operand
+static void ir_count_uses(const ir_func_t *f, uint32_t *uses) {
+    memset(uses, 0, sizeof(uint32_t) * f->ninsts);
+    for (ir_val_t v = 1; v < f->ninsts; v++) {
+        const ir_inst_t *const inst = &f->insts[v];
+        const uint32_t n = ir_noperands(inst);
+        for (uint32_t i = 0; i < n; i++) uses[ir_operand(f, inst, i)]++;
     }
+}
 
-    // Cap the integer to the bit width of what it is
-    switch (to->class) {
-    case TYPE_CHAR: val->literal.i = (intmax_t)(char)val->literal.i; break;
-    case TYPE_SHORT: val->literal.i = (intmax_t)(short)val->literal.i; break;
-    case TYPE_INT: val->literal.i = (intmax_t)(int)val->literal.i; break;
-    case TYPE_UCHAR: val->literal.u &= 0xFF; break;
-    case TYPE_USHORT: val->literal.u &= 0xFFFF; break;
-    case TYPE_UINT: val->literal.u &= 0xFFFFFFFF; break;
-    default: break;
+// Fill in the predecessors of every block and the arguments of every phi in
+// the same order. Returns false if we ran out of memory
+static bool ir_finish(cnm_t *cnm) {
+    ir_func_t *const f = &cnm->ir.f;
+
+    // Count the edges first so that the lists of each block are in one piece
+    for (uint32_t i = 0; i < f->nblocks; i++) f->blocks[i].npreds = 0;
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        const ir_block_t *const b = &f->blocks[i];
+        if (!b->ninsts) continue;
+        uint32_t succs[2];
+        const uint32_t nsuccs = ir_succs(f, i, succs);
+        for (uint32_t j = 0; j < nsuccs; j++) f->blocks[succs[j]].npreds++;
+    }
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < f->nblocks; i++) total += f->blocks[i].npreds;
+    if (!ir_args_reserve(cnm, total)) return false;
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        f->blocks[i].preds = f->nargs;
+        f->nargs += f->blocks[i].npreds;
+        f->blocks[i].npreds = 0;
+    }
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        uint32_t succs[2];
+        const uint32_t nsuccs = ir_succs(f, i, succs);
+        for (uint32_t j = 0; j < nsuccs; j++) {
+            ir_block_t *const succ = &f->blocks[succs[j]];
+            f->args[succ->preds + succ->npreds++] = i;
+        }
     }
 
+    // Then give every phi one argument per predecessor of its block
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        const ir_block_t *const b = &f->blocks[i];
+        for (uint32_t v = b->first; v < b->first + b->ninsts; v++) {
+            if (f->insts[v].op != IR_PHI) break;
+            if (!ir_args_reserve(cnm, b->npreds)) return false;
+            f->insts[v].a = f->nargs;
+            f->insts[v].b = b->npreds;
+            memset(f->args + f->nargs, 0, sizeof(uint32_t) * b->npreds);
+            f->nargs += b->npreds;
+        }
+    }
+    for (uint32_t i = 0; i < cnm->ir.nphiins; i += 3) {
+        const uint32_t *const in = cnm->ir.phiins + i;
+        const ir_inst_t *const phi = &f->insts[in[0]];
+        const uint32_t *const preds = f->args + f->blocks[phi->c].preds;
+        for (uint32_t j = 0; j < phi->b; j++) {
+            if (preds[j] != in[1]) continue;
+            f->args[phi->a + j] = in[2];
+            break;
+        }
+    }
     return true;
 }
 
-// Generate code to cast the type and value of val to the type of to
-static bool valref_cast_runtime(cnm_t *cnm, valref_t *val, const typeref_t to) {
-    // TODO: Emit byte code to cast value
-    return false;
+// Same as ir_operand but where the operand is stored, so it can be replaced
+static uint32_t *ir_operand_ref(ir_func_t *f, ir_inst_t *inst, uint32_t i) {
+    switch ((ir_op_t)inst->op) {
+    case IR_CALL: return i ? &f->args[inst->b + i - 1] : &inst->a;
+    case IR_PHI: return &f->args[inst->a + i];
+    default: return i ? &inst->b : &inst->a;
+    }
 }
 
-// Cast val to 'to'
-static bool valref_cast(cnm_t *cnm, valref_t *val, const typeref_t to, bool gencode) {
-    if (type_eq(val->type, to, true)) return true;
-    if (val->isliteral) {
-        if (!valref_cast_literal(cnm, val, to)) return false;
-    } else if (gencode) {
-        if (!valref_cast_runtime(cnm, val, to)) return false;
-    }
-    return true;
+// Whether an instruction can be left out when its value isn't used.
+// Parameters stay since the ones after them are found by counting
+static inline bool ir_is_pure(const ir_inst_t *inst) {
+    return inst->op != IR_NOP && inst->op != IR_PARAM && inst->op != IR_STORE
+        && inst->op != IR_CALL && !ir_is_term(inst);
 }
 
-// Cast something, with token pointing to right after '(' in cast expr
-static bool expr_cast(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                      const typeref_t *expected_type) {
-    // Get the type to cast to first
-    type_t base;
-    bool istypedef;
-    if (!type_parse_declspec(cnm, &base, &istypedef)) return false;
-    if (istypedef) {
-        cnm_doerr(cnm, true, "Can not declare typedef in cast expression.");
+// What a value was replaced with
+static inline ir_val_t ir_resolve(const ir_val_t *repl, ir_val_t v) {
+    while (repl[v] != v) v = repl[v];
+    return v;
+}
+
+// Clean up a finished function for CNM_TIER_OPTIMIZE. Phis that only ever
+// pass on one value (loops get one for every variable, even the ones they
+// don't change) are replaced by it, instructions whose values aren't used are
+// dropped and what is left is moved together. Returns false if we ran out of
+// memory
+static bool ir_optimize(cnm_t *cnm) {
+    ir_func_t *const f = &cnm->ir.f;
+    const uint32_t n = f->ninsts;
+    const region_mark_t mark = cnm_mark(cnm);
+    ir_val_t *const repl = cnm_alloc(cnm, sizeof(ir_val_t) * ((size_t)n * 3 + 1),
+                                     sizeof(ir_val_t));
+    if (!repl) {
+        cnm_release(cnm, mark);
         return false;
     }
-    strview_t name;
-    typeref_t type = type_parse(cnm, &base, &name, false);
-    if (!type.type) return false;
-    if (name.str) {
-        cnm_doerr(cnm, true, "Can not give type a identifier in cast expression");
-        return false;
+    uint32_t *const uses = repl + n, *const work = uses + n;
+    for (ir_val_t v = 0; v < n; v++) repl[v] = v;
+
+    // Replacing a phi can make the ones that use it trivial as well. An
+    // argument of 0 isn't defined on that edge, which keeps the phi
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (ir_val_t v = 1; v < n; v++) {
+            const ir_inst_t *const inst = &f->insts[v];
+            if (inst->op != IR_PHI || repl[v] != v) continue;
+            ir_val_t same = v;
+            uint32_t i = 0;
+            for (; i < inst->b; i++) {
+                const ir_val_t arg = ir_resolve(repl, f->args[inst->a + i]);
+                if (arg == v || arg == same) continue;
+                if (same != v || !arg) break;
+                same = arg;
+            }
+            if (i < inst->b || same == v) continue;
+            repl[v] = same;
+            changed = true;
+        }
+    }
+    for (ir_val_t v = 1; v < n; v++) {
+        ir_inst_t *const inst = &f->insts[v];
+        if (repl[v] != v) {
+            inst->op = IR_NOP, inst->type = TYPE_VOID;
+            continue;
+        }
+        const uint32_t nops = ir_noperands(inst);
+        for (uint32_t i = 0; i < nops; i++) {
+            uint32_t *const op = ir_operand_ref(f, inst, i);
+            *op = ir_resolve(repl, *op);
+        }
     }
 
-    // Make sure there is the ending parenthesis
-    if (cnm->s.tok.type != TOKEN_PAREN_R) {
-        return false;
+    // Dropping a value can leave its operands unused too
+    uint32_t nwork = 0;
+    ir_count_uses(f, uses);
+    for (ir_val_t v = 1; v < n; v++) {
+        if (!uses[v] && ir_is_pure(&f->insts[v])) work[nwork++] = v;
     }
-    token_next(cnm);
+    while (nwork) {
+        ir_inst_t *const inst = &f->insts[work[--nwork]];
+        const uint32_t nops = ir_noperands(inst);
+        for (uint32_t i = 0; i < nops; i++) {
+            const ir_val_t op = ir_operand(f, inst, i);
+            if (!--uses[op] && ir_is_pure(&f->insts[op])) work[nwork++] = op;
+        }
+        inst->op = IR_NOP, inst->type = TYPE_VOID;
+    }
+
+    // Values only move down, so the instructions are moved in place. The
+    // ones that are dropped map to the next one that is kept, which is where
+    // a block that starts with them starts now
+    ir_val_t *const to = repl;
+    uint32_t kept = 1;
+    for (ir_val_t v = 1; v < n; v++) {
+        to[v] = kept;
+        kept += f->insts[v].op != IR_NOP;
+    }
+    to[n] = kept;
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        ir_block_t *const b = &f->blocks[i];
+        if (!b->ninsts) continue;
+        const uint32_t first = to[b->first];
+        b->ninsts = to[b->first + b->ninsts] - first;
+        b->first = first;
+    }
+    for (ir_val_t v = 1; v < n; v++) {
+        ir_inst_t inst = f->insts[v];
+        if (inst.op == IR_NOP) continue;
+        const uint32_t nops = ir_noperands(&inst);
+        for (uint32_t i = 0; i < nops; i++) {
+            uint32_t *const op = ir_operand_ref(f, &inst, i);
+            *op = to[*op];
+        }
+        f->insts[to[v]] = inst;
+    }
+    f->ninsts = kept;
+    cnm_release(cnm, mark);
+    return true;
+}
 
-    // Now parse the expression
-    if (!expr_parse(cnm, out, gencode, gendata, PREC_PREFIX, &type)) return false;
+static const char *const ir_op_names[IR_OP_COUNT] = {
+    [IR_NOP] = "nop",       [IR_CONST] = "const",   [IR_GLOBAL] = "global",
+    [IR_PARAM] = "param",   [IR_LOAD] = "load",     [IR_STORE] = "store",
+    [IR_ADD] = "add",       [IR_SUB] = "sub",       [IR_MUL] = "mul",
+    [IR_DIV] = "div",       [IR_MOD] = "mod",       [IR_AND] = "and",
+    [IR_OR] = "or",         [IR_XOR] = "xor",       [IR_SHL] = "shl",
+    [IR_SHR] = "shr",       [IR_EQ] = "eq",         [IR_NE] = "ne",
+    [IR_LT] = "lt",         [IR_LE] = "le",         [IR_GT] = "gt",
+    [IR_GE] = "ge",         [IR_NEG] = "neg",       [IR_NOT] = "not",
+    [IR_BNOT] = "bnot",     [IR_CAST] = "cast",     [IR_CALL] = "call",
+    [IR_PHI] = "phi",       [IR_JMP] = "jmp",       [IR_BR] = "br",
+    [IR_RET] = "ret",
+};
 
-    // Now cast out to the type
-    if (!valref_cast(cnm, out, type, gencode)) return false;
+static const char *const ir_type_names[TYPE_VOID + 1] = {
+    [TYPE_CHAR] = "char",       [TYPE_UCHAR] = "uchar",
+    [TYPE_SHORT] = "short",     [TYPE_USHORT] = "ushort",
+    [TYPE_INT] = "int",         [TYPE_UINT] = "uint",
+    [TYPE_LONG] = "long",       [TYPE_ULONG] = "ulong",
+    [TYPE_LLONG] = "llong",     [TYPE_ULLONG] = "ullong",
+    [TYPE_FLOAT] = "float",     [TYPE_DOUBLE] = "double",
+    [TYPE_BOOL] = "bool",       [TYPE_PTR] = "ptr",
+    [TYPE_REF] = "ref",         [TYPE_ANYREF] = "anyref",
+    [TYPE_VOID] = "void",
+};
 
-    return true;
+// Print one instruction of the IR like "%3 = add int %1, %2"
+static int ir_dump_inst(const cnm_t *cnm, const ir_func_t *f, ir_val_t v,
+                        char *buf, size_t len) {
+    const ir_inst_t *const inst = &f->insts[v];
+    const typeclass_t type = inst->type;
+    int n = 0;
+#define IR_PRINT(...) \
+    n += snprintf((size_t)n < len ? buf + n : NULL, (size_t)n < len ? len - n : 0, __VA_ARGS__)
+
+    IR_PRINT("    ");
+    if (type != TYPE_VOID) IR_PRINT("%%%" PRIu32 " = ", v);
+    IR_PRINT("%s", ir_op_names[inst->op]);
+    if (type != TYPE_VOID) IR_PRINT(" %s", ir_type_names[type]);
+
+    const uint64_t imm = ir_imm(inst);
+    switch ((ir_op_t)inst->op) {
+    case IR_CONST:
+        if (type == TYPE_FLOAT) {
+            float f32;
+            const uint32_t bits = imm;
+            memcpy(&f32, &bits, sizeof(f32));
+            IR_PRINT(" %g", f32);
+        } else if (type == TYPE_DOUBLE) {
+            double f64;
+            memcpy(&f64, &imm, sizeof(f64));
+            IR_PRINT(" %g", f64);
+        } else if (type_is_unsigned((type_t){ .class = type }) || type == TYPE_BOOL
+                   || type == TYPE_PTR) {
+            IR_PRINT(" %" PRIu64, imm);
+        } else {
+            IR_PRINT(" %" PRId64, (int64_t)imm);
+        }
+        break;
+    case IR_GLOBAL: {
+        // Globals are printed by where they are in the globals buffer so that
+        // dumps don't change between runs
+        const uint8_t *const addr = (const uint8_t *)(uintptr_t)imm;
+        if (addr >= cnm->globals.buf && addr < cnm->globals.buf + cnm->globals.len) {
+            IR_PRINT(" +%zu", (size_t)(addr - cnm->globals.buf));
+        } else {
+            IR_PRINT(" %p", (const void *)addr);
+        }
+        break;
+    }
+    case IR_PARAM: IR_PRINT(" %" PRIu32, inst->a); break;
+    case IR_PHI:
+        for (uint32_t i = 0; i < inst->b; i++) {
+            IR_PRINT("%s[b%" PRIu32 " %%%" PRIu32 "]", i ? ", " : " ",
+                     f->args[f->blocks[inst->c].preds + i], f->args[inst->a + i]);
+        }
+        break;
+    case IR_CALL:
+        IR_PRINT(" %%%" PRIu32 "(", inst->a);
+        for (uint32_t i = 0; i < inst->c; i++) {
+            IR_PRINT("%s%%%" PRIu32, i ? ", " : "", f->args[inst->b + i]);
+        }
+        IR_PRINT(")");
+        break;
+    case IR_JMP: IR_PRINT(" b%" PRIu32, inst->a); break;
+    case IR_BR:
+        IR_PRINT(" %%%" PRIu32 ", b%" PRIu32 ", b%" PRIu32, inst->a, inst->b, inst->c);
+        break;
+    case IR_RET: if (inst->a) IR_PRINT(" %%%" PRIu32, inst->a); break;
+    case IR_LOAD: case IR_NEG: case IR_NOT: case IR_BNOT: case IR_CAST:
+        IR_PRINT(" %%%" PRIu32, inst->a);
+        break;
+    default:
+        IR_PRINT(" %%%" PRIu32 ", %%%" PRIu32, inst->a, inst->b);
+        break;
+    }
+    IR_PRINT("\n");
+#undef IR_PRINT
+    return n;
 }
 
-// Makes sure that a literal is allocated to the global data buffer
-static bool val_enforce_global(cnm_t *cnm, valref_t *val) {
-    if (val->isliteral &&
-        (val->type.type[0].class == TYPE_USER || val->type.type[0].class == TYPE_ARR)) {
-        if (val->scope) val->scope->abs_addr = val->literal.addr;
-        return true;
+// Print the IR of a function into buf as text, one block after another. The
+// output is cut short if it doesn't fit. Returns how long the whole text is
+__attribute__((unused))
+static size_t ir_dump(const cnm_t *cnm, const ir_func_t *f, char *buf, size_t len) {
+    size_t n = 0;
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        const ir_block_t *const b = &f->blocks[i];
+        n += snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, "b%" PRIu32 ":", i);
+        for (uint32_t j = 0; j < b->npreds; j++) {
+            n += snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, "%sb%" PRIu32, j ? ", " : " <- ",
+                          f->args[b->preds + j]);
+        }
+        n += snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, "\n");
+        for (uint32_t v = b->first; v < b->first + b->ninsts; v++) {
+            n += ir_dump_inst(cnm, f, v, n < len ? buf + n : NULL, n < len ? len - n : 0);
+        }
     }
-    if (!val->isliteral || !type_is_pod(*val->type.type)) return true;
+    return n;
+}
 
-    // Move the data to the global region
-    const typeinf_t inf = type_getinf(cnm, val->type.type);
-    uint8_t *buf = cnm_alloc_global(cnm, inf.size, inf.align);
-    if (!buf) return false;
-    memcpy(buf, &val->literal, inf.size);
+// Address that the code at p in the code buffer is run from
+static void *code_real_addr(const cnm_t *cnm, const uint8_t *p) {
+    if (!cnm->code.real_addr) return (void *)p;
+    return (uint8_t *)cnm->code.real_addr + (p - cnm->code.buf);
+}
 
-    // Update the variable info
-    if (val->scope) val->scope->abs_addr = buf;
-    val->isliteral = false;
+#if defined(__x86_64__) && !defined(_WIN32)
+#define X64_NATIVE
+
+// System V x86-64 code generator. Values are kept in the registers that a
+// linear scan allocator hands out (see x64_alloc), and the ones that don't get
+// one live in their own 8 byte stack slot at [rbp - 8 * value]. Instructions
+// work on rax/rcx (xmm0/xmm1 for floating point) when their operands or result
+// aren't in a register, those are never allocated. Integers are kept sign or
+// zero extended to 64 bits so that they can be used at any width, floats only
+// use the low 4 bytes. Phis are copies made on the edges that go into their
+// block.
+
+// Register and condition code encodings
+enum {
+    X64_RAX, X64_RCX, X64_RDX, X64_RBX, X64_RSP, X64_RBP, X64_RSI, X64_RDI,
+    X64_R8, X64_R9, X64_R10, X64_R11, X64_R12, X64_R13, X64_R14, X64_R15,
+};
+enum {
+    X64_CC_B = 0x2,     X64_CC_AE = 0x3,    X64_CC_E = 0x4,     X64_CC_NE = 0x5,
+    X64_CC_BE = 0x6,    X64_CC_A = 0x7,     X64_CC_S = 0x8,     X64_CC_P = 0xA,
+    X64_CC_NP = 0xB,    X64_CC_L = 0xC,     X64_CC_GE = 0xD,    X64_CC_LE = 0xE,
+    X64_CC_G = 0xF,
+};
 
-    return true;
+// Registers that the first integer parameters are passed in
+static const uint8_t x64_int_params[6] = {
+    X64_RDI, X64_RSI, X64_RDX, X64_RCX, X64_R8, X64_R9,
+};
+#define X64_FP_PARAMS 8
+
+// Where a value is: a general purpose register, an xmm register from X64_XMM
+// on, or X64_STACK for its stack slot
+#define X64_XMM 16
+#define X64_STACK (-1)
+
+// Registers that values can be allocated to, the ones that calls don't
+// preserve first
+static const int8_t x64_gp_regs[] = {
+    X64_RSI, X64_RDI, X64_R8, X64_R9, X64_R10, X64_RBX, X64_R12, X64_R13, X64_R14, X64_R15,
+};
+static const int8_t x64_fp_regs[] = {
+    X64_XMM + 2, X64_XMM + 3, X64_XMM + 4, X64_XMM + 5, X64_XMM + 6, X64_XMM + 7,
+    X64_XMM + 8, X64_XMM + 9, X64_XMM + 10, X64_XMM + 11, X64_XMM + 12, X64_XMM + 13,
+    X64_XMM + 14, X64_XMM + 15,
+};
+#define X64_CALLEE_SAVED (1u << X64_RBX | 1u << X64_R12 | 1u << X64_R13 | 1u << X64_R14 \
+                          | 1u << X64_R15)
+
+// Instructions are numbered 2, 4, 6 and so on in the order they are emitted.
+// Operands are read at the position of their instruction and results written
+// one after it. A piece is part of the life of a value that it spends in one
+// place, from start up to but not including end. The pieces of a value are
+// linked in order
+typedef struct x64_piece_s {
+    uint32_t start, end, next;
+    ir_val_t v;
+    int loc;
+} x64_piece_t;
+
+// Copy from one place to another. The stack slots are the ones of dv and sv
+typedef struct x64_move_s {
+    int8_t dst, src;
+    ir_val_t dv, sv;
+} x64_move_t;
+
+// Jump to a block whose offset isn't known yet. at is where its rel32 is
+typedef struct x64_fixup_s {
+    uint32_t at, block;
+} x64_fixup_t;
+
+typedef struct x64_s {
+    uint8_t *start, *p, *end;
+    bool full; // Set when the code didn't fit, p stops moving
+
+    const ir_func_t *f;
+    uint32_t *offs; // Offset of every block, UINT32_MAX until it is emitted
+    x64_fixup_t *fixups;
+    uint32_t nfixups;
+    uint32_t next; // Block emitted after the current one, jumps to it are left out
+    uint32_t *uses; // How many times every value is used
+
+    // Register allocation, see x64_alloc
+    uint32_t *pos; // Position of every instruction
+    uint32_t *order; // Blocks in the order they are emitted in, see x64_order
+    uint32_t norder;
+    uint32_t *from; // Position of the first instruction of every block, or
+                    // UINT32_MAX for the ones that aren't emitted
+    uint32_t at; // Position of the instruction being emitted
+    uint64_t *livein; // Values that are live at the start of every block
+    uint32_t words; // Size of a set of values in words
+    x64_piece_t *pieces; // Piece 0 isn't used
+    uint32_t npieces, piececap;
+    uint32_t *first; // First piece of every value, 0 if it has none
+    ir_val_t *phiuse; // Phi that every value is an argument of, 0 if none
+    uint32_t *calls; // Positions of the calls in order
+    uint32_t ncalls;
+    uint32_t *splits; // Pieces that aren't the first of their value by start
+    uint32_t nsplits, split;
+    x64_move_t *moves;
+    uint32_t saved; // Callee saved registers that are used, one bit each
+    uint32_t nsaved;
+    ir_val_t fused; // Comparison that the flags are set for, see x64_fused
+    int cc;
+} x64_t;
+
+static void x64_byte(x64_t *x, uint8_t b) {
+    if (x->p < x->end) *x->p++ = b;
+    else x->full = true;
 }
 
-// Parse an POD initializer list
-static bool expr_parse_init_list_pod(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                                     const typeref_t *type) {
-    if (!expr_parse(cnm, out, gencode, gendata, PREC_FULL, NULL)) return false;
+static void x64_u32(x64_t *x, uint32_t v) {
+    for (int i = 0; i < 4; i++) x64_byte(x, v >> i * 8);
+}
 
-    if (!type_eq(out->type, *type, false)) {
-        cnm_doerr(cnm, true, "initializer list type does not match expected type");
-        return false;
-    }
+static void x64_u64(x64_t *x, uint64_t v) {
+    for (int i = 0; i < 8; i++) x64_byte(x, v >> i * 8);
+}
 
-    return true;
+// Emit an instruction with a ModRM operand. pfx is its mandatory prefix (0 if
+// it has none), w selects 64 bit operands and op is one byte or 0x0F and a
+// second byte. rm is a register, or the base register of [rm + disp] if mem
+// is set
+static void x64_op(x64_t *x, uint8_t pfx, bool w, uint16_t op, int reg, int rm,
+                   bool mem, int32_t disp) {
+    if (pfx) x64_byte(x, pfx);
+    const uint8_t rex = 0x40 | w << 3 | (reg & 8) >> 1 | (rm & 8) >> 3;
+    if (rex != 0x40) x64_byte(x, rex);
+    if (op > 0xFF) x64_byte(x, op >> 8);
+    x64_byte(x, op);
+    if (!mem) {
+        x64_byte(x, 0xC0 | (reg & 7) << 3 | (rm & 7));
+        return;
+    }
+    x64_byte(x, 0x80 | (reg & 7) << 3 | (rm & 7));
+    if ((rm & 7) == X64_RSP) x64_byte(x, 0x24);
+    x64_u32(x, disp);
 }
 
-#define INIT_LIST_MAX_DEPTH 16
+static inline int32_t x64_slot(ir_val_t v) {
+    return -8 * (int32_t)v;
+}
 
-typedef struct {
-    typeref_t type;
+// Where v is at a position
+static int x64_loc(const x64_t *x, ir_val_t v, uint32_t at) {
+    uint32_t i = x->first[v];
+    if (!i) return X64_STACK;
+    while (x->pieces[i].end <= at && x->pieces[i].next) i = x->pieces[i].next;
+    return x->pieces[i].loc;
+}
 
-    // Normal union fields
-    field_list_t *s;
-    field_t *f;
-    uint8_t *d;
-    int n_fields_inited;
+static inline bool x64_same_loc(int a, ir_val_t av, int b, ir_val_t bv) {
+    return a == b && (a != X64_STACK || av == bv);
+}
 
-    // Array fields
-    bool isarr;
-    int arridx, arrlen;
-} init_list_stack_t;
+// Copy 8 bytes from src to dst. Stack slots are copied through rcx
+static void x64_move(x64_t *x, int dst, ir_val_t dv, int src, ir_val_t sv) {
+    if (x64_same_loc(dst, dv, src, sv)) return;
+    if (dst == X64_STACK && src == X64_STACK) {
+        x64_move(x, X64_RCX, 0, src, sv);
+        src = X64_RCX;
+    }
+    if (src == X64_STACK && dst >= X64_XMM) {
+        x64_op(x, 0xF3, false, 0x0F7E, dst - X64_XMM, X64_RBP, true, x64_slot(sv)); // movq
+    } else if (src == X64_STACK) {
+        x64_op(x, 0, true, 0x8B, dst, X64_RBP, true, x64_slot(sv));
+    } else if (dst == X64_STACK && src >= X64_XMM) {
+        x64_op(x, 0x66, false, 0x0FD6, src - X64_XMM, X64_RBP, true, x64_slot(dv));
+    } else if (dst == X64_STACK) {
+        x64_op(x, 0, true, 0x89, src, X64_RBP, true, x64_slot(dv));
+    } else if (dst >= X64_XMM && src >= X64_XMM) {
+        x64_op(x, 0xF3, false, 0x0F7E, dst - X64_XMM, src - X64_XMM, false, 0);
+    } else if (dst >= X64_XMM) {
+        x64_op(x, 0x66, true, 0x0F6E, dst - X64_XMM, src, false, 0); // movq xmm, r64
+    } else if (src >= X64_XMM) {
+        x64_op(x, 0x66, true, 0x0F7E, src - X64_XMM, dst, false, 0); // movq r64, xmm
+    } else {
+        x64_op(x, 0, true, 0x89, src, dst, false, 0);
+    }
+}
 
-typedef struct {
-    init_list_stack_t stack[INIT_LIST_MAX_DEPTH];
-    init_list_stack_t *cur;
-    bool stop, isliteral;
-    int biggest_idx;
+// Move v into a general purpose register and back. Operands are read from
+// where they are at the current instruction and results written to where
+// they are right after it
+static inline void x64_load(x64_t *x, int reg, ir_val_t v) {
+    x64_move(x, reg, 0, x64_loc(x, v, x->at), v);
+}
+static inline void x64_store(x64_t *x, int reg, ir_val_t v) {
+    x64_move(x, x64_loc(x, v, x->at + 1), v, reg, 0);
+}
 
-    // Save this for the case that the initializer isn't completely constant
-    uint8_t *global_backup;
-    uint8_t *data_start;
+// Same for xmm registers
+static inline void x64_loadx(x64_t *x, int xmm, ir_val_t v) {
+    x64_load(x, X64_XMM + xmm, v);
+}
+static inline void x64_storex(x64_t *x, int xmm, ir_val_t v) {
+    x64_store(x, X64_XMM + xmm, v);
+}
 
-    typeref_t basety;
-    typeinf_t inf;
-} init_list_state_t;
+// The general purpose register that the operand v is in, after loading it
+// into scratch if it isn't in one
+static int x64_reg(x64_t *x, int scratch, ir_val_t v) {
+    const int loc = x64_loc(x, v, x->at);
+    if (loc >= 0 && loc < X64_XMM) return loc;
+    x64_load(x, scratch, v);
+    return scratch;
+}
 
-static inline int init_list_stack_get_offs(cnm_t *cnm, init_list_stack_t *self) {
-    if (self->isarr) {
-        const typeinf_t inf = type_getinf(cnm, self->type.type);
-        if (self->arridx > self->arrlen) {
-            cnm_doerr(cnm, true, "array index out of bounds in initializer");
-            return -1;
-        } else {
-            return self->arridx * inf.size;
+// Same for xmm registers, returns the number of the xmm register
+static int x64_xreg(x64_t *x, int scratch, ir_val_t v) {
+    const int loc = x64_loc(x, v, x->at);
+    if (loc >= X64_XMM) return loc - X64_XMM;
+    x64_loadx(x, scratch, v);
+    return scratch;
+}
+
+// The general purpose register that the result v goes to: its own one, or
+// scratch if it has none and has to be stored from there
+static int x64_dst(const x64_t *x, int scratch, ir_val_t v) {
+    const int loc = x64_loc(x, v, x->at + 1);
+    return loc >= 0 && loc < X64_XMM ? loc : scratch;
+}
+
+// Make moves as if they all happened at once. A move is made once nothing
+// that is left reads its destination, and when only cycles are left one of
+// their sources is taken out into rax
+static void x64_moves(x64_t *x, x64_move_t *moves, uint32_t n) {
+    while (n) {
+        bool moved = false;
+        for (uint32_t i = 0; i < n;) {
+            bool blocked = false;
+            for (uint32_t j = 0; j < n && !blocked; j++) {
+                blocked = j != i
+                    && x64_same_loc(moves[j].src, moves[j].sv, moves[i].dst, moves[i].dv);
+            }
+            if (blocked) {
+                i++;
+                continue;
+            }
+            x64_move(x, moves[i].dst, moves[i].dv, moves[i].src, moves[i].sv);
+            moves[i] = moves[--n];
+            moved = true;
+        }
+        if (moved || !n) continue;
+        const int src = moves[0].src;
+        const ir_val_t sv = moves[0].sv;
+        x64_move(x, X64_RAX, 0, src, sv);
+        for (uint32_t j = 0; j < n; j++) {
+            if (x64_same_loc(moves[j].src, moves[j].sv, src, sv)) moves[j].src = X64_RAX;
         }
-    } else {
-        return self->f->offs;
     }
 }
 
-// Initialize a initializer stack element based on the previous stack element
-// if there is one
-static void init_list_stack_init(cnm_t *cnm, const typeref_t *type,
-                                 init_list_stack_t *last, init_list_stack_t *self,
-                                 init_list_state_t *state) {
-    userty_t *u;
-    for (u = cnm->type.types; u && u->typeid != type->type[0].n; u = u->next);
-
-    if (type->type[0].class == TYPE_ARR) {
-        *self = (init_list_stack_t){
-            .isarr = true,
-            .arridx = 0,
-            .arrlen = type->type[0].n,
-            .type = (typeref_t){
-                .type = type->type + 1,
-                .size = type->size - 1,
-            },
-        };
+// mov reg, imm in the shortest form there is
+static void x64_imm(x64_t *x, int reg, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        // mov r32, imm32 clears the upper half
+        if (reg & 8) x64_byte(x, 0x41);
+        x64_byte(x, 0xB8 + (reg & 7));
+        x64_u32(x, imm);
+    } else if ((int64_t)imm == (int32_t)imm) {
+        x64_op(x, 0, true, 0xC7, 0, reg, false, 0);
+        x64_u32(x, imm);
     } else {
-        *self = (init_list_stack_t){
-            .s = (field_list_t *)u->data,
-        };
-        self->f = self->s->end;
-        self->type = self->f->type;
+        x64_byte(x, 0x48 | (reg & 8) >> 3);
+        x64_byte(x, 0xB8 + (reg & 7));
+        x64_u64(x, imm);
     }
+}
 
-    self->d = last ? last->d + init_list_stack_get_offs(cnm, last) : state->data_start;
+// Sign or zero extend a register from the width of class to 64 bits
+static void x64_extend(x64_t *x, typeclass_t class, int reg) {
+    switch (class) {
+    case TYPE_CHAR: x64_op(x, 0, true, 0x0FBE, reg, reg, false, 0); break;
+    case TYPE_UCHAR: case TYPE_BOOL:
+        // With REX.W so that sil and dil can be used
+        x64_op(x, 0, true, 0x0FB6, reg, reg, false, 0);
+        break;
+    case TYPE_SHORT: x64_op(x, 0, true, 0x0FBF, reg, reg, false, 0); break;
+    case TYPE_USHORT: x64_op(x, 0, false, 0x0FB7, reg, reg, false, 0); break;
+    case TYPE_INT: x64_op(x, 0, true, 0x63, reg, reg, false, 0); break;
+    case TYPE_UINT: x64_op(x, 0, false, 0x89, reg, reg, false, 0); break;
+    default: break;
+    }
+}
 
-    // Make it the maximum that we can
-    if (self->isarr && !self->arrlen) {
-        const typeinf_t inf = type_getinf(cnm, self->type.type);
-        
-        // Get amount of free data memory
-        size_t nfree = (cnm->globals.strnext - self->d) / inf.size * inf.size;
+// setcc al
+static inline void x64_setcc(x64_t *x, int cc, int reg) {
+    x64_op(x, 0, false, 0x0F90 | cc, 0, reg, false, 0);
+}
 
-        self->arrlen = nfree;
+// Store the flags as a bool. For floating point comparisons the parity flag is
+// set when either side is a NaN, which makes == false and != true
+static void x64_store_cc(x64_t *x, int cc, bool fp, ir_val_t v) {
+    x64_setcc(x, cc, X64_RAX);
+    if (fp && cc == X64_CC_E) {
+        x64_setcc(x, X64_CC_NP, X64_RCX);
+        x64_op(x, 0, false, 0x20, X64_RCX, X64_RAX, false, 0); // and al, cl
+    } else if (fp && cc == X64_CC_NE) {
+        x64_setcc(x, X64_CC_P, X64_RCX);
+        x64_op(x, 0, false, 0x08, X64_RCX, X64_RAX, false, 0); // or al, cl
+    }
+    x64_extend(x, TYPE_BOOL, X64_RAX);
+    x64_store(x, X64_RAX, v);
+}
+
+// Compare a with zero, leaving the flags like a cmp would
+static void x64_test_zero(x64_t *x, ir_val_t a, bool fp, bool f32) {
+    if (!fp) {
+        x64_load(x, X64_RAX, a);
+        x64_op(x, 0, true, 0x85, X64_RAX, X64_RAX, false, 0);
+        return;
     }
+    x64_loadx(x, 0, a);
+    x64_op(x, 0, false, 0x0F57, 1, 1, false, 0); // xorps xmm1, xmm1
+    x64_op(x, f32 ? 0 : 0x66, false, 0x0F2E, 0, 1, false, 0); // ucomis
 }
 
-static bool init_list_designator(cnm_t *cnm, init_list_state_t *state,
-                                 bool in_designator) {
-    if (cnm->s.tok.type == TOKEN_DOT) {
-        // Move 1 stack inwards
-        if (in_designator) {
-            init_list_stack_t *cur = state->cur + 1;
-            if (cur >= state->stack + INIT_LIST_MAX_DEPTH) {
-                cnm_doerr(cnm, true, "hit max initializer designator depth");
-                return false;
-            }
+// Emit a short forward jump (jmp or jcc) and return where its rel8 is
+static uint8_t *x64_jmp8(x64_t *x, int cc) {
+    x64_byte(x, cc < 0 ? 0xEB : 0x70 | cc);
+    x64_byte(x, 0);
+    return x->p - 1;
+}
 
-            init_list_stack_init(cnm, &state->cur->f->type, state->cur, cur, state);
-            state->cur = cur;
-        }
+// Point a short jump at the current position
+static void x64_land8(x64_t *x, uint8_t *rel) {
+    if (!x->full) *rel = (uint8_t)(x->p - (rel + 1));
+}
 
-        // Struct parameter
-        token_next(cnm);
-        if (cnm->s.tok.type != TOKEN_IDENT) {
-            cnm_doerr(cnm, true, "expected identifier");
-            return false;
+// Put the moves for the edge from one block to another into x->moves: the
+// phis of the block get their arguments, and values that are somewhere else
+// at its start than at the end of this one are moved there. Returns how many
+// there are
+static uint32_t x64_edge_moves(x64_t *x, uint32_t from, uint32_t to) {
+    const ir_func_t *const f = x->f;
+    const ir_block_t *const b = &f->blocks[to];
+    const uint32_t start = x->from[to];
+    uint32_t pred = 0, n = 0;
+    while (pred < b->npreds && f->args[b->preds + pred] != from) pred++;
+    if (pred == b->npreds) return 0;
+
+    for (ir_val_t v = b->first; v < b->first + b->ninsts && f->insts[v].op == IR_PHI; v++) {
+        const ir_val_t arg = f->args[f->insts[v].a + pred];
+        if (!arg) continue;
+        const x64_move_t m = { x64_loc(x, v, start), x64_loc(x, arg, x->at), v, arg };
+        if (!x64_same_loc(m.dst, m.dv, m.src, m.sv)) x->moves[n++] = m;
+    }
+    for (uint32_t w = 0; w < x->words; w++) {
+        for (uint64_t bits = x->livein[(size_t)to * x->words + w]; bits; bits &= bits - 1) {
+            const ir_val_t v = w * 64 + __builtin_ctzll(bits);
+            const x64_move_t m = { x64_loc(x, v, start), x64_loc(x, v, x->at), v, v };
+            if (!x64_same_loc(m.dst, m.dv, m.src, m.sv)) x->moves[n++] = m;
         }
+    }
+    return n;
+}
 
-        field_t *f = state->cur->s->fields;
-        for (; f && !strview_eq(f->name, cnm->s.tok.src); f = f->next);
-        if (!f) {
-            cnm_doerr(cnm, true, "no member found with that name");
-            return false;
-        }
-        state->cur->f = f;
-        state->cur->type = f->type;
+// Move the values whose piece changes at the current instruction. The ones
+// that change at the start of a block are moved on the edges into it
+static void x64_split_moves(x64_t *x, uint32_t block) {
+    uint32_t n = 0;
+    for (; x->split < x->nsplits; x->split++) {
+        const x64_piece_t *const p = &x->pieces[x->splits[x->split]];
+        if (p->start > x->at) break;
+        if (p->start < x->at || x->at == x->from[block]) continue;
+        const x64_move_t m = { p->loc, x64_loc(x, p->v, x->at - 1), p->v, p->v };
+        if (!x64_same_loc(m.dst, m.dv, m.src, m.sv)) x->moves[n++] = m;
+    }
+    x64_moves(x, x->moves, n);
+}
 
-        token_next(cnm);
-        return init_list_designator(cnm, state, true);
-    } else if (cnm->s.tok.type == TOKEN_BRACK_L) {
-        // Move 1 stack inwards
-        if (in_designator) {
-            init_list_stack_t *cur = state->cur + 1;
-            if (cur >= state->stack + INIT_LIST_MAX_DEPTH) {
-                cnm_doerr(cnm, true, "hit max initializer designator depth");
-                return false;
-            }
+// Where a jump to a block can go instead: blocks that only have phis and jump
+// on without moving anything are jumped over
+static uint32_t x64_target(x64_t *x, uint32_t block) {
+    const ir_func_t *const f = x->f;
+    const uint32_t at = x->at;
+    for (int hops = 0; hops < 8; hops++) {
+        const ir_block_t *const b = &f->blocks[block];
+        const ir_val_t last = b->first + b->ninsts - 1;
+        const ir_inst_t *const term = &f->insts[last];
+        if (term->op != IR_JMP || term->a == block) break;
+        ir_val_t v = b->first;
+        while (v < last && f->insts[v].op == IR_PHI) v++;
+        if (v != last) break;
+        x->at = x->pos[last];
+        const uint32_t n = x64_edge_moves(x, block, term->a);
+        x->at = at;
+        if (n) break;
+        block = term->a;
+    }
+    return block;
+}
 
-            init_list_stack_init(cnm, &(typeref_t){
-                .type = state->cur->type.type + 1,
-                .size = state->cur->type.size - 1,
-            }, state->cur, cur, state);
-            state->cur = cur;
-        }
+// Jump to a block, jcc if cc isn't negative. The jump is left out if it goes
+// to the next block anyway, or to where that one jumps on to
+static void x64_jmp(x64_t *x, int cc, uint32_t block) {
+    block = x64_target(x, block);
+    if (cc < 0 && x->next != UINT32_MAX
+        && (block == x->next || block == x64_target(x, x->next))) return;
+    if (cc < 0) {
+        x64_byte(x, 0xE9);
+    } else {
+        x64_byte(x, 0x0F);
+        x64_byte(x, 0x80 | cc);
+    }
+    const uint32_t at = x->p - x->start;
+    if (x->offs[block] != UINT32_MAX) {
+        x64_u32(x, x->offs[block] - (at + 4));
+    } else {
+        x->fixups[x->nfixups++] = (x64_fixup_t){ .at = at, .block = block };
+        x64_u32(x, 0);
+    }
+}
 
-        // Array index
-        token_next(cnm);
+// Convert the integer in rax to a float in xmm0. Unsigned 64 bit integers
+// that don't fit in a signed one are halved (keeping the lowest bit so it
+// still rounds right) and doubled after
+static void x64_int_to_fp(x64_t *x, typeclass_t from, bool f32) {
+    const uint8_t pfx = f32 ? 0xF3 : 0xF2;
+    if (from != TYPE_ULONG && from != TYPE_ULLONG && from != TYPE_PTR) {
+        x64_op(x, pfx, true, 0x0F2A, 0, X64_RAX, false, 0); // cvtsi2s
+        return;
+    }
+    x64_op(x, 0, true, 0x85, X64_RAX, X64_RAX, false, 0);
+    uint8_t *const big = x64_jmp8(x, X64_CC_S);
+    x64_op(x, pfx, true, 0x0F2A, 0, X64_RAX, false, 0);
+    uint8_t *const done = x64_jmp8(x, -1);
+    x64_land8(x, big);
+    x64_op(x, 0, true, 0x89, X64_RAX, X64_RCX, false, 0); // mov rcx, rax
+    x64_op(x, 0, true, 0xD1, 5, X64_RCX, false, 0); // shr rcx, 1
+    x64_op(x, 0, false, 0x83, 4, X64_RAX, false, 0); // and eax, 1
+    x64_byte(x, 1);
+    x64_op(x, 0, true, 0x09, X64_RAX, X64_RCX, false, 0); // or rcx, rax
+    x64_op(x, pfx, true, 0x0F2A, 0, X64_RCX, false, 0);
+    x64_op(x, pfx, false, 0x0F58, 0, 0, false, 0); // adds xmm0, xmm0
+    x64_land8(x, done);
+}
 
-        valref_t val;
-        if (!expr_parse(cnm, &val, false, false, PREC_OR, NULL)) return false;
-        if (!val.isliteral) {
-            cnm_doerr(cnm, true, "array index initializer must be constant expression");
-            return false;
-        }
-        if (!type_is_int(val.type.type[0])) return false;
-        if (type_is_unsigned(val.type.type[0]) && val.literal.i < 0) {
-            cnm_doerr(cnm, true, "can not have negative array index in initializer");
-            return false;
-        }
-        state->cur->arridx = val.literal.u;
-        if (state->cur->arridx >= state->cur->arrlen) {
-            cnm_doerr(cnm, true, "array index in initializer is out of bounds");
-            return false;
-        }
+// Convert the float in xmm0 to an integer in rax. Unsigned 64 bit integers
+// above the signed range are converted with 2^63 taken off and put back after
+static void x64_fp_to_int(x64_t *x, typeclass_t to, bool f32) {
+    const uint8_t pfx = f32 ? 0xF3 : 0xF2;
+    if (to != TYPE_ULONG && to != TYPE_ULLONG && to != TYPE_PTR) {
+        x64_op(x, pfx, true, 0x0F2C, X64_RAX, 0, false, 0); // cvtts2si
+        return;
+    }
+    x64_imm(x, X64_RCX, f32 ? 0x5F000000 : 0x43E0000000000000);
+    x64_op(x, 0x66, true, 0x0F6E, 1, X64_RCX, false, 0); // movq xmm1, rcx
+    x64_op(x, f32 ? 0 : 0x66, false, 0x0F2E, 0, 1, false, 0);
+    uint8_t *const big = x64_jmp8(x, X64_CC_AE);
+    x64_op(x, pfx, true, 0x0F2C, X64_RAX, 0, false, 0);
+    uint8_t *const done = x64_jmp8(x, -1);
+    x64_land8(x, big);
+    x64_op(x, pfx, false, 0x0F5C, 0, 1, false, 0); // subs xmm0, xmm1
+    x64_op(x, pfx, true, 0x0F2C, X64_RAX, 0, false, 0);
+    x64_op(x, 0, true, 0x0FBA, 7, X64_RAX, false, 0); // btc rax, 63
+    x64_byte(x, 63);
+    x64_land8(x, done);
+}
 
-        token_next(cnm);
-        return init_list_designator(cnm, state, true);
-    } else if (cnm->s.tok.type == TOKEN_ASSIGN) {
-        token_next(cnm);
-        if (in_designator) {
-            return true;
-        } else {
-            cnm_doerr(cnm, true, "expected initialzer expression, not =");
-            return false;
-        }
+static void x64_cast(x64_t *x, const ir_inst_t *inst, ir_val_t v) {
+    const typeclass_t from = x->f->insts[inst->a].type, to = inst->type;
+    const bool fp_from = type_is_fp((type_t){ .class = from }),
+        fp_to = type_is_fp((type_t){ .class = to });
+
+    if (to == TYPE_BOOL) {
+        x64_test_zero(x, inst->a, fp_from, from == TYPE_FLOAT);
+        x64_store_cc(x, X64_CC_NE, fp_from, v);
+    } else if (fp_from && fp_to) {
+        x64_loadx(x, 0, inst->a);
+        if (from != to) x64_op(x, from == TYPE_FLOAT ? 0xF3 : 0xF2, false, 0x0F5A, 0, 0, false, 0);
+        x64_storex(x, 0, v);
+    } else if (fp_from) {
+        x64_loadx(x, 0, inst->a);
+        x64_fp_to_int(x, to, from == TYPE_FLOAT);
+        x64_extend(x, to, X64_RAX);
+        x64_store(x, X64_RAX, v);
+    } else if (fp_to) {
+        x64_load(x, X64_RAX, inst->a);
+        x64_int_to_fp(x, from, to == TYPE_FLOAT);
+        x64_storex(x, 0, v);
     } else {
-        return true;
+        const int dst = x64_dst(x, X64_RAX, v);
+        x64_load(x, dst, inst->a);
+        x64_extend(x, to, dst);
+        x64_store(x, dst, v);
     }
 }
 
-static bool array_init_grow_to_size(cnm_t *cnm, const typeref_t array,
-                                    size_t curr_n, size_t needed_n) {
-    if (curr_n == needed_n || !needed_n) return true;
-    typeinf_t inf = type_getinf(cnm, array.type + 1);
-    const size_t size = inf.size * (needed_n - curr_n);
-    void *area;
-    if (!(area = cnm_alloc_global(cnm, size, 1))) return false;
-    memset(area, 0, size);
-
-    return true;
-}
-
-// Optionally grow the array size to the needed size of an array on the top of the
-// globals array on the cnm state
-static bool array_init_grow_size(cnm_t *cnm, typeref_t *type, const typeref_t *needed) {
-    if (type->type[0].class != TYPE_ARR || needed->type[0].class != TYPE_ARR) return true;
+// Opcodes of the binary operations (r/m, reg forms), their extensions in the
+// r/m, imm32 form and the opcodes of their floating point versions
+static const uint16_t x64_int_ops[IR_OP_COUNT] = {
+    [IR_ADD] = 0x01, [IR_SUB] = 0x29, [IR_AND] = 0x21, [IR_OR] = 0x09, [IR_XOR] = 0x31,
+};
+static const uint8_t x64_int_exts[IR_OP_COUNT] = {
+    [IR_ADD] = 0, [IR_SUB] = 5, [IR_AND] = 4, [IR_OR] = 1, [IR_XOR] = 6,
+};
+static const uint16_t x64_fp_ops[IR_OP_COUNT] = {
+    [IR_ADD] = 0x0F58, [IR_SUB] = 0x0F5C, [IR_MUL] = 0x0F59, [IR_DIV] = 0x0F5E,
+};
 
-    int curr_n = type->type[0].n, needed_n = needed->type[0].n;
+// Condition codes of the comparisons for signed, unsigned and floating point
+// operands. Floating point < and <= swap the operands
+static const uint8_t x64_cmp_cc[IR_GE - IR_EQ + 1][3] = {
+    [IR_EQ - IR_EQ] = { X64_CC_E, X64_CC_E, X64_CC_E },
+    [IR_NE - IR_EQ] = { X64_CC_NE, X64_CC_NE, X64_CC_NE },
+    [IR_LT - IR_EQ] = { X64_CC_L, X64_CC_B, X64_CC_A },
+    [IR_LE - IR_EQ] = { X64_CC_LE, X64_CC_BE, X64_CC_AE },
+    [IR_GT - IR_EQ] = { X64_CC_G, X64_CC_A, X64_CC_A },
+    [IR_GE - IR_EQ] = { X64_CC_GE, X64_CC_AE, X64_CC_AE },
+};
 
-    if (!type_eq((typeref_t){
-        .type = type->type + 1,
-        .size = type->size - 1,
-    }, (typeref_t){
-        .type = needed->type + 1,
-        .size = needed->size - 1,
-    }, true) || (curr_n > needed_n && needed_n)) {
-        cnm_doerr(cnm, true, "array types don't match");
-        return false;
+// push v
+static void x64_push(x64_t *x, ir_val_t v) {
+    const int loc = x64_loc(x, v, x->at);
+    if (loc == X64_STACK) {
+        x64_op(x, 0, false, 0xFF, 6, X64_RBP, true, x64_slot(v));
+    } else if (loc >= X64_XMM) {
+        x64_op(x, 0, true, 0x81, 5, X64_RSP, false, 0), x64_u32(x, 8); // sub rsp, 8
+        x64_op(x, 0x66, false, 0x0FD6, loc - X64_XMM, X64_RSP, true, 0);
+    } else {
+        if (loc & 8) x64_byte(x, 0x41);
+        x64_byte(x, 0x50 + (loc & 7));
     }
-
-    if (needed_n) type->type[0].n = needed_n;
-    return array_init_grow_to_size(cnm, *needed, curr_n, needed_n);
 }
 
-// Advance to next field / index
-static void init_list_advance_field(cnm_t *cnm, init_list_state_t *state) {
-    if (state->cur->isarr) {
-        if (state->cur == state->stack
-            && state->cur->arridx > state->biggest_idx) {
-            state->biggest_idx = state->cur->arridx;
-        }
-        if (state->cur->arridx < state->cur->arrlen - 1) {
-            state->cur->arridx++;
-        } else if (state->cur > state->stack) {
-            state->cur--;
-            init_list_advance_field(cnm, state);
+// Values in caller saved registers that live on after a call have been moved
+// out of them by the allocator, so the arguments are put in place all at once
+static void x64_call(x64_t *x, const ir_inst_t *inst, ir_val_t v) {
+    const ir_func_t *const f = x->f;
+    const uint32_t *const args = f->args + inst->b;
+
+    // Arguments that don't fit in registers go on the stack, which has to be
+    // 16 byte aligned at the call
+    uint32_t nint = 0, nfp = 0, nstack = 0;
+    for (uint32_t i = 0; i < inst->c; i++) {
+        if (type_is_fp((type_t){ .class = f->insts[args[i]].type })) {
+            nstack += nfp++ >= X64_FP_PARAMS;
         } else {
-            state->stop = true;
+            nstack += nint++ >= arrlen(x64_int_params);
         }
-    } else {
-        state->cur->n_fields_inited++;
-        if (state->cur->f->last) {
-            state->cur->f = state->cur->f->last;
-        } else if (state->cur > state->stack) {
-            state->cur--;
-            init_list_advance_field(cnm, state);
+    }
+    const uint32_t stack = (nstack + (nstack & 1)) * 8;
+    if (nstack & 1) x64_op(x, 0, true, 0x81, 5, X64_RSP, false, 0), x64_u32(x, 8);
+    for (uint32_t i = inst->c, fi = nfp, ii = nint; i--;) {
+        const bool fp = type_is_fp((type_t){ .class = f->insts[args[i]].type });
+        if (fp ? --fi >= X64_FP_PARAMS : --ii >= arrlen(x64_int_params)) x64_push(x, args[i]);
+    }
+    x64_load(x, X64_R11, inst->a);
+    uint32_t n = 0;
+    nint = nfp = 0;
+    for (uint32_t i = 0; i < inst->c; i++) {
+        int dst = -1;
+        if (type_is_fp((type_t){ .class = f->insts[args[i]].type })) {
+            if (nfp < X64_FP_PARAMS) dst = X64_XMM + nfp;
+            nfp++;
         } else {
-            state->stop = true;
+            if (nint < arrlen(x64_int_params)) dst = x64_int_params[nint];
+            nint++;
         }
-        state->cur->type = state->cur->f->type;
+        const x64_move_t m = { dst, x64_loc(x, args[i], x->at), 0, args[i] };
+        if (dst >= 0 && !x64_same_loc(m.dst, m.dv, m.src, m.sv)) x->moves[n++] = m;
     }
-}
+    x64_moves(x, x->moves, n);
 
-static bool init_list_field(cnm_t *cnm, init_list_state_t *state,
-                            bool gencode, bool gendata) {
-    if (!init_list_designator(cnm, state, false)) return false;
+    // al has the number of vector registers used in case it is variadic
+    x64_byte(x, 0xB8);
+    x64_u32(x, nfp < X64_FP_PARAMS ? nfp : X64_FP_PARAMS);
+    x64_op(x, 0, false, 0xFF, 2, X64_R11, false, 0); // call r11
+    if (stack) x64_op(x, 0, true, 0x81, 0, X64_RSP, false, 0), x64_u32(x, stack);
 
-    // Consume actual value here
-    valref_t val;
-    if (gendata) {
-        int offs = init_list_stack_get_offs(cnm, state->cur);
-        if (offs == -1) return false;
-        cnm->globals.next = state->cur->d + offs;
+    if (inst->type == TYPE_VOID) return;
+    if (type_is_fp((type_t){ .class = inst->type })) {
+        x64_storex(x, 0, v);
+    } else {
+        x64_extend(x, inst->type, X64_RAX);
+        x64_store(x, X64_RAX, v);
     }
-    if (!expr_parse(cnm, &val, gencode, gendata, PREC_COND, &state->cur->type)) return false;
-    state->isliteral &= val.isliteral;
-    if (!valref_cast(cnm, &val, state->cur->type, gencode)) return false;
-    if (!type_eq(val.type, state->cur->type, false)) {
-        cnm_doerr(cnm, true, "types in initializer list do not match");
+}
+
+// Whether operand i of an instruction is a constant that is encoded in it as
+// an immediate instead of being put in a register. Those are sign extended
+// from 32 bits
+static bool x64_imm_operand(const ir_func_t *f, const ir_inst_t *inst, uint32_t i) {
+    if (i != 1) return false;
+    switch ((ir_op_t)inst->op) {
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_AND: case IR_OR: case IR_XOR:
+    case IR_SHL: case IR_SHR:
+        if (type_is_fp((type_t){ .class = inst->type })) return false;
+        break;
+    case IR_EQ: case IR_NE: case IR_LT: case IR_LE: case IR_GT: case IR_GE:
+        if (type_is_fp((type_t){ .class = f->insts[inst->a].type })) return false;
+        break;
+    default:
         return false;
     }
-    if (!val_enforce_global(cnm, &val)) return false;
-    init_list_advance_field(cnm, state);
-
-    return true;
+    const uint64_t imm = ir_imm(&f->insts[inst->b]);
+    return f->insts[inst->b].op == IR_CONST && (int64_t)imm == (int32_t)imm;
 }
 
-static bool init_list_init(cnm_t *cnm, init_list_state_t *state,
-                           const typeref_t *type, bool gencode, bool gendata) {
-    // Unions and structs
-    *state = (init_list_state_t){
-        .global_backup = cnm->globals.next,
-        .stop = false,
-        .inf = type_getinf(cnm, type->type),
-        .basety = *type,
-        .isliteral = true,
-    };
-
-    // Save this for if the initializer is completely constant
-    // TODO: Code pointer here
+// Whether v is an integer comparison that is only used by the branch right
+// after it, which then jumps on the flags
+static bool x64_fused(const x64_t *x, uint32_t block, ir_val_t v) {
+    const ir_func_t *const f = x->f;
+    const ir_block_t *const b = &f->blocks[block];
+    const ir_inst_t *const inst = &f->insts[v];
+    return inst->op >= IR_EQ && inst->op <= IR_GE && x->uses[v] == 1
+        && !type_is_fp((type_t){ .class = f->insts[inst->a].type })
+        && v + 1 < b->first + b->ninsts && f->insts[v + 1].op == IR_BR && f->insts[v + 1].a == v;
+}
 
-    // Now make sure that we can even fit the type onto the global segment
-    if (gendata) {
-        if (!(state->data_start = cnm_alloc_global(cnm, 0, state->inf.align))) return false;
-        if (!cnm_alloc_global(cnm, state->inf.size, 1)) return false;
-        cnm->globals.next = state->data_start;
-        memset(state->data_start, 0, state->inf.size);
+// Compare the operands of a comparison. Returns the condition code that is
+// set when it is true
+static int x64_compare(x64_t *x, const ir_inst_t *inst) {
+    const typeclass_t optype = x->f->insts[inst->a].type;
+    const bool opfp = type_is_fp((type_t){ .class = optype });
+    const bool opunsigned = type_is_unsigned((type_t){ .class = optype })
+        || optype == TYPE_BOOL || optype == TYPE_PTR;
+    if (opfp) {
+        // a < b is b > a, which is false for NaNs like the others
+        const bool swap = inst->op == IR_LT || inst->op == IR_LE;
+        const int a = x64_xreg(x, 0, swap ? inst->b : inst->a);
+        const int b = x64_xreg(x, 1, swap ? inst->a : inst->b);
+        x64_op(x, optype == TYPE_FLOAT ? 0 : 0x66, false, 0x0F2E, a, b, false, 0); // ucomis
+    } else if (x64_imm_operand(x->f, inst, 1)) {
+        x64_op(x, 0, true, 0x81, 7, x64_reg(x, X64_RAX, inst->a), false, 0); // cmp a, imm
+        x64_u32(x, ir_imm(&x->f->insts[inst->b]));
+    } else {
+        const int a = x64_reg(x, X64_RAX, inst->a);
+        const int b = x64_reg(x, X64_RCX, inst->b);
+        x64_op(x, 0, true, 0x39, b, a, false, 0); // cmp a, b
     }
-
-    state->cur = state->stack;
-    init_list_stack_init(cnm, type, NULL, state->cur, state);
-
-    return true;
+    return x64_cmp_cc[inst->op - IR_EQ][opfp ? 2 : opunsigned];
 }
 
-static bool init_list_finish(cnm_t *cnm, init_list_state_t *state,
-                             valref_t *out, bool gencode, bool gendata) {
-    // Finalize array size
-    if (state->basety.type[0].class == TYPE_ARR) {
-        if (!array_init_grow_to_size(cnm, state->basety,
-                                     state->biggest_idx + 1,
-                                     state->basety.type[0].n)) return false;
-        if (!state->basety.type[0].n) state->basety.type[0].n = state->biggest_idx + 1;
-        state->inf = type_getinf(cnm, state->basety.type);
+// Save the callee saved registers that are used below the value slots, or
+// restore them
+static void x64_save(x64_t *x, bool restore) {
+    int32_t slot = x->f->ninsts;
+    for (int reg = 0; reg < X64_XMM; reg++) {
+        if (!(x->saved >> reg & 1)) continue;
+        x64_op(x, 0, true, restore ? 0x8B : 0x89, reg, X64_RBP, true, -8 * slot++);
     }
+}
 
-    // Goto end of size
-    if (gendata) cnm->globals.next = state->data_start + state->inf.size;
+static void x64_inst(x64_t *x, uint32_t block, ir_val_t v) {
+    const ir_func_t *const f = x->f;
+    const ir_inst_t *const inst = &f->insts[v];
+    const typeclass_t type = inst->type;
+    const bool fp = type_is_fp((type_t){ .class = type }), f32 = type == TYPE_FLOAT;
+    const bool sign = !type_is_unsigned((type_t){ .class = type })
+        && type != TYPE_BOOL && type != TYPE_PTR;
+
+    switch ((ir_op_t)inst->op) {
+    case IR_NOP: case IR_PARAM: case IR_PHI: case IR_OP_COUNT:
+        // Parameters are stored by the prologue and phis on the edges
+        break;
+    case IR_CONST: case IR_GLOBAL: {
+        // Constants that are only used as immediates aren't needed
+        if (!x->uses[v]) break;
+        const int dst = x64_dst(x, X64_RAX, v);
+        x64_imm(x, dst, ir_imm(inst));
+        x64_store(x, dst, v);
+        break;
+    }
+    case IR_LOAD: {
+        const int base = x64_reg(x, X64_RCX, inst->a), dst = x64_dst(x, X64_RAX, v);
+        switch (type) {
+        case TYPE_CHAR: x64_op(x, 0, true, 0x0FBE, dst, base, true, 0); break;
+        case TYPE_UCHAR: case TYPE_BOOL: x64_op(x, 0, false, 0x0FB6, dst, base, true, 0); break;
+        case TYPE_SHORT: x64_op(x, 0, true, 0x0FBF, dst, base, true, 0); break;
+        case TYPE_USHORT: x64_op(x, 0, false, 0x0FB7, dst, base, true, 0); break;
+        case TYPE_INT: x64_op(x, 0, true, 0x63, dst, base, true, 0); break;
+        case TYPE_UINT: case TYPE_FLOAT: x64_op(x, 0, false, 0x8B, dst, base, true, 0); break;
+        default: x64_op(x, 0, true, 0x8B, dst, base, true, 0); break;
+        }
+        x64_store(x, dst, v);
+        break;
+    }
+    case IR_STORE: {
+        // Bytes are stored from al since sil and dil would need a REX prefix
+        const typeinf_t inf = type_getinf(NULL, &(type_t){ .class = f->insts[inst->b].type });
+        const int base = x64_reg(x, X64_RCX, inst->a);
+        int val = X64_RAX;
+        if (inf.size == 1) x64_load(x, X64_RAX, inst->b);
+        else val = x64_reg(x, X64_RAX, inst->b);
+        x64_op(x, inf.size == 2 ? 0x66 : 0, inf.size == 8, inf.size == 1 ? 0x88 : 0x89,
+               val, base, true, 0);
+        break;
+    }
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_MOD:
+    case IR_AND: case IR_OR: case IR_XOR: case IR_SHL: case IR_SHR: {
+        // The result is worked out in its own register when it has one,
+        // unless that is where b is
+        if (fp) {
+            const int b = x64_xreg(x, 1, inst->b), loc = x64_loc(x, v, x->at + 1);
+            const int dst = loc >= X64_XMM && loc - X64_XMM != b ? loc - X64_XMM : 0;
+            x64_loadx(x, dst, inst->a);
+            x64_op(x, f32 ? 0xF3 : 0xF2, false, x64_fp_ops[inst->op], dst, b, false, 0);
+            x64_storex(x, dst, v);
+            break;
+        }
+        if (inst->op == IR_DIV || inst->op == IR_MOD) {
+            // Operands are extended to 64 bits so this is exact for every width
+            x64_load(x, X64_RAX, inst->a);
+            const int b = x64_reg(x, X64_RCX, inst->b);
+            if (sign) x64_byte(x, 0x48), x64_byte(x, 0x99); // cqo
+            else x64_op(x, 0, false, 0x31, X64_RDX, X64_RDX, false, 0); // xor edx, edx
+            x64_op(x, 0, true, 0xF7, sign ? 7 : 6, b, false, 0); // idiv/div b
+            if (inst->op == IR_MOD) x64_op(x, 0, true, 0x89, X64_RDX, X64_RAX, false, 0);
+            x64_extend(x, type, X64_RAX);
+            x64_store(x, X64_RAX, v);
+            break;
+        }
+        const bool shift = inst->op == IR_SHL || inst->op == IR_SHR;
+        const bool imm = x64_imm_operand(f, inst, 1);
+        const int32_t k = ir_imm(&f->insts[inst->b]);
+        int b = X64_RCX;
+        if (shift && !imm) x64_load(x, X64_RCX, inst->b);
+        else if (!imm) b = x64_reg(x, X64_RCX, inst->b);
+
+        // When b is where the result goes the operands of commutative
+        // operations are swapped, the others are worked out in rax
+        ir_val_t a = inst->a;
+        int dst = x64_dst(x, X64_RAX, v);
+        if (!imm && dst == b && (x64_int_ops[inst->op] || inst->op == IR_MUL)
+            && inst->op != IR_SUB) {
+            b = x64_reg(x, X64_RCX, inst->a);
+            a = inst->b;
+        } else if (!imm && dst == b) {
+            dst = X64_RAX;
+        }
+        x64_load(x, dst, a);
+        if (x64_int_ops[inst->op] && imm) {
+            x64_op(x, 0, true, 0x81, x64_int_exts[inst->op], dst, false, 0);
+            x64_u32(x, k);
+        } else if (x64_int_ops[inst->op]) {
+            x64_op(x, 0, true, x64_int_ops[inst->op], b, dst, false, 0);
+        } else if (inst->op == IR_MUL && imm) {
+            x64_op(x, 0, true, 0x69, dst, dst, false, 0); // imul dst, dst, imm
+            x64_u32(x, k);
+        } else if (inst->op == IR_MUL) {
+            x64_op(x, 0, true, 0x0FAF, dst, b, false, 0); // imul dst, b
+        } else {
+            const int ext = inst->op == IR_SHL ? 4 : sign ? 7 : 5; // shl, sar, shr
+            x64_op(x, 0, true, imm ? 0xC1 : 0xD3, ext, dst, false, 0);
+            if (imm) x64_byte(x, k);
+        }
+        x64_extend(x, type, dst);
+        x64_store(x, dst, v);
+        break;
+    }
+    case IR_EQ: case IR_NE: case IR_LT: case IR_LE: case IR_GT: case IR_GE: {
+        // The branch after a fused comparison only needs the flags. Moves
+        // between them don't change those
+        const int cc = x64_compare(x, inst);
+        if (x64_fused(x, block, v)) {
+            x->fused = v, x->cc = cc;
+            break;
+        }
+        x64_store_cc(x, cc, type_is_fp((type_t){ .class = f->insts[inst->a].type }), v);
+        break;
+    }
+    case IR_NEG: case IR_BNOT: {
+        if (fp) {
+            x64_load(x, X64_RAX, inst->a);
+            x64_op(x, 0, true, 0x0FBA, 7, X64_RAX, false, 0); // btc rax, sign bit
+            x64_byte(x, f32 ? 31 : 63);
+            x64_store(x, X64_RAX, v);
+            break;
+        }
+        const int dst = x64_dst(x, X64_RAX, v);
+        x64_load(x, dst, inst->a);
+        x64_op(x, 0, true, 0xF7, inst->op == IR_NEG ? 3 : 2, dst, false, 0);
+        x64_extend(x, type, dst);
+        x64_store(x, dst, v);
+        break;
+    }
+    case IR_NOT: {
+        const typeclass_t optype = f->insts[inst->a].type;
+        const bool opfp = type_is_fp((type_t){ .class = optype });
+        x64_test_zero(x, inst->a, opfp, optype == TYPE_FLOAT);
+        x64_store_cc(x, X64_CC_E, opfp, v);
+        break;
+    }
+    case IR_CAST: x64_cast(x, inst, v); break;
+    case IR_CALL: x64_call(x, inst, v); break;
+    case IR_JMP:
+        x64_moves(x, x->moves, x64_edge_moves(x, block, inst->a));
+        x64_jmp(x, -1, inst->a);
+        break;
+    case IR_BR: {
+        int cc = x->cc;
+        if (x->fused != inst->a) {
+            const int a = x64_reg(x, X64_RAX, inst->a);
+            x64_op(x, 0, true, 0x85, a, a, false, 0); // test a, a
+            cc = X64_CC_NE;
+        }
+        x->fused = 0;
+        uint32_t n = x64_edge_moves(x, block, inst->b);
+        if (!n && x64_target(x, inst->b) == x->next && !x64_edge_moves(x, block, inst->c)) {
+            x64_jmp(x, cc ^ 1, inst->c);
+            break;
+        }
+        if (!n) {
+            x64_jmp(x, cc, inst->b);
+            x64_moves(x, x->moves, x64_edge_moves(x, block, inst->c));
+            x64_jmp(x, -1, inst->c);
+            break;
+        }
 
-    if (state->isliteral) {
-        // Generate memcpy code
-    } else {
-        // DEBUG: Remove this. This is here just because yea
-        return false;
+        // The moves of the true edge are skipped over when it's false
+        x64_byte(x, 0x0F);
+        x64_byte(x, 0x80 | (cc ^ 1));
+        x64_u32(x, 0);
+        uint8_t *const rel = x->p - 4;
+        const uint32_t next = x->next;
+        x->next = UINT32_MAX;
+        x64_moves(x, x->moves, n);
+        x64_jmp(x, -1, inst->b);
+        x->next = next;
+        if (!x->full) {
+            const uint32_t d = x->p - (rel + 4);
+            memcpy(rel, &d, sizeof(d));
+        }
+        x64_moves(x, x->moves, x64_edge_moves(x, block, inst->c));
+        x64_jmp(x, -1, inst->c);
+        break;
+    }
+    case IR_RET:
+        if (inst->a) {
+            if (type_is_fp((type_t){ .class = f->insts[inst->a].type })) {
+                x64_loadx(x, 0, inst->a);
+            } else {
+                x64_load(x, X64_RAX, inst->a);
+            }
+        }
+        x64_save(x, true);
+        x64_byte(x, 0xC9); // leave
+        x64_byte(x, 0xC3); // ret
+        break;
     }
+}
 
-    *out = (valref_t){
-        .isliteral = true,
-        .type = state->basety,
-        .literal.addr = state->data_start,
-    };
+// Move the parameters to where they were allocated, extending the integers
+// since the upper bits of narrow ones are undefined
+static void x64_prologue(x64_t *x) {
+    const ir_func_t *const f = x->f;
+    const uint32_t frame = align_size(((size_t)f->ninsts + x->nsaved) * 8, 16);
+    x64_byte(x, 0x55); // push rbp
+    x64_op(x, 0, true, 0x89, X64_RSP, X64_RBP, false, 0); // mov rbp, rsp
+    x64_op(x, 0, true, 0x81, 5, X64_RSP, false, 0); // sub rsp, frame
+    x64_u32(x, frame);
+    x64_save(x, false);
+
+    // The ones passed in registers are moved at once since they can be
+    // allocated to each other's registers
+    x->at = 0;
+    uint32_t nint = 0, nfp = 0, n = 0;
+    for (ir_val_t v = 1; v < f->ninsts; v++) {
+        const ir_inst_t *const inst = &f->insts[v];
+        if (inst->op != IR_PARAM) continue;
+        int src = X64_STACK;
+        if (type_is_fp((type_t){ .class = inst->type })) {
+            if (nfp < X64_FP_PARAMS) src = X64_XMM + nfp++;
+        } else if (nint < arrlen(x64_int_params)) {
+            src = x64_int_params[nint++];
+        }
+        const x64_move_t m = { x64_loc(x, v, 1), src, v, 0 };
+        if (src != X64_STACK && !x64_same_loc(m.dst, m.dv, m.src, m.sv)) x->moves[n++] = m;
+    }
+    x64_moves(x, x->moves, n);
+
+    nint = nfp = 0;
+    uint32_t nstack = 0;
+    for (ir_val_t v = 1; v < f->ninsts; v++) {
+        const ir_inst_t *const inst = &f->insts[v];
+        if (inst->op != IR_PARAM) continue;
+        const bool fp = type_is_fp((type_t){ .class = inst->type });
+        if (fp ? nfp++ >= X64_FP_PARAMS : nint++ >= arrlen(x64_int_params)) {
+            x64_op(x, 0, true, 0x8B, X64_RAX, X64_RBP, true, 16 + 8 * nstack++);
+            x64_extend(x, inst->type, X64_RAX);
+            x64_store(x, X64_RAX, v);
+        } else if (!fp && (inst->type <= TYPE_UINT || inst->type == TYPE_BOOL)) {
+            const int reg = x64_dst(x, X64_RAX, v);
+            x64_load(x, reg, v);
+            x64_extend(x, inst->type, reg);
+            x64_store(x, reg, v);
+        }
+    }
+}
 
+// Put the blocks in the order they are emitted in, which is reverse postorder
+// so that blocks come after the ones that jump to them (except for loops) and
+// loops are in one piece. The false side of a branch is visited first so that
+// the true side comes right after it. Blocks that can't be reached are left
+// out. Returns false if we ran out of memory
+static bool x64_order(cnm_t *cnm, x64_t *x) {
+    const ir_func_t *const f = x->f;
+    uint32_t *const stack = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks * 2, sizeof(uint32_t));
+    x->order = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks, sizeof(uint32_t));
+    x->from = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks, sizeof(uint32_t));
+    if (!stack || !x->order || !x->from) return false;
+
+    // from marks the blocks that were visited until the positions are known
+    memset(x->from, 0xFF, sizeof(uint32_t) * f->nblocks);
+    uint32_t n = 0, done = f->nblocks;
+    stack[n++] = 0, stack[n++] = 0;
+    x->from[0] = 0;
+    while (n) {
+        const uint32_t block = stack[n - 2];
+        uint32_t succs[2];
+        const uint32_t nsuccs = ir_succs(f, block, succs);
+        if (stack[n - 1] == nsuccs) {
+            x->order[--done] = block;
+            n -= 2;
+            continue;
+        }
+        const uint32_t succ = succs[nsuccs - 1 - stack[n - 1]++];
+        if (x->from[succ] != UINT32_MAX) continue;
+        x->from[succ] = 0;
+        stack[n++] = succ, stack[n++] = 0;
+    }
+    x->norder = f->nblocks - done;
+    memmove(x->order, x->order + done, sizeof(uint32_t) * x->norder);
     return true;
 }
 
-static bool expr_parse_init_list_user(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                                      const typeref_t *type) {
-    userty_t *u = NULL;
-
-    // Optional code for unions and enums
-    if (type->type[0].class != TYPE_ARR) {
-        // Get fields and struct
-        for (u = cnm->type.types; u && u->typeid != type->type[0].n; u = u->next);
+// Put the values that are live at the end of a block into live: the ones
+// live at the start of the blocks it jumps to and the arguments of their phis
+static void x64_live_out(const x64_t *x, uint32_t block, uint64_t *live) {
+    const ir_func_t *const f = x->f;
+    uint32_t succs[2];
+    const uint32_t nsuccs = ir_succs(f, block, succs);
+    memset(live, 0, sizeof(uint64_t) * x->words);
+    for (uint32_t i = 0; i < nsuccs; i++) {
+        const ir_block_t *const b = &f->blocks[succs[i]];
+        const uint64_t *const in = x->livein + (size_t)succs[i] * x->words;
+        for (uint32_t w = 0; w < x->words; w++) live[w] |= in[w];
+        uint32_t pred = 0;
+        while (pred < b->npreds && f->args[b->preds + pred] != block) pred++;
+        if (pred == b->npreds) continue;
+        for (ir_val_t v = b->first; v < b->first + b->ninsts && f->insts[v].op == IR_PHI; v++) {
+            const ir_val_t arg = f->args[f->insts[v].a + pred];
+            if (arg) live[arg / 64] |= 1ull << arg % 64;
+        }
+    }
+}
 
-        // Optionally do enums
-        if (u->type == USER_ENUM) {
-            valref_t val;
-            if (!expr_parse(cnm, &val, gencode, gendata, PREC_FULL, NULL)) return false;
-            if (!type_is_int(val.type.type[0])) {
-                cnm_doerr(cnm, true, "you need int for enum initializer");
-                return false;
-            } else {
-                return true;
+// Work out which values are live at the start of every block, going over
+// the blocks backwards until nothing changes
+static void x64_liveness(x64_t *x, uint64_t *live) {
+    const ir_func_t *const f = x->f;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (uint32_t k = x->norder; k--;) {
+            const uint32_t i = x->order[k];
+            const ir_block_t *const b = &f->blocks[i];
+            x64_live_out(x, i, live);
+            for (ir_val_t v = b->first + b->ninsts; v-- > b->first;) {
+                const ir_inst_t *const inst = &f->insts[v];
+                live[v / 64] &= ~(1ull << v % 64);
+                if (inst->op == IR_PHI) continue;
+                const uint32_t n = ir_noperands(inst);
+                for (uint32_t j = 0; j < n; j++) {
+                    const ir_val_t o = ir_operand(f, inst, j);
+                    if (o && !x64_imm_operand(f, inst, j)) live[o / 64] |= 1ull << o % 64;
+                }
+            }
+            uint64_t *const in = x->livein + (size_t)i * x->words;
+            if (memcmp(in, live, sizeof(uint64_t) * x->words)) {
+                memcpy(in, live, sizeof(uint64_t) * x->words);
+                changed = true;
             }
         }
     }
+}
 
-    init_list_state_t state;
-    if (!init_list_init(cnm, &state, type, gencode, gendata)) return false;
-
-    // Do the field initializers!!!!!
-    while (!state.stop && cnm->s.tok.type != TOKEN_BRACE_R) {
-        if (!(init_list_field(cnm, &state, gencode, gendata))) return false;
-        if (cnm->s.tok.type == TOKEN_COMMA) token_next(cnm);
+// Split a piece at a position. The new piece takes the rest of it and is on
+// the stack until it is allocated. Returns it, or 0 if we ran out of memory
+static uint32_t x64_split(cnm_t *cnm, x64_t *x, uint32_t i, uint32_t at) {
+    if (!ir_reserve(cnm, &x->pieces, &x->piececap, x->npieces, 1, sizeof(x64_piece_t))) {
+        return 0;
     }
+    x64_piece_t *const p = &x->pieces[i];
+    x->pieces[x->npieces] = (x64_piece_t){
+        .start = at, .end = p->end, .next = p->next, .v = p->v, .loc = X64_STACK,
+    };
+    p->end = at, p->next = x->npieces;
+    return x->npieces++;
+}
 
-    if (!init_list_finish(cnm, &state, out, gencode, gendata)) return false;
+// Pieces are sorted by start in keys that have the start in the upper half
+static int x64_key_cmp(const void *a, const void *b) {
+    const uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+    return (ka > kb) - (ka < kb);
+}
 
-    if (state.cur == state.stack && u && u->type == USER_UNION
-        && state.cur->n_fields_inited > 1) {
-        cnm_doerr(cnm, false, "excess initializers in union initializer list");
-    }
+static inline uint64_t x64_key(const x64_t *x, uint32_t piece) {
+    return (uint64_t)x->pieces[piece].start << 32 | piece;
+}
 
+// Add a piece to a queue that is sorted so that the one that starts first is
+// last. Returns false if we ran out of memory
+static bool x64_enqueue(cnm_t *cnm, x64_t *x, uint64_t **queue, uint32_t *cap, uint32_t *n,
+                        uint32_t piece) {
+    if (!piece || !ir_reserve(cnm, queue, cap, *n, 1, sizeof(uint64_t))) return false;
+    const uint64_t key = x64_key(x, piece);
+    uint32_t i = (*n)++;
+    for (; i && (*queue)[i - 1] < key; i--) (*queue)[i] = (*queue)[i - 1];
+    (*queue)[i] = key;
     return true;
 }
 
-// Parse initializer list and create code and data for it
-// the cnm token should be pointing to the opening '{'
-static bool expr_init_list(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                                 const typeref_t *type) {
-    if (!type) {
-        cnm_doerr(cnm, true, "can not have initializer list here");
+// Number the instructions and give every value that is live somewhere one
+// piece from its definition to its last use, in the order the blocks are
+// emitted in. Loops make this cover everything between their start and end.
+// Returns false if we ran out of memory
+static bool x64_lifetimes(cnm_t *cnm, x64_t *x) {
+    const ir_func_t *const f = x->f;
+    const uint32_t n = f->ninsts;
+    uint32_t ncalls = 0;
+    for (ir_val_t v = 1; v < n; v++) ncalls += f->insts[v].op == IR_CALL;
+
+    // The pieces are indexed by value to collect the hulls in before they
+    // are packed, with room for about one split for every fourth value
+    x->words = (n + 63) / 64;
+    x->piececap = n + n / 4;
+    x->pieces = cnm_alloc(cnm, sizeof(x64_piece_t) * x->piececap, sizeof(uint32_t));
+    x->pos = cnm_alloc(cnm, sizeof(uint32_t) * n, sizeof(uint32_t));
+    x->first = cnm_alloc(cnm, sizeof(uint32_t) * n, sizeof(uint32_t));
+    x->calls = cnm_alloc(cnm, sizeof(uint32_t) * (ncalls ? ncalls : 1), sizeof(uint32_t));
+    x->phiuse = cnm_alloc(cnm, sizeof(ir_val_t) * n, sizeof(ir_val_t));
+    x->livein = cnm_alloc(cnm, sizeof(uint64_t) * x->words * f->nblocks, sizeof(uint64_t));
+    uint64_t *const live = cnm_alloc(cnm, sizeof(uint64_t) * x->words, sizeof(uint64_t));
+    if (!x->pieces || !x->pos || !x->first || !x->calls || !x->phiuse || !x->livein || !live) {
         return false;
     }
+    x64_piece_t *const hull = x->pieces;
+    memset(x->first, 0, sizeof(uint32_t) * n);
+    memset(x->phiuse, 0, sizeof(ir_val_t) * n);
+    memset(x->livein, 0, sizeof(uint64_t) * x->words * f->nblocks);
+
+    uint32_t at = 2;
+    for (uint32_t k = 0; k < x->norder; k++) {
+        const ir_block_t *const b = &f->blocks[x->order[k]];
+        x->from[x->order[k]] = at;
+        for (ir_val_t v = b->first; v < b->first + b->ninsts; v++, at += 2) {
+            x->pos[v] = at;
+            if (f->insts[v].op == IR_CALL) x->calls[x->ncalls++] = at;
+        }
+    }
+    x64_liveness(x, live);
+
+    for (ir_val_t v = 0; v < n; v++) {
+        hull[v] = (x64_piece_t){ .start = UINT32_MAX, .v = v, .loc = X64_STACK };
+    }
+    for (uint32_t k = 0; k < x->norder; k++) {
+        const uint32_t i = x->order[k];
+        const ir_block_t *const b = &f->blocks[i];
+        const uint32_t start = x->from[i], end = x->pos[b->first + b->ninsts - 1] + 2;
+        const uint64_t *const in = x->livein + (size_t)i * x->words;
+        x64_live_out(x, i, live);
+        for (uint32_t w = 0; w < x->words; w++) {
+            for (uint64_t bits = live[w]; bits; bits &= bits - 1) {
+                const ir_val_t v = w * 64 + __builtin_ctzll(bits);
+                if (end > hull[v].end) hull[v].end = end;
+            }
+            for (uint64_t bits = in[w]; bits; bits &= bits - 1) {
+                const ir_val_t v = w * 64 + __builtin_ctzll(bits);
+                if (start < hull[v].start) hull[v].start = start;
+                if (start + 1 > hull[v].end) hull[v].end = start + 1;
+            }
+        }
+        for (ir_val_t v = b->first; v < b->first + b->ninsts; v++) {
+            const ir_inst_t *const inst = &f->insts[v];
+            const uint32_t def = inst->op == IR_PARAM ? 0 : inst->op == IR_PHI ? start
+                : x->pos[v] + 1;
+            if (inst->type != TYPE_VOID && (x->uses[v] || inst->op != IR_CONST)) {
+                if (def < hull[v].start) hull[v].start = def;
+                if (def + 1 > hull[v].end) hull[v].end = def + 1;
+            }
+            if (inst->op == IR_PHI) {
+                for (uint32_t j = 0; j < inst->b; j++) x->phiuse[f->args[inst->a + j]] = v;
+                continue;
+            }
+            const uint32_t nops = ir_noperands(inst);
+            for (uint32_t j = 0; j < nops; j++) {
+                const ir_val_t o = ir_operand(f, inst, j);
+                if (!x64_imm_operand(f, inst, j) && x->pos[v] + 1 > hull[o].end) {
+                    hull[o].end = x->pos[v] + 1;
+                }
+            }
+        }
+    }
 
-    token_next(cnm);
+    // Pieces never move up, so this packs them in place
+    x->npieces = 1;
+    for (ir_val_t v = 1; v < n; v++) {
+        if (hull[v].end <= hull[v].start) continue;
+        x->pieces[x->npieces] = hull[v];
+        x->first[v] = x->npieces++;
+    }
+    return true;
+}
 
-    // Do POD types first if it is one
-    if (type_is_pod(type->type[0])) {
-        if (!expr_parse_init_list_pod(cnm, out, gencode, gendata, type)) return false;
-    } else if (type->type[0].class == TYPE_USER
-            || type->type[0].class == TYPE_ARR) {
-        if (!expr_parse_init_list_user(cnm, out, gencode, gendata, type)) return false;
-    } else {
-        cnm_doerr(cnm, true, "Can not initialize this type");
-        return false;
+// The register that the first piece of a value should rather get since that
+// saves moves: the one of the phi it is passed to, one of the arguments of a
+// phi, or the one of the first operand of an operation. X64_STACK if none
+static int x64_hint(const x64_t *x, const x64_piece_t *p) {
+    const ir_func_t *const f = x->f;
+    const ir_inst_t *const inst = &f->insts[p->v];
+    const ir_val_t phi = x->phiuse[p->v];
+    if (phi && x->first[phi] && x->pieces[x->first[phi]].loc != X64_STACK) {
+        return x->pieces[x->first[phi]].loc;
+    }
+    if (inst->op == IR_PHI) {
+        const ir_block_t *const b = &f->blocks[inst->c];
+        for (uint32_t i = 0; i < inst->b; i++) {
+            const uint32_t pred = f->args[b->preds + i];
+            const ir_val_t arg = f->args[inst->a + i];
+            if (!arg || x->from[pred] == UINT32_MAX) continue;
+            const ir_block_t *const pb = &f->blocks[pred];
+            const int loc = x64_loc(x, arg, x->pos[pb->first + pb->ninsts - 1]);
+            if (loc != X64_STACK) return loc;
+        }
+        return X64_STACK;
     }
+    if (inst->op == IR_CALL || inst->op == IR_CONST || inst->op == IR_GLOBAL
+        || inst->op == IR_PARAM || !ir_noperands(inst)) {
+        return X64_STACK;
+    }
+    return x64_loc(x, inst->a, p->start - 1);
+}
 
-    // Check for ending }
-    if (cnm->s.tok.type != TOKEN_BRACE_R) {
-        cnm_doerr(cnm, true, "expected } after initializer list");
-        return false;
-    }
-    token_next(cnm);
+// Linear scan register allocation. Pieces get a register in the order they
+// start, preferring one that is free for all of it. If there is none the one
+// that stays free the longest is taken, and the piece is split where it stops
+// being free so that the rest is allocated again from there. Calls clobber
+// the registers that the System V ABI doesn't preserve, so values that live
+// across a call only keep those up to it. When no register is free at all,
+// the active piece that ends last loses its register and stays on the stack
+// from there on. Returns false if we ran out of memory
+static bool x64_alloc(cnm_t *cnm, x64_t *x) {
+    const ir_func_t *const f = x->f;
+    if (!x64_order(cnm, x) || !x64_lifetimes(cnm, x)) return false;
+    uint32_t nqueue = 0, queuecap = x->piececap;
+    uint64_t *queue = cnm_alloc(cnm, sizeof(uint64_t) * queuecap, sizeof(uint64_t));
+    if (!queue) return false;
+    for (uint32_t i = 1; i < x->npieces; i++) queue[nqueue++] = ~x64_key(x, i);
+    qsort(queue, nqueue, sizeof(uint64_t), x64_key_cmp);
+    for (uint32_t i = 0; i < nqueue; i++) queue[i] = ~queue[i];
+
+    uint32_t active[arrlen(x64_gp_regs) + arrlen(x64_fp_regs)], nactive = 0, call = 0;
+    while (nqueue) {
+        const uint32_t cur = (uint32_t)queue[--nqueue];
+        const uint32_t start = x->pieces[cur].start, end = x->pieces[cur].end;
+        const bool fp = type_is_fp((type_t){ .class = f->insts[x->pieces[cur].v].type });
+        for (uint32_t i = 0; i < nactive;) {
+            if (x->pieces[active[i]].end <= start) active[i] = active[--nactive];
+            else i++;
+        }
+        while (call < x->ncalls && x->calls[call] < start) call++;
+        const uint32_t clobber = call < x->ncalls && x->calls[call] + 1 < end
+            ? x->calls[call] : UINT32_MAX;
+
+        // Find the register that is free the longest
+        const int8_t *const regs = fp ? x64_fp_regs : x64_gp_regs;
+        const uint32_t nregs = fp ? arrlen(x64_fp_regs) : arrlen(x64_gp_regs);
+        uint32_t limit = start, split = 0;
+        int reg = X64_STACK;
+        const int hint = x->first[x->pieces[cur].v] == cur ? x64_hint(x, &x->pieces[cur]) : X64_STACK;
+        bool callfree = false, hintfree = false;
+        for (uint32_t i = 0; i < nregs; i++) {
+            bool taken = false;
+            for (uint32_t j = 0; j < nactive && !taken; j++) {
+                taken = x->pieces[active[j]].loc == regs[i];
+            }
+            if (taken) continue;
+            const bool saved = regs[i] < X64_XMM && X64_CALLEE_SAVED >> regs[i] & 1;
+            const uint32_t free = clobber == UINT32_MAX || saved ? end : clobber;
+            if (free > limit) limit = free, reg = regs[i];
+            callfree |= free == start;
+            hintfree |= regs[i] == hint && free == end;
+        }
+        if (hintfree) limit = end, reg = hint;
+        if (reg != X64_STACK) {
+            if (limit < end) split = x64_split(cnm, x, cur, limit);
+        } else if (callfree) {
+            // Free registers would only be clobbered by the call it starts
+            // at, so it waits on the stack until after it
+            if (clobber + 2 < end) split = x64_split(cnm, x, cur, clobber + 2);
+        } else {
+            uint32_t victim = 0;
+            for (uint32_t j = 0; j < nactive; j++) {
+                const x64_piece_t *const p = &x->pieces[active[j]];
+                if ((p->loc >= X64_XMM) != fp) continue;
+                if (!victim || p->end > x->pieces[victim].end) victim = active[j];
+            }
+            if (!victim || x->pieces[victim].end <= end) {
+                x->pieces[cur].loc = X64_STACK;
+                continue;
+            }
 
-    return true;
+            // Nothing can be split off before the first instruction, the
+            // prologue puts the parameters where they start
+            const uint32_t at = start & ~1u;
+            reg = x->pieces[victim].loc;
+            if (x->pieces[victim].start >= at || at <= 2) {
+                x->pieces[victim].loc = X64_STACK;
+            } else if (!x64_split(cnm, x, victim, at)) {
+                return false;
+            }
+            for (uint32_t j = 0; j < nactive; j++) {
+                if (active[j] == victim) active[j] = active[--nactive];
+            }
+            const bool saved = reg < X64_XMM && X64_CALLEE_SAVED >> reg & 1;
+            if (clobber != UINT32_MAX && !saved) split = x64_split(cnm, x, cur, clobber);
+        }
+        if (split && !x64_enqueue(cnm, x, &queue, &queuecap, &nqueue, split)) return false;
+        if (reg == X64_STACK) continue;
+        x->pieces[cur].loc = reg;
+        active[nactive++] = cur;
+        if (reg < X64_XMM && X64_CALLEE_SAVED >> reg & 1) x->saved |= 1u << reg;
+    }
+
+    // The pieces that values move to in the middle of their life, by start
+    if (!ir_reserve(cnm, &queue, &queuecap, 0, x->npieces, sizeof(uint64_t))) return false;
+    for (uint32_t i = 1; i < x->npieces; i++) {
+        if (x->first[x->pieces[i].v] != i) queue[x->nsplits++] = x64_key(x, i);
+    }
+    qsort(queue, x->nsplits, sizeof(uint64_t), x64_key_cmp);
+    x->splits = (uint32_t *)queue;
+    for (uint32_t i = 0; i < x->nsplits; i++) x->splits[i] = (uint32_t)queue[i];
+    for (uint32_t reg = 0; reg < X64_XMM; reg++) x->nsaved += x->saved >> reg & 1;
+    x->moves = cnm_alloc(cnm, sizeof(x64_move_t) * ((size_t)f->ninsts + f->nargs),
+                         sizeof(uint32_t));
+    return x->moves != NULL;
 }
 
-// Group together operations into one group inbetween parentheses
-static bool expr_group(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                       const typeref_t *expected_type) {
-    // Consume the '(' token
-    const token_t errtok = cnm->s.tok;
-    token_next(cnm);
-   
-    // This might also be a cast operator so watch out
-    if (cnm_at_declspec(cnm)) return expr_cast(cnm, out, gencode, gendata, expected_type);
+// Lay the blocks out in the order they were built in and keep every value in
+// its stack slot, which is all CNM_TIER_BASELINE does before emitting.
+// Returns false if we ran out of memory
+static bool x64_layout(cnm_t *cnm, x64_t *x) {
+    const ir_func_t *const f = x->f;
+    const uint32_t n = f->ninsts;
+    x->order = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks, sizeof(uint32_t));
+    x->from = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks, sizeof(uint32_t));
+    x->pos = cnm_alloc(cnm, sizeof(uint32_t) * n, sizeof(uint32_t));
+    x->first = cnm_alloc(cnm, sizeof(uint32_t) * n, sizeof(uint32_t));
+    x->moves = cnm_alloc(cnm, sizeof(x64_move_t) * ((size_t)n + f->nargs), sizeof(uint32_t));
+    if (!x->order || !x->from || !x->pos || !x->first || !x->moves) return false;
+    memset(x->first, 0, sizeof(uint32_t) * n);
+
+    uint32_t at = 2;
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        const ir_block_t *const b = &f->blocks[i];
+        x->from[i] = UINT32_MAX;
+        if (!b->ninsts) continue;
+        x->order[x->norder++] = i;
+        x->from[i] = at;
+        for (ir_val_t v = b->first; v < b->first + b->ninsts; v++, at += 2) x->pos[v] = at;
+    }
+    return true;
+}
 
-    // Get the inner grouping
-    if (!expr_parse(cnm, out, gencode, gendata, PREC_FULL, NULL)) return false;
+// Does the work of x64_compile
+static bool x64_compile_func(cnm_t *cnm, const ir_func_t *f, void **addr) {
+    x64_t x = {
+        .start = cnm->code.ptr,
+        .p = cnm->code.ptr,
+        .end = cnm->code.buf + cnm->code.len,
+        .f = f,
+        .offs = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks, sizeof(uint32_t)),
+        .fixups = cnm_alloc(cnm, sizeof(x64_fixup_t) * f->nblocks * 2, sizeof(uint32_t)),
+        .uses = cnm_alloc(cnm, sizeof(uint32_t) * f->ninsts, sizeof(uint32_t)),
+    };
+    if (!x.offs || !x.fixups || !x.uses) return false;
+    memset(x.offs, 0xFF, sizeof(uint32_t) * f->nblocks);
+    ir_count_uses(f, x.uses);
+    for (ir_val_t v = 1; v < f->ninsts; v++) {
+        if (x64_imm_operand(f, &f->insts[v], 1)) x.uses[f->insts[v].b]--;
+    }
+    if (!(cnm->code.tier == CNM_TIER_BASELINE ? x64_layout(cnm, &x) : x64_alloc(cnm, &x))) {
+        return false;
+    }
 
-    // Consume the ')' token
-    if (cnm->s.tok.type != TOKEN_PAREN_R) {
-        cnm_doerr(cnm, true, "expected ')' after expression group");
-        cnm->s.tok = errtok;
-        cnm_doerr(cnm, false, "grouping started here");
-        return NULL;
+    x64_prologue(&x);
+    for (uint32_t k = 0; k < x.norder; k++) {
+        const uint32_t i = x.order[k];
+        const ir_block_t *const b = &f->blocks[i];
+        x.next = k + 1 < x.norder ? x.order[k + 1] : UINT32_MAX;
+        x.offs[i] = x.p - x.start;
+        for (ir_val_t v = b->first; v < b->first + b->ninsts; v++) {
+            x.at = x.pos[v];
+            x64_split_moves(&x, i);
+            x64_inst(&x, i, v);
+        }
+    }
+    if (x.full) {
+        cnm_doerr(cnm, true, "ran out of code memory");
+        return false;
+    }
+    for (uint32_t i = 0; i < x.nfixups; i++) {
+        const uint32_t d = x.offs[x.fixups[i].block] - (x.fixups[i].at + 4);
+        memcpy(x.start + x.fixups[i].at, &d, sizeof(d));
     }
-    token_next(cnm);
 
+    *addr = code_real_addr(cnm, x.start);
+    cnm->code.ptr = x.p;
     return true;
 }
 
-// Create a literal value valref for a string token
-static bool expr_str(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                     const typeref_t *expected_type) {
-    *out = (valref_t){ .isliteral = true, .type.size = 2 };
+// Lower the IR of a function to machine code at the end of the code buffer.
+// Returns false if it didn't fit or we ran out of memory
+static bool x64_compile(cnm_t *cnm, const ir_func_t *f, void **addr) {
+    // Nothing the allocator needs lives on after the function is done
+    const region_mark_t mark = cnm_mark(cnm);
+    const bool ok = x64_compile_func(cnm, f, addr);
+    cnm_release(cnm, mark);
+    return ok;
+}
 
-    // Allocate and initialize type
-    if (!(out->type.type = cnm_alloc(cnm, sizeof(type_t) * 2, sizeof(type_t)))) return false;
-    if (cnm->s.tok.suffix[0] == 'u') {
-        out->type.type[0] = (type_t){ .class = TYPE_PTR };
-        out->type.type[1] = (type_t){ .class = TYPE_UCHAR, .n = 8, .isconst = true };
-    } else if (cnm->s.tok.suffix[0] == 'U') {
-        out->type.type[0] = (type_t){ .class = TYPE_PTR };
-        out->type.type[1] = (type_t){ .class = TYPE_UINT, .n = 32, .isconst = true };
-    } else {
-        out->type.type[0] = (type_t){ .class = TYPE_PTR };
-        out->type.type[1] = (type_t){ .class = TYPE_CHAR, .n = 8, .isconst = true };
-    }
+#else
 
-    if (expected_type->type[0].class == TYPE_ARR) {
-        out->type.type[0].class = TYPE_ARR;
-        out->type.type[0].n = token_strlen(&cnm->s.tok) + 1;
-        out->type.type[1].isconst = false;
+static bool x64_compile(cnm_t *cnm, const ir_func_t *f, void **addr) {
+    cnm_doerr(cnm, true, "there is no code generator for this architecture");
+    return false;
+}
 
-        size_t align = 1;
-        size_t size = out->type.type[0].n;
-        if (cnm->s.tok.suffix[0] == 'U') {
-            size *= 4;
-            align = 4;
-        }
-        void *area = cnm_alloc_global(cnm, size, align);
-        memcpy(area, cnm->s.tok.s, size);
+#endif
+
+// Portable interpreter for when the code buffer can't be executable. The IR of
+// a function is translated to direct threaded code in the code buffer, which
+// is only ever read as data: every instruction starts with the address of the
+// code that runs it (or its opcode if computed goto isn't there) and operands
+// are slots of a frame that has one value per IR instruction plus temporaries
+// for the phi copies. Values are kept like in the native backend, integers
+// sign or zero extended to 64 bits. External functions are called with the
+// integer and floating point arguments in two separate lists, which matches
+// how the register based ABIs below pass them.
+
+#if defined(__GNUC__) && !defined(CNM_INTERP_SWITCH)
+#define INTERP_THREADED
+#endif
+#if (defined(__x86_64__) && !defined(_WIN32)) || defined(__aarch64__)
+#define INTERP_XCALL
+#define INTERP_XCALL_INTS 6
+#define INTERP_XCALL_FPS 8
+#endif
+
+// Integer operations come in versions that extend the result from 32 bits and
+// ones that work on all 64. Only the ones where the sign matters have a
+// separate unsigned 64 bit version. Comparisons are either signed, unsigned or
+// floating point
+#define INTERP_INT3(X, op) X(op##_I32) X(op##_U32) X(op##_I64)
+#define INTERP_INT4(X, op) INTERP_INT3(X, op) X(op##_U64)
+#define INTERP_FP(X, op) X(op##_F32) X(op##_F64)
+#define INTERP_CMP(X, op) X(op##_I) X(op##_U) X(op##_F32) X(op##_F64)
+#define INTERP_OPS(X) \
+    X(CONST) X(CONST_F32) X(MOV) X(PARAM) \
+    X(LOAD_I8) X(LOAD_U8) X(LOAD_I16) X(LOAD_U16) X(LOAD_I32) X(LOAD_U32) \
+    X(LOAD_F32) X(LOAD_64) \
+    X(STORE_8) X(STORE_16) X(STORE_32) X(STORE_F32) X(STORE_64) \
+    INTERP_INT3(X, ADD) INTERP_INT3(X, SUB) INTERP_INT3(X, MUL) \
+    INTERP_INT4(X, DIV) INTERP_INT4(X, MOD) \
+    INTERP_INT3(X, AND) INTERP_INT3(X, OR) INTERP_INT3(X, XOR) \
+    INTERP_INT3(X, SHL) INTERP_INT4(X, SHR) \
+    INTERP_FP(X, FADD) INTERP_FP(X, FSUB) INTERP_FP(X, FMUL) INTERP_FP(X, FDIV) \
+    INTERP_CMP(X, EQ) INTERP_CMP(X, NE) INTERP_CMP(X, LT) \
+    INTERP_CMP(X, LE) INTERP_CMP(X, GT) INTERP_CMP(X, GE) \
+    INTERP_CMP(X, JEQ) INTERP_CMP(X, JNE) INTERP_CMP(X, JLT) \
+    INTERP_CMP(X, JLE) INTERP_CMP(X, JGT) INTERP_CMP(X, JGE) \
+    INTERP_INT3(X, NEG) INTERP_FP(X, FNEG) INTERP_INT3(X, BNOT) \
+    X(NOT_I) INTERP_FP(X, NOT) X(BOOL_I) INTERP_FP(X, BOOL) \
+    X(EXT_I8) X(EXT_U8) X(EXT_I16) X(EXT_U16) X(EXT_I32) X(EXT_U32) \
+    X(I2F32) X(I2F64) X(U2F32) X(U2F64) X(F32_2I) X(F64_2I) X(F32_2U) X(F64_2U) \
+    X(F32_2F64) X(F64_2F32) \
+    X(CALL) X(CALLX) X(JMP) X(BRT) X(RET) X(RETV)
+
+typedef enum interp_op_e {
+#define X(name) INTERP_##name,
+    INTERP_OPS(X)
+#undef X
+} interp_op_t;
+
+// Offsets from the first version of an operation
+enum { INTERP_V_I32, INTERP_V_U32, INTERP_V_I64, INTERP_V_U64 };
+enum { INTERP_C_I, INTERP_C_U, INTERP_C_F32, INTERP_C_F64 };
+
+// One instruction. Jumps go to the instruction at index c. Calls take up
+// interp_call_len instructions: the second one's op is the function that is
+// called and the arguments follow as slot indices
+typedef struct interp_inst_s {
+    const void *op;
+    uint32_t dst, a, b, c;
+} interp_inst_t;
+
+// Arguments of external calls have their class in the top bits of the slot
+#define INTERP_ARG_F64 0x80000000u
+#define INTERP_ARG_F32 0x40000000u
+#define INTERP_ARG_SLOT 0x3FFFFFFFu
+
+// What external calls return
+enum { INTERP_RET_INT, INTERP_RET_F64, INTERP_RET_F32 };
+
+static inline uint32_t interp_call_len(uint32_t nargs) {
+    const uint32_t per = sizeof(interp_inst_t) / sizeof(uint32_t);
+    return 2 + (nargs + per - 1) / per;
+}
 
-        out->literal.addr = area;
+#ifdef INTERP_THREADED
+static const void *const *interp_labels;
+#endif
+
+// Run the threaded code of a function. The first instruction of a function is
+// a header whose dst is how many slots its frame has. With a NULL function,
+// this only sets interp_labels
+static cnm_val_t interp_exec(const interp_inst_t *fn, const cnm_val_t *args) {
+#ifdef INTERP_THREADED
+    static const void *const labels[] = {
+#define X(name) [INTERP_##name] = &&l_##name,
+        INTERP_OPS(X)
+#undef X
+    };
+    if (!fn) {
+        interp_labels = labels;
+        return (cnm_val_t){ 0 };
+    }
+#define INTERP_CASE(name) l_##name:
+#define INTERP_DISPATCH() goto *ip->op
+#else
+#define INTERP_CASE(name) case INTERP_##name:
+#define INTERP_DISPATCH() continue
+#endif
+
+    const interp_inst_t *const code = fn + 1;
+    const interp_inst_t *ip = code;
+    cnm_val_t s[fn->dst];
+
+#define INTERP_PTR(v) ((void *)(uintptr_t)(v).u)
+// No do while (0) around these since continue has to reach the switch loop
+#define INTERP_NEXT(n) { ip += (n); INTERP_DISPATCH(); }
+#define INTERP_SET(field, e) { s[ip->dst].field = (e); INTERP_NEXT(1); }
+
+    // Integer operations with a and b as their unsigned 64 bit operands. x is
+    // the signed version of the expression and y the unsigned one
+#define INTERP_ARITH3(op, e) \
+    INTERP_CASE(op##_I32) { const uint64_t a = s[ip->a].u, b = s[ip->b].u; \
+        INTERP_SET(i, (int32_t)(e)); } \
+    INTERP_CASE(op##_U32) { const uint64_t a = s[ip->a].u, b = s[ip->b].u; \
+        INTERP_SET(u, (uint32_t)(e)); } \
+    INTERP_CASE(op##_I64) { const uint64_t a = s[ip->a].u, b = s[ip->b].u; \
+        INTERP_SET(u, (e)); }
+#define INTERP_ARITH4(op, x, y) \
+    INTERP_CASE(op##_I32) { const int64_t a = s[ip->a].i, b = s[ip->b].i; \
+        INTERP_SET(i, (int32_t)(x)); } \
+    INTERP_CASE(op##_U32) { const uint64_t a = s[ip->a].u, b = s[ip->b].u; \
+        INTERP_SET(u, (uint32_t)(y)); } \
+    INTERP_CASE(op##_I64) { const int64_t a = s[ip->a].i, b = s[ip->b].i; \
+        INTERP_SET(i, (x)); } \
+    INTERP_CASE(op##_U64) { const uint64_t a = s[ip->a].u, b = s[ip->b].u; \
+        INTERP_SET(u, (y)); }
+#define INTERP_FARITH(op, o) \
+    INTERP_CASE(op##_F32) INTERP_SET(f, s[ip->a].f o s[ip->b].f); \
+    INTERP_CASE(op##_F64) INTERP_SET(d, s[ip->a].d o s[ip->b].d);
+
+    // Comparisons store a bool, the jumping versions go to c if it is true
+#define INTERP_COMPARE(op, o) \
+    INTERP_CASE(op##_I) INTERP_SET(u, s[ip->a].i o s[ip->b].i); \
+    INTERP_CASE(op##_U) INTERP_SET(u, s[ip->a].u o s[ip->b].u); \
+    INTERP_CASE(op##_F32) INTERP_SET(u, s[ip->a].f o s[ip->b].f); \
+    INTERP_CASE(op##_F64) INTERP_SET(u, s[ip->a].d o s[ip->b].d); \
+    INTERP_CASE(J##op##_I) { ip = s[ip->a].i o s[ip->b].i ? code + ip->c : ip + 1; \
+        INTERP_DISPATCH(); } \
+    INTERP_CASE(J##op##_U) { ip = s[ip->a].u o s[ip->b].u ? code + ip->c : ip + 1; \
+        INTERP_DISPATCH(); } \
+    INTERP_CASE(J##op##_F32) { ip = s[ip->a].f o s[ip->b].f ? code + ip->c : ip + 1; \
+        INTERP_DISPATCH(); } \
+    INTERP_CASE(J##op##_F64) { ip = s[ip->a].d o s[ip->b].d ? code + ip->c : ip + 1; \
+        INTERP_DISPATCH(); }
+
+#define INTERP_LOAD(name, type, field) \
+    INTERP_CASE(name) { type v; memcpy(&v, INTERP_PTR(s[ip->a]), sizeof(v)); \
+        INTERP_SET(field, v); }
+#define INTERP_STORE(name, type, field) \
+    INTERP_CASE(name) { const type v = s[ip->b].field; \
+        memcpy(INTERP_PTR(s[ip->a]), &v, sizeof(v)); INTERP_NEXT(1); }
+
+#ifdef INTERP_THREADED
+    INTERP_DISPATCH();
+#else
+    for (;;) switch ((interp_op_t)(uintptr_t)ip->op) {
+#endif
+    INTERP_CASE(CONST) INTERP_SET(u, (uint64_t)ip->c << 32 | ip->b);
+    INTERP_CASE(CONST_F32) {
+        const uint32_t bits = ip->b;
+        memcpy(&s[ip->dst].f, &bits, sizeof(bits));
+        INTERP_NEXT(1);
+    }
+    INTERP_CASE(MOV) INTERP_SET(u, s[ip->a].u);
+    INTERP_CASE(PARAM) { s[ip->dst] = args[ip->a]; INTERP_NEXT(1); }
+
+    INTERP_LOAD(LOAD_I8, int8_t, i)
+    INTERP_LOAD(LOAD_U8, uint8_t, u)
+    INTERP_LOAD(LOAD_I16, int16_t, i)
+    INTERP_LOAD(LOAD_U16, uint16_t, u)
+    INTERP_LOAD(LOAD_I32, int32_t, i)
+    INTERP_LOAD(LOAD_U32, uint32_t, u)
+    INTERP_LOAD(LOAD_F32, float, f)
+    INTERP_LOAD(LOAD_64, uint64_t, u)
+    INTERP_STORE(STORE_8, uint8_t, u)
+    INTERP_STORE(STORE_16, uint16_t, u)
+    INTERP_STORE(STORE_32, uint32_t, u)
+    INTERP_STORE(STORE_F32, float, f)
+    INTERP_STORE(STORE_64, uint64_t, u)
+
+    // Shift counts are masked like the native backend does
+    INTERP_ARITH3(ADD, a + b)
+    INTERP_ARITH3(SUB, a - b)
+    INTERP_ARITH3(MUL, a * b)
+    INTERP_ARITH4(DIV, a / b, a / b)
+    INTERP_ARITH4(MOD, a % b, a % b)
+    INTERP_ARITH3(AND, a & b)
+    INTERP_ARITH3(OR, a | b)
+    INTERP_ARITH3(XOR, a ^ b)
+    INTERP_ARITH3(SHL, a << (b & 63))
+    INTERP_ARITH4(SHR, a >> (b & 63), a >> (b & 63))
+    INTERP_FARITH(FADD, +)
+    INTERP_FARITH(FSUB, -)
+    INTERP_FARITH(FMUL, *)
+    INTERP_FARITH(FDIV, /)
+
+    INTERP_COMPARE(EQ, ==)
+    INTERP_COMPARE(NE, !=)
+    INTERP_COMPARE(LT, <)
+    INTERP_COMPARE(LE, <=)
+    INTERP_COMPARE(GT, >)
+    INTERP_COMPARE(GE, >=)
+
+    INTERP_CASE(NEG_I32) INTERP_SET(i, (int32_t)(0 - s[ip->a].u));
+    INTERP_CASE(NEG_U32) INTERP_SET(u, (uint32_t)(0 - s[ip->a].u));
+    INTERP_CASE(NEG_I64) INTERP_SET(u, 0 - s[ip->a].u);
+    INTERP_CASE(FNEG_F32) INTERP_SET(f, -s[ip->a].f);
+    INTERP_CASE(FNEG_F64) INTERP_SET(d, -s[ip->a].d);
+    INTERP_CASE(BNOT_I32) INTERP_SET(i, (int32_t)~s[ip->a].u);
+    INTERP_CASE(BNOT_U32) INTERP_SET(u, (uint32_t)~s[ip->a].u);
+    INTERP_CASE(BNOT_I64) INTERP_SET(u, ~s[ip->a].u);
+    INTERP_CASE(NOT_I) INTERP_SET(u, !s[ip->a].u);
+    INTERP_CASE(NOT_F32) INTERP_SET(u, !s[ip->a].f);
+    INTERP_CASE(NOT_F64) INTERP_SET(u, !s[ip->a].d);
+    INTERP_CASE(BOOL_I) INTERP_SET(u, s[ip->a].u != 0);
+    INTERP_CASE(BOOL_F32) INTERP_SET(u, s[ip->a].f != 0);
+    INTERP_CASE(BOOL_F64) INTERP_SET(u, s[ip->a].d != 0);
+
+    INTERP_CASE(EXT_I8) INTERP_SET(i, (int8_t)s[ip->a].u);
+    INTERP_CASE(EXT_U8) INTERP_SET(u, (uint8_t)s[ip->a].u);
+    INTERP_CASE(EXT_I16) INTERP_SET(i, (int16_t)s[ip->a].u);
+    INTERP_CASE(EXT_U16) INTERP_SET(u, (uint16_t)s[ip->a].u);
+    INTERP_CASE(EXT_I32) INTERP_SET(i, (int32_t)s[ip->a].u);
+    INTERP_CASE(EXT_U32) INTERP_SET(u, (uint32_t)s[ip->a].u);
+
+    // Floats too big for a signed 64 bit integer are converted with 2^63 taken
+    // off like the native backend does
+    INTERP_CASE(I2F32) INTERP_SET(f, (float)s[ip->a].i);
+    INTERP_CASE(I2F64) INTERP_SET(d, (double)s[ip->a].i);
+    INTERP_CASE(U2F32) INTERP_SET(f, (float)s[ip->a].u);
+    INTERP_CASE(U2F64) INTERP_SET(d, (double)s[ip->a].u);
+    INTERP_CASE(F32_2I) INTERP_SET(i, (int64_t)s[ip->a].f);
+    INTERP_CASE(F64_2I) INTERP_SET(i, (int64_t)s[ip->a].d);
+    INTERP_CASE(F32_2U) {
+        const float v = s[ip->a].f;
+        INTERP_SET(u, v < 0x1p63f ? (uint64_t)(int64_t)v
+                                  : (uint64_t)(int64_t)(v - 0x1p63f) ^ UINT64_C(1) << 63);
+    }
+    INTERP_CASE(F64_2U) {
+        const double v = s[ip->a].d;
+        INTERP_SET(u, v < 0x1p63 ? (uint64_t)(int64_t)v
+                                 : (uint64_t)(int64_t)(v - 0x1p63) ^ UINT64_C(1) << 63);
+    }
+    INTERP_CASE(F32_2F64) INTERP_SET(d, s[ip->a].f);
+    INTERP_CASE(F64_2F32) INTERP_SET(f, (float)s[ip->a].d);
+
+    INTERP_CASE(CALL) {
+        const uint32_t *const argslots = (const uint32_t *)(ip + 2);
+        cnm_val_t argv[MAX_FN_PARAMS];
+        for (uint32_t i = 0; i < ip->a; i++) argv[i] = s[argslots[i]];
+        s[ip->dst] = interp_exec(ip[1].op, argv);
+        INTERP_NEXT(interp_call_len(ip->a));
+    }
+    INTERP_CASE(CALLX) {
+#ifdef INTERP_XCALL
+        typedef int64_t (*xcall_int_t)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+                                       double, double, double, double,
+                                       double, double, double, double);
+        typedef double (*xcall_fp_t)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+                                     double, double, double, double,
+                                     double, double, double, double);
+
+        // A float goes in the low bits of its register
+        const uint32_t *const argslots = (const uint32_t *)(ip + 2);
+        int64_t ints[INTERP_XCALL_INTS] = { 0 };
+        double fps[INTERP_XCALL_FPS] = { 0 };
+        uint32_t nint = 0, nfp = 0;
+        for (uint32_t i = 0; i < ip->a; i++) {
+            const cnm_val_t v = s[argslots[i] & INTERP_ARG_SLOT];
+            if (argslots[i] & INTERP_ARG_F32) memcpy(&fps[nfp++], &v.f, sizeof(v.f));
+            else if (argslots[i] & INTERP_ARG_F64) fps[nfp++] = v.d;
+            else ints[nint++] = v.i;
+        }
+        if (ip->b == INTERP_RET_INT) {
+            s[ip->dst].i = ((xcall_int_t)ip[1].op)(ints[0], ints[1], ints[2], ints[3],
+                                                   ints[4], ints[5], fps[0], fps[1], fps[2],
+                                                   fps[3], fps[4], fps[5], fps[6], fps[7]);
+        } else {
+            const double d = ((xcall_fp_t)ip[1].op)(ints[0], ints[1], ints[2], ints[3],
+                                                    ints[4], ints[5], fps[0], fps[1], fps[2],
+                                                    fps[3], fps[4], fps[5], fps[6], fps[7]);
+            if (ip->b == INTERP_RET_F64) s[ip->dst].d = d;
+            else memcpy(&s[ip->dst].f, &d, sizeof(float));
+        }
+#endif
+        INTERP_NEXT(interp_call_len(ip->a));
+    }
+    INTERP_CASE(JMP) { ip = code + ip->c; INTERP_DISPATCH(); }
+    INTERP_CASE(BRT) { ip = s[ip->a].u ? code + ip->c : ip + 1; INTERP_DISPATCH(); }
+    INTERP_CASE(RET) return s[ip->a];
+    INTERP_CASE(RETV) return (cnm_val_t){ 0 };
+#ifndef INTERP_THREADED
+    }
+#endif
+
+#undef INTERP_CASE
+#undef INTERP_DISPATCH
+#undef INTERP_PTR
+#undef INTERP_NEXT
+#undef INTERP_SET
+#undef INTERP_ARITH3
+#undef INTERP_ARITH4
+#undef INTERP_FARITH
+#undef INTERP_COMPARE
+#undef INTERP_LOAD
+#undef INTERP_STORE
+}
 
-        if (!array_init_grow_size(cnm, &out->type, expected_type)) return false;
-    } else {
-        // Set the pointer
-        out->literal.addr = cnm->s.tok.s;
+#ifdef INTERP_THREADED
+// Fill in interp_labels once before main, like lex_scanners_init
+__attribute__((constructor)) static void interp_labels_init(void) {
+    interp_exec(NULL, NULL);
+}
+#endif
+
+// How a value of a class is kept and operated on
+typedef enum interp_kind_e {
+    INTERP_K_I8,    INTERP_K_U8,
+    INTERP_K_I16,   INTERP_K_U16,
+    INTERP_K_I32,   INTERP_K_U32,
+    INTERP_K_I64,   INTERP_K_U64,
+    INTERP_K_F32,   INTERP_K_F64,
+} interp_kind_t;
+
+static interp_kind_t interp_kind(typeclass_t class) {
+    if (class == TYPE_FLOAT) return INTERP_K_F32;
+    if (class == TYPE_DOUBLE) return INTERP_K_F64;
+    const bool u = type_is_unsigned((type_t){ .class = class })
+        || class == TYPE_BOOL || class == TYPE_PTR;
+    switch (type_getinf(NULL, &(type_t){ .class = class }).size) {
+    case 1: return u ? INTERP_K_U8 : INTERP_K_I8;
+    case 2: return u ? INTERP_K_U16 : INTERP_K_I16;
+    case 4: return u ? INTERP_K_U32 : INTERP_K_I32;
+    default: return u ? INTERP_K_U64 : INTERP_K_I64;
     }
+}
 
-    token_next(cnm);
+static inline bool interp_kind_unsigned(interp_kind_t k) {
+    return k == INTERP_K_U8 || k == INTERP_K_U16 || k == INTERP_K_U32 || k == INTERP_K_U64;
+}
 
-    return true;
+// Which version of an integer operation to use for a kind. Narrower kinds use
+// the 64 bit ones and are extended after
+static uint32_t interp_variant(interp_kind_t k, bool has_u64) {
+    if (k == INTERP_K_I32) return INTERP_V_I32;
+    if (k == INTERP_K_U32) return INTERP_V_U32;
+    return interp_kind_unsigned(k) && has_u64 ? INTERP_V_U64 : INTERP_V_I64;
 }
 
-// Create a literal value valref for a character token
-static bool expr_char(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                      const typeref_t *expected_type) {
-    *out = (valref_t){ .isliteral = true, .type.size = 1 };
+static inline uint32_t interp_cmp_variant(interp_kind_t k) {
+    if (k == INTERP_K_F32) return INTERP_C_F32;
+    if (k == INTERP_K_F64) return INTERP_C_F64;
+    return interp_kind_unsigned(k) ? INTERP_C_U : INTERP_C_I;
+}
 
-    // Allocate and initialize type
-    if (!(out->type.type = cnm_alloc(cnm, sizeof(type_t), sizeof(type_t)))) return false;
-    if (cnm->s.tok.suffix[0] == 'u') {
-        *out->type.type = (type_t){ .class = TYPE_UCHAR, .n = 8 };
-    } else if (cnm->s.tok.suffix[0] == 'U') {
-        *out->type.type = (type_t){ .class = TYPE_UINT, .n = 32 };
+// Integer and floating point versions of the binary operations. Integer ones
+// with an unsigned 64 bit version have it in the table
+static const uint8_t interp_int_ops[IR_OP_COUNT] = {
+    [IR_ADD] = INTERP_ADD_I32, [IR_SUB] = INTERP_SUB_I32, [IR_MUL] = INTERP_MUL_I32,
+    [IR_DIV] = INTERP_DIV_I32, [IR_MOD] = INTERP_MOD_I32, [IR_AND] = INTERP_AND_I32,
+    [IR_OR] = INTERP_OR_I32, [IR_XOR] = INTERP_XOR_I32, [IR_SHL] = INTERP_SHL_I32,
+    [IR_SHR] = INTERP_SHR_I32,
+};
+static const bool interp_has_u64[IR_OP_COUNT] = {
+    [IR_DIV] = true, [IR_MOD] = true, [IR_SHR] = true,
+};
+static const uint8_t interp_fp_ops[IR_OP_COUNT] = {
+    [IR_ADD] = INTERP_FADD_F32, [IR_SUB] = INTERP_FSUB_F32,
+    [IR_MUL] = INTERP_FMUL_F32, [IR_DIV] = INTERP_FDIV_F32,
+};
+static const uint8_t interp_cmp_ops[IR_GE - IR_EQ + 1][2] = {
+    [IR_EQ - IR_EQ] = { INTERP_EQ_I, INTERP_JEQ_I },
+    [IR_NE - IR_EQ] = { INTERP_NE_I, INTERP_JNE_I },
+    [IR_LT - IR_EQ] = { INTERP_LT_I, INTERP_JLT_I },
+    [IR_LE - IR_EQ] = { INTERP_LE_I, INTERP_JLE_I },
+    [IR_GT - IR_EQ] = { INTERP_GT_I, INTERP_JGT_I },
+    [IR_GE - IR_EQ] = { INTERP_GE_I, INTERP_JGE_I },
+};
+
+// Jump to a block whose index isn't known yet. at is the jump instruction
+typedef struct interp_fixup_s {
+    uint32_t at, block;
+} interp_fixup_t;
+
+typedef struct interp_s {
+    interp_inst_t *start, *p, *end;
+    bool full; // Set when the code didn't fit, p stops moving
+
+    const ir_func_t *f;
+    const uint8_t *lo, *hi; // Where functions of the interpreter are run from
+    uint32_t *uses; // How many times each value is used
+    uint32_t *offs; // Index of every block, UINT32_MAX until it is emitted
+    interp_fixup_t *fixups;
+    uint32_t nfixups;
+    uint32_t next; // Block emitted after the current one, jumps to it are left out
+    uint32_t temps; // First slot after the values, used for phi copies
+} interp_t;
+
+static inline const void *interp_opaddr(interp_op_t op) {
+#ifdef INTERP_THREADED
+    return interp_labels[op];
+#else
+    return (const void *)(uintptr_t)op;
+#endif
+}
+
+// Emit an instruction and return its index
+static uint32_t interp_emit(interp_t *in, interp_op_t op, uint32_t dst, uint32_t a,
+                            uint32_t b, uint32_t c) {
+    const uint32_t at = in->p - in->start;
+    if (in->p < in->end) {
+        *in->p++ = (interp_inst_t){ .op = interp_opaddr(op), .dst = dst, .a = a, .b = b, .c = c };
     } else {
-        *out->type.type = (type_t){ .class = TYPE_INT, .n = 32 };
+        in->full = true;
     }
+    return at;
+}
 
-    // Set char
-    out->literal.c = cnm->s.tok.c;
+// Extend v in place if its kind is narrower than 64 bits
+static void interp_extend(interp_t *in, interp_kind_t k, ir_val_t v) {
+    static const uint8_t exts[] = {
+        [INTERP_K_I8] = INTERP_EXT_I8, [INTERP_K_U8] = INTERP_EXT_U8,
+        [INTERP_K_I16] = INTERP_EXT_I16, [INTERP_K_U16] = INTERP_EXT_U16,
+        [INTERP_K_I32] = INTERP_EXT_I32, [INTERP_K_U32] = INTERP_EXT_U32,
+    };
+    if (k < arrlen(exts)) interp_emit(in, exts[k], v, v, 0, 0);
+}
 
-    // Goto next token for rest of expression
-    token_next(cnm);
+// Point the jump at index at to a block
+static void interp_target(interp_t *in, uint32_t at, uint32_t block) {
+    if (in->offs[block] != UINT32_MAX) {
+        if (!in->full) in->start[at].c = in->offs[block];
+        return;
+    }
+    in->fixups[in->nfixups++] = (interp_fixup_t){ .at = at, .block = block };
+}
 
-    return true;
+// Jump to a block, unless it is the next one and elide is set
+static void interp_jmp(interp_t *in, uint32_t block, bool elide) {
+    if (elide && block == in->next) return;
+    interp_target(in, interp_emit(in, INTERP_JMP, 0, 0, 0, 0), block);
 }
 
-// Create a literal value valref for the integer
-static bool expr_int(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                     const typeref_t *expected_type) {
-    *out = (valref_t){ .isliteral = true };
+// Whether going from one block to another needs copies for phis
+static bool interp_edge_copies(const interp_t *in, uint32_t to) {
+    const ir_block_t *const b = &in->f->blocks[to];
+    return b->ninsts && in->f->insts[b->first].op == IR_PHI;
+}
 
-    // Allocate type
-    if (!(out->type.type = cnm_alloc(cnm, sizeof(type_t), sizeof(type_t)))) return false;
-    out->type.size = 1;
+// Copy the arguments of the phis of a block for the edge from another block.
+// If a phi uses another phi of the block the copies have to happen at once,
+// so they go through temporaries
+static void interp_edge(interp_t *in, uint32_t from, uint32_t to) {
+    const ir_func_t *const f = in->f;
+    const ir_block_t *const b = &f->blocks[to];
+    uint32_t pred = 0;
+    while (pred < b->npreds && f->args[b->preds + pred] != from) pred++;
+    if (pred == b->npreds) return;
+
+    ir_val_t end = b->first;
+    bool temps = false;
+    while (end < b->first + b->ninsts && f->insts[end].op == IR_PHI) end++;
+    for (ir_val_t v = b->first; v < end; v++) {
+        const ir_val_t arg = f->args[f->insts[v].a + pred];
+        temps |= arg != v && arg >= b->first && arg < end;
+    }
+    for (ir_val_t v = b->first; v < end; v++) {
+        const ir_val_t arg = f->args[f->insts[v].a + pred];
+        if (!arg || arg == v) continue;
+        interp_emit(in, INTERP_MOV, temps ? in->temps + (v - b->first) : v, arg, 0, 0);
+    }
+    for (ir_val_t v = b->first; temps && v < end; v++) {
+        const ir_val_t arg = f->args[f->insts[v].a + pred];
+        if (!arg || arg == v) continue;
+        interp_emit(in, INTERP_MOV, v, in->temps + (v - b->first), 0, 0);
+    }
+}
 
-    // Get minimum allowed type by suffix
-    typeclass_t mintype = TYPE_INT;
-    if (cnm->s.tok.suffix[0] == 'u') {
-        mintype = TYPE_UINT;
-        if (cnm->s.tok.suffix[1] == 'l') {
-            mintype = TYPE_ULONG;
-            if (cnm->s.tok.suffix[2] == 'l') {
-                mintype = TYPE_ULLONG;
-            }
-        }
-    } else if (cnm->s.tok.suffix[0] == 'l') {
-        mintype = TYPE_LONG;
-        if (cnm->s.tok.suffix[1] == 'l') {
-            mintype = TYPE_LLONG;
-        }
+static void interp_cast(interp_t *in, const ir_inst_t *inst, ir_val_t v) {
+    const interp_kind_t from = interp_kind(in->f->insts[inst->a].type);
+    const bool fp_from = from >= INTERP_K_F32;
+    if (inst->type == TYPE_BOOL) {
+        interp_emit(in, fp_from ? INTERP_BOOL_F32 + (from == INTERP_K_F64) : INTERP_BOOL_I,
+                    v, inst->a, 0, 0);
+        return;
+    }
+
+    const interp_kind_t to = interp_kind(inst->type);
+    const bool fp_to = to >= INTERP_K_F32;
+    if (fp_from && fp_to) {
+        interp_emit(in, from == to ? INTERP_MOV
+                        : from == INTERP_K_F32 ? INTERP_F32_2F64 : INTERP_F64_2F32,
+                    v, inst->a, 0, 0);
+    } else if (fp_from) {
+        const bool u = to == INTERP_K_U64;
+        interp_emit(in, from == INTERP_K_F32 ? (u ? INTERP_F32_2U : INTERP_F32_2I)
+                                             : (u ? INTERP_F64_2U : INTERP_F64_2I),
+                    v, inst->a, 0, 0);
+        interp_extend(in, to, v);
+    } else if (fp_to) {
+        const bool u = from == INTERP_K_U64;
+        interp_emit(in, to == INTERP_K_F32 ? (u ? INTERP_U2F32 : INTERP_I2F32)
+                                           : (u ? INTERP_U2F64 : INTERP_I2F64),
+                    v, inst->a, 0, 0);
+    } else {
+        interp_emit(in, INTERP_MOV, v, inst->a, 0, 0);
+        interp_extend(in, to, v);
     }
+}
 
-    const bool allow_u = cnm->s.tok.suffix[0] == 'u' || cnm->s.tok.i.base != 10;
+// Calls to functions in the code buffer run them with the interpreter, others
+// are external and called natively. Returns false if that isn't possible
+static bool interp_call(cnm_t *cnm, interp_t *in, const ir_inst_t *inst, ir_val_t v) {
+    const ir_func_t *const f = in->f;
+    const ir_inst_t *const callee = &f->insts[inst->a];
+    const uint8_t *const addr = (const uint8_t *)(uintptr_t)ir_imm(callee);
+    const bool internal = callee->op == IR_CONST && addr >= in->lo && addr < in->hi;
+    const uint32_t *const args = f->args + inst->b;
+    const interp_kind_t ret = inst->type == TYPE_VOID ? INTERP_K_I64 : interp_kind(inst->type);
+
+    uint32_t ret_kind = INTERP_RET_INT;
+    if (ret == INTERP_K_F64) ret_kind = INTERP_RET_F64;
+    else if (ret == INTERP_K_F32) ret_kind = INTERP_RET_F32;
+    interp_emit(in, internal ? INTERP_CALL : INTERP_CALLX, v, inst->c, ret_kind, 0);
+
+    interp_inst_t *const fn = in->p;
+    const uint32_t len = interp_call_len(inst->c);
+    if (in->end - in->p < len - 1) {
+        in->full = true;
+        return true;
+    }
+    memset(fn, 0, sizeof(interp_inst_t) * (len - 1));
+    in->p += len - 1;
+    uint32_t *const slots = (uint32_t *)(fn + 1);
+    if (internal) {
+        fn->op = addr;
+        if (inst->c) memcpy(slots, args, sizeof(uint32_t) * inst->c);
+        return true;
+    }
 
-    // Find smallest type that can represent the number and is bigger than the
-    // minimum allowed type
-    switch (mintype) {
-    case TYPE_INT:
-        if (cnm->s.tok.i.n <= INT_MAX && cnm->s.tok.suffix[0] != 'u') {
-            out->type.type[0] = (type_t){ .class = TYPE_INT, .n = 32 };
-            out->literal.i = cnm->s.tok.i.n;
-            token_next(cnm); // Continue to next part in expression
-            return true;
+#ifdef INTERP_XCALL
+    if (callee->op != IR_CONST) {
+        cnm_doerr(cnm, true, "the interpreter can only call functions by their address");
+        return false;
+    }
+    uint32_t nint = 0, nfp = 0;
+    for (uint32_t i = 0; i < inst->c; i++) {
+        const interp_kind_t k = interp_kind(f->insts[args[i]].type);
+        slots[i] = args[i];
+        if (k == INTERP_K_F32) slots[i] |= INTERP_ARG_F32, nfp++;
+        else if (k == INTERP_K_F64) slots[i] |= INTERP_ARG_F64, nfp++;
+        else nint++;
+    }
+    if (nint > INTERP_XCALL_INTS || nfp > INTERP_XCALL_FPS) {
+        cnm_doerr(cnm, true, "too many arguments to call an external function from the interpreter");
+        return false;
+    }
+    fn->op = (const void *)(uintptr_t)ir_imm(callee);
+    if (inst->type != TYPE_VOID) interp_extend(in, ret, v);
+    return true;
+#else
+    cnm_doerr(cnm, true, "the interpreter can't call external functions on this architecture");
+    return false;
+#endif
+}
+
+static bool interp_inst(cnm_t *cnm, interp_t *in, uint32_t block, ir_val_t v) {
+    const ir_func_t *const f = in->f;
+    const ir_inst_t *const inst = &f->insts[v];
+
+    switch ((ir_op_t)inst->op) {
+    case IR_NOP: case IR_PHI: case IR_OP_COUNT:
+        // Phis are copied on the edges
+        break;
+    case IR_CONST: case IR_GLOBAL:
+        // Already set at the start (see interp_compile)
+        break;
+    case IR_PARAM:
+        // The upper bits of narrow parameters from the host aren't trusted
+        interp_emit(in, INTERP_PARAM, v, inst->a, 0, 0);
+        interp_extend(in, interp_kind(inst->type), v);
+        break;
+    case IR_LOAD: {
+        static const uint8_t loads[] = {
+            [INTERP_K_I8] = INTERP_LOAD_I8, [INTERP_K_U8] = INTERP_LOAD_U8,
+            [INTERP_K_I16] = INTERP_LOAD_I16, [INTERP_K_U16] = INTERP_LOAD_U16,
+            [INTERP_K_I32] = INTERP_LOAD_I32, [INTERP_K_U32] = INTERP_LOAD_U32,
+            [INTERP_K_I64] = INTERP_LOAD_64, [INTERP_K_U64] = INTERP_LOAD_64,
+            [INTERP_K_F32] = INTERP_LOAD_F32, [INTERP_K_F64] = INTERP_LOAD_64,
+        };
+        interp_emit(in, loads[interp_kind(inst->type)], v, inst->a, 0, 0);
+        break;
+    }
+    case IR_STORE: {
+        static const uint8_t stores[] = {
+            [INTERP_K_I8] = INTERP_STORE_8, [INTERP_K_U8] = INTERP_STORE_8,
+            [INTERP_K_I16] = INTERP_STORE_16, [INTERP_K_U16] = INTERP_STORE_16,
+            [INTERP_K_I32] = INTERP_STORE_32, [INTERP_K_U32] = INTERP_STORE_32,
+            [INTERP_K_I64] = INTERP_STORE_64, [INTERP_K_U64] = INTERP_STORE_64,
+            [INTERP_K_F32] = INTERP_STORE_F32, [INTERP_K_F64] = INTERP_STORE_64,
+        };
+        interp_emit(in, stores[interp_kind(f->insts[inst->b].type)], 0, inst->a, inst->b, 0);
+        break;
+    }
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_MOD:
+    case IR_AND: case IR_OR: case IR_XOR: case IR_SHL: case IR_SHR: {
+        const interp_kind_t k = interp_kind(inst->type);
+        if (k >= INTERP_K_F32) {
+            interp_emit(in, interp_fp_ops[inst->op] + (k == INTERP_K_F64), v, inst->a, inst->b, 0);
+            break;
         }
-    case TYPE_UINT:
-        if (cnm->s.tok.i.n <= UINT_MAX && allow_u) {
-            out->type.type[0] = (type_t){ .class = TYPE_UINT, .n = 32 };
-            out->literal.u = cnm->s.tok.i.n;
-            token_next(cnm); // Continue to next part in expression
-            return true;
+        interp_emit(in, interp_int_ops[inst->op] + interp_variant(k, interp_has_u64[inst->op]),
+                    v, inst->a, inst->b, 0);
+        if (k < INTERP_K_I32) interp_extend(in, k, v);
+        break;
+    }
+    case IR_EQ: case IR_NE: case IR_LT: case IR_LE: case IR_GT: case IR_GE: {
+        // A comparison that only decides the branch right after it jumps by
+        // itself (see IR_BR)
+        const ir_block_t *const b = &f->blocks[block];
+        const bool fused = v + 1 < b->first + b->ninsts && f->insts[v + 1].op == IR_BR
+            && f->insts[v + 1].a == v && in->uses[v] == 1;
+        if (fused) break;
+        const uint32_t variant = interp_cmp_variant(interp_kind(f->insts[inst->a].type));
+        interp_emit(in, interp_cmp_ops[inst->op - IR_EQ][0] + variant, v, inst->a, inst->b, 0);
+        break;
+    }
+    case IR_NEG: case IR_BNOT: {
+        const interp_kind_t k = interp_kind(inst->type);
+        if (k >= INTERP_K_F32) {
+            interp_emit(in, INTERP_FNEG_F32 + (k == INTERP_K_F64), v, inst->a, 0, 0);
+            break;
         }
-    case TYPE_LONG:
-        if (cnm->s.tok.i.n <= LONG_MAX && cnm->s.tok.suffix[0] != 'u') {
-            out->type.type[0] = (type_t){ .class = TYPE_LONG, .n = 64 };
-            out->literal.i = cnm->s.tok.i.n;
-            token_next(cnm); // Continue to next part in expression
-            return true;
+        interp_emit(in, (inst->op == IR_NEG ? INTERP_NEG_I32 : INTERP_BNOT_I32)
+                        + interp_variant(k, false), v, inst->a, 0, 0);
+        if (k < INTERP_K_I32) interp_extend(in, k, v);
+        break;
+    }
+    case IR_NOT: {
+        const interp_kind_t k = interp_kind(f->insts[inst->a].type);
+        interp_emit(in, k >= INTERP_K_F32 ? INTERP_NOT_F32 + (k == INTERP_K_F64) : INTERP_NOT_I,
+                    v, inst->a, 0, 0);
+        break;
+    }
+    case IR_CAST: interp_cast(in, inst, v); break;
+    case IR_CALL: return interp_call(cnm, in, inst, v);
+    case IR_JMP:
+        interp_edge(in, block, inst->a);
+        interp_jmp(in, inst->a, true);
+        break;
+    case IR_BR: {
+        // Go to the true block (or to the copies for its edge) if the
+        // condition holds and fall through to the false side otherwise
+        const ir_inst_t *const cond = &f->insts[inst->a];
+        const bool fused = inst->a == v - 1 && cond->op >= IR_EQ && cond->op <= IR_GE
+            && in->uses[inst->a] == 1;
+        uint32_t at;
+        if (fused) {
+            const uint32_t variant = interp_cmp_variant(interp_kind(f->insts[cond->a].type));
+            at = interp_emit(in, interp_cmp_ops[cond->op - IR_EQ][1] + variant, 0,
+                             cond->a, cond->b, 0);
+        } else {
+            at = interp_emit(in, INTERP_BRT, 0, inst->a, 0, 0);
         }
-    case TYPE_ULONG:
-        if (cnm->s.tok.i.n <= ULONG_MAX && allow_u) {
-            out->type.type[0] = (type_t){ .class = TYPE_ULONG, .n = 64 };
-            out->literal.u = cnm->s.tok.i.n;
-            token_next(cnm); // Continue to next part in expression
-            return true;
+
+        const bool copies = interp_edge_copies(in, inst->b);
+        if (!copies) interp_target(in, at, inst->b);
+        interp_edge(in, block, inst->c);
+        interp_jmp(in, inst->c, !copies);
+        if (copies) {
+            if (!in->full) in->start[at].c = in->p - in->start;
+            interp_edge(in, block, inst->b);
+            interp_jmp(in, inst->b, true);
         }
-    case TYPE_LLONG:
-        if (cnm->s.tok.i.n <= LLONG_MAX && cnm->s.tok.suffix[0] != 'u') {
-            out->type.type[0] = (type_t){ .class = TYPE_LLONG, .n = 64 };
-            out->literal.i = cnm->s.tok.i.n;
-            token_next(cnm); // Continue to next part in expression
-            return true;
+        break;
+    }
+    case IR_RET:
+        interp_emit(in, inst->a ? INTERP_RET : INTERP_RETV, 0, inst->a, 0, 0);
+        break;
+    }
+    return true;
+}
+
+// Start the next function in the code buffer at an instruction boundary.
+// Called before its address is handed out for calls to itself
+static void interp_align(cnm_t *cnm) {
+    const uintptr_t at = (uintptr_t)cnm->code.ptr, align = __alignof__(interp_inst_t);
+    const size_t pad = (align - at % align) % align;
+    const size_t left = cnm->code.buf + cnm->code.len - cnm->code.ptr;
+    cnm->code.ptr += pad < left ? pad : left;
+}
+
+// Translate the IR of a function to threaded code at the end of the code
+// buffer. Returns false if it didn't fit or we ran out of memory
+static bool interp_compile(cnm_t *cnm, const ir_func_t *f, void **addr) {
+    interp_align(cnm);
+    interp_inst_t *const fn = (interp_inst_t *)cnm->code.ptr;
+    const size_t room = (cnm->code.buf + cnm->code.len - cnm->code.ptr) / sizeof(interp_inst_t);
+    uint32_t maxphis = 0;
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        const ir_block_t *const b = &f->blocks[i];
+        uint32_t n = 0;
+        while (n < b->ninsts && f->insts[b->first + n].op == IR_PHI) n++;
+        if (n > maxphis) maxphis = n;
+    }
+
+    interp_t in = {
+        .start = fn + 1,
+        .p = fn + 1,
+        .end = fn + room,
+        .full = !room,
+        .f = f,
+        .lo = code_real_addr(cnm, cnm->code.buf),
+        .hi = code_real_addr(cnm, cnm->code.buf + cnm->code.len),
+        .uses = cnm_alloc(cnm, sizeof(uint32_t) * f->ninsts, sizeof(uint32_t)),
+        .offs = cnm_alloc(cnm, sizeof(uint32_t) * f->nblocks, sizeof(uint32_t)),
+        .fixups = cnm_alloc(cnm, sizeof(interp_fixup_t) * f->nblocks * 3, sizeof(uint32_t)),
+        .temps = f->ninsts,
+    };
+    if (!in.uses || !in.offs || !in.fixups) return false;
+    if (!room) in.start = in.p = in.end = fn;
+    memset(in.offs, 0xFF, sizeof(uint32_t) * f->nblocks);
+    ir_count_uses(f, in.uses);
+
+    // Constants don't depend on anything, so they are all set once up front
+    // instead of every time a loop gets to them
+    for (ir_val_t v = 1; v < f->ninsts; v++) {
+        const ir_inst_t *const inst = &f->insts[v];
+        if (inst->op != IR_CONST && inst->op != IR_GLOBAL) continue;
+        interp_emit(&in, inst->type == TYPE_FLOAT ? INTERP_CONST_F32 : INTERP_CONST,
+                    v, 0, inst->b, inst->c);
+    }
+
+    // Blocks that nothing jumps to are left out
+    for (uint32_t i = 0; i < f->nblocks; i++) {
+        const ir_block_t *const b = &f->blocks[i];
+        if (!b->ninsts || (i && !b->npreds)) continue;
+        in.next = i + 1;
+        while (in.next < f->nblocks && (!f->blocks[in.next].ninsts || !f->blocks[in.next].npreds)) {
+            in.next++;
         }
-    case TYPE_ULLONG:
-        if (allow_u) {
-            out->type.type[0] = (type_t){ .class = TYPE_ULLONG, .n = 64 };
-            out->literal.u = cnm->s.tok.i.n;
-            token_next(cnm); // Continue to next part in expression
-            return true;
+        in.offs[i] = in.p - in.start;
+        for (ir_val_t v = b->first; v < b->first + b->ninsts; v++) {
+            if (!interp_inst(cnm, &in, i, v)) return false;
         }
-    default:
-        break;
+    }
+    if (in.full) {
+        cnm_doerr(cnm, true, "ran out of code memory");
+        return false;
+    }
+    for (uint32_t i = 0; i < in.nfixups; i++) {
+        in.start[in.fixups[i].at].c = in.offs[in.fixups[i].block];
     }
 
-    // Couldn't find type to fix the number, default to int
-    out->type.type[0] = (type_t){ .class = TYPE_INT, .n = 32 };
-    out->literal.u = cnm->s.tok.i.n;
-    cnm_doerr(cnm, false, "integer constant can not fit, defaulting to int");
+    *fn = (interp_inst_t){ .dst = f->ninsts + maxphis };
+    *addr = code_real_addr(cnm, (uint8_t *)fn);
+    cnm->code.ptr = (uint8_t *)in.p;
+    return true;
+}
 
-    // Goto next token for the rest of the expression
-    token_next(cnm);
+// Number of local variables in scope. They are at the start of the variable
+// list, before the globals
+static uint32_t locals_count(const cnm_t *cnm) {
+    uint32_t n = 0;
+    for (const scope_t *var = cnm->vars; var && var->scope > 0; var = var->next) n++;
+    return n;
+}
+
+// The locals that were in scope when there were n of them. The ones declared
+// since then are newer, so they are skipped from the start of the list
+static scope_t *locals_from(cnm_t *cnm, uint32_t n) {
+    scope_t *var = cnm->vars;
+    for (uint32_t count = locals_count(cnm); count > n; count--) var = var->next;
+    return var;
+}
 
+static inline typeclass_t local_class(const cnm_t *cnm, const scope_t *var) {
+    return type_get(cnm, var->type).type[0].class;
+}
+
+// Copy the values of the first n locals so that they can be put back with
+// locals_restore. Returns NULL if we ran out of memory
+static ir_val_t *locals_save(cnm_t *cnm, uint32_t n) {
+    ir_val_t *const vals = cnm_alloc(cnm, sizeof(ir_val_t) * (n ? n : 1), sizeof(ir_val_t));
+    if (!vals) return NULL;
+    const scope_t *var = locals_from(cnm, n);
+    for (uint32_t i = 0; i < n; i++, var = var->next) vals[i] = var->val;
+    return vals;
+}
+
+static void locals_restore(cnm_t *cnm, const ir_val_t *vals, uint32_t n) {
+    scope_t *var = locals_from(cnm, n);
+    for (uint32_t i = 0; i < n; i++, var = var->next) var->val = vals[i];
+}
+
+// Instructions are added to a new block that nothing jumps to, like after a
+// return. Returns false if we ran out of memory
+static bool stmt_dead_block(cnm_t *cnm) {
+    uint32_t block;
+    if (!ir_block_new(cnm, &block)) return false;
+    ir_block_start(cnm, block);
+    cnm->fn.dead = true;
     return true;
 }
 
-// Generate valref with literal double
-static bool expr_double(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                        const typeref_t *expected_type) {
-    *out = (valref_t){
-        .isliteral = true,
-    };
+// Place where control flow comes back together, like after an if. Every edge
+// into it records the block it comes from and the values of the locals (and
+// of nextra other values) there, and the ones that differ between edges get a
+// phi once the block is started
+typedef struct stmt_join_s {
+    uint32_t block;
+    uint32_t nlocals, nextra;
+
+    // Each edge is the block followed by the nlocals + nextra values
+    uint32_t *edges;
+    uint32_t nedges, cap; // In uint32_t's
+} stmt_join_t;
+
+static bool join_init(cnm_t *cnm, stmt_join_t *join, uint32_t nextra) {
+    *join = (stmt_join_t){ .nlocals = locals_count(cnm), .nextra = nextra };
+    return ir_block_new(cnm, &join->block);
+}
 
-    // Allocate ast type
-    if (!(out->type.type = cnm_alloc(cnm, sizeof(type_t), sizeof(type_t)))) return false;
-    out->type.size = 1;
-    out->type.type[0] = (type_t){
-        .class = cnm->s.tok.suffix[0] == 'f' ? TYPE_FLOAT : TYPE_DOUBLE,
-    };
+// Add the edge from the current block to the join without jumping there yet.
+// Nothing is added from blocks that can't be reached
+static bool join_edge(cnm_t *cnm, stmt_join_t *join, const ir_val_t *extra) {
+    if (cnm->fn.dead) return true;
+    const uint32_t n = 1 + join->nlocals + join->nextra;
+    if (!ir_reserve(cnm, &join->edges, &join->cap, join->nedges, n, sizeof(uint32_t))) {
+        return false;
+    }
+    uint32_t *const edge = join->edges + join->nedges;
+    edge[0] = cnm->ir.block;
+    const scope_t *var = locals_from(cnm, join->nlocals);
+    for (uint32_t i = 0; i < join->nlocals; i++, var = var->next) edge[1 + i] = var->val;
+    for (uint32_t i = 0; i < join->nextra; i++) edge[1 + join->nlocals + i] = extra[i];
+    join->nedges += n;
+    return true;
+}
 
-    if (cnm->s.tok.suffix[0] == 'f') out->literal.f = cnm->s.tok.f;
-    else out->literal.d = cnm->s.tok.f;
+// End the current block with a jump to the join. Blocks that can't be reached
+// just return so that they don't add a predecessor
+static bool join_jump(cnm_t *cnm, stmt_join_t *join, const ir_val_t *extra) {
+    if (cnm->fn.dead) return ir_emit(cnm, IR_RET, TYPE_VOID, 0, 0, 0) != 0;
+    return join_edge(cnm, join, extra) && ir_emit(cnm, IR_JMP, TYPE_VOID, join->block, 0, 0);
+}
 
-    // Goto next token for the rest of the expression
-    token_next(cnm);
+// Pick one value out of the edges, or make a phi if they don't agree
+static ir_val_t join_merge(cnm_t *cnm, const stmt_join_t *join, uint32_t idx,
+                           typeclass_t class) {
+    const uint32_t n = 1 + join->nlocals + join->nextra;
+    const ir_val_t first = join->edges[1 + idx];
+    bool same = true;
+    for (uint32_t e = n; e < join->nedges && same; e += n) same = join->edges[e + 1 + idx] == first;
+    if (same) return first;
+
+    const ir_val_t phi = ir_phi(cnm, class);
+    if (!phi) return 0;
+    for (uint32_t e = 0; e < join->nedges; e += n) {
+        if (!ir_phi_add(cnm, phi, join->edges[e], join->edges[e + 1 + idx])) return 0;
+    }
+    return phi;
+}
 
+// Start the block of the join and set the locals to what they are there. The
+// extra values are put in extra, with the classes in classes. The block can't
+// be reached if no edges came in
+static bool join_start(cnm_t *cnm, stmt_join_t *join, ir_val_t *extra,
+                       const typeclass_t *classes) {
+    ir_block_start(cnm, join->block);
+    cnm->fn.dead = !join->nedges;
+    if (cnm->fn.dead) return true;
+
+    scope_t *var = locals_from(cnm, join->nlocals);
+    for (uint32_t i = 0; i < join->nlocals; i++, var = var->next) {
+        if (!(var->val = join_merge(cnm, join, i, local_class(cnm, var)))) return false;
+    }
+    for (uint32_t i = 0; i < join->nextra; i++) {
+        if (!(extra[i] = join_merge(cnm, join, join->nlocals + i, classes[i]))) return false;
+    }
     return true;
 }
 
-// Helper function to set the type of an arithmetic valref
-static bool set_arith_type(cnm_t *cnm, valref_t *out, valref_t *left, valref_t *right) {
-    type_t *ltype = left->type.type, *rtype = right->type.type;
+// A loop. Since it isn't known which locals change in the body before it is
+// parsed, the header starts with a phi for every local and the back edges
+// fill them in
+typedef struct stmt_loop_s {
+    struct stmt_loop_s *outer;
+    uint32_t header;
+    uint32_t nlocals;
+    ir_val_t *phis; // Phi of every local in the header
+
+    stmt_join_t exit; // Where break goes
+    stmt_join_t *cont; // Where continue goes, NULL if it goes to the header
+} stmt_loop_t;
+
+// Jump to the header of a new loop and start it
+static bool loop_begin(cnm_t *cnm, stmt_loop_t *loop, stmt_join_t *cont) {
+    *loop = (stmt_loop_t){
+        .outer = cnm->fn.loop,
+        .nlocals = locals_count(cnm),
+        .cont = cont,
+    };
+    if (!join_init(cnm, &loop->exit, 0) || !ir_block_new(cnm, &loop->header)) return false;
+    if (!(loop->phis = cnm_alloc(cnm, sizeof(ir_val_t) * (loop->nlocals ? loop->nlocals : 1),
+                                 sizeof(ir_val_t)))) return false;
 
-    // Binary arithmetic conversion ranks. Ranks have been built into the
-    // enum definition of types
-    // see https://en.cppreference.com/w/c/language/conversion for more
-    out->type.type[0].n = ltype->class > rtype->class ? ltype->n : rtype->n;
-    out->type.type[0].class = ltype->class > rtype->class ? ltype->class : rtype->class;
-    type_promote_to_int(&out->type);
+    const bool entered = !cnm->fn.dead;
+    const uint32_t pred = cnm->ir.block;
+    if (!ir_emit(cnm, entered ? IR_JMP : IR_RET, TYPE_VOID, entered ? loop->header : 0, 0, 0)) {
+        return false;
+    }
+    ir_block_start(cnm, loop->header);
 
+    scope_t *var = locals_from(cnm, loop->nlocals);
+    for (uint32_t i = 0; i < loop->nlocals; i++, var = var->next) {
+        const ir_val_t phi = ir_phi(cnm, local_class(cnm, var));
+        if (!phi || (entered && !ir_phi_add(cnm, phi, pred, var->val))) return false;
+        var->val = loop->phis[i] = phi;
+    }
     return true;
 }
 
-// Perform math operation constant folding on valref
-#define CF_OP(opname, optoken) \
-    static void cf_##opname(valref_t *out, valref_t *left, valref_t *right) { \
-        const typeclass_t class = out->type.type[0].class; \
+// Add the current block as a back edge of the loop without jumping yet
+static bool loop_back_edge(cnm_t *cnm, stmt_loop_t *loop) {
+    if (cnm->fn.dead) return true;
+    const scope_t *var = locals_from(cnm, loop->nlocals);
+    for (uint32_t i = 0; i < loop->nlocals; i++, var = var->next) {
+        if (!ir_phi_add(cnm, loop->phis[i], cnm->ir.block, var->val)) return false;
+    }
+    return true;
+}
+
+// End the current block by going back to the header of the loop
+static bool loop_back(cnm_t *cnm, stmt_loop_t *loop) {
+    if (cnm->fn.dead) return ir_emit(cnm, IR_RET, TYPE_VOID, 0, 0, 0) != 0;
+    return loop_back_edge(cnm, loop) && ir_emit(cnm, IR_JMP, TYPE_VOID, loop->header, 0, 0);
+}
+
+// Generates code and data for the expression being parsed
+static bool expr_parse(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                       prec_t prec, const typeref_t *expected_type) {
+    // Consume a prefix/unary ast node like an integer literal
+    expr_rule_t *rule = &expr_rules[cnm->s.tok.type];
+    if (!rule->prefix || prec > rule->prefix_prec) {
+        cnm_doerr(cnm, true, "expected expression");
+        return false;
+    }
+    if (!rule->prefix(cnm, out, gencode, gendata, expected_type)) return false;
+
+    // Continue to consume binary operators that fall under this precedence level
+    rule = &expr_rules[cnm->s.tok.type];
+    while (rule->infix && prec <= rule->infix_prec) {
+        valref_t tmp;
+        if (!rule->infix(cnm, &tmp, gencode, gendata, out, expected_type)) return false;
+        *out = tmp;
+        rule = &expr_rules[cnm->s.tok.type];
+    }
+
+    return true;
+}
+
+// Constant fold cast an valref to the to type
+static bool valref_cast_literal(cnm_t *cnm, valref_t *val, typeref_t cast_to) {
+    type_t *from = val->type.type, *to = cast_to.type;
+
+    if (!type_is_pod(*from) || !type_is_pod(*to)) {
+        cnm_doerr(cnm, true, "can only do casting between pod data types");
+        return false;
+    }
+
+    // Cache information about from and to types
+    const bool fp_to = type_is_fp(*cast_to.type), fp_from = type_is_fp(*val->type.type),
+        u_from = type_is_unsigned(*val->type.type) || val->type.type->class == TYPE_PTR,
+        f_to = cast_to.type[0].class == TYPE_FLOAT,
+        f_from = val->type.type[0].class == TYPE_FLOAT;
+
+    val->type = cast_to;
+
+    // Convert to or convert from and to float types
+    if (to->class == TYPE_BOOL) {
+        if (fp_from) val->literal.u = !!(f_from ? val->literal.f : val->literal.d);
+        else val->literal.u = !!val->literal.u;
+    } else if (fp_to && !fp_from) {
+        if (f_to) val->literal.f = u_from ? val->literal.u : val->literal.i;
+        else val->literal.d = u_from ? val->literal.u : val->literal.i;
+    } else if (!fp_to && fp_from) {
+        if (u_from) val->literal.u = f_from ? val->literal.f : val->literal.d;
+        else val->literal.i = f_from ? val->literal.f : val->literal.d;
+    } else if (f_to != f_from) {
+        if (f_to) val->literal.f = val->literal.d;
+        else val->literal.d = val->literal.f;
+    }
+
+enforce_width:
+    if (to->class == TYPE_FLOAT || to->class == TYPE_DOUBLE || to->class == TYPE_PTR
+        || to->class == TYPE_LONG || to->class == TYPE_LLONG
+        || to->class == TYPE_ULONG || to->class == TYPE_ULLONG) {
+        return true;
+    } else if (to->class == TYPE_BOOL) {
+        val->literal.u = !!val->literal.u;
+        return true;
+    }
+
+    // Cap the integer to the bit width of what it is
+    switch (to->class) {
+    case TYPE_CHAR: val->literal.i = (intmax_t)(char)val->literal.i; break;
+    case TYPE_SHORT: val->literal.i = (intmax_t)(short)val->literal.i; break;
+    case TYPE_INT: val->literal.i = (intmax_t)(int)val->literal.i; break;
+    case TYPE_UCHAR: val->literal.u &= 0xFF; break;
+    case TYPE_USHORT: val->literal.u &= 0xFFFF; break;
+    case TYPE_UINT: val->literal.u &= 0xFFFFFFFF; break;
+    default: break;
+    }
+
+    return true;
+}
+
+// Generate code to cast the type and value of val to the type of to
+static bool valref_cast_runtime(cnm_t *cnm, valref_t *val, const typeref_t to) {
+    if (!type_is_pod(*val->type.type) || !type_is_pod(*to.type)) {
+        cnm_doerr(cnm, true, "can only do casting between pod data types");
+        return false;
+    }
+
+    // Types of the same class are the same at runtime
+    if (val->type.type[0].class != to.type[0].class
+        && !(val->ir = ir_emit(cnm, IR_CAST, to.type[0].class, val->ir, 0, 0))) return false;
+    val->type = to;
+    return true;
+}
+
+// Get the IR value of val, adding a constant for literals. Returns 0 if we ran
+// out of memory
+static ir_val_t valref_ir(cnm_t *cnm, const valref_t *val) {
+    if (!val->isliteral) return val->ir;
+
+    const typeclass_t class = val->type.type[0].class;
+    uint64_t bits = val->literal.u;
+    if (class == TYPE_FLOAT) {
+        uint32_t f32;
+        memcpy(&f32, &val->literal.f, sizeof(f32));
+        bits = f32;
+    }
+    return ir_emit_imm(cnm, IR_CONST, class, bits);
+}
+
+// Cast val to 'to'
+static bool valref_cast(cnm_t *cnm, valref_t *val, const typeref_t to, bool gencode) {
+    if (type_eq(val->type, to, true)) return true;
+    if (val->isliteral) {
+        if (!valref_cast_literal(cnm, val, to)) return false;
+    } else if (gencode) {
+        if (!valref_cast_runtime(cnm, val, to)) return false;
+    }
+    return true;
+}
+
+// Cast something, with token pointing to right after '(' in cast expr
+static bool expr_cast(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                      const typeref_t *expected_type) {
+    // Get the type to cast to first
+    type_t base;
+    bool istypedef;
+    if (!type_parse_declspec(cnm, &base, &istypedef)) return false;
+    if (istypedef) {
+        cnm_doerr(cnm, true, "Can not declare typedef in cast expression.");
+        return false;
+    }
+    ident_t name;
+    typeref_t type = type_parse(cnm, &base, &name, false);
+    if (!type.type) return false;
+    if (name) {
+        cnm_doerr(cnm, true, "Can not give type a identifier in cast expression");
+        return false;
+    }
+
+    // Make sure there is the ending parenthesis
+    if (cnm->s.tok.type != TOKEN_PAREN_R) {
+        return false;
+    }
+    token_next(cnm);
+
+    // Now parse the expression
+    if (!expr_parse(cnm, out, gencode, gendata, PREC_PREFIX, &type)) return false;
+
+    // Now cast out to the type
+    if (!valref_cast(cnm, out, type, gencode)) return false;
+
+    return true;
+}
+
+// Makes sure that a literal is allocated to the global data buffer
+static bool val_enforce_global(cnm_t *cnm, valref_t *val) {
+    if (val->isliteral &&
+        (val->type.type[0].class == TYPE_USER || val->type.type[0].class == TYPE_ARR)) {
+        if (val->scope) val->scope->abs_addr = val->literal.addr;
+        return true;
+    }
+    if (!val->isliteral || !type_is_pod(*val->type.type)) return true;
+
+    // Move the data to the global region
+    const typeinf_t inf = type_getinf(cnm, val->type.type);
+    uint8_t *buf = cnm_alloc_global(cnm, inf.size, inf.align);
+    if (!buf) return false;
+    memcpy(buf, &val->literal, inf.size);
+
+    // Update the variable info
+    if (val->scope) val->scope->abs_addr = buf;
+    val->isliteral = false;
+
+    return true;
+}
+
+// Parse an POD initializer list
+static bool expr_parse_init_list_pod(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                                     const typeref_t *type) {
+    if (!expr_parse(cnm, out, gencode, gendata, PREC_FULL, NULL)) return false;
+
+    if (!type_eq(out->type, *type, false)) {
+        cnm_doerr(cnm, true, "initializer list type does not match expected type");
+        return false;
+    }
+
+    return true;
+}
+
+#define INIT_LIST_MAX_DEPTH 16
+
+typedef struct {
+    typeref_t type;
+
+    // Normal union fields
+    field_list_t *s;
+    field_t *f;
+    uint8_t *d;
+    int n_fields_inited;
+
+    // Array fields
+    bool isarr;
+    int arridx, arrlen;
+} init_list_stack_t;
+
+typedef struct {
+    init_list_stack_t stack[INIT_LIST_MAX_DEPTH];
+    init_list_stack_t *cur;
+    bool stop, isliteral;
+    int biggest_idx;
+
+    // Save this for the case that the initializer isn't completely constant
+    uint8_t *global_backup;
+    uint8_t *data_start;
+
+    typeref_t basety;
+    typeinf_t inf;
+} init_list_state_t;
+
+static inline int init_list_stack_get_offs(cnm_t *cnm, init_list_stack_t *self) {
+    if (self->isarr) {
+        const typeinf_t inf = type_getinf(cnm, self->type.type);
+        if (self->arridx > self->arrlen) {
+            cnm_doerr(cnm, true, "array index out of bounds in initializer");
+            return -1;
+        } else {
+            return self->arridx * inf.size;
+        }
+    } else {
+        return self->f->offs;
+    }
+}
+
+// Initialize a initializer stack element based on the previous stack element
+// if there is one
+static void init_list_stack_init(cnm_t *cnm, const typeref_t *type,
+                                 init_list_stack_t *last, init_list_stack_t *self,
+                                 init_list_state_t *state) {
+    userty_t *u = userty_get(cnm, type->type[0].n);
+
+    if (type->type[0].class == TYPE_ARR) {
+        *self = (init_list_stack_t){
+            .isarr = true,
+            .arridx = 0,
+            .arrlen = type->type[0].n,
+            .type = (typeref_t){
+                .type = type->type + 1,
+                .size = type->size - 1,
+            },
+        };
+    } else {
+        *self = (init_list_stack_t){
+            .s = (field_list_t *)u->data,
+        };
+        self->f = self->s->fields;
+        self->type = type_get(cnm, self->f->type);
+    }
+
+    self->d = last ? last->d + init_list_stack_get_offs(cnm, last) : state->data_start;
+
+    // Make it the maximum that we can
+    if (self->isarr && !self->arrlen) {
+        const typeinf_t inf = type_getinf(cnm, self->type.type);
+        
+        // Get amount of free data memory
+        size_t nfree = (cnm->globals.strnext - self->d) / inf.size * inf.size;
+
+        self->arrlen = nfree;
+    }
+}
+
+static bool init_list_designator(cnm_t *cnm, init_list_state_t *state,
+                                 bool in_designator) {
+    if (cnm->s.tok.type == TOKEN_DOT) {
+        // Move 1 stack inwards
+        if (in_designator) {
+            init_list_stack_t *cur = state->cur + 1;
+            if (cur >= state->stack + INIT_LIST_MAX_DEPTH) {
+                cnm_doerr(cnm, true, "hit max initializer designator depth");
+                return false;
+            }
+
+            const typeref_t ftype = type_get(cnm, state->cur->f->type);
+            init_list_stack_init(cnm, &ftype, state->cur, cur, state);
+            state->cur = cur;
+        }
+
+        // Struct parameter
+        token_next(cnm);
+        if (cnm->s.tok.type != TOKEN_IDENT) {
+            cnm_doerr(cnm, true, "expected identifier");
+            return false;
+        }
+
+        field_t *f = field_find(state->cur->s, cnm->s.tok.id);
+        if (!f) {
+            cnm_doerr(cnm, true, "no member found with that name");
+            return false;
+        }
+        state->cur->f = f;
+        state->cur->type = type_get(cnm, f->type);
+
+        token_next(cnm);
+        return init_list_designator(cnm, state, true);
+    } else if (cnm->s.tok.type == TOKEN_BRACK_L) {
+        // Move 1 stack inwards
+        if (in_designator) {
+            init_list_stack_t *cur = state->cur + 1;
+            if (cur >= state->stack + INIT_LIST_MAX_DEPTH) {
+                cnm_doerr(cnm, true, "hit max initializer designator depth");
+                return false;
+            }
+
+            init_list_stack_init(cnm, &(typeref_t){
+                .type = state->cur->type.type + 1,
+                .size = state->cur->type.size - 1,
+            }, state->cur, cur, state);
+            state->cur = cur;
+        }
+
+        // Array index
+        token_next(cnm);
+
+        valref_t val;
+        if (!expr_parse(cnm, &val, false, false, PREC_OR, NULL)) return false;
+        if (!val.isliteral) {
+            cnm_doerr(cnm, true, "array index initializer must be constant expression");
+            return false;
+        }
+        if (!type_is_int(val.type.type[0])) return false;
+        if (type_is_unsigned(val.type.type[0]) && val.literal.i < 0) {
+            cnm_doerr(cnm, true, "can not have negative array index in initializer");
+            return false;
+        }
+        state->cur->arridx = val.literal.u;
+        if (state->cur->arridx >= state->cur->arrlen) {
+            cnm_doerr(cnm, true, "array index in initializer is out of bounds");
+            return false;
+        }
+
+        token_next(cnm);
+        return init_list_designator(cnm, state, true);
+    } else if (cnm->s.tok.type == TOKEN_ASSIGN) {
+        token_next(cnm);
+        if (in_designator) {
+            return true;
+        } else {
+            cnm_doerr(cnm, true, "expected initialzer expression, not =");
+            return false;
+        }
+    } else {
+        return true;
+    }
+}
+
+static bool array_init_grow_to_size(cnm_t *cnm, const typeref_t array,
+                                    size_t curr_n, size_t needed_n) {
+    if (curr_n == needed_n || !needed_n) return true;
+    typeinf_t inf = type_getinf(cnm, array.type + 1);
+    const size_t size = inf.size * (needed_n - curr_n);
+    void *area;
+    if (!(area = cnm_alloc_global(cnm, size, 1))) return false;
+    memset(area, 0, size);
+
+    return true;
+}
+
+// Optionally grow the array size to the needed size of an array on the top of the
+// globals array on the cnm state
+static bool array_init_grow_size(cnm_t *cnm, typeref_t *type, const typeref_t *needed) {
+    if (type->type[0].class != TYPE_ARR || needed->type[0].class != TYPE_ARR) return true;
+
+    int curr_n = type->type[0].n, needed_n = needed->type[0].n;
+
+    if (!type_eq((typeref_t){
+        .type = type->type + 1,
+        .size = type->size - 1,
+    }, (typeref_t){
+        .type = needed->type + 1,
+        .size = needed->size - 1,
+    }, true) || (curr_n > needed_n && needed_n)) {
+        cnm_doerr(cnm, true, "array types don't match");
+        return false;
+    }
+
+    if (needed_n && needed_n != curr_n && !typeref_set_arrlen(cnm, type, needed_n)) return false;
+    return array_init_grow_to_size(cnm, *needed, curr_n, needed_n);
+}
+
+// Advance to next field / index
+static void init_list_advance_field(cnm_t *cnm, init_list_state_t *state) {
+    if (state->cur->isarr) {
+        if (state->cur == state->stack
+            && state->cur->arridx > state->biggest_idx) {
+            state->biggest_idx = state->cur->arridx;
+        }
+        if (state->cur->arridx < state->cur->arrlen - 1) {
+            state->cur->arridx++;
+        } else if (state->cur > state->stack) {
+            state->cur--;
+            init_list_advance_field(cnm, state);
+        } else {
+            state->stop = true;
+        }
+    } else {
+        state->cur->n_fields_inited++;
+        if (state->cur->f + 1 < state->cur->s->fields + state->cur->s->nfields) {
+            state->cur->f++;
+        } else if (state->cur > state->stack) {
+            state->cur--;
+            init_list_advance_field(cnm, state);
+        } else {
+            state->stop = true;
+        }
+        state->cur->type = type_get(cnm, state->cur->f->type);
+    }
+}
+
+static bool init_list_field(cnm_t *cnm, init_list_state_t *state,
+                            bool gencode, bool gendata) {
+    if (!init_list_designator(cnm, state, false)) return false;
+
+    // Consume actual value here
+    valref_t val;
+    if (gendata) {
+        int offs = init_list_stack_get_offs(cnm, state->cur);
+        if (offs == -1) return false;
+        cnm->globals.next = state->cur->d + offs;
+    }
+    if (!expr_parse(cnm, &val, gencode, gendata, PREC_COND, &state->cur->type)) return false;
+    state->isliteral &= val.isliteral;
+    if (!valref_cast(cnm, &val, state->cur->type, gencode)) return false;
+    if (!type_eq(val.type, state->cur->type, false)) {
+        cnm_doerr(cnm, true, "types in initializer list do not match");
+        return false;
+    }
+    if (!val_enforce_global(cnm, &val)) return false;
+    init_list_advance_field(cnm, state);
+
+    return true;
+}
+
+static bool init_list_init(cnm_t *cnm, init_list_state_t *state,
+                           const typeref_t *type, bool gencode, bool gendata) {
+    // Unions and structs
+    *state = (init_list_state_t){
+        .global_backup = cnm->globals.next,
+        .stop = false,
+        .inf = type_getinf(cnm, type->type),
+        .basety = *type,
+        .isliteral = true,
+    };
+
+    // Save this for if the initializer is completely constant
+    // TODO: Code pointer here
+
+    // Now make sure that we can even fit the type onto the global segment
+    if (gendata) {
+        if (!(state->data_start = cnm_alloc_global(cnm, 0, state->inf.align))) return false;
+        if (!cnm_alloc_global(cnm, state->inf.size, 1)) return false;
+        cnm->globals.next = state->data_start;
+        memset(state->data_start, 0, state->inf.size);
+    }
+
+    state->cur = state->stack;
+    init_list_stack_init(cnm, type, NULL, state->cur, state);
+
+    return true;
+}
+
+static bool init_list_finish(cnm_t *cnm, init_list_state_t *state,
+                             valref_t *out, bool gencode, bool gendata) {
+    // Finalize array size
+    if (state->basety.type[0].class == TYPE_ARR) {
+        if (!array_init_grow_to_size(cnm, state->basety,
+                                     state->biggest_idx + 1,
+                                     state->basety.type[0].n)) return false;
+        if (!state->basety.type[0].n
+            && !typeref_set_arrlen(cnm, &state->basety, state->biggest_idx + 1)) return false;
+        state->inf = type_getinf(cnm, state->basety.type);
+    }
+
+    // Goto end of size
+    if (gendata) cnm->globals.next = state->data_start + state->inf.size;
+
+    if (state->isliteral) {
+        // Generate memcpy code
+    } else {
+        // DEBUG: Remove this. This is here just because yea
+        return false;
+    }
+
+    *out = (valref_t){
+        .isliteral = true,
+        .type = state->basety,
+        .literal.addr = state->data_start,
+    };
+
+    return true;
+}
+
+static bool expr_parse_init_list_user(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                                      const typeref_t *type) {
+    userty_t *u = NULL;
+
+    // Optional code for unions and enums
+    if (type->type[0].class != TYPE_ARR) {
+        // Get fields and struct
+        u = userty_get(cnm, type->type[0].n);
+
+        // Optionally do enums
+        if (u->type == USER_ENUM) {
+            valref_t val;
+            if (!expr_parse(cnm, &val, gencode, gendata, PREC_FULL, NULL)) return false;
+            if (!type_is_int(val.type.type[0])) {
+                cnm_doerr(cnm, true, "you need int for enum initializer");
+                return false;
+            } else {
+                return true;
+            }
+        }
+    }
+
+    init_list_state_t state;
+    if (!init_list_init(cnm, &state, type, gencode, gendata)) return false;
+
+    // Do the field initializers!!!!!
+    while (!state.stop && cnm->s.tok.type != TOKEN_BRACE_R) {
+        if (!(init_list_field(cnm, &state, gencode, gendata))) return false;
+        if (cnm->s.tok.type == TOKEN_COMMA) token_next(cnm);
+    }
+
+    if (!init_list_finish(cnm, &state, out, gencode, gendata)) return false;
+
+    if (state.cur == state.stack && u && u->type == USER_UNION
+        && state.cur->n_fields_inited > 1) {
+        cnm_doerr(cnm, false, "excess initializers in union initializer list");
+    }
+
+    return true;
+}
+
+// Parse initializer list and create code and data for it
+// the cnm token should be pointing to the opening '{'
+static bool expr_init_list(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                                 const typeref_t *type) {
+    if (!type) {
+        cnm_doerr(cnm, true, "can not have initializer list here");
+        return false;
+    }
+
+    token_next(cnm);
+
+    // Do POD types first if it is one
+    if (type_is_pod(type->type[0])) {
+        if (!expr_parse_init_list_pod(cnm, out, gencode, gendata, type)) return false;
+    } else if (type->type[0].class == TYPE_USER
+            || type->type[0].class == TYPE_ARR) {
+        if (!expr_parse_init_list_user(cnm, out, gencode, gendata, type)) return false;
+    } else {
+        cnm_doerr(cnm, true, "Can not initialize this type");
+        return false;
+    }
+
+    // Check for ending }
+    if (cnm->s.tok.type != TOKEN_BRACE_R) {
+        cnm_doerr(cnm, true, "expected } after initializer list");
+        return false;
+    }
+    token_next(cnm);
+
+    return true;
+}
+
+// Group together operations into one group inbetween parentheses
+static bool expr_group(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                       const typeref_t *expected_type) {
+    // Consume the '(' token
+    const token_t errtok = cnm->s.tok;
+    token_next(cnm);
+   
+    // This might also be a cast operator so watch out
+    if (cnm_at_declspec(cnm)) return expr_cast(cnm, out, gencode, gendata, expected_type);
+
+    // Get the inner grouping
+    if (!expr_parse(cnm, out, gencode, gendata, PREC_FULL, NULL)) return false;
+
+    // Consume the ')' token
+    if (cnm->s.tok.type != TOKEN_PAREN_R) {
+        cnm_doerr(cnm, true, "expected ')' after expression group");
+        cnm->s.tok = errtok;
+        cnm_doerr(cnm, false, "grouping started here");
+        return NULL;
+    }
+    token_next(cnm);
+
+    return true;
+}
+
+// Create a literal value valref for a string token
+static bool expr_str(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                     const typeref_t *expected_type) {
+    *out = (valref_t){ .isliteral = true };
+
+    // Initialize type
+    type_t type[2] = { { .class = TYPE_PTR } };
+    if (cnm->s.tok.suffix[0] == 'u') {
+        type[1] = (type_t){ .class = TYPE_UCHAR, .n = 8, .isconst = true };
+    } else if (cnm->s.tok.suffix[0] == 'U') {
+        type[1] = (type_t){ .class = TYPE_UINT, .n = 32, .isconst = true };
+    } else {
+        type[1] = (type_t){ .class = TYPE_CHAR, .n = 8, .isconst = true };
+    }
+
+    const bool isarr = expected_type->type[0].class == TYPE_ARR;
+    if (isarr) {
+        type[0].class = TYPE_ARR;
+        type[0].n = token_strlen(&cnm->s.tok) + 1;
+        type[1].isconst = false;
+    }
+    if (!typeref_set(cnm, &out->type, type, 2)) return false;
+
+    if (isarr) {
+        size_t align = 1;
+        size_t size = type[0].n;
+        if (cnm->s.tok.suffix[0] == 'U') {
+            size *= 4;
+            align = 4;
+        }
+        void *area = cnm_alloc_global(cnm, size, align);
+        memcpy(area, cnm->s.tok.s, size);
+
+        out->literal.addr = area;
+
+        if (!array_init_grow_size(cnm, &out->type, expected_type)) return false;
+    } else {
+        // Set the pointer
+        out->literal.addr = cnm->s.tok.s;
+    }
+
+    token_next(cnm);
+
+    return true;
+}
+
+// Create a literal value valref for a character token
+static bool expr_char(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                      const typeref_t *expected_type) {
+    *out = (valref_t){ .isliteral = true };
+
+    // Initialize type
+    type_t type = { .class = TYPE_INT, .n = 32 };
+    if (cnm->s.tok.suffix[0] == 'u') type = (type_t){ .class = TYPE_UCHAR, .n = 8 };
+    else if (cnm->s.tok.suffix[0] == 'U') type = (type_t){ .class = TYPE_UINT, .n = 32 };
+    if (!typeref_set(cnm, &out->type, &type, 1)) return false;
+
+    // Set char
+    out->literal.c = cnm->s.tok.c;
+
+    // Goto next token for rest of expression
+    token_next(cnm);
+
+    return true;
+}
+
+// Create a literal value valref for the integer
+static bool expr_int(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                     const typeref_t *expected_type) {
+    *out = (valref_t){ .isliteral = true };
+    type_t type;
+
+    // Get minimum allowed type by suffix
+    typeclass_t mintype = TYPE_INT;
+    if (cnm->s.tok.suffix[0] == 'u') {
+        mintype = TYPE_UINT;
+        if (cnm->s.tok.suffix[1] == 'l') {
+            mintype = TYPE_ULONG;
+            if (cnm->s.tok.suffix[2] == 'l') {
+                mintype = TYPE_ULLONG;
+            }
+        }
+    } else if (cnm->s.tok.suffix[0] == 'l') {
+        mintype = TYPE_LONG;
+        if (cnm->s.tok.suffix[1] == 'l') {
+            mintype = TYPE_LLONG;
+        }
+    }
+
+    const bool allow_u = cnm->s.tok.suffix[0] == 'u' || cnm->s.tok.i.base != 10;
+
+    // Find smallest type that can represent the number and is bigger than the
+    // minimum allowed type
+    switch (mintype) {
+    case TYPE_INT:
+        if (cnm->s.tok.i.n <= INT_MAX && cnm->s.tok.suffix[0] != 'u') {
+            type = (type_t){ .class = TYPE_INT, .n = 32 };
+            out->literal.i = cnm->s.tok.i.n;
+            goto found;
+        }
+    case TYPE_UINT:
+        if (cnm->s.tok.i.n <= UINT_MAX && allow_u) {
+            type = (type_t){ .class = TYPE_UINT, .n = 32 };
+            out->literal.u = cnm->s.tok.i.n;
+            goto found;
+        }
+    case TYPE_LONG:
+        if (cnm->s.tok.i.n <= LONG_MAX && cnm->s.tok.suffix[0] != 'u') {
+            type = (type_t){ .class = TYPE_LONG, .n = 64 };
+            out->literal.i = cnm->s.tok.i.n;
+            goto found;
+        }
+    case TYPE_ULONG:
+        if (cnm->s.tok.i.n <= ULONG_MAX && allow_u) {
+            type = (type_t){ .class = TYPE_ULONG, .n = 64 };
+            out->literal.u = cnm->s.tok.i.n;
+            goto found;
+        }
+    case TYPE_LLONG:
+        if (cnm->s.tok.i.n <= LLONG_MAX && cnm->s.tok.suffix[0] != 'u') {
+            type = (type_t){ .class = TYPE_LLONG, .n = 64 };
+            out->literal.i = cnm->s.tok.i.n;
+            goto found;
+        }
+    case TYPE_ULLONG:
+        if (allow_u) {
+            type = (type_t){ .class = TYPE_ULLONG, .n = 64 };
+            out->literal.u = cnm->s.tok.i.n;
+            goto found;
+        }
+    default:
+        break;
+    }
+
+    // Couldn't find type to fix the number, default to int
+    type = (type_t){ .class = TYPE_INT, .n = 32 };
+    out->literal.u = cnm->s.tok.i.n;
+    cnm_doerr(cnm, false, "integer constant can not fit, defaulting to int");
+
+found:
+    if (!typeref_set(cnm, &out->type, &type, 1)) return false;
+
+    // Goto next token for the rest of the expression
+    token_next(cnm);
+
+    return true;
+}
+
+// Generate valref with literal double
+static bool expr_double(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                        const typeref_t *expected_type) {
+    *out = (valref_t){
+        .isliteral = true,
+    };
+
+    // Get ast type
+    const type_t type = { .class = cnm->s.tok.suffix[0] == 'f' ? TYPE_FLOAT : TYPE_DOUBLE };
+    if (!typeref_set(cnm, &out->type, &type, 1)) return false;
+
+    if (cnm->s.tok.suffix[0] == 'f') out->literal.f = cnm->s.tok.f;
+    else out->literal.d = cnm->s.tok.f;
+
+    // Goto next token for the rest of the expression
+    token_next(cnm);
+
+    return true;
+}
+
+// Generate valref that reads a variable
+static bool expr_ident(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                       const typeref_t *expected_type) {
+    scope_t *const var = varmap_find(cnm, cnm->s.tok.id);
+    if (!var) {
+        // Functions can only be called
+        bool shared = false;
+        for (func_t *func = cnm->funcs; func; func = func->next) {
+            shared |= func == cnm->base_funcs;
+            if (func->name == cnm->s.tok.id) {
+                return expr_call(cnm, out, gencode, gendata, func, shared);
+            }
+        }
+        cnm_doerr(cnm, true, "use of undeclared identifier");
+        return false;
+    }
+    if (!gencode) {
+        cnm_doerr(cnm, true, "initializer element is not a compile time constant");
+        return false;
+    }
+
+    const typeref_t type = type_get(cnm, var->type);
+    if (!type_is_pod(*type.type)) {
+        cnm_doerr(cnm, true, "only pod variables can be used in expressions");
+        return false;
+    }
+
+    // Locals are always in an IR value, globals are loaded from their address
+    if (var->scope > 0) {
+        *out = (valref_t){ .type = type, .scope = var, .ir = var->val };
+        token_next(cnm);
+        return true;
+    }
+    if (!var->abs_addr) {
+        cnm_doerr(cnm, true, "variable is declared but never defined");
+        return false;
+    }
+
+    const ir_val_t addr = ir_emit_imm(cnm, IR_GLOBAL, TYPE_PTR, (uintptr_t)var->abs_addr);
+    *out = (valref_t){
+        .type = type,
+        .scope = var,
+        .ir = addr ? ir_emit(cnm, IR_LOAD, type.type[0].class, addr, 0, 0) : 0,
+    };
+    if (!out->ir) return false;
+
+    // Goto next token for the rest of the expression
+    token_next(cnm);
+
+    return true;
+}
+
+// Helper function to set the type of an arithmetic valref
+static bool set_arith_type(cnm_t *cnm, valref_t *out, valref_t *left, valref_t *right) {
+    // Both sides are promoted first so that bools (which come after the
+    // floating point types) rank below int
+    type_t ltype = left->type.type[0], rtype = right->type.type[0];
+    type_promote_to_int(&ltype);
+    type_promote_to_int(&rtype);
+
+    // Binary arithmetic conversion ranks. Ranks have been built into the
+    // enum definition of types
+    // see https://en.cppreference.com/w/c/language/conversion for more
+    type_t type = {
+        .class = ltype.class > rtype.class ? ltype.class : rtype.class,
+        .n = ltype.class > rtype.class ? ltype.n : rtype.n,
+    };
+
+    return typeref_set(cnm, &out->type, &type, 1);
+}
+
+// Perform math operation constant folding on valref
+#define CF_OP(opname, optoken) \
+    static void cf_##opname(valref_t *out, valref_t *left, valref_t *right) { \
+        const typeclass_t class = out->type.type[0].class; \
         if (class == TYPE_DOUBLE) { \
             out->literal.d = left->literal.d optoken right->literal.d; \
         } else if (class == TYPE_FLOAT) { \
@@ -3166,238 +7302,1172 @@ static void cf_neg(valref_t *var) {
         var->literal.i = -var->literal.i;
     }
 }
-static void cf_not(valref_t *var) {
-    type_t *type = &var->type.type[0];
-    if (type->class == TYPE_DOUBLE) {
-        var->literal.u = !var->literal.d;
-    } else if (type->class == TYPE_FLOAT) {
-        var->literal.u = !var->literal.f;
-    } else if (type_is_unsigned(*var->type.type)) {
-        var->literal.u = !var->literal.u;
+static void cf_not(valref_t *var) {
+    const type_t *type = &var->type.type[0];
+    if (type->class == TYPE_DOUBLE) {
+        var->literal.u = !var->literal.d;
+    } else if (type->class == TYPE_FLOAT) {
+        var->literal.u = !var->literal.f;
+    } else if (type_is_unsigned(*var->type.type)) {
+        var->literal.u = !var->literal.u;
+    } else {
+        var->literal.u = !var->literal.i;
+    }
+}
+static void cf_bit_not(valref_t *var) {
+    const typeclass_t class = var->type.type[0].class;
+    if (type_is_unsigned(*var->type.type)) {
+        var->literal.u = ~var->literal.u;
+    } else {
+        var->literal.u = ~var->literal.i;
+    }
+}
+
+// IR operations of the binary arithmetic tokens
+static const uint8_t expr_arith_ops[TOKEN_MAX] = {
+    [TOKEN_PLUS] = IR_ADD,      [TOKEN_MINUS] = IR_SUB,
+    [TOKEN_STAR] = IR_MUL,      [TOKEN_DIVIDE] = IR_DIV,
+    [TOKEN_MODULO] = IR_MOD,    [TOKEN_BIT_OR] = IR_OR,
+    [TOKEN_BIT_AND] = IR_AND,   [TOKEN_BIT_XOR] = IR_XOR,
+    [TOKEN_SHIFT_L] = IR_SHL,   [TOKEN_SHIFT_R] = IR_SHR,
+};
+
+// Emit the IR of a binary arithmetic operation once the type of out is known
+static bool expr_arith_emit(cnm_t *cnm, valref_t *out, token_type_t optype,
+                            valref_t *left, valref_t *right) {
+    if (!left->isliteral && !valref_cast_runtime(cnm, left, out->type)) return false;
+    if (!right->isliteral && !valref_cast_runtime(cnm, right, out->type)) return false;
+    const ir_val_t a = valref_ir(cnm, left), b = valref_ir(cnm, right);
+    if (!a || !b) return false;
+    out->ir = ir_emit(cnm, expr_arith_ops[optype], out->type.type[0].class, a, b, 0);
+    return out->ir != 0;
+}
+
+// Run an arithmetic operation on left and right and perform constant folding
+// if nessesary. backup is the operator token, for errors
+static bool expr_arith_apply(cnm_t *cnm, valref_t *out, bool gencode, token_type_t optype,
+                             valref_t *left, valref_t *right, const token_t *backup) {
+    *out = (valref_t){0};
+
+    // Set to if the operation can only be for integers (only needed for
+    // constant folding)
+    bool int_only_op = false;
+    switch (optype) {
+    case TOKEN_MODULO: case TOKEN_BIT_OR: case TOKEN_BIT_AND:
+    case TOKEN_BIT_XOR: case TOKEN_SHIFT_L: case TOKEN_SHIFT_R:
+        int_only_op = true;
+        break;
+    default: break;
+    }
+
+    // Make sure operands can even perform the operation we want
+    if (!type_is_arith(*left->type.type) || !type_is_arith(*right->type.type)) {
+        cnm->s.tok = *backup;
+        cnm_doerr(cnm, true, "expect arithmetic types for both operators of operand");
+        return false;
+    }
+
+    // Make sure that if we are doing something like a bit operation that
+    // we don't use it on floating point types
+    if (int_only_op && (type_is_fp(*left->type.type) || type_is_fp(*right->type.type))) {
+        cnm->s.tok = *backup;
+        cnm_doerr(cnm, true, "expected integer operands for integer/bitwise operation");
+        return false;
+    }
+
+    // Get the new type and convert both sides at compile time if we can
+    if (!set_arith_type(cnm, out, left, right)) return false;
+    if (left->isliteral) valref_cast_literal(cnm, left, out->type);
+    if (right->isliteral) valref_cast_literal(cnm, right, out->type);
+
+    // Start constant propogation if we can
+    if (!left->isliteral || !right->isliteral) {
+        return !gencode || expr_arith_emit(cnm, out, optype, left, right);
+    }
+
+    // Do the operation in question
+    switch (optype) {
+    case TOKEN_PLUS: cf_add(out, left, right); break;
+    case TOKEN_MINUS: cf_sub(out, left, right); break;
+    case TOKEN_STAR: cf_mul(out, left, right); break;
+    case TOKEN_DIVIDE: cf_div(out, left, right); break;
+    case TOKEN_MODULO: cf_mod(out, left, right); break;
+    case TOKEN_BIT_OR: cf_bit_or(out, left, right); break;
+    case TOKEN_BIT_XOR: cf_bit_xor(out, left, right); break;
+    case TOKEN_BIT_AND: cf_bit_and(out, left, right); break;
+    case TOKEN_SHIFT_L: cf_shift_l(out, left, right); break;
+    case TOKEN_SHIFT_R: cf_shift_r(out, left, right); break;
+    default:
+        // Should never be reached (dead code)
+        break;
+    }
+    
+    // Enforce bit width and class
+    valref_cast_literal(cnm, out, out->type);
+    out->isliteral = true;
+    return true;
+}
+
+// Generate valref that runs arithmetic operation on left and right hand side
+// and perform constant folding if nessesary
+static bool expr_arith(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                       valref_t *left, const typeref_t *expected_type) {
+    // Get current precedence level
+    const prec_t prec = expr_rules[cnm->s.tok.type].infix_prec;
+
+    // Skip past arithmetic token to be at start of right hand of equasion
+    const token_type_t optype = cnm->s.tok.type;
+    const token_t backup = cnm->s.tok; // Used for if an error happens
+    token_next(cnm);
+
+    // Evaluate right hand side with left to right associativity
+    valref_t right;
+    if (!expr_parse(cnm, &right, gencode, gendata, prec + 1, NULL)) return false;
+    return expr_arith_apply(cnm, out, gencode, optype, left, &right, &backup);
+}
+
+// Generate ast node that performs a math operation on its child and does
+// constant folding if nessescary
+static bool expr_prefix_arith(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                              const typeref_t *expected_type) {
+    *out = (valref_t){0};
+
+    // Save the operation type
+    const token_type_t optype = cnm->s.tok.type;
+
+    // Set to true if the operation can only be for integers (only needed for
+    // constant folding)
+    bool int_only_op = optype == TOKEN_BIT_NOT;
+
+    // Skip pout arithmetic token to be at start of right hand of equasion
+    const token_t backup = cnm->s.tok; // Used for if an error happens
+    token_next(cnm);
+
+    // Evaluate child with right to left hand associativity. Use PREC_PREFIX
+    // for every option because every token used by this function has that prec
+    if (!expr_parse(cnm, out, gencode, gendata, PREC_PREFIX, NULL)) return false;
+
+    // Make sure we can even perform the operation we want with this type
+    if (!type_is_arith(*out->type.type)) {
+        cnm->s.tok = backup;
+        cnm_doerr(cnm, true, "expect arithmetic type for operand of operator");
+        return false;
+    }
+
+    // Make sure that if we are doing something like a bit operation that
+    // we don't use it on floating point types
+    if (int_only_op && type_is_fp(*out->type.type)) {
+        cnm->s.tok = backup;
+        cnm_doerr(cnm, true, "expected integer operand for integer/bitwise operation");
+        return false;
+    }
+
+    // Get the new type and convert both sides at compile time if we can
+    type_t type = { .class = out->type.type[0].class, .n = out->type.type[0].n };
+    if (optype == TOKEN_NOT) type.class = TYPE_BOOL;
+    else type_promote_to_int(&type);
+    typeref_t newtype;
+    if (!typeref_set(cnm, &newtype, &type, 1)) return false;
+
+    // Now perform constant folding if we can
+    if (!out->isliteral) {
+        if (!gencode) return true;
+
+        // Logical not works on the operand as is, the others promote it first
+        if (optype != TOKEN_NOT && !valref_cast_runtime(cnm, out, newtype)) return false;
+        const ir_op_t op = optype == TOKEN_NOT ? IR_NOT
+            : optype == TOKEN_MINUS ? IR_NEG : IR_BNOT;
+        out->type = newtype;
+        return (out->ir = ir_emit(cnm, op, type.class, out->ir, 0, 0)) != 0;
+    }
+    out->type = newtype;
+
+    // Do the operation in question
+    switch (optype) {
+    case TOKEN_NOT: cf_not(out); break;
+    case TOKEN_MINUS: cf_neg(out); break;
+    case TOKEN_BIT_NOT: cf_bit_not(out); break;
+    default:
+        // Should never be reached (dead code)
+        break;
+    }
+    
+    // Enforce bit width and class
+    valref_cast_literal(cnm, out, out->type);
+    return true;
+}
+
+// Implicitly convert a value to the type of what it is assigned to, passed as
+// or returned as
+static bool valref_assign_cast(cnm_t *cnm, valref_t *val, const typeref_t to) {
+    if (type_is_arith(*val->type.type) && type_is_arith(*to.type)) {
+        return valref_cast(cnm, val, to, true);
+    }
+    if (!type_eq(val->type, to, false)) {
+        cnm_doerr(cnm, true, "assigning expression of different type");
+        return false;
+    }
+    return true;
+}
+
+// A literal of the type with all bits zero
+static inline valref_t valref_zero(const typeref_t type) {
+    return (valref_t){ .isliteral = true, .type = type };
+}
+
+// Get the type of a bool. Returns false if we ran out of memory
+static inline bool typeref_bool(cnm_t *cnm, typeref_t *out) {
+    return typeref_set(cnm, out, &(type_t){ .class = TYPE_BOOL, .n = 1 }, 1);
+}
+
+// Store val (which already has the type of var) in a variable. out is the
+// value of the assignment
+static bool expr_store(cnm_t *cnm, valref_t *out, scope_t *var, const valref_t *val) {
+    const ir_val_t v = valref_ir(cnm, val);
+    if (!v) return false;
+    if (var->scope > 0) {
+        var->val = v;
     } else {
-        var->literal.u = !var->literal.i;
+        const ir_val_t addr = ir_emit_imm(cnm, IR_GLOBAL, TYPE_PTR, (uintptr_t)var->abs_addr);
+        if (!addr || !ir_emit(cnm, IR_STORE, TYPE_VOID, addr, v, 0)) return false;
     }
-    type->class = TYPE_BOOL;
+    *out = (valref_t){ .type = val->type, .ir = v };
+    return true;
 }
-static void cf_bit_not(valref_t *var) {
-    const typeclass_t class = var->type.type[0].class;
-    if (type_is_unsigned(*var->type.type)) {
-        var->literal.u = ~var->literal.u;
-    } else {
-        var->literal.u = ~var->literal.i;
+
+// Make sure that the value refers to a variable that can be changed
+static bool expr_check_assignable(cnm_t *cnm, const valref_t *val) {
+    if (!val->scope || val->isliteral
+        || !type_eq(val->type, type_get(cnm, val->scope->type), true)) {
+        cnm_doerr(cnm, true, "expression is not assignable");
+        return false;
+    }
+    if (val->type.type[0].isconst) {
+        cnm_doerr(cnm, true, "can not assign to const variable");
+        return false;
     }
+    return true;
 }
 
-// Generate valref that runs arithmetic operation on left and right hand side
-// and perform constant folding if nessesary
-static bool expr_arith(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                       valref_t *left, const typeref_t *expected_type) {
-    *out = (valref_t){0};
+// Binary operators of the compound assignments
+static const uint8_t expr_assign_ops[TOKEN_MAX] = {
+    [TOKEN_PLUS_EQ] = TOKEN_PLUS,       [TOKEN_MINUS_EQ] = TOKEN_MINUS,
+    [TOKEN_TIMES_EQ] = TOKEN_STAR,      [TOKEN_DIVIDE_EQ] = TOKEN_DIVIDE,
+    [TOKEN_MODULO_EQ] = TOKEN_MODULO,   [TOKEN_AND_EQ] = TOKEN_BIT_AND,
+    [TOKEN_OR_EQ] = TOKEN_BIT_OR,       [TOKEN_BIT_XOR_EQ] = TOKEN_BIT_XOR,
+    [TOKEN_SHIFT_L_EQ] = TOKEN_SHIFT_L, [TOKEN_SHIFT_R_EQ] = TOKEN_SHIFT_R,
+};
 
-    // Allocate ast type
-    if (!(out->type.type = cnm_alloc(cnm, sizeof(type_t), sizeof(type_t)))) return false;
-    out->type.size = 1;
-    out->type.type[0] = (type_t){0};
+// Generate an assignment (or compound assignment) to the variable on the left
+static bool expr_assign(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                        valref_t *left, const typeref_t *expected_type) {
+    const token_type_t optype = cnm->s.tok.type;
+    const token_t backup = cnm->s.tok;
+    if (!expr_check_assignable(cnm, left)) return false;
+    token_next(cnm);
 
-    // Get current precedence level
-    const prec_t prec = expr_rules[cnm->s.tok.type].infix_prec;
+    // Assignments are right associative
+    valref_t right;
+    if (!expr_parse(cnm, &right, gencode, gendata, PREC_ASSIGN, &left->type)) return false;
+    if (optype != TOKEN_ASSIGN) {
+        valref_t res, lhs = *left;
+        if (!expr_arith_apply(cnm, &res, gencode, expr_assign_ops[optype], &lhs, &right,
+                              &backup)) return false;
+        right = res;
+    }
+    if (!valref_assign_cast(cnm, &right, left->type)) return false;
+    return expr_store(cnm, out, left->scope, &right);
+}
 
-    // Set to if the operation can only be for integers (only needed for
-    // constant folding)
-    bool int_only_op = false;
+// Add one to or take one from a variable. out is the new value
+static bool expr_step(cnm_t *cnm, valref_t *out, bool gencode, token_type_t optype,
+                      const valref_t *var, const token_t *backup) {
+    valref_t one = { .isliteral = true, .literal.i = 1 };
+    if (!typeref_set(cnm, &one.type, &(type_t){ .class = TYPE_INT, .n = 32 }, 1)) return false;
+
+    valref_t res, old = *var;
+    if (!expr_arith_apply(cnm, &res, gencode, optype == TOKEN_PLUS_DBL ? TOKEN_PLUS : TOKEN_MINUS,
+                          &old, &one, backup)) return false;
+    if (!valref_cast(cnm, &res, var->type, gencode)) return false;
+    return expr_store(cnm, out, var->scope, &res);
+}
 
-    // Save the operation type
+// Generate a prefix increment or decrement, like ++i
+static bool expr_prefix_step(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                             const typeref_t *expected_type) {
     const token_type_t optype = cnm->s.tok.type;
-    switch (cnm->s.tok.type) {
-    case TOKEN_MODULO: case TOKEN_BIT_OR: case TOKEN_BIT_AND:
-    case TOKEN_BIT_XOR: case TOKEN_SHIFT_L: case TOKEN_SHIFT_R:
-        int_only_op = true;
-        break;
-    default: break;
+    const token_t backup = cnm->s.tok;
+    token_next(cnm);
+
+    valref_t var;
+    if (!expr_parse(cnm, &var, gencode, gendata, PREC_PREFIX, NULL)) return false;
+    if (!expr_check_assignable(cnm, &var)) return false;
+    return expr_step(cnm, out, gencode, optype, &var, &backup);
+}
+
+// Generate a postfix increment or decrement, which gives the old value
+static bool expr_postfix_step(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                              valref_t *left, const typeref_t *expected_type) {
+    const token_type_t optype = cnm->s.tok.type;
+    const token_t backup = cnm->s.tok;
+    if (!expr_check_assignable(cnm, left)) return false;
+    token_next(cnm);
+
+    valref_t res;
+    if (!expr_step(cnm, &res, gencode, optype, left, &backup)) return false;
+    *out = (valref_t){ .type = left->type, .ir = left->ir };
+    return true;
+}
+
+// IR operations of the comparison tokens
+static const uint8_t expr_compare_ops[TOKEN_MAX] = {
+    [TOKEN_EQ_EQ] = IR_EQ,      [TOKEN_NOT_EQ] = IR_NE,
+    [TOKEN_LESS] = IR_LT,       [TOKEN_LESS_EQ] = IR_LE,
+    [TOKEN_GREATER] = IR_GT,    [TOKEN_GREATER_EQ] = IR_GE,
+};
+
+// Fold a comparison of two literals of the same type
+static bool cf_compare(ir_op_t op, const valref_t *left, const valref_t *right) {
+    const typeclass_t class = left->type.type[0].class;
+    int cmp;
+    if (class == TYPE_DOUBLE || class == TYPE_FLOAT) {
+        const double l = class == TYPE_FLOAT ? left->literal.f : left->literal.d,
+            r = class == TYPE_FLOAT ? right->literal.f : right->literal.d;
+        if (l != l || r != r) return op == IR_NE; // NaN
+        cmp = (l > r) - (l < r);
+    } else if (type_is_unsigned(*left->type.type)) {
+        cmp = (left->literal.u > right->literal.u) - (left->literal.u < right->literal.u);
+    } else {
+        cmp = (left->literal.i > right->literal.i) - (left->literal.i < right->literal.i);
+    }
+    switch (op) {
+    case IR_EQ: return cmp == 0;
+    case IR_NE: return cmp != 0;
+    case IR_LT: return cmp < 0;
+    case IR_LE: return cmp <= 0;
+    case IR_GT: return cmp > 0;
+    default: return cmp >= 0;
     }
+}
 
-    // Skip past arithmetic token to be at start of right hand of equasion
-    const token_t backup = cnm->s.tok; // Used for if an error happens
+// Generate a comparison of the left and right hand side, which is a bool
+static bool expr_compare(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                         valref_t *left, const typeref_t *expected_type) {
+    const prec_t prec = expr_rules[cnm->s.tok.type].infix_prec;
+    const ir_op_t op = expr_compare_ops[cnm->s.tok.type];
+    const token_t backup = cnm->s.tok;
     token_next(cnm);
 
-    // Evaluate right hand side with left to right associativity
     valref_t right;
     if (!expr_parse(cnm, &right, gencode, gendata, prec + 1, NULL)) return false;
-
-    // Make sure operands can even perform the operation we want
     if (!type_is_arith(*left->type.type) || !type_is_arith(*right.type.type)) {
         cnm->s.tok = backup;
         cnm_doerr(cnm, true, "expect arithmetic types for both operators of operand");
         return false;
     }
 
-    // Make sure that if we are doing something like a bit operation that
-    // we don't use it on floating point types
-    if (int_only_op && (type_is_fp(*left->type.type) || type_is_fp(*right.type.type))) {
-        cnm->s.tok = backup;
-        cnm_doerr(cnm, true, "expected integer operands for integer/bitwise operation");
+    // Both sides are converted like they are for arithmetic
+    valref_t common;
+    *out = (valref_t){0};
+    if (!set_arith_type(cnm, &common, left, &right) || !typeref_bool(cnm, &out->type)) {
         return false;
     }
+    if (left->isliteral) valref_cast_literal(cnm, left, common.type);
+    if (right.isliteral) valref_cast_literal(cnm, &right, common.type);
+    if (left->isliteral && right.isliteral) {
+        out->isliteral = true;
+        out->literal.u = cf_compare(op, left, &right);
+        return true;
+    }
+    if (!gencode) return true;
 
-    // Get the new type and convert both sides at compile time if we can
-    if (!set_arith_type(cnm, out, left, &right)) return false;
-    if (left->isliteral) valref_cast_literal(cnm, left, out->type);
-    if (right.isliteral) valref_cast_literal(cnm, &right, out->type);
+    if (!left->isliteral && !valref_cast_runtime(cnm, left, common.type)) return false;
+    if (!right.isliteral && !valref_cast_runtime(cnm, &right, common.type)) return false;
+    const ir_val_t a = valref_ir(cnm, left), b = valref_ir(cnm, &right);
+    return a && b && (out->ir = ir_emit(cnm, op, TYPE_BOOL, a, b, 0));
+}
 
-    // Start constant propogation if we can
-    if (!left->isliteral || !right.isliteral) return true;
+// Generate && or ||. The right hand side is only run if the left doesn't
+// decide the result already, so at runtime this branches like an if
+static bool expr_logic(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                       valref_t *left, const typeref_t *expected_type) {
+    const prec_t prec = expr_rules[cnm->s.tok.type].infix_prec;
+    const bool isor = cnm->s.tok.type == TOKEN_OR;
+    token_next(cnm);
+
+    *out = (valref_t){0};
+    if (!typeref_bool(cnm, &out->type)) return false;
+    if (!valref_cast(cnm, left, out->type, gencode)) return false;
+
+    valref_t right;
+    if (!gencode) {
+        if (!expr_parse(cnm, &right, gencode, gendata, prec + 1, NULL)) return false;
+        if (!valref_cast(cnm, &right, out->type, gencode)) return false;
+        out->isliteral = left->isliteral && right.isliteral;
+        out->literal.u = isor ? left->literal.u || right.literal.u
+                              : left->literal.u && right.literal.u;
+        return true;
+    }
+
+    // The left side is the result when it is true for || and false for &&
+    stmt_join_t join;
+    uint32_t rhs;
+    const ir_val_t cond = valref_ir(cnm, left);
+    const ir_val_t decided = ir_emit_imm(cnm, IR_CONST, TYPE_BOOL, isor);
+    if (!cond || !decided || !join_init(cnm, &join, 1) || !ir_block_new(cnm, &rhs)
+        || !join_edge(cnm, &join, &decided)
+        || !ir_emit(cnm, IR_BR, TYPE_VOID, cond, isor ? join.block : rhs,
+                    isor ? rhs : join.block)) return false;
+
+    ir_block_start(cnm, rhs);
+    if (!expr_parse(cnm, &right, gencode, gendata, prec + 1, NULL)) return false;
+    if (!valref_cast(cnm, &right, out->type, gencode)) return false;
+    const ir_val_t val = valref_ir(cnm, &right);
+    if (!val || !join_jump(cnm, &join, &val)) return false;
+    return join_start(cnm, &join, &out->ir, &(typeclass_t){ TYPE_BOOL });
+}
+
+// Number of parameters of a function type. A single void one means none
+static uint32_t fn_nparams(const typeref_t type) {
+    if (type.type[0].n == 1 && type.type[1].n == 1 && type.type[2].class == TYPE_VOID) return 0;
+    return type.type[0].n;
+}
+
+// Type of the return value of a function type
+static typeref_t fn_ret(const typeref_t type) {
+    size_t layer = 1;
+    for (uint32_t i = 0; i < type.type[0].n; i++) layer += 1 + type.type[layer].n;
+    return (typeref_t){ .type = type.type + layer, .size = type.size - layer };
+}
+
+// Get the address of a function to call it. Functions that aren't defined yet
+// are looked up with the function address callback. The address is kept
+// unless the function belongs to the base
+static void *func_resolve(cnm_t *cnm, func_t *func, bool shared) {
+    if (func->addr) return func->addr;
+    if (func == cnm->fn.func) return cnm->fn.addr;
+
+    void *addr = NULL;
+    const strview_t name = ident_str(cnm, func->name);
+    char buf[256];
+    if (cnm->cb.fnaddr && name.len < sizeof(buf)) {
+        strview_cat_str(buf, sizeof(buf), name);
+        addr = cnm->cb.fnaddr(cnm, buf);
+    }
+    if (!addr) {
+        cnm_doerr(cnm, true, "function is called but never defined");
+        return NULL;
+    }
+    if (!shared) func->addr = addr;
+    return addr;
+}
+
+// Generate a call to a function, with the token at its name
+static bool expr_call(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
+                      func_t *func, bool shared) {
+    if (!gencode) {
+        cnm_doerr(cnm, true, "initializer element is not a compile time constant");
+        return false;
+    }
+    if (token_next(cnm)->type != TOKEN_PAREN_L) {
+        cnm_doerr(cnm, true, "expected '(' to call function");
+        return false;
+    }
+    token_next(cnm);
+
+    const typeref_t type = type_get(cnm, func->type);
+    const typeref_t ret = fn_ret(type);
+    const uint32_t nparams = fn_nparams(type);
+    if (!type_is_pod(*ret.type) && ret.type[0].class != TYPE_VOID) {
+        cnm_doerr(cnm, true, "only functions that return pod types can be called");
+        return false;
+    }
+    if (nparams > MAX_FN_PARAMS) {
+        cnm_doerr(cnm, true, "function has too many parameters to be called");
+        return false;
+    }
+
+    ir_val_t args[MAX_FN_PARAMS];
+    size_t layer = 1;
+    for (uint32_t i = 0; i < nparams; i++) {
+        if (i && cnm->s.tok.type == TOKEN_COMMA) token_next(cnm);
+        else if (i || cnm->s.tok.type == TOKEN_PAREN_R) {
+            cnm_doerr(cnm, true, "too few arguments to function");
+            return false;
+        }
+        const typeref_t param = { .type = type.type + layer + 1, .size = type.type[layer].n };
+        layer += 1 + param.size;
+        if (!type_is_pod(*param.type)) {
+            cnm_doerr(cnm, true, "only functions with pod parameters can be called");
+            return false;
+        }
+
+        valref_t arg;
+        if (!expr_parse(cnm, &arg, gencode, gendata, PREC_ASSIGN, &param)) return false;
+        if (!valref_assign_cast(cnm, &arg, param)) return false;
+        if (!(args[i] = valref_ir(cnm, &arg))) return false;
+    }
+    if (cnm->s.tok.type != TOKEN_PAREN_R) {
+        cnm_doerr(cnm, true, "too many arguments to function");
+        return false;
+    }
+    token_next(cnm);
+
+    void *const addr = func_resolve(cnm, func, shared);
+    if (!addr) return false;
+    const ir_val_t callee = ir_emit_imm(cnm, IR_CONST, TYPE_PTR, (uintptr_t)addr);
+    if (!callee || !ir_args_reserve(cnm, nparams)) return false;
+    ir_func_t *const f = &cnm->ir.f;
+    if (nparams) memcpy(f->args + f->nargs, args, sizeof(ir_val_t) * nparams);
+    f->nargs += nparams;
+
+    *out = (valref_t){
+        .type = ret,
+        .ir = ir_emit(cnm, IR_CALL, ret.type[0].class, callee, f->nargs - nparams, nparams),
+    };
+    return out->ir != 0;
+}
+
+// Initialize a cnm state object to compile code in the space provided by the code argument
+cnm_t *cnm_init(void *region, size_t regionsz,
+                void *code, size_t codesz,
+                void *globals, size_t globalsz) {
+    if (regionsz < sizeof(cnm_t)) return NULL;
+
+    cnm_t *cnm = region;
+    memset(cnm, 0, sizeof(*cnm));
+    cnm->code.buf = code;
+    cnm->code.len = codesz;
+    cnm->code.ptr = cnm->code.buf;
+#ifndef X64_NATIVE
+    cnm->code.interp = true;
+#endif
+    cnm->globals.buf = globals;
+    cnm->globals.len = globalsz;
+    cnm->globals.next = cnm->globals.buf;
+    cnm->globals.strnext = cnm->globals.buf + cnm->globals.len;
+    cnm->buflen = regionsz - sizeof(cnm_t);
+    cnm->alloc.next = cnm->buf;
+    cnm->alloc.curr_static = cnm->buf + cnm->buflen;
+    cnm->alloc.end = &cnm->alloc.curr_static;
+    cnm->alloc.static_end = &cnm->alloc.next;
+    if (!varmap_init(cnm)) return NULL;
+
+    return cnm;
+}
+
+bool cnm_copy(cnm_t *to, const cnm_t *from) {
+    // Ids are handed out after the ones from the base, so nothing can have
+    // been declared in the to state yet
+    if (to == from || to->code.ptr != to->code.buf || to->idents.count || to->types.count
+        || to->type.gid || to->type.typedef_gid || to->funcs || to->vars) return false;
+
+    to->base = from;
+    to->idents.first = to->idents.count = from->idents.count;
+    to->types.first = to->types.count = from->types.count;
+    to->type.first = to->type.gid = from->type.gid;
+    to->type.typedef_first = to->type.typedef_gid = from->type.typedef_gid;
+    to->funcs = from->funcs;
+    to->base_funcs = from->funcs;
+
+    // Functions of the base can only be called if they run the same way
+    to->code.interp = from->code.interp;
+    return true;
+}
+
+void cnm_set_errcb(cnm_t *cnm, cnm_err_cb_t errcb) {
+    cnm->cb.err = errcb;
+}
+
+void cnm_set_fnaddrcb(cnm_t *cnm, cnm_fnaddr_cb_t fnaddrcb) {
+    cnm->cb.fnaddr = fnaddrcb;
+}
+
+void cnm_set_chunkcb(cnm_t *cnm, cnm_chunk_cb_t chunkcb, void *user, size_t chunksz) {
+    cnm->alloc.cb = chunkcb;
+    cnm->alloc.user = user;
+    cnm->alloc.chunksz = chunksz;
+}
+
+void cnm_free_chunks(cnm_t *cnm) {
+    chunk_t *lists[] = { cnm->alloc.chunks, cnm->alloc.static_chunk };
+    for (int i = 0; i < arrlen(lists); i++) {
+        for (chunk_t *c = lists[i], *next; c; c = next) {
+            next = c->next;
+            cnm->alloc.cb(cnm->alloc.user, c, 0);
+        }
+    }
+    cnm->alloc.chunks = cnm->alloc.chunk = cnm->alloc.static_chunk = NULL;
+}
+
+bool cnm_set_structid(cnm_t *cnm, int old_type_id, int new_type_id) {
+    userty_t *u = userty_get(cnm, old_type_id);
+    if (!u || u->typeid != old_type_id) return false;
+    if (new_type_id < 0 || new_type_id >= 1 << 24) return false;
+
+    // The old ID keeps pointing at the type so types already using it still
+    // work. It only counts as occupied by the type that actually owns it
+    const userty_t *const occupant = userty_get(cnm, new_type_id);
+    if (occupant && occupant->typeid == new_type_id) return false;
+    if (!(u = userty_own(cnm, u, 0))) return false;
+    if (!userty_set(cnm, new_type_id, u)) return false;
+
+    // New IDs are handed out after the highest one
+    u->typeid = new_type_id;
+    if (new_type_id >= cnm->type.gid) cnm->type.gid = new_type_id + 1;
+    return true;
+}
+
+bool cnm_set_real_code_addr(cnm_t *cnm, void *addr) {
+    cnm->code.real_addr = addr;
+    return true;
+}
+
+bool cnm_set_interp(cnm_t *cnm, bool interp) {
+    if (cnm->code.interp == interp) return true;
+#ifndef X64_NATIVE
+    return false;
+#endif
+    if (cnm->code.ptr != cnm->code.buf || cnm->base) return false;
+    cnm->code.interp = interp;
+    return true;
+}
+
+bool cnm_set_tier(cnm_t *cnm, cnm_tier_t tier) {
+    if (cnm->code.tier == tier) return true;
+    if (tier != CNM_TIER_OPTIMIZE && tier != CNM_TIER_BASELINE) return false;
+    if (cnm->code.ptr != cnm->code.buf) return false;
+    cnm->code.tier = tier;
+    return true;
+}
+
+size_t cnm_get_global_size(const cnm_t *cnm) {
+    return cnm->globals.next - cnm->globals.buf;
+}
+
+size_t cnm_get_region_peak(const cnm_t *cnm) {
+    const size_t used = region_used(cnm);
+    return sizeof(cnm_t) + (used > cnm->alloc.peak ? used : cnm->alloc.peak);
+}
+
+size_t cnm_get_strings_saved(const cnm_t *cnm) {
+    return cnm->strs.saved;
+}
+
+// A global variable and where its data is moving to
+typedef struct globalent_s {
+    scope_t *var;
+    uint8_t *addr;
+    size_t size, align;
+    bool hot;
+} globalent_t;
+
+size_t cnm_pack_globals(cnm_t *cnm) {
+    // Code can have global addresses baked into it
+    if (cnm->code.ptr != cnm->code.buf) return 0;
+
+    uint32_t n = 0;
+    for (const scope_t *var = cnm->vars; var; var = var->next) n += var->abs_addr != NULL;
+    if (!n) return 0;
+
+    const region_mark_t mark = cnm_mark(cnm);
+    globalent_t *const ents = cnm_alloc(cnm, sizeof(*ents) * n, sizeof(void *));
+    if (!ents) {
+        cnm_release(cnm, mark);
+        return 0;
+    }
+
+    // The variable list is newest first, so fill it in backwards to keep
+    // declaration order within each group
+    size_t maxalign = 1;
+    uint32_t i = n;
+    for (scope_t *var = cnm->vars; var; var = var->next) {
+        if (!var->abs_addr) continue;
+        const typeref_t type = type_get(cnm, var->type);
+        const typeinf_t inf = type_getinf(cnm, type.type);
+        ents[--i] = (globalent_t){
+            .var = var,
+            .size = inf.size,
+            .align = inf.align ? inf.align : 1,
+            .hot = type_is_pod(type.type[0]) && inf.size <= sizeof(uint64_t),
+        };
+        if (ents[i].align > maxalign) maxalign = ents[i].align;
+    }
+
+    // Small scalars go first so that they share cache lines, then the arrays
+    // and structs. Both groups go from the biggest alignment to the smallest
+    // so that there is no padding inside of them.
+    uint8_t *next = cnm->globals.buf;
+    for (int hot = 1; hot >= 0; hot--) {
+        for (size_t align = maxalign; align; align /= 2) {
+            for (i = 0; i < n; i++) {
+                globalent_t *const e = ents + i;
+                if (e->hot != hot || e->align != align) continue;
+                e->addr = (uint8_t *)(((uintptr_t)(next - 1) / align + 1) * align);
+                next = e->addr + e->size;
+            }
+        }
+    }
+
+    // The padding between the two groups can make it bigger than it was
+    const size_t used = cnm_get_global_size(cnm), packed = next - cnm->globals.buf;
+    uint8_t *const tmp = packed < used ? cnm_alloc(cnm, packed, 16) : NULL;
+    if (!tmp) {
+        cnm_release(cnm, mark);
+        return 0;
+    }
+
+    memset(tmp, 0, packed);
+    for (i = 0; i < n; i++) {
+        memcpy(tmp + (ents[i].addr - cnm->globals.buf), ents[i].var->abs_addr, ents[i].size);
+        ents[i].var->abs_addr = ents[i].addr;
+    }
+    memcpy(cnm->globals.buf, tmp, packed);
+    cnm->globals.next = next;
+    cnm_release(cnm, mark);
+    return used - packed;
+}
+
+static cnm_memuse_t memuse(size_t used, size_t peak) {
+    return (cnm_memuse_t){ .used = used, .peak = used > peak ? used : peak };
+}
+
+void cnm_get_memstats(const cnm_t *cnm, cnm_memstats_t *stats) {
+    const size_t *bycat = cnm->alloc.bycat;
+    const size_t statics = region_static_used(cnm);
+    const size_t code = cnm->code.ptr - cnm->code.buf;
+    const size_t strings = cnm->globals.buf + cnm->globals.len
+        - cnm->globals.strnext;
+
+    *stats = (cnm_memstats_t){
+        .scratch = memuse(region_scratch_used(cnm), cnm->alloc.scratch_peak),
+        .statics = memuse(statics, statics),
+        .code = memuse(code, code),
+        .globals = memuse(cnm_get_global_size(cnm), cnm->globals.peak),
+        .strings = memuse(strings, strings),
+        .by = {
+            .types = bycat[MEM_TYPES],
+            .fields = bycat[MEM_FIELDS],
+            .typedefs = bycat[MEM_TYPEDEFS],
+            .funcs = bycat[MEM_FUNCS],
+            .vars = bycat[MEM_VARS],
+            .strings = bycat[MEM_STRINGS],
+            .idents = bycat[MEM_IDENTS],
+        },
+    };
+}
+
+static void cnm_set_src_n(cnm_t *cnm, const char *src, size_t len, const char *fname) {
+    cnm->s.src = src;
+    cnm->s.end = src + len;
+    cnm->s.fname = fname;
+    cnm->s.tok = (token_t){
+        .src = { .str = src, .len = 0 },
+        .start = { .row = 1, .col = 1 },
+        .end = { .row = 1, .col = 1 },
+        .line = src,
+        .endline = src,
+        .type = TOKEN_UNINITIALIZED,
+    };
+}
+
+static void cnm_set_src(cnm_t *cnm, const char *src, const char *fname) {
+    cnm_set_src_n(cnm, src, strlen(src), fname);
+}
+
+static bool parse_stmt(cnm_t *cnm);
+
+// Consume a token that has to be there
+static bool token_expect(cnm_t *cnm, token_type_t type, const char *err) {
+    if (cnm->s.tok.type != type) {
+        cnm_doerr(cnm, true, err);
+        return false;
+    }
+    token_next(cnm);
+    return true;
+}
+
+// Parse a condition in parentheses and convert it to a bool
+static bool parse_cond(cnm_t *cnm, valref_t *cond) {
+    if (!token_expect(cnm, TOKEN_PAREN_L, "expected '(' before condition")) return false;
+    typeref_t type;
+    if (!expr_parse(cnm, cond, true, true, PREC_FULL, NULL) || !typeref_bool(cnm, &type)
+        || !valref_cast(cnm, cond, type, true)) return false;
+    return token_expect(cnm, TOKEN_PAREN_R, "expected ')' after condition");
+}
+
+// End the current block by going to then if cond is true and to other if it
+// isn't. Returns which of them can be reached in then_live and other_live
+static bool stmt_branch(cnm_t *cnm, const valref_t *cond, uint32_t then, uint32_t other,
+                        bool *then_live, bool *other_live) {
+    *then_live = !cnm->fn.dead && (!cond->isliteral || cond->literal.u);
+    *other_live = !cnm->fn.dead && (!cond->isliteral || !cond->literal.u);
+    if (cond->isliteral) {
+        return ir_emit(cnm, IR_JMP, TYPE_VOID, cond->literal.u ? then : other, 0, 0) != 0;
+    }
+    return ir_emit(cnm, IR_BR, TYPE_VOID, cond->ir, then, other) != 0;
+}
+
+// Parse the declaration of local variables
+static bool parse_stmt_decl(cnm_t *cnm) {
+    type_t base;
+    bool istypedef;
+    if (!type_parse_declspec(cnm, &base, &istypedef)) return false;
+    if (istypedef || base.isstatic || base.isextern) {
+        cnm_doerr(cnm, true, "only local variables can be declared in functions");
+        return false;
+    }
+
+    while (true) {
+        ident_t name;
+        const typeref_t type = type_parse(cnm, &base, &name, false);
+        if (!typeref_isvalid(type)) return false;
+        if (!name) {
+            cnm_doerr(cnm, true, "expected name of local variable");
+            return false;
+        }
+        if (!type_is_pod(*type.type)) {
+            cnm_doerr(cnm, true, "local variables have to be pod types");
+            return false;
+        }
+        const scope_t *const old = varmap_find(cnm, name);
+        if (old && old->scope == cnm->scope) {
+            cnm_doerr(cnm, true, "redefinition of variable");
+            return false;
+        }
+
+        // Variables without an initializer start out as zero
+        valref_t val = valref_zero(type);
+        if (cnm->s.tok.type == TOKEN_ASSIGN) {
+            token_next(cnm);
+            if (!expr_parse(cnm, &val, true, true, PREC_ASSIGN, &type)) return false;
+            if (!valref_assign_cast(cnm, &val, type)) return false;
+        }
+
+        // The variable is only in scope after its initializer
+        scope_t *const var = cnm_alloc(cnm, sizeof(scope_t), sizeof(void *));
+        if (!var) return false;
+        *var = (scope_t){
+            .name = name,
+            .type = type_intern(cnm, type.type, type.size),
+            .val = valref_ir(cnm, &val),
+        };
+        if (!var->type || !var->val) return false;
+        varmap_add(cnm, var);
+
+        if (cnm->s.tok.type != TOKEN_COMMA) break;
+        token_next(cnm);
+    }
+    return token_expect(cnm, TOKEN_SEMICOLON, "expected ';'");
+}
 
-    // Do the operation in question
-    switch (optype) {
-    case TOKEN_PLUS: cf_add(out, left, &right); break;
-    case TOKEN_MINUS: cf_sub(out, left, &right); break;
-    case TOKEN_STAR: cf_mul(out, left, &right); break;
-    case TOKEN_DIVIDE: cf_div(out, left, &right); break;
-    case TOKEN_MODULO: cf_mod(out, left, &right); break;
-    case TOKEN_BIT_OR: cf_bit_or(out, left, &right); break;
-    case TOKEN_BIT_XOR: cf_bit_xor(out, left, &right); break;
-    case TOKEN_BIT_AND: cf_bit_and(out, left, &right); break;
-    case TOKEN_SHIFT_L: cf_shift_l(out, left, &right); break;
-    case TOKEN_SHIFT_R: cf_shift_r(out, left, &right); break;
-    default:
-        // Should never be reached (dead code)
-        break;
+static bool parse_stmt_block(cnm_t *cnm) {
+    token_next(cnm);
+    if (!scope_push(cnm)) return false;
+    while (cnm->s.tok.type != TOKEN_BRACE_R) {
+        if (cnm->s.tok.type == TOKEN_EOF) {
+            cnm_doerr(cnm, true, "expected '}'");
+            return false;
+        }
+        const bool ok = cnm_at_declspec(cnm) ? parse_stmt_decl(cnm) : parse_stmt(cnm);
+        if (!ok) return false;
     }
-    
-    // Enforce bit width and class
-    valref_cast_literal(cnm, out, out->type);
-    out->isliteral = true;
+    token_next(cnm);
+    scope_pop(cnm);
     return true;
 }
 
-// Generate ast node that performs a math operation on its child and does
-// constant folding if nessescary
-static bool expr_prefix_arith(cnm_t *cnm, valref_t *out, bool gencode, bool gendata,
-                              const typeref_t *expected_type) {
-    *out = (valref_t){0};
+static bool parse_stmt_if(cnm_t *cnm) {
+    token_next(cnm);
+    valref_t cond;
+    if (!parse_cond(cnm, &cond)) return false;
+
+    stmt_join_t join;
+    uint32_t then, other;
+    if (!join_init(cnm, &join, 0) || !ir_block_new(cnm, &then)) return false;
+    const uint32_t nlocals = join.nlocals;
+    ir_val_t *const vals = locals_save(cnm, nlocals);
+    if (!vals) return false;
+
+    // Without an else, the other block just goes to the join
+    bool then_live, other_live;
+    if (!ir_block_new(cnm, &other)) return false;
+    if (!stmt_branch(cnm, &cond, then, other, &then_live, &other_live)) return false;
+
+    ir_block_start(cnm, then);
+    cnm->fn.dead = !then_live;
+    if (!parse_stmt(cnm) || !join_jump(cnm, &join, NULL)) return false;
+
+    ir_block_start(cnm, other);
+    cnm->fn.dead = !other_live;
+    locals_restore(cnm, vals, nlocals);
+    if (cnm->s.tok.type == TOKEN_KW_ELSE) {
+        token_next(cnm);
+        if (!parse_stmt(cnm)) return false;
+    }
+    return join_jump(cnm, &join, NULL) && join_start(cnm, &join, NULL, NULL);
+}
 
-    // Allocate out type
-    if (!(out->type.type = cnm_alloc(cnm, sizeof(type_t), sizeof(type_t)))) return false;
-    out->type.size = 1;
-    out->type.type[0] = (type_t){0};
+// Parse the body of a loop. It can be left with break and continue
+static bool parse_loop_body(cnm_t *cnm, stmt_loop_t *loop) {
+    cnm->fn.loop = loop;
+    const bool ok = parse_stmt(cnm);
+    cnm->fn.loop = loop->outer;
+    return ok;
+}
 
-    // Save the operation type
-    const token_type_t optype = cnm->s.tok.type;
+// Go into the body of a loop or leave it depending on the condition
+static bool loop_branch(cnm_t *cnm, stmt_loop_t *loop, const valref_t *cond, uint32_t body) {
+    bool body_live, exit_live;
+    const bool dead = cnm->fn.dead;
+    if (!cond->isliteral || !cond->literal.u) {
+        if (!join_edge(cnm, &loop->exit, NULL)) return false;
+    }
+    if (!stmt_branch(cnm, cond, body, loop->exit.block, &body_live, &exit_live)) return false;
+    ir_block_start(cnm, body);
+    cnm->fn.dead = dead || !body_live;
+    return true;
+}
 
-    // Set to true if the operation can only be for integers (only needed for
-    // constant folding)
-    bool int_only_op = optype == TOKEN_BIT_NOT;
+static bool parse_stmt_while(cnm_t *cnm) {
+    token_next(cnm);
+    stmt_loop_t loop;
+    uint32_t body;
+    valref_t cond;
+    if (!loop_begin(cnm, &loop, NULL) || !ir_block_new(cnm, &body)) return false;
+    if (!parse_cond(cnm, &cond) || !loop_branch(cnm, &loop, &cond, body)) return false;
+    if (!parse_loop_body(cnm, &loop) || !loop_back(cnm, &loop)) return false;
+    return join_start(cnm, &loop.exit, NULL, NULL);
+}
 
-    // Skip pout arithmetic token to be at start of right hand of equasion
-    const token_t backup = cnm->s.tok; // Used for if an error happens
+static bool parse_stmt_do(cnm_t *cnm) {
     token_next(cnm);
+    stmt_loop_t loop;
+    stmt_join_t cont;
+    valref_t cond;
+    if (!join_init(cnm, &cont, 0) || !loop_begin(cnm, &loop, &cont)) return false;
+    if (!parse_loop_body(cnm, &loop) || !join_jump(cnm, &cont, NULL)
+        || !join_start(cnm, &cont, NULL, NULL)) return false;
+    if (!token_expect(cnm, TOKEN_KW_WHILE, "expected 'while' after do loop")) return false;
+    if (!parse_cond(cnm, &cond)) return false;
+
+    // The true edge goes back to the header
+    if (cond.isliteral) {
+        if (cond.literal.u ? !loop_back(cnm, &loop) : !join_jump(cnm, &loop.exit, NULL)) {
+            return false;
+        }
+    } else {
+        if (!loop_back_edge(cnm, &loop) || !join_edge(cnm, &loop.exit, NULL)
+            || !ir_emit(cnm, IR_BR, TYPE_VOID, cond.ir, loop.header, loop.exit.block)) {
+            return false;
+        }
+    }
+    return token_expect(cnm, TOKEN_SEMICOLON, "expected ';' after do loop")
+        && join_start(cnm, &loop.exit, NULL, NULL);
+}
 
-    // Evaluate child with right to left hand associativity. Use PREC_PREFIX
-    // for every option because every token used by this function has that prec
-    if (!expr_parse(cnm, out, gencode, gendata, PREC_PREFIX, NULL)) return false;
+// The step of a for loop is run after the body but comes before it, so it is
+// skipped over at first and parsed again once the body is done
+static bool parse_stmt_for(cnm_t *cnm) {
+    token_next(cnm);
+    if (!token_expect(cnm, TOKEN_PAREN_L, "expected '(' after for")) return false;
+    if (!scope_push(cnm)) return false;
 
-    // Make sure we can even perform the operation we want with this type
-    if (!type_is_arith(*out->type.type)) {
-        cnm->s.tok = backup;
-        cnm_doerr(cnm, true, "expect arithmetic type for operand of operator");
-        return NULL;
+    valref_t val;
+    if (cnm_at_declspec(cnm)) {
+        if (!parse_stmt_decl(cnm)) return false;
+    } else if (cnm->s.tok.type != TOKEN_SEMICOLON) {
+        if (!expr_parse(cnm, &val, true, true, PREC_FULL, NULL)) return false;
+        if (!token_expect(cnm, TOKEN_SEMICOLON, "expected ';' in for loop")) return false;
+    } else {
+        token_next(cnm);
     }
 
-    // Make sure that if we are doing something like a bit operation that
-    // we don't use it on floating point types
-    if (int_only_op && type_is_fp(*out->type.type)) {
-        cnm->s.tok = backup;
-        cnm_doerr(cnm, true, "expected integer operand for integer/bitwise operation");
-        return NULL;
+    stmt_loop_t loop;
+    stmt_join_t cont;
+    uint32_t body;
+    if (!join_init(cnm, &cont, 0) || !loop_begin(cnm, &loop, &cont)
+        || !ir_block_new(cnm, &body)) return false;
+
+    // A missing condition is always true
+    valref_t cond = { .isliteral = true, .literal.u = 1 };
+    if (cnm->s.tok.type != TOKEN_SEMICOLON) {
+        typeref_t type;
+        if (!expr_parse(cnm, &cond, true, true, PREC_FULL, NULL) || !typeref_bool(cnm, &type)
+            || !valref_cast(cnm, &cond, type, true)) return false;
     }
+    if (!token_expect(cnm, TOKEN_SEMICOLON, "expected ';' in for loop")) return false;
 
-    // Get the new type and convert both sides at compile time if we can
-    out->type.type[0].class = out->type.type[0].class;
-    if (optype == TOKEN_NOT) out->type.type[0].class = TYPE_BOOL;
-    else type_promote_to_int(&out->type);
+    const token_t step = cnm->s.tok;
+    for (int depth = 0; cnm->s.tok.type != TOKEN_PAREN_R || depth; token_next(cnm)) {
+        if (cnm->s.tok.type == TOKEN_EOF) {
+            cnm_doerr(cnm, true, "expected ')' after for loop");
+            return false;
+        }
+        depth += (cnm->s.tok.type == TOKEN_PAREN_L) - (cnm->s.tok.type == TOKEN_PAREN_R);
+    }
+    token_next(cnm);
 
-    // Now perform constant folding if we can
-    if (!out->isliteral) return out;
+    if (!loop_branch(cnm, &loop, &cond, body) || !parse_loop_body(cnm, &loop)) return false;
+    if (!join_jump(cnm, &cont, NULL) || !join_start(cnm, &cont, NULL, NULL)) return false;
 
-    // Do the operation in question
-    switch (optype) {
-    case TOKEN_NOT: cf_not(out); break;
-    case TOKEN_MINUS: cf_neg(out); break;
-    case TOKEN_BIT_NOT: cf_bit_not(out); break;
-    default:
-        // Should never be reached (dead code)
-        break;
+    const token_t after = cnm->s.tok;
+    cnm->s.tok = step;
+    if (cnm->s.tok.type != TOKEN_PAREN_R
+        && !expr_parse(cnm, &val, true, true, PREC_FULL, NULL)) return false;
+    if (cnm->s.tok.type != TOKEN_PAREN_R) {
+        cnm_doerr(cnm, true, "expected ')' after for loop");
+        return false;
     }
-    
-    // Enforce bit width and class
-    valref_cast_literal(cnm, out, out->type);
+    cnm->s.tok = after;
+
+    if (!loop_back(cnm, &loop) || !join_start(cnm, &loop.exit, NULL, NULL)) return false;
+    scope_pop(cnm);
     return true;
 }
 
-// Initialize a cnm state object to compile code in the space provided by the code argument
-cnm_t *cnm_init(void *region, size_t regionsz,
-                void *code, size_t codesz,
-                void *globals, size_t globalsz) {
-    if (regionsz < sizeof(cnm_t)) return NULL;
-    
-    cnm_t *cnm = region;
-    memset(cnm, 0, sizeof(*cnm));
-    cnm->code.buf = code;
-    cnm->code.len = codesz;
-    cnm->code.ptr = cnm->code.buf;
-    cnm->globals.buf = globals;
-    cnm->globals.len = globalsz;
-    cnm->globals.next = cnm->globals.buf;
-    cnm->globals.strnext = cnm->globals.buf + cnm->globals.len;
-    cnm->buflen = regionsz - sizeof(cnm_t);
-    cnm->alloc.next = cnm->buf;
-    cnm->alloc.curr_static = cnm->buf + cnm->buflen;
-    cnm->strs = NULL;
-
-    return cnm;
+static bool parse_stmt_return(cnm_t *cnm) {
+    token_next(cnm);
+    ir_val_t ret = 0;
+    if (cnm->fn.ret.type[0].class == TYPE_VOID) {
+        if (cnm->s.tok.type != TOKEN_SEMICOLON) {
+            cnm_doerr(cnm, true, "void function should not return a value");
+            return false;
+        }
+    } else {
+        valref_t val;
+        if (cnm->s.tok.type == TOKEN_SEMICOLON) {
+            cnm_doerr(cnm, true, "non-void function should return a value");
+            return false;
+        }
+        if (!expr_parse(cnm, &val, true, true, PREC_FULL, &cnm->fn.ret)) return false;
+        if (!valref_assign_cast(cnm, &val, cnm->fn.ret) || !(ret = valref_ir(cnm, &val))) {
+            return false;
+        }
+    }
+    if (!token_expect(cnm, TOKEN_SEMICOLON, "expected ';' after return")) return false;
+    return ir_emit(cnm, IR_RET, TYPE_VOID, ret, 0, 0) && stmt_dead_block(cnm);
 }
 
-void cnm_set_errcb(cnm_t *cnm, cnm_err_cb_t errcb) {
-    cnm->cb.err = errcb;
-}
+// Parse break or continue
+static bool parse_stmt_jump(cnm_t *cnm) {
+    const bool isbreak = cnm->s.tok.type == TOKEN_KW_BREAK;
+    stmt_loop_t *const loop = cnm->fn.loop;
+    if (!loop) {
+        cnm_doerr(cnm, true, isbreak ? "break statement not in loop"
+                                     : "continue statement not in loop");
+        return false;
+    }
+    token_next(cnm);
+    if (!token_expect(cnm, TOKEN_SEMICOLON, "expected ';'")) return false;
 
-bool cnm_set_real_code_addr(cnm_t *cnm, void *addr) {
-    cnm->code.real_addr = addr;
-    return true;
+    bool ok;
+    if (isbreak) ok = join_jump(cnm, &loop->exit, NULL);
+    else if (loop->cont) ok = join_jump(cnm, loop->cont, NULL);
+    else ok = loop_back(cnm, loop);
+    return ok && stmt_dead_block(cnm);
 }
 
-size_t cnm_get_global_size(const cnm_t *cnm) {
-    return cnm->globals.next - cnm->globals.buf;
+// Parse any type of statement
+static bool parse_stmt(cnm_t *cnm) {
+    switch (cnm->s.tok.type) {
+    case TOKEN_BRACE_L: return parse_stmt_block(cnm);
+    case TOKEN_KW_IF: return parse_stmt_if(cnm);
+    case TOKEN_KW_WHILE: return parse_stmt_while(cnm);
+    case TOKEN_KW_DO: return parse_stmt_do(cnm);
+    case TOKEN_KW_FOR: return parse_stmt_for(cnm);
+    case TOKEN_KW_RETURN: return parse_stmt_return(cnm);
+    case TOKEN_KW_BREAK: case TOKEN_KW_CONTINUE: return parse_stmt_jump(cnm);
+    case TOKEN_SEMICOLON:
+        token_next(cnm);
+        return true;
+    default: {
+        valref_t val;
+        return expr_parse(cnm, &val, true, true, PREC_FULL, NULL)
+            && token_expect(cnm, TOKEN_SEMICOLON, "expected ';'");
+    }
+    }
 }
 
-static void cnm_set_src(cnm_t *cnm, const char *src, const char *fname) {
-    cnm->s.src = src;
-    cnm->s.fname = fname;
-    cnm->s.tok = (token_t){
-        .src = { .str = src, .len = 0 },
-        .start = { .row = 1, .col = 1 },
-        .end = { .row = 1, .col = 1 },
-        .type = TOKEN_UNINITIALIZED,
-    };
-}
+// Bring the parameters of the function being defined into scope
+static bool parse_func_params(cnm_t *cnm, const typeref_t type, const fnparams_t *params) {
+    const uint32_t nparams = fn_nparams(type);
+    if (nparams > MAX_FN_PARAMS) {
+        cnm_doerr(cnm, true, "too many function parameters");
+        return false;
+    }
+    if (!ir_begin(cnm, nparams)) return false;
+
+    size_t layer = 1;
+    for (uint32_t i = 0; i < nparams; i++) {
+        const typeref_t param = { .type = type.type + layer + 1, .size = type.type[layer].n };
+        layer += 1 + param.size;
+        if (params->n != type.type[0].n || !params->names[i]) {
+            cnm_doerr(cnm, true, "parameter name omitted in function definition");
+            return false;
+        }
+        if (!type_is_pod(*param.type)) {
+            cnm_doerr(cnm, true, "function parameters have to be pod types");
+            return false;
+        }
 
-//// Parse any type of statement
-//static bool parse_stmt(cnm_t *cnm) {
-//    
-//}
+        scope_t *const var = cnm_alloc(cnm, sizeof(scope_t), sizeof(void *));
+        if (!var) return false;
+        *var = (scope_t){
+            .name = params->names[i],
+            .type = type_intern(cnm, param.type, param.size),
+            .val = ir_emit(cnm, IR_PARAM, param.type[0].class, i, 0, 0),
+        };
+        if (!var->type || !var->val) return false;
+        varmap_add(cnm, var);
+    }
+    return true;
+}
 
 // Parse and generate code for a function
-static bool parse_func(cnm_t *cnm, func_t *func) {
-    while (cnm->s.tok.type != TOKEN_BRACE_R) {
-        //if (!parse_stmt(cnm)) return false;
+static bool parse_func(cnm_t *cnm, func_t *func, const fnparams_t *params) {
+    const typeref_t type = type_get(cnm, func->type);
+    cnm->fn.func = func;
+    cnm->fn.ret = fn_ret(type);
+    if (cnm->code.interp) interp_align(cnm);
+    cnm->fn.addr = code_real_addr(cnm, cnm->code.ptr);
+    cnm->fn.dead = false;
+    cnm->fn.loop = NULL;
+    if (!type_is_pod(*cnm->fn.ret.type) && cnm->fn.ret.type[0].class != TYPE_VOID) {
+        cnm_doerr(cnm, true, "functions can only return pod types");
+        return false;
+    }
+
+    // The parameters are in their own scope around the body
+    const int scope = cnm->scope;
+    bool ok = scope_push(cnm) && parse_func_params(cnm, type, params);
+    while (ok && cnm->s.tok.type != TOKEN_BRACE_R) {
+        if (cnm->s.tok.type == TOKEN_EOF) {
+            cnm_doerr(cnm, true, "expected '}' at end of function");
+            ok = false;
+        } else {
+            ok = cnm_at_declspec(cnm) ? parse_stmt_decl(cnm) : parse_stmt(cnm);
+        }
     }
+    while (cnm->scope > scope) scope_pop(cnm);
+    cnm->fn.func = NULL;
+    if (!ok) return false;
     token_next(cnm);
 
-    return true;
+    // Falling off the end returns zero
+    ir_val_t ret = 0;
+    if (cnm->fn.ret.type[0].class != TYPE_VOID
+        && !(ret = valref_ir(cnm, &(valref_t){ .isliteral = true, .type = cnm->fn.ret }))) {
+        return false;
+    }
+    if (!ir_emit(cnm, IR_RET, TYPE_VOID, ret, 0, 0) || !ir_finish(cnm)) return false;
+    if (cnm->code.tier == CNM_TIER_OPTIMIZE && !ir_optimize(cnm)) return false;
+    if (cnm->code.interp) return interp_compile(cnm, &cnm->ir.f, &func->addr);
+    return x64_compile(cnm, &cnm->ir.f, &func->addr);
 }
 
 // Parse variable declaration/definition
-static bool parse_file_decl_var(cnm_t *cnm, strview_t name, typeref_t type) {
+static bool parse_file_decl_var(cnm_t *cnm, ident_t name, typeref_t type) {
     // Make sure that the variable has a defined size
     {
         typeinf_t inf = type_getinf(cnm, type.type);
@@ -3412,37 +8482,34 @@ static bool parse_file_decl_var(cnm_t *cnm, strview_t name, typeref_t type) {
         }
     }
 
-    scope_t *var = NULL;
-
-    // Find existing variable with this name
-    for (scope_t *iter = cnm->vars; iter && iter->scope == cnm->scope; iter = iter->next) {
-        if (!strview_eq(iter->name, name)) continue;
-
-        // Don't add duplicate variables
-        if (type_eq(type, iter->type, true)) {
-            var = iter;
-            break;
-        }
+    // Find existing variable with this name in this scope
+    scope_t *var = varmap_find(cnm, name);
+    if (var && var->scope != cnm->scope) var = NULL;
 
-        // Types don't match, throw error instead
+    // Don't add duplicate variables, but types have to match
+    if (var && !type_eq(type, type_get(cnm, var->type), true)) {
         cnm_doerr(cnm, true, "redeclaration of function with different types");
         return false;
     }
 
-    // Generate a new scope entry for that variable
+    // Generate a new scope entry for that variable. It outlives the
+    // declaration, so its type is interned in the static region once the
+    // initializer is done filling in array sizes
+    const bool isnew = !var;
     if (!var) {
-        if (!(var = cnm_alloc_static(cnm, sizeof(scope_t), sizeof(void *)))) return false;
+        if (!(var = cnm_alloc_static(cnm, sizeof(scope_t), sizeof(void *), MEM_VARS))) {
+            return false;
+        }
         *var = (scope_t){
             .name = name,
-            .type = type,
-            .scope = cnm->scope,
             .abs_addr = NULL,
-            .next = cnm->vars,
         };
-        cnm->vars = var;
+        varmap_add(cnm, var);
     }
 
-    if (cnm->s.tok.type != TOKEN_ASSIGN) return true;
+    if (cnm->s.tok.type != TOKEN_ASSIGN) {
+        return !isnew || (var->type = type_intern(cnm, type.type, type.size));
+    }
     token_next(cnm);
 
     // Actually allocate the variable
@@ -3478,19 +8545,22 @@ static bool parse_file_decl_var(cnm_t *cnm, strview_t name, typeref_t type) {
     val.scope = var;
     if (!val_enforce_global(cnm, &val)) return false;
 
-    return true;
+    return !isnew || (var->type = type_intern(cnm, type.type, type.size));
 }
 
 // Parse function definition
-static bool parse_file_decl_func(cnm_t *cnm, strview_t name, typeref_t type) {
+static bool parse_file_decl_func(cnm_t *cnm, ident_t name, typeref_t type,
+                                 const fnparams_t *params) {
     func_t *func = NULL;
+    bool shared = false;
 
     // Find existing function with this name
     for (func_t *iter = cnm->funcs; iter; iter = iter->next) {
-        if (!strview_eq(iter->name, name)) continue;
+        shared |= iter == cnm->base_funcs;
+        if (iter->name != name) continue;
 
         // Don't add duplicate functions
-        if (type_eq(type, iter->type, true)) {
+        if (type_eq(type, type_get(cnm, iter->type), true)) {
             func = iter;
             break;
         }
@@ -3502,14 +8572,18 @@ static bool parse_file_decl_func(cnm_t *cnm, strview_t name, typeref_t type) {
 
     // Create a new function if there isn't already one with this name and type
     if (!func) {
-        if (!(func = cnm_alloc_static(cnm, sizeof(func_t), sizeof(void *)))) return false;
+        if (!(func = cnm_alloc_static(cnm, sizeof(func_t), sizeof(void *), MEM_FUNCS))) {
+            return false;
+        }
         *func = (func_t){
             .next = cnm->funcs,
             .name = name,
-            .type = type,
+            .type = type_intern(cnm, type.type, type.size),
             .addr = NULL,
         };
+        if (!func->type) return false;
         cnm->funcs = func;
+        shared = false;
     }
 
     if (cnm->s.tok.type != TOKEN_BRACE_L) return true;
@@ -3519,23 +8593,31 @@ static bool parse_file_decl_func(cnm_t *cnm, strview_t name, typeref_t type) {
         return false;
     }
 
+    // Functions declared in the base are defined in a copy that hides them
+    if (shared) {
+        func_t *const copy = cnm_alloc_static(cnm, sizeof(func_t), sizeof(void *), MEM_FUNCS);
+        if (!copy) return false;
+        *copy = *func;
+        copy->next = cnm->funcs;
+        cnm->funcs = func = copy;
+    }
+
     // Do function definition (code)
-    return parse_func(cnm, func);
+    return parse_func(cnm, func, params);
 }
 
 // Parse typedef definition
-static bool parse_file_decl_typedef(cnm_t *cnm, strview_t name, typeref_t type) {
-    if (!name.str) {
+static bool parse_file_decl_typedef(cnm_t *cnm, ident_t name, typeref_t type) {
+    if (!name) {
         cnm_doerr(cnm, true, "can not have anonymous typedef");
         return false;
     }
 
     // Find existing typedef with this name
-    for (typedef_t *iter = cnm->type.typedefs; iter; iter = iter->next) {
-        if (!strview_eq(iter->name, name)) continue;
-
+    const typedef_t *const old = typedef_find(cnm, name);
+    if (old) {
         // Don't add duplicate typedefs
-        if (type_eq(type, iter->type, true)) return true;
+        if (type_eq(type, type_get(cnm, old->type), true)) return true;
 
         // Types don't match, throw error instead
         cnm_doerr(cnm, true, "redefinition of typedef");
@@ -3543,16 +8625,17 @@ static bool parse_file_decl_typedef(cnm_t *cnm, strview_t name, typeref_t type)
     }
 
     // Add new typedef definition
-    typedef_t *td = cnm_alloc(cnm, sizeof(typedef_t), sizeof(void *));
+    if (!typedef_reserve(cnm, cnm->type.typedef_gid)) return false;
+    typedef_t *td = cnm_alloc_static(cnm, sizeof(typedef_t), sizeof(typedef_t *), MEM_TYPEDEFS);
     if (!td) return false;
     *td = (typedef_t){
-        .type = type,
+        .type = type_intern(cnm, type.type, type.size),
         .name = name,
-        .typedef_id = cnm->type.typedef_gid++,
-        .next = cnm->type.typedefs,
+        .typedef_id = cnm->type.typedef_gid,
         .scope = cnm->scope,
     };
-    cnm->type.typedefs = td;
+    if (!td->type) return false;
+    cnm->type.typedefs[cnm->type.typedef_gid++ - cnm->type.typedef_first] = td;
     return true;
 }
 
@@ -3563,6 +8646,10 @@ static bool parse_file_decl(cnm_t *cnm) {
     // Hold old number of user types so that we don't post erronious warnings
     const userty_t *const userty_old = cnm->type.types;
 
+    // Everything that outlives the declaration is put in the static region, so
+    // the normal region only holds temporaries and can be reset afterwards
+    const region_mark_t mark = cnm_mark(cnm);
+
     // Get the base type
     bool istypedef, was_fn = false;
     type_t base;
@@ -3571,8 +8658,9 @@ static bool parse_file_decl(cnm_t *cnm) {
     // Get full types by aquiring the derived type
     while (true) {
         // Parse the type
-        strview_t name;
-        typeref_t type = type_parse(cnm, &base, &name, false);
+        ident_t name;
+        fnparams_t params;
+        typeref_t type = type_parse_ex(cnm, &base, &name, &params, false, false);
         if (!typeref_isvalid(type)) return false;
 
         // Now branch depending on what we parsed
@@ -3582,8 +8670,8 @@ static bool parse_file_decl(cnm_t *cnm) {
         } else if (type.type[0].class == TYPE_FN) {
             // Do function
             was_fn = true;
-            if (!parse_file_decl_func(cnm, name, type)) return false;
-        } else if (!name.str) {
+            if (!parse_file_decl_func(cnm, name, type, &params)) return false;
+        } else if (!name) {
             // Do nothing (empty declaration, that declares nothing)
             if (userty_old == cnm->type.types) {
                 cnm_doerr(cnm, false, "declaration does not declare anything");
@@ -3605,11 +8693,12 @@ static bool parse_file_decl(cnm_t *cnm) {
     }
     if (cnm->s.tok.type == TOKEN_SEMICOLON) token_next(cnm);
 
+    cnm_release(cnm, mark);
     return true;
 }
 
-bool cnm_parse(cnm_t *cnm, const char *src, const char *fname) {
-    cnm_set_src(cnm, src, fname);
+bool cnm_parse_n(cnm_t *cnm, const char *src, size_t len, const char *fname) {
+    cnm_set_src_n(cnm, src, len, fname);
     token_next(cnm);
     while (cnm->s.tok.type != TOKEN_EOF) {
         if (!parse_file_decl(cnm)) return false;
@@ -3617,3 +8706,293 @@ bool cnm_parse(cnm_t *cnm, const char *src, const char *fname) {
     return true;
 }
 
+bool cnm_parse(cnm_t *cnm, const char *src, const char *fname) {
+    return cnm_parse_n(cnm, src, strlen(src), fname);
+}
+
+
+void *cnm_fn_addr(const cnm_fn_t *fn) {
+    return fn->addr;
+}
+
+cnm_val_t cnm_interp_call(const void *fn, const cnm_val_t *args) {
+    return interp_exec(fn, args);
+}
+
+// Find the function with this name, NULL if there is none
+static const func_t *func_find(const cnm_t *cnm, const char *name) {
+    const size_t len = strlen(name);
+    const ident_t id = ident_find(cnm, name, len, hash_bytes(name, len));
+    if (!id) return NULL;
+    for (const func_t *func = cnm->funcs; func; func = func->next) {
+        if (func->name == id) return func;
+    }
+    return NULL;
+}
+
+const cnm_fn_t *cnm_get_fn(const cnm_t *cnm, const char *fn) {
+    return func_find(cnm, fn);
+}
+
+// Find the struct, union or enum with this name, NULL if there is none
+static const userty_t *userty_find(const cnm_t *cnm, const char *name) {
+    const size_t len = strlen(name);
+    const ident_t id = ident_find(cnm, name, len, hash_bytes(name, len));
+    const uint32_t tag = id ? ident_tag(cnm, id) : 0;
+    return tag ? userty_get(cnm, tag - 1) : NULL;
+}
+
+// The public struct and enum types point at the userty_t of the type, both in
+// the state and in snapshots, so these work on either
+const cnm_struct_t *cnm_get_struct(const cnm_t *cnm, const char *name) {
+    const userty_t *const u = userty_find(cnm, name);
+    return u && u->type != USER_ENUM ? (const cnm_struct_t *)u : NULL;
+}
+
+const cnm_enum_t *cnm_get_enum(const cnm_t *cnm, const char *name) {
+    const userty_t *const u = userty_find(cnm, name);
+    return u && u->type == USER_ENUM ? (const cnm_enum_t *)u : NULL;
+}
+
+int cnm_struct_get_id(const cnm_struct_t *s) {
+    return ((const userty_t *)s)->typeid;
+}
+
+size_t cnm_struct_get_size(const cnm_struct_t *s) {
+    return ((const userty_t *)s)->inf.size;
+}
+
+int cnm_enum_get_id(const cnm_enum_t *e) {
+    return ((const userty_t *)e)->typeid;
+}
+
+size_t cnm_enum_get_size(const cnm_enum_t *e) {
+    return ((const userty_t *)e)->inf.size;
+}
+
+void *cnm_get_global(cnm_t *cnm, const char *name) {
+    const size_t len = strlen(name);
+    const ident_t id = ident_find(cnm, name, len, hash_bytes(name, len));
+    const scope_t *const var = id ? varmap_find(cnm, id) : NULL;
+    return var ? var->abs_addr : NULL;
+}
+
+// Where everything goes in a snapshot (offsets from its start)
+typedef struct snaplayout_s {
+    uint32_t ntags, nfuncs, nvars, nbuckets;
+    size_t tags, funcs, vars, syms, buckets, names, size;
+} snaplayout_t;
+
+// Struct, union and enum tags are found through the interner so that only the
+// type each name currently refers to is counted
+static const userty_t *snap_tag(const cnm_t *cnm, ident_t id) {
+    if (ident_is_shadow(cnm, id)) return NULL;
+    const uint32_t tag = ident_tag(cnm, id);
+    return tag ? userty_get(cnm, tag - 1) : NULL;
+}
+
+// Functions from the base that were defined after cnm_copy are hidden by the
+// copy they were defined in
+static bool snap_fn_hidden(const cnm_t *cnm, const func_t *func) {
+    if (!cnm->base) return false;
+    for (const func_t *iter = cnm->funcs; iter != cnm->base_funcs; iter = iter->next) {
+        if (iter == func) return false;
+        if (iter->name == func->name) return true;
+    }
+    return false;
+}
+
+static snaplayout_t snap_layout(const cnm_t *cnm) {
+    snaplayout_t l = {0};
+    size_t namesz = 0;
+    for (ident_t id = 1; id <= cnm->idents.count; id++) {
+        if (!snap_tag(cnm, id)) continue;
+        l.ntags++;
+        namesz += ident_get(cnm, id)->len + 1;
+    }
+    for (const func_t *func = cnm->funcs; func; func = func->next) {
+        if (snap_fn_hidden(cnm, func)) continue;
+        l.nfuncs++;
+        namesz += ident_str(cnm, func->name).len + 1;
+    }
+    for (const scope_t *var = cnm->vars; var; var = var->next) {
+        if (!var->abs_addr) continue;
+        l.nvars++;
+        namesz += ident_str(cnm, var->name).len + 1;
+    }
+
+    // Same load factor as the interner
+    const uint32_t nsyms = l.ntags + l.nfuncs + l.nvars;
+    l.nbuckets = 1;
+    while (l.nbuckets < nsyms) l.nbuckets *= 2;
+
+    l.tags = align_size(sizeof(cnm_snap_t), sizeof(void *));
+    l.funcs = l.tags + sizeof(userty_t) * l.ntags;
+    l.vars = l.funcs + sizeof(func_t) * l.nfuncs;
+    l.syms = l.vars + sizeof(void *) * l.nvars;
+    l.buckets = l.syms + sizeof(snapsym_t) * nsyms;
+    l.names = l.buckets + sizeof(uint32_t) * l.nbuckets;
+    l.size = align_size(l.names + namesz, sizeof(void *));
+    return l;
+}
+
+// Add a named record to a snapshot that is being made
+static void snap_add(cnm_snap_t *snap, size_t *names, strview_t name, snapkind_t kind,
+                     size_t rec) {
+    uint8_t *const base = (uint8_t *)snap;
+    snapsym_t *const sym = (snapsym_t *)(base + snap->syms) + snap->nsyms;
+    uint32_t *const bucket = (uint32_t *)(base + snap->buckets);
+    const uint32_t hash = hash_bytes(name.str, name.len);
+
+    memcpy(base + *names, name.str, name.len);
+    base[*names + name.len] = '\0';
+    *sym = (snapsym_t){
+        .hash = hash,
+        .next = bucket[hash & (snap->nbuckets - 1)],
+        .name = *names,
+        .len = name.len,
+        .kind = kind,
+        .rec = rec,
+    };
+    bucket[hash & (snap->nbuckets - 1)] = ++snap->nsyms;
+    *names += name.len + 1;
+}
+
+size_t cnm_compact_size(const cnm_t *cnm) {
+    return snap_layout(cnm).size;
+}
+
+cnm_snap_t *cnm_compact(const cnm_t *cnm, void *buf, size_t bufsz) {
+    const snaplayout_t l = snap_layout(cnm);
+    if (l.size > bufsz || l.size > UINT32_MAX) return NULL;
+    if ((uintptr_t)buf % sizeof(void *)) return NULL;
+
+    uint8_t *const base = buf;
+    cnm_snap_t *const snap = buf;
+    memset(buf, 0, l.size);
+    *snap = (cnm_snap_t){
+        .size = l.size,
+        .nbuckets = l.nbuckets,
+        .syms = l.syms,
+        .buckets = l.buckets,
+    };
+
+    // Records only keep what the accessors need, names are in the symbols
+    size_t names = l.names, rec = l.tags;
+    for (ident_t id = 1; id <= cnm->idents.count; id++) {
+        const userty_t *const u = snap_tag(cnm, id);
+        if (!u) continue;
+        *(userty_t *)(base + rec) = (userty_t){
+            .type = u->type,
+            .typeid = u->typeid,
+            .scope = u->scope,
+            .inf = u->inf,
+        };
+        snap_add(snap, &names, ident_str(cnm, id), SNAP_TAG, rec);
+        rec += sizeof(userty_t);
+    }
+    for (const func_t *func = cnm->funcs; func; func = func->next) {
+        if (snap_fn_hidden(cnm, func)) continue;
+        *(func_t *)(base + rec) = (func_t){ .addr = func->addr };
+        snap_add(snap, &names, ident_str(cnm, func->name), SNAP_FN, rec);
+        rec += sizeof(func_t);
+    }
+    for (const scope_t *var = cnm->vars; var; var = var->next) {
+        if (!var->abs_addr) continue;
+        *(void **)(base + rec) = var->abs_addr;
+        snap_add(snap, &names, ident_str(cnm, var->name), SNAP_VAR, rec);
+        rec += sizeof(void *);
+    }
+    return snap;
+}
+
+size_t cnm_snap_size(const cnm_snap_t *snap) {
+    return snap->size;
+}
+
+// Find the record of a name in a snapshot, NULL if there is none
+static const void *snap_find(const cnm_snap_t *snap, const char *name, snapkind_t kind) {
+    const uint8_t *const base = (const uint8_t *)snap;
+    const snapsym_t *const syms = (const snapsym_t *)(base + snap->syms);
+    const uint32_t *const buckets = (const uint32_t *)(base + snap->buckets);
+    const size_t len = strlen(name);
+    const uint32_t hash = hash_bytes(name, len);
+
+    for (uint32_t i = buckets[hash & (snap->nbuckets - 1)]; i; i = syms[i - 1].next) {
+        const snapsym_t *const sym = &syms[i - 1];
+        if (sym->hash == hash && sym->kind == kind && sym->len == len
+            && memcmp(base + sym->name, name, len) == 0) {
+            return base + sym->rec;
+        }
+    }
+    return NULL;
+}
+
+const cnm_fn_t *cnm_snap_get_fn(const cnm_snap_t *snap, const char *fn) {
+    return snap_find(snap, fn, SNAP_FN);
+}
+
+const cnm_struct_t *cnm_snap_get_struct(const cnm_snap_t *snap, const char *name) {
+    const userty_t *const u = snap_find(snap, name, SNAP_TAG);
+    return u && u->type != USER_ENUM ? (const cnm_struct_t *)u : NULL;
+}
+
+const cnm_enum_t *cnm_snap_get_enum(const cnm_snap_t *snap, const char *name) {
+    const userty_t *const u = snap_find(snap, name, SNAP_TAG);
+    return u && u->type == USER_ENUM ? (const cnm_enum_t *)u : NULL;
+}
+
+void *cnm_snap_get_global(const cnm_snap_t *snap, const char *name) {
+    void *const *const addr = snap_find(snap, name, SNAP_VAR);
+    return addr ? *addr : NULL;
+}
+
+// Files are mapped with mmap where it exists, and read into memory otherwise
+bool cnm_parse_file(cnm_t *cnm, const char *path, cnm_file_t *file) {
+    *file = (cnm_file_t){0};
+#ifdef CNM_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    // Empty files can't be mapped, but there is nothing to map anyways
+    if (st.st_size) {
+        void *const src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (src == MAP_FAILED) return false;
+        *file = (cnm_file_t){ .src = src, .len = st.st_size };
+    } else {
+        close(fd);
+        *file = (cnm_file_t){ .src = "", .len = 0 };
+    }
+#else
+    FILE *const fp = fopen(path, "rb");
+    if (!fp) return false;
+    char *src = NULL;
+    long len;
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0
+        || !(src = malloc(len ? len : 1)) || fread(src, 1, len, fp) != (size_t)len) {
+        free(src);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+    *file = (cnm_file_t){ .src = src, .len = len };
+#endif
+
+    return cnm_parse_n(cnm, file->src, file->len, path);
+}
+
+void cnm_unmap_file(cnm_file_t *file) {
+    if (!file->src) return;
+#ifdef CNM_MMAP
+    if (file->len) munmap((void *)file->src, file->len);
+#else
+    free((void *)file->src);
+#endif
+    *file = (cnm_file_t){0};
+}
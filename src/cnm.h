@@ -98,6 +98,11 @@ typedef void(cnmcall *cnm_dbg_cb_t)(cnm_t *cnm, int line);
 // will error out.
 typedef void *(*cnm_fnaddr_cb_t)(cnm_t *cnm, const char *fn);
 
+// Called when the region runs out of memory to get a new chunk of at least
+// size bytes (return NULL if there is no more memory), or with a size of 0 to
+// free a chunk it returned before.
+typedef void *(*cnm_chunk_cb_t)(void *user, void *chunk, size_t size);
+
 // Initiailze CNM state
 // region can be free'd after the code is compiled. The outputted code is found
 // in the code buffer and its globals are found in the global buffer.
@@ -105,11 +110,13 @@ cnm_t *cnm_init(void *region, size_t regionsz,
                 void *code, size_t codesz,
                 void *globals, size_t globalsz);
 
-// Will copy type definitions and function declarations from one instance to
-// another (already initialized but with no compiled code) cnm state. Returns
-// false if there is not enough space or the to state has already started
-// compiling code. It will also override any already existing types in the to
-// cnm state object.
+// Makes the type definitions, typedefs and function declarations of one state
+// visible in another (already initialized) state without copying them. The to
+// state refers to the tables of the from state and only puts what is declared
+// after this in its own region, so from (and the source it parsed) has to stay
+// around and must not parse anything else while to is used. Many states can
+// share the same from state. Returns false if anything was already parsed into
+// the to state.
 bool cnm_copy(cnm_t *to, const cnm_t *from);
 
 // Adds typedefs from stdint.h into the cnm state
@@ -133,6 +140,14 @@ void cnm_set_dbgcb(cnm_t *cnm, cnm_dbg_cb_t errcb);
 // Sets callback for when an external function is parsed in cnm script
 void cnm_set_fnaddrcb(cnm_t *cnm, cnm_fnaddr_cb_t fnaddrcb);
 
+// Lets the region grow past the buffer given to cnm_init. Once it is full,
+// chunks of at least chunksz bytes are chained from the callback.
+void cnm_set_chunkcb(cnm_t *cnm, cnm_chunk_cb_t chunkcb, void *user, size_t chunksz);
+
+// Gives every chunk back to the chunk callback. The state can not be used
+// afterwards.
+void cnm_free_chunks(cnm_t *cnm);
+
 // Returns false if debug mode is changed after the first part of compiled code.
 bool cnm_set_debug(cnm_t *cnm, bool debug_mode);
 
@@ -149,6 +164,28 @@ bool cnm_set_real_code_addr(cnm_t *cnm, void *addr);
 // in the source code.
 bool cnm_set_stepmode(cnm_t *cnm, bool step_mode);
 
+// Returns false if it was changed after compilation began, or if there is no
+// code generator for this architecture (the interpreter is always used then).
+// If set to true, functions are compiled to threaded code that is run with
+// cnm_interp_call instead of to machine code, so the code buffer doesn't have
+// to be executable. cnm_fn_addr then returns a handle for cnm_interp_call
+// instead of a function pointer.
+bool cnm_set_interp(cnm_t *cnm, bool interp);
+
+// How much work goes into the code of every function, see cnm_set_tier
+typedef enum cnm_tier_e {
+    // The IR is cleaned up and values are kept in registers (the default)
+    CNM_TIER_OPTIMIZE,
+
+    // Code is generated in one pass over the IR with every value in memory,
+    // which compiles fastest but runs slower. Meant for reloading scripts
+    // while they are being worked on
+    CNM_TIER_BASELINE,
+} cnm_tier_t;
+
+// Returns false if it was changed after compilation began or isn't a tier.
+bool cnm_set_tier(cnm_t *cnm, cnm_tier_t tier);
+
 // Returns false if it was changed after compilation began.
 // If set to true, it will insert detailed error messages when NULL is
 // derefrenced or slices are accessed out of bounds.
@@ -159,18 +196,87 @@ bool cnm_set_rterr_detail(cnm_t *cnm, bool detailed);
 // Returns how many bytes are being used in the global buffer for the code
 size_t cnm_get_global_size(const cnm_t *cnm);
 
+// Returns the most region memory that was in use at once, which is how big the
+// region has to be to compile the same code without a chunk callback (plus a
+// little for alignment, which depends on where the region is)
+size_t cnm_get_region_peak(const cnm_t *cnm);
+
+// Returns how many bytes of the global buffer were saved by storing identical
+// string literals only once
+size_t cnm_get_strings_saved(const cnm_t *cnm);
+
+// Rearranges the global buffer so that small scalar globals sit next to each
+// other at the start and everything is sorted by alignment to get rid of
+// padding. Call it after parsing and before looking up or snapshotting global
+// addresses, since the variables move. Does nothing once code was generated.
+// Returns how many bytes of the global buffer were saved.
+size_t cnm_pack_globals(cnm_t *cnm);
+
+// Bytes in use right now and the most that were in use at once
+typedef struct cnm_memuse_s {
+    size_t used, peak;
+} cnm_memuse_t;
+
+// Where the memory handed to cnm_init went. scratch and statics are the two
+// ends of the region (statics are never given back so used is the peak), code
+// and globals are their buffers and strings is the end of the global buffer
+// that holds string literals. by splits statics up by what they were for.
+typedef struct cnm_memstats_s {
+    cnm_memuse_t scratch, statics, code, globals, strings;
+    struct {
+        size_t types, fields, typedefs, funcs, vars, strings, idents;
+    } by;
+} cnm_memstats_t;
+
+// Fills in stats with how much memory the cnm state is using
+void cnm_get_memstats(const cnm_t *cnm, cnm_memstats_t *stats);
+
 // If the new type id can not be set because there is already a type occupying
 // that id or if the new id is out of bounds, it will return false. If it
-// succeeded it will return true.
+// succeeded it will return true. Types already declared with the old id keep
+// working until another type is moved to it.
 bool cnm_set_structid(cnm_t *cnm, int old_type_id, int new_type_id);
 
 // Returns false when compilation or parsing failed
 bool cnm_parse(cnm_t *cnm, const char *src, const char *fname);
 
+// Same as cnm_parse but the source is len bytes long and doesn't need a null
+// terminator. The source is used in place, so keep it around for as long as
+// the state is used (it's where names and error messages come from).
+bool cnm_parse_n(cnm_t *cnm, const char *src, size_t len, const char *fname);
+
+// A file's contents mapped (read only) into memory by cnm_parse_file
+typedef struct cnm_file_s {
+    const char *src;
+    size_t len;
+} cnm_file_t;
+
+// Maps the file at path into memory and parses it in place without copying it.
+// Like with cnm_parse_n, the file has to stay mapped for as long as the state
+// is used. file->src is NULL if the file couldn't be mapped. Returns false
+// when that happens or when compilation or parsing failed.
+bool cnm_parse_file(cnm_t *cnm, const char *path, cnm_file_t *file);
+
+// Unmaps a file mapped by cnm_parse_file
+void cnm_unmap_file(cnm_file_t *file);
+
 // Can return NULL if the function at id is just declared or if id is out of
 // bounds.
 void *cnm_fn_addr(const cnm_fn_t *fn);
 
+// Argument or return value of a function run with cnm_interp_call. Integers
+// and pointers (cast to uintptr_t) go in i or u, floats in f and doubles in d.
+typedef union cnm_val_u {
+    long long i;
+    unsigned long long u;
+    float f;
+    double d;
+} cnm_val_t;
+
+// Runs a function compiled for the interpreter (see cnm_set_interp). fn is
+// what cnm_fn_addr returned for it and args has a value for every parameter.
+cnm_val_t cnm_interp_call(const void *fn, const cnm_val_t *args);
+
 // Returns NULL if the function in question does not exist.
 const cnm_fn_t *cnm_get_fn(const cnm_t *cnm, const char *fn);
 
@@ -190,5 +296,28 @@ int cnm_get_pod_id(const char *type);
 // Returns the address of a global variable
 void *cnm_get_global(cnm_t *cnm, const char *name);
 
+// Compact copy of everything the functions above can look up. It has no
+// pointers into itself or into the region, so once it is made the region and
+// the source can be freed and the snapshot can be copied anywhere. Function and
+// global addresses still point into the code and globals buffers.
+typedef struct cnm_snap_s cnm_snap_t;
+
+// Returns how many bytes cnm_compact needs
+size_t cnm_compact_size(const cnm_t *cnm);
+
+// Makes a snapshot in buf, which has to be aligned for a pointer. Returns NULL
+// if buf is too small or not aligned.
+cnm_snap_t *cnm_compact(const cnm_t *cnm, void *buf, size_t bufsz);
+
+// How many bytes the snapshot takes up (how much to copy when moving it)
+size_t cnm_snap_size(const cnm_snap_t *snap);
+
+// Same as the cnm_get functions but on a snapshot. What they return can be
+// used with the same functions as what the cnm_get functions return.
+const cnm_fn_t *cnm_snap_get_fn(const cnm_snap_t *snap, const char *fn);
+const cnm_struct_t *cnm_snap_get_struct(const cnm_snap_t *snap, const char *name);
+const cnm_enum_t *cnm_snap_get_enum(const cnm_snap_t *snap, const char *name);
+void *cnm_snap_get_global(const cnm_snap_t *snap, const char *name);
+
 #endif
 
@@ -9,6 +9,109 @@
 #ifndef _cnm_ir_h_
 #define _cnm_ir_h_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// The IR of a function is in SSA form and lives in flat arrays. Every value is
+// defined by exactly one instruction and is refered to by the index of that
+// instruction, so there is no separate register numbering. Instruction 0 is
+// never used so that a value of 0 means no value.
+typedef uint32_t ir_val_t;
+
+typedef enum ir_op_e {
+    IR_NOP,
+
+    // Values that come from outside of the function. imm is the constant's
+    // bits (floats in the low 32 bits) or the address of the global. a is the
+    // index of the parameter.
+    IR_CONST,       IR_GLOBAL,      IR_PARAM,
+
+    // Memory. a is the address, b the value that is stored
+    IR_LOAD,        IR_STORE,
+
+    // Binary operations on a and b, which have the same type as the result
+    IR_ADD,         IR_SUB,
+    IR_MUL,         IR_DIV,
+    IR_MOD,         IR_AND,
+    IR_OR,          IR_XOR,
+    IR_SHL,         IR_SHR,
+
+    // Comparisons of a and b, the result is a bool
+    IR_EQ,          IR_NE,
+    IR_LT,          IR_LE,
+    IR_GT,          IR_GE,
+
+    // Unary operations on a. IR_NOT is logical (the result is a bool) and
+    // IR_CAST converts a to the type of the result
+    IR_NEG,         IR_NOT,
+    IR_BNOT,        IR_CAST,
+
+    // Calls the function at address a with the arguments args[b + i] for
+    // i < c. The result has the class of the return type
+    IR_CALL,
+
+    // Picks the value from args[a + i] when coming from the ith predecessor
+    // of the block, b is the number of args and c the block. Phis are always
+    // at the start of their block.
+    IR_PHI,
+
+    // Block terminators. a is the block to jump to. For branches a is the
+    // condition and b and c are the blocks to go to when it's true and false.
+    // a is the returned value, if there is one.
+    IR_JMP,         IR_BR,
+    IR_RET,
+
+    IR_OP_COUNT,
+} ir_op_t;
+
+typedef struct ir_inst_s {
+    uint8_t op; // ir_op_t
+
+    // Class of the value this defines. Only POD types, BOOL, PTR, REF and
+    // ANYREF are used (see typeclass_t), VOID if it defines nothing
+    uint8_t type;
+    uint16_t pad;
+
+    // Operands (see ir_op_t). IR_CONST and IR_GLOBAL use b and c for the low
+    // and high halves of imm instead
+    uint32_t a, b, c;
+} ir_inst_t;
+
+// Instructions of a block are the range [first, first + ninsts). The last one
+// is always a terminator once the function is done. Predecessors are indices
+// of other blocks in args[preds + i].
+typedef struct ir_block_s {
+    uint32_t first, ninsts;
+    uint32_t preds, npreds;
+} ir_block_t;
+
+typedef struct ir_func_s {
+    ir_inst_t *insts;
+    uint32_t ninsts, instcap;
+
+    ir_block_t *blocks;
+    uint32_t nblocks, blockcap;
+
+    // Phi arguments and block predecessor lists
+    uint32_t *args;
+    uint32_t nargs, argcap;
+
+    uint32_t nparams;
+} ir_func_t;
+
+static inline uint64_t ir_imm(const ir_inst_t *inst) {
+    return (uint64_t)inst->c << 32 | inst->b;
+}
+
+static inline void ir_set_imm(ir_inst_t *inst, uint64_t imm) {
+    inst->b = (uint32_t)imm;
+    inst->c = (uint32_t)(imm >> 32);
+}
+
+// Whether the instruction ends a block
+static inline bool ir_is_term(const ir_inst_t *inst) {
+    return inst->op == IR_JMP || inst->op == IR_BR || inst->op == IR_RET;
+}
 
 #endif
 
@@ -4,7 +4,7 @@
 
 #include "../cnm.c"
 
-static uint8_t test_region[2048];
+static uint8_t test_region[8192];
 static uint8_t test_globals[2048];
 static uint8_t *test_globals_a4; // Aligned to 4 byte boundary
 static uint8_t *test_globals_a8; // Aligned to 4 byte boundary
@@ -19,6 +19,12 @@ static bool test_expect_err = false;
 static void test_expect_errcb(int line, const char *v, const char *s) {
     test_expect_err = true;
 }
+static char test_err_verbose[512];
+static int test_err_line;
+static void test_capture_errcb(int line, const char *v, const char *s) {
+    snprintf(test_err_verbose, sizeof(test_err_verbose), "%s", v);
+    test_err_line = line;
+}
 
 #define SIMPLE_TEST(_name, _errcb, _src) \
     static bool _name(void) { \
@@ -54,6 +60,53 @@ SIMPLE_TEST(test_lexer_uninitialized, test_errcb, "")
     if (!strview_eq(cnm->s.tok.src, SV(""))) return TESTFAIL;
     return true;
 }
+SIMPLE_TEST(test_lexer_error_line1, test_capture_errcb, "foo\n\n  bar\n \t baz \xC3\xA9 x\nqux")
+    // The diagnostic shows the line the bad token is on
+    while (token_next(cnm)->type != TOKEN_EOF);
+    if (test_err_line != 4) return TESTFAIL;
+    if (!strstr(test_err_verbose, "\n4  |   \t baz \xC3\xA9 x\n")) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_error_line2, test_capture_errcb, "\"a\"\n   \"b\"  \"c\xFF\"")
+    // Strings concatinated across lines report the line they started on
+    while (token_next(cnm)->type != TOKEN_EOF);
+    if (test_err_line != 1) return TESTFAIL;
+    if (!strstr(test_err_verbose, "\n1  |  \"a\"\n")) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_error_line3, test_capture_errcb, "\"a\"\n   \"b\" $")
+    // Tokens after them are on the line that the last string is on
+    while (token_next(cnm)->type != TOKEN_EOF);
+    if (test_err_line != 2) return TESTFAIL;
+    if (!strstr(test_err_verbose, "\n2  |     \"b\" $\n")) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_error_line4, test_capture_errcb, "\"a\"\n\"b\xFF\"")
+    // An error in a later string shows the line the token starts on
+    while (token_next(cnm)->type != TOKEN_EOF);
+    if (test_err_line != 1) return TESTFAIL;
+    if (!strstr(test_err_verbose, "\n1  |  \"a\"\n")) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_lexer_error_line5, test_capture_errcb)
+    // So do errors about the whole token, and the ones after it are on the
+    // line it ends on
+    if (cnm_parse(cnm, "const char *s = 1 \"a\"\n   \"b\";", "test_lexer_error_line5")) {
+        return TESTFAIL;
+    }
+    if (test_err_line != 1) return TESTFAIL;
+    if (!strstr(test_err_verbose, "\n1  |  const char *s = 1 \"a\"\n")) return TESTFAIL;
+
+    cnm = cnm_init(test_region, sizeof(test_region), test_code_area, test_code_size,
+                   test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_capture_errcb);
+    if (cnm_parse(cnm, "const char *s = \"a\"\n   \"b\"; int y = 3 $;", "test_lexer_error_line5")) {
+        return TESTFAIL;
+    }
+    if (test_err_line != 2) return TESTFAIL;
+    if (!strstr(test_err_verbose, "\n2  |     \"b\"; int y = 3 $;\n")) return TESTFAIL;
+    return true;
+}
 SIMPLE_TEST(test_lexer_ident, test_errcb, " _foo123_ ")
     token_next(cnm);
     if (cnm->s.tok.type != TOKEN_IDENT) return TESTFAIL;
@@ -64,6 +117,164 @@ SIMPLE_TEST(test_lexer_ident, test_errcb, " _foo123_ ")
     if (!strview_eq(cnm->s.tok.src, SV("_foo123_"))) return TESTFAIL;
     return true;
 }
+SIMPLE_TEST(test_lexer_whitespace, test_errcb, " \t\v\f\r\n foo1 ")
+    token_next(cnm);
+    if (cnm->s.tok.type != TOKEN_IDENT) return TESTFAIL;
+    if (cnm->s.tok.start.row != 2) return TESTFAIL;
+    if (cnm->s.tok.start.col != 2) return TESTFAIL;
+    if (cnm->s.tok.end.row != 2) return TESTFAIL;
+    if (cnm->s.tok.end.col != 6) return TESTFAIL;
+    if (!strview_eq(cnm->s.tok.src, SV("foo1"))) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_unknown_char, test_expect_errcb, "foo \xC3\xA9")
+    token_next(cnm);
+    if (cnm->s.tok.type != TOKEN_IDENT) return TESTFAIL;
+    token_next(cnm);
+    if (cnm->s.tok.type != TOKEN_EOF) return TESTFAIL;
+    return test_expect_err;
+}
+// Lexes src with every scanner implementation the cpu supports at every
+// alignment and makes sure they all match what the scalar scanners produce.
+// Each one is also lexed without a null terminator, with chars after the end
+// that would keep the last token going if they were read.
+static bool test_lexer_scanners_src(const char *src) {
+    const lex_scanners_t *impls[3] = { &lex_scanners_scalar };
+    int nimpls = 1;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("sse2")) impls[nimpls++] = &lex_scanners_sse2;
+    if (__builtin_cpu_supports("avx2")) impls[nimpls++] = &lex_scanners_avx2;
+#endif
+
+    static token_t expected[64];
+    static char strs[64][128];
+    static char buf[512];
+    const size_t len = strlen(src) + 1;
+    int ntoks = 0;
+    bool result = true;
+
+    static const char after[] = { '\0', 'a', ' ', '\"', '9' };
+    for (int i = 0; i < nimpls && result; i++) {
+        for (int align = 0; align < 32 * arrlen(after) && result; align++) {
+            cnm_t *cnm = cnm_init(test_region, sizeof(test_region),
+                                  test_code_area, test_code_size,
+                                  test_globals, sizeof(test_globals));
+            cnm_set_errcb(cnm, test_errcb);
+            lex_scan = *impls[i];
+            memset(buf, after[align / 32], sizeof(buf));
+            memcpy(buf + align % 32, src, len - 1);
+            cnm_set_src_n(cnm, buf + align % 32, len - 1, "test_lexer_scanners");
+
+            int t = 0;
+            for (; token_next(cnm)->type != TOKEN_EOF; t++) {
+                const token_t *tok = &cnm->s.tok;
+                if (i == 0 && align == 0) {
+                    expected[t] = *tok;
+                    if (tok->type == TOKEN_STRING) strcpy(strs[t], tok->s);
+                    ntoks = t + 1;
+                    continue;
+                }
+
+                if (t >= ntoks
+                    || tok->type != expected[t].type
+                    || tok->src.str - (buf + align % 32) != expected[t].src.str - buf
+                    || tok->src.len != expected[t].src.len
+                    || tok->start.row != expected[t].start.row
+                    || tok->start.col != expected[t].start.col
+                    || tok->end.row != expected[t].end.row
+                    || tok->end.col != expected[t].end.col
+                    || (tok->type == TOKEN_STRING && strcmp(tok->s, strs[t]) != 0)) {
+                    result = TESTFAIL;
+                    break;
+                }
+            }
+            if (result && t != ntoks) result = TESTFAIL;
+        }
+    }
+
+    lex_scanners_init();
+    return result;
+}
+static bool test_lexer_scanners1(void) {
+    return test_lexer_scanners_src(
+        "   \n\t\t  \n                                        "
+        "foo_bar_baz_0123456789_abcdefghijklmnopqrstuvwxyz_ABCDEFGHIJ x\n"
+        "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n  y \v\f\r"
+        "a b\nc\n d\n  e                                      \n"
+        "                                                     f");
+}
+static bool test_lexer_scanners2(void) {
+    return test_lexer_scanners_src(
+        "\"a somewhat long string literal with \\\"escapes\\\" and \\n in it!!\"  "
+        "u8\"ünïcödé string that is longer than a vector ☺☺☺\"\n  \"end\"  \n  z "
+        "\"\" \"\\\\\\\\\" \"0123456789abcdef0123456789abcdef0123456789abcdef\"");
+}
+static bool test_lexer_scanners4(void) {
+    // Tokens that run right up to the end of the source
+    return test_lexer_scanners_src("a \"str\" 12 long_identifier_at_the_end_0123456789")
+        && test_lexer_scanners_src("\"a string at the end of the source\"        \n     ")
+        && test_lexer_scanners_src("x +=");
+}
+SIMPLE_TEST(test_lexer_scanners3, test_expect_errcb, "\"plain strings can't hold ü\"")
+    token_next(cnm);
+    return test_expect_err;
+}
+#define K(name, str, first, last) str " "
+SIMPLE_TEST(test_lexer_keywords, test_errcb, KEYWORDS)
+#undef K
+    // Every keyword gets its own token, which also catches hash collisions
+    static const token_type_t expected[] = {
+#define K(name, str, first, last) name,
+KEYWORDS
+#undef K
+    };
+
+    for (int i = 0; i < arrlen(expected); i++) {
+        if (token_next(cnm)->type != expected[i]) return TESTFAIL;
+    }
+    if (token_next(cnm)->type != TOKEN_EOF) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_keywords_near_miss, test_errcb,
+            "in ints Int bools chart nt intt unsignedd unsigne typedefs _int sigbed")
+    // Identifiers that look like keywords must stay identifiers
+    for (int i = 0; i < 12; i++) {
+        if (token_next(cnm)->type != TOKEN_IDENT) return TESTFAIL;
+    }
+    if (token_next(cnm)->type != TOKEN_EOF) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_ident_intern1, test_errcb, "foo bar foo fo bar")
+    // Same identifiers get the same ids, different ones don't
+    ident_t ids[5];
+    for (int i = 0; i < arrlen(ids); i++) {
+        if (token_next(cnm)->type != TOKEN_IDENT) return TESTFAIL;
+        ids[i] = cnm->s.tok.id;
+        if (!ids[i]) return TESTFAIL;
+    }
+    if (ids[0] != ids[2] || ids[1] != ids[4]) return TESTFAIL;
+    if (ids[0] == ids[1] || ids[0] == ids[3] || ids[1] == ids[3]) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, ids[3]), SV("fo"))) return TESTFAIL;
+    if (ident_str(cnm, 0).len) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_ident_intern2, test_errcb,
+            "a0 a1 a2 a3 a4 a5 a6 a7 a8 a9 b0 b1 b2 b3 b4 b5 b6 b7 b8 b9 "
+            "a0 a1 a2 a3 a4 a5 a6 a7 a8 a9 b0 b1 b2 b3 b4 b5 b6 b7 b8 b9")
+    // Ids have to survive the bucket table growing
+    ident_t ids[20];
+    for (int i = 0; i < arrlen(ids); i++) {
+        if (token_next(cnm)->type != TOKEN_IDENT) return TESTFAIL;
+        ids[i] = cnm->s.tok.id;
+    }
+    if (cnm->idents.nbuckets <= IDENT_MIN_BUCKETS) return TESTFAIL;
+    for (int i = 0; i < arrlen(ids); i++) {
+        if (token_next(cnm)->type != TOKEN_IDENT) return TESTFAIL;
+        if (cnm->s.tok.id != ids[i]) return TESTFAIL;
+        if (!strview_eq(ident_str(cnm, ids[i]), cnm->s.tok.src)) return TESTFAIL;
+    }
+    return true;
+}
 SIMPLE_TEST(test_lexer_string1, test_errcb, "\"hello \"")
     token_next(cnm);
     if (cnm->s.tok.type != TOKEN_STRING) return TESTFAIL;
@@ -152,6 +363,75 @@ SIMPLE_TEST(test_lexer_string7, test_errcb,  "U\"abc\"")
     if (((uint32_t *)cnm->s.tok.s)[3] != '\0') return TESTFAIL;
     return true;
 }
+SIMPLE_TEST(test_lexer_string_dedup1, test_errcb, "\"hello\", \"hel\" \"lo\", u8\"hello\"")
+    // Identical strings are only stored once
+    const char *strs[3];
+    for (int i = 0; i < arrlen(strs); i++) {
+        if (token_next(cnm)->type != TOKEN_STRING) return TESTFAIL;
+        strs[i] = cnm->s.tok.s;
+        token_next(cnm);
+    }
+    if (strs[0] != strs[1] || strs[0] != strs[2]) return TESTFAIL;
+    if (strcmp(strs[0], "hello") != 0) return TESTFAIL;
+    if (cnm_get_strings_saved(cnm) != 2 * sizeof("hello")) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_string_dedup2, test_errcb,
+            "\"ab\", \"ab\\x00gh\", U\"ab\", \"a\\x00\\x00\\x00b\\x00\\x00\", U\"ab\", "
+            "\"ab\\x00gh\"")
+    // Strings with embedded nulls have to compare all their bytes
+    const char *strs[6];
+    for (int i = 0; i < arrlen(strs); i++) {
+        if (token_next(cnm)->type != TOKEN_STRING) return TESTFAIL;
+        strs[i] = cnm->s.tok.s;
+        token_next(cnm);
+    }
+    if (strs[0] == strs[1] || strs[0] == strs[2] || strs[2] == strs[3]) return TESTFAIL;
+    if (strs[2] != strs[4] || strs[1] != strs[5]) return TESTFAIL;
+    if ((uintptr_t)strs[2] % 4) return TESTFAIL;
+    if (((uint32_t *)strs[4])[1] != 'b') return TESTFAIL;
+    if (cnm_get_strings_saved(cnm) < sizeof(U"ab") + sizeof("ab\0gh")) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_string_utf8_1, test_errcb, "U\"ab\xC3\xA9\xE2\x98\xBA\xF0\x9F\x98\x80 c\\u00e9\"")
+    // ascii runs and non-ascii characters mixed together in a utf32 string
+    static const uint32_t expected[] = { 'a', 'b', 0xE9, 0x263A, 0x1F600, ' ', 'c', 0xE9, 0 };
+    if (token_next(cnm)->type != TOKEN_STRING) return TESTFAIL;
+    if (memcmp(cnm->s.tok.s, expected, sizeof(expected)) != 0) return TESTFAIL;
+    if (cnm->s.tok.end.col != 17) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_string_utf8_2, test_errcb, "u8\"\\U0001F600\xF0\x9F\x98\x80\"")
+    if (token_next(cnm)->type != TOKEN_STRING) return TESTFAIL;
+    if (strcmp(cnm->s.tok.s, "\xF0\x9F\x98\x80\xF0\x9F\x98\x80") != 0) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_string_utf8_3, test_expect_errcb, "u8\"abc\xC3(\"")
+    // Truncated sequence
+    if (token_next(cnm)->type != TOKEN_EOF) return TESTFAIL;
+    return test_expect_err;
+}
+SIMPLE_TEST(test_lexer_string_utf8_4, test_expect_errcb, "U\"abc\xC0\xAF\"")
+    // Overlong encoding of '/'
+    if (token_next(cnm)->type != TOKEN_EOF) return TESTFAIL;
+    return test_expect_err;
+}
+#define TEST_STR64 "\"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\" "
+#define TEST_STR1K TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64 \
+                   TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64 \
+                   TEST_STR64 TEST_STR64 TEST_STR64 TEST_STR64
+SIMPLE_TEST(test_lexer_string_fill1, test_errcb, TEST_STR1K TEST_STR64 TEST_STR64)
+    // Concatinated strings that take up most of the globals memory still fit
+    if (token_next(cnm)->type != TOKEN_STRING) return TESTFAIL;
+    if (strlen(cnm->s.tok.s) != 18 * 64) return TESTFAIL;
+    if (memcmp(cnm->s.tok.s + 17 * 64, "0123456789abcdef", 16) != 0) return TESTFAIL;
+    if (cnm->s.tok.s + 18 * 64 + 1 != (char *)test_globals + sizeof(test_globals)) return TESTFAIL;
+    return true;
+}
+SIMPLE_TEST(test_lexer_string_fill2, test_expect_errcb, TEST_STR1K TEST_STR1K)
+    if (token_next(cnm)->type != TOKEN_EOF) return TESTFAIL;
+    return test_expect_err;
+}
 SIMPLE_TEST(test_lexer_char1, test_errcb,  "'h'")
     token_next(cnm);
     if (cnm->s.tok.type != TOKEN_CHAR) return TESTFAIL;
@@ -746,12 +1026,12 @@ SIMPLE_TEST(test_expr_constant_folding26, test_errcb,  "1 + 'a'")
 SIMPLE_TEST(test_type_parsing1, test_errcb,  "const char *foo")
     token_next(cnm);
     bool istypedef;
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, &istypedef)) return TESTFAIL;
     typeref_t type = type_parse(cnm, &base, &name, false);
     if (istypedef) return TESTFAIL;
-    if (!strview_eq(name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("foo"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_PTR },
@@ -764,12 +1044,12 @@ SIMPLE_TEST(test_type_parsing1, test_errcb,  "const char *foo")
 SIMPLE_TEST(test_type_parsing2, test_errcb,  "typedef unsigned char u8")
     token_next(cnm);
     bool istypedef;
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, &istypedef)) return TESTFAIL;
     typeref_t type = type_parse(cnm, &base, &name, false);
     if (!istypedef) return TESTFAIL;
-    if (!strview_eq(name, SV("u8"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("u8"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_UCHAR, .n = 8 },
@@ -1115,11 +1395,11 @@ SIMPLE_TEST(test_type_parsing9, test_errcb,  "int a, *b, *c[2]")
     token_next(cnm);
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
-    strview_t name;
+    ident_t name;
 
     // a
     typeref_t type = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("a"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
@@ -1132,7 +1412,7 @@ SIMPLE_TEST(test_type_parsing9, test_errcb,  "int a, *b, *c[2]")
 
     // b
     type = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("b"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_PTR },
@@ -1146,7 +1426,7 @@ SIMPLE_TEST(test_type_parsing9, test_errcb,  "int a, *b, *c[2]")
 
     // c
     type = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("c"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 2 },
@@ -1164,11 +1444,11 @@ GENERIC_TEST(test_type_parsing10, test_expect_errcb)
     token_next(cnm);
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
-    strview_t name;
+    ident_t name;
     typeref_t type = type_parse(cnm, &base, &name, false);
     if (!type.type) return TESTFAIL;
 
-    if (!strview_eq(name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("foo"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .size = 1,
         .type = (type_t[]){
@@ -1293,6 +1573,13 @@ SIMPLE_TEST(test_type_parsing20, test_expect_errcb,  "double : 9")
     type_parse(cnm, &base, NULL, true);
     return test_expect_err;
 }
+// Walk the fields of a struct from the last one declared to the first one
+static field_t *test_field_last(const field_list_t *s) {
+    return s->nfields ? &s->fields[s->nfields - 1] : NULL;
+}
+static field_t *test_field_prev(const field_list_t *s, const field_t *f) {
+    return f > s->fields ? (field_t *)f - 1 : NULL;
+}
 static cnm_t *test_util_create_types1(const char *fname) {
     cnm_t *cnm = cnm_init(test_region, sizeof(test_region),
                           test_code_area, test_code_size,
@@ -1317,11 +1604,11 @@ static bool test_type_parsing21(void) {
 
     // bar
     type_t base;
-    strview_t name;
+    ident_t name;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t type = type_parse(cnm, &base, &name, true);
     if (!type.type) return TESTFAIL;
-    if (!strview_eq(name, SV("bar"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("bar"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .size = 1,
         .type = (type_t[]){
@@ -1335,36 +1622,36 @@ static bool test_type_parsing21(void) {
     if (!u) return TESTFAIL;
     field_list_t *s = (field_list_t *)u->data;
 
-    if (!strview_eq(u->name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, u->name), SV("foo"))) return TESTFAIL;
     if (u->type != USER_STRUCT) return TESTFAIL;
     if (u->inf.size != sizeof(int) * 2) return TESTFAIL;
     if (u->inf.align != sizeof(int)) return TESTFAIL;
     if (u->scope != 0) return TESTFAIL;
     if (u->typeid != 0) return TESTFAIL;
     if (u->next != NULL) return TESTFAIL;
-    if (!s->fields) return TESTFAIL;
+    if (!s->nfields) return TESTFAIL;
 
     // struct foo::y
-    field_t *f = s->fields;
-    if (!strview_eq(f->name, SV("y"))) return TESTFAIL;
+    field_t *f = test_field_last(s);
+    if (!strview_eq(ident_str(cnm, f->name), SV("y"))) return TESTFAIL;
     if (f->offs != sizeof(int)) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .size = 1,
         .type = &(type_t){ .class = TYPE_INT, .n = 32 },
     }, true)) return TESTFAIL;
-    if (f->next == NULL) return TESTFAIL;
+    if (!test_field_prev(s, f)) return TESTFAIL;
 
     // struct foo::x
-    f = f->next;
-    if (!strview_eq(f->name, SV("x"))) return TESTFAIL;
+    f = test_field_prev(s, f);
+    if (!strview_eq(ident_str(cnm, f->name), SV("x"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .size = 1,
         .type = &(type_t){ .class = TYPE_INT, .n = 32 },
     }, true)) return TESTFAIL;
-    if (f->next != NULL) return TESTFAIL;
+    if (test_field_prev(s, f)) return TESTFAIL;
 
     return true;
 }
@@ -1377,11 +1664,11 @@ static bool test_type_parsing22(void) {
 
     // bar
     type_t base;
-    strview_t name;
+    ident_t name;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t type = type_parse(cnm, &base, &name, true);
     if (!type.type) return TESTFAIL;
-    if (!strview_eq(name, SV("bar"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("bar"))) return TESTFAIL;
     if (!type_eq(type, (typeref_t){
         .size = 1,
         .type = (type_t[]){
@@ -1406,11 +1693,11 @@ SIMPLE_TEST(test_typedef_parsing1, test_errcb,
         "    int b;\n"
         "} *bar[4]\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("bar"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("bar"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 4 },
@@ -1426,27 +1713,27 @@ SIMPLE_TEST(test_typedef_parsing1, test_errcb,
     if (!t) return TESTFAIL;
     if (t->inf.size != sizeof(int) * 2) return TESTFAIL;
     if (t->inf.align != sizeof(int)) return TESTFAIL;
-    if (!strview_eq(t->name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::b
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
@@ -1462,11 +1749,11 @@ SIMPLE_TEST(test_typedef_parsing2, test_errcb,
         "    int c;\n"
         "} FSN__FHA__FZR__FEX__FGO\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("FSN__FHA__FZR__FEX__FGO"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("FSN__FHA__FZR__FEX__FGO"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 0 },
@@ -1480,39 +1767,39 @@ SIMPLE_TEST(test_typedef_parsing2, test_errcb,
     if (!t) return TESTFAIL;
     if (t->inf.size != sizeof(double) * 3) return TESTFAIL;
     if (t->inf.align != sizeof(double)) return TESTFAIL;
-    if (!strview_eq(t->name, SV("baz"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("baz"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 16) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 8) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_DOUBLE },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 8 },
         },
@@ -1531,11 +1818,11 @@ SIMPLE_TEST(test_typedef_parsing3, test_errcb,
         "    char c;\n"
         "} EBE \n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("EBE"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("EBE"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 0 },
@@ -1547,78 +1834,78 @@ SIMPLE_TEST(test_typedef_parsing3, test_errcb,
     userty_t *t = cnm->type.types;
     if (!t) return TESTFAIL;
     field_list_t *s = (field_list_t *)t->data;
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (t->inf.size != 8) return TESTFAIL;
     if (t->inf.align != 4) return TESTFAIL;
-    if (t->name.str) return TESTFAIL;
+    if (t->name) return TESTFAIL;
     if (t->typeid != 1) return TESTFAIL;
 
     // foo::b::baz
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("baz"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("baz"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 3 },
             (type_t){ .class = TYPE_CHAR, .n = 8 },
         },
         .size = 2,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b::foo
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("foo"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // Goto next struct
     t = t->next;
     if (!t) return TESTFAIL;
     s = (field_list_t *)t->data;
-    f = s->fields;
+    f = test_field_last(s);
 
     // struct SNU
     if (t->inf.size != 16) return TESTFAIL;
     if (t->inf.align != 4) return TESTFAIL;
-    if (!strview_eq(t->name, SV("SNU"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("SNU"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 12) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 8 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 1 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
@@ -1637,11 +1924,11 @@ SIMPLE_TEST(test_typedef_parsing4, test_errcb,
         "    char c;\n"
         "} EBE \n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("EBE"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("EBE"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 0 },
@@ -1654,7 +1941,7 @@ SIMPLE_TEST(test_typedef_parsing4, test_errcb,
     if (!t) return TESTFAIL;
     if (t->inf.size != 8) return TESTFAIL;
     if (t->inf.align != 4) return TESTFAIL;
-    if (!strview_eq(t->name, SV("SNU"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("SNU"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
 
     return true;
@@ -1666,11 +1953,11 @@ SIMPLE_TEST(test_typedef_parsing5, test_errcb,
         "    BAZ\n"
         "} subihibi \n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("subihibi"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("subihibi"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 0 },
@@ -1684,18 +1971,18 @@ SIMPLE_TEST(test_typedef_parsing5, test_errcb,
     enum_t *e = (enum_t *)t->data;
     if (t->inf.size != 4) return TESTFAIL;
     if (t->inf.align != 4) return TESTFAIL;
-    if (!strview_eq(t->name, SV("E"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("E"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
 
     if (e->nvariants != 3) return TESTFAIL;
     if (e->variants[2].id.i != 0) return TESTFAIL;
-    if (!strview_eq(e->variants[2].name, SV("FOO"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, e->variants[2].name), SV("FOO"))) return TESTFAIL;
 
     if (e->variants[1].id.i != 10) return TESTFAIL;
-    if (!strview_eq(e->variants[1].name, SV("BAR"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, e->variants[1].name), SV("BAR"))) return TESTFAIL;
 
     if (e->variants[0].id.i != 11) return TESTFAIL;
-    if (!strview_eq(e->variants[0].name, SV("BAZ"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, e->variants[0].name), SV("BAZ"))) return TESTFAIL;
 
     return true;
 }
@@ -1706,11 +1993,11 @@ SIMPLE_TEST(test_typedef_parsing6, test_errcb,
         "    BAZ,\n"
         "} subihibi \n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("subihibi"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("subihibi"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 0 },
@@ -1730,18 +2017,18 @@ SIMPLE_TEST(test_typedef_parsing6, test_errcb,
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    if (!strview_eq(t->name, SV("E"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("E"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
 
     if (e->nvariants != 3) return TESTFAIL;
     if (e->variants[2].id.i != 0) return TESTFAIL;
-    if (!strview_eq(e->variants[2].name, SV("FOO"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, e->variants[2].name), SV("FOO"))) return TESTFAIL;
 
     if (e->variants[1].id.i != 1) return TESTFAIL;
-    if (!strview_eq(e->variants[1].name, SV("BAR"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, e->variants[1].name), SV("BAR"))) return TESTFAIL;
 
     if (e->variants[0].id.i != 2) return TESTFAIL;
-    if (!strview_eq(e->variants[0].name, SV("BAZ"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, e->variants[0].name), SV("BAZ"))) return TESTFAIL;
 
     return true;
 }
@@ -1755,11 +2042,11 @@ SIMPLE_TEST(test_typedef_parsing7, test_errcb,
         "    char;\n"
         "} EBE \n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
-    if (!strview_eq(name, SV("EBE"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, name), SV("EBE"))) return TESTFAIL;
     if (!type_eq(ref, (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 0 },
@@ -1771,78 +2058,78 @@ SIMPLE_TEST(test_typedef_parsing7, test_errcb,
     userty_t *t = cnm->type.types;
     if (!t) return TESTFAIL;
     field_list_t *s = (field_list_t *)t->data;
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (t->inf.size != 8) return TESTFAIL;
     if (t->inf.align != 4) return TESTFAIL;
-    if (t->name.str) return TESTFAIL;
+    if (t->name) return TESTFAIL;
     if (t->typeid != 1) return TESTFAIL;
 
     // foo::b::baz
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("baz"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("baz"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 3 },
             (type_t){ .class = TYPE_CHAR, .n = 8 },
         },
         .size = 2,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b::foo
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("foo"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // Goto next struct
     t = t->next;
     if (!t) return TESTFAIL;
     s = (field_list_t *)t->data;
-    f = s->fields;
+    f = test_field_last(s);
 
     // struct SNU
     if (t->inf.size != 16) return TESTFAIL;
     if (t->inf.align != 4) return TESTFAIL;
-    if (!strview_eq(t->name, SV("SNU"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("SNU"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
     if (!f) return TESTFAIL;
-    if (f->name.str) return TESTFAIL;
+    if (f->name) return TESTFAIL;
     if (f->offs != 12) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 8 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (f->name.str) return TESTFAIL;
+    if (f->name) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 1 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
@@ -1899,27 +2186,27 @@ SIMPLE_TEST(test_typedef_parsing11, test_errcb,
     if (!t) return TESTFAIL;
     if (t->inf.size != sizeof(int) * 2) return TESTFAIL;
     if (t->inf.align != sizeof(int)) return TESTFAIL;
-    if (!strview_eq(t->name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::b
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
@@ -1948,7 +2235,7 @@ SIMPLE_TEST(test_typedef_parsing12, test_errcb,
     if (!t) return TESTFAIL;
     if (t->inf.size != sizeof(int)) return TESTFAIL;
     if (t->inf.align != sizeof(int)) return TESTFAIL;
-    if (!strview_eq(t->name, SV("foo"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo"))) return TESTFAIL;
     if (t->typeid != 0) return TESTFAIL;
 
     return true;
@@ -1959,7 +2246,7 @@ SIMPLE_TEST(test_typedef_parsing13, test_errcb,
         "    int b : 24;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -1973,25 +2260,25 @@ SIMPLE_TEST(test_typedef_parsing13, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::b
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 24 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 4 },
         },
@@ -2007,7 +2294,7 @@ SIMPLE_TEST(test_typedef_parsing14, test_errcb,
         "    int c : 16;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2021,38 +2308,38 @@ SIMPLE_TEST(test_typedef_parsing14, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 16 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 20 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 4 },
         },
@@ -2067,7 +2354,7 @@ SIMPLE_TEST(test_typedef_parsing15, test_errcb,
         "    unsigned int b : 24;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2081,25 +2368,25 @@ SIMPLE_TEST(test_typedef_parsing15, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::b
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_UINT, .n = 24 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 4 },
         },
@@ -2115,7 +2402,7 @@ SIMPLE_TEST(test_typedef_parsing16, test_errcb,
         "    unsigned int b : 24;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2129,25 +2416,25 @@ SIMPLE_TEST(test_typedef_parsing16, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::b
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_UINT, .n = 24 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 4 },
         },
@@ -2163,7 +2450,7 @@ SIMPLE_TEST(test_typedef_parsing17, test_errcb,
         "    int c : 23;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2177,38 +2464,38 @@ SIMPLE_TEST(test_typedef_parsing17, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 23 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 1) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 5 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 4 },
         },
@@ -2224,7 +2511,7 @@ SIMPLE_TEST(test_typedef_parsing18, test_errcb,
         "    short c : 8;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2238,38 +2525,38 @@ SIMPLE_TEST(test_typedef_parsing18, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 2) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_SHORT, .n = 8 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 3) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 5 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 3 },
         },
@@ -2285,7 +2572,7 @@ SIMPLE_TEST(test_typedef_parsing19, test_errcb,
         "    short c;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2299,38 +2586,38 @@ SIMPLE_TEST(test_typedef_parsing19, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 2) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_SHORT, .n = 16 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 3) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 5 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_CHAR, .n = 3 },
         },
@@ -2346,7 +2633,7 @@ SIMPLE_TEST(test_typedef_parsing20, test_errcb,
         "    int c : 16;\n"
         "}\n")
     token_next(cnm);
-    strview_t name;
+    ident_t name;
     type_t base;
     if (!type_parse_declspec(cnm, &base, NULL)) return TESTFAIL;
     typeref_t ref = type_parse(cnm, &base, &name, false);
@@ -2360,38 +2647,38 @@ SIMPLE_TEST(test_typedef_parsing20, test_errcb,
     if (t->typeid != 0) return TESTFAIL;
    
     // foo::c
-    field_t *f = s->fields;
+    field_t *f = test_field_last(s);
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("c"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("c"))) return TESTFAIL;
     if (f->offs != 4) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 16 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::b
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("b"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("b"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 4) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 24 },
         },
         .size = 1,
     }, false)) return TESTFAIL;
-    f = f->next;
+    f = test_field_prev(s, f);
 
     // foo::a
     if (!f) return TESTFAIL;
-    if (!strview_eq(f->name, SV("a"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, f->name), SV("a"))) return TESTFAIL;
     if (f->offs != 0) return TESTFAIL;
     if (f->bit_offs != 0) return TESTFAIL;
-    if (!type_eq(f->type, (typeref_t){
+    if (!type_eq(type_get(cnm, f->type), (typeref_t){
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 4 },
         },
@@ -2411,19 +2698,18 @@ GENERIC_TEST(test_filelvl_typedef1, test_expect_errcb)
     if (!cnm->type.typedefs) return TESTFAIL;
     if (cnm->type.typedef_gid != 1) return TESTFAIL;
 
-    typedef_t *t = cnm->type.typedefs;
+    typedef_t *t = cnm->type.typedefs[cnm->type.typedef_gid - 1];
 
     // foo_t
-    if (!strview_eq(t->name, SV("foo_t"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo_t"))) return TESTFAIL;
     if (t->scope != 0) return TESTFAIL;
     if (t->typedef_id != 0) return TESTFAIL;
-    if (!type_eq(t->type, (typeref_t){
+    if (!type_eq(type_get(cnm, t->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
     }, true)) return TESTFAIL;
-    if (t->next) return TESTFAIL;
 
     return !test_expect_err;
 }
@@ -2433,32 +2719,30 @@ GENERIC_TEST(test_filelvl_typedef2, test_expect_errcb)
     if (!cnm->type.typedefs) return TESTFAIL;
     if (cnm->type.typedef_gid != 2) return TESTFAIL;
 
-    typedef_t *t = cnm->type.typedefs;
+    typedef_t *t = cnm->type.typedefs[cnm->type.typedef_gid - 1];
 
     // bar_t
-    if (!strview_eq(t->name, SV("bar_t"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("bar_t"))) return TESTFAIL;
     if (t->scope != 0) return TESTFAIL;
     if (t->typedef_id != 1) return TESTFAIL;
-    if (!type_eq(t->type, (typeref_t){
+    if (!type_eq(type_get(cnm, t->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_PTR },
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
     }, true)) return TESTFAIL;
-    if (!t->next) return TESTFAIL;
-    t = t->next;
+    t = cnm->type.typedefs[t->typedef_id - 1];
 
     // foo_t
-    if (!strview_eq(t->name, SV("foo_t"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo_t"))) return TESTFAIL;
     if (t->typedef_id != 0) return TESTFAIL;
-    if (!type_eq(t->type, (typeref_t){
+    if (!type_eq(type_get(cnm, t->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
     }, true)) return TESTFAIL;
-    if (t->next) return TESTFAIL;
 
     return !test_expect_err;
 }
@@ -2468,18 +2752,17 @@ GENERIC_TEST(test_filelvl_typedef3, test_expect_errcb)
     if (!cnm->type.typedefs) return TESTFAIL;
     if (cnm->type.typedef_gid != 1) return TESTFAIL;
 
-    typedef_t *t = cnm->type.typedefs;
+    typedef_t *t = cnm->type.typedefs[cnm->type.typedef_gid - 1];
 
     // foo_t
-    if (!strview_eq(t->name, SV("foo_t"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo_t"))) return TESTFAIL;
     if (t->typedef_id != 0) return TESTFAIL;
-    if (!type_eq(t->type, (typeref_t){
+    if (!type_eq(type_get(cnm, t->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
     }, true)) return TESTFAIL;
-    if (t->next) return TESTFAIL;
 
     return !test_expect_err;
 }
@@ -2494,31 +2777,29 @@ GENERIC_TEST(test_filelvl_typedef5, test_expect_errcb)
     if (!cnm->type.typedefs) return TESTFAIL;
     if (cnm->type.typedef_gid != 2) return TESTFAIL;
 
-    typedef_t *t = cnm->type.typedefs;
+    typedef_t *t = cnm->type.typedefs[cnm->type.typedef_gid - 1];
 
     // bar_t
-    if (!strview_eq(t->name, SV("bar_t"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("bar_t"))) return TESTFAIL;
     if (t->scope != 0) return TESTFAIL;
     if (t->typedef_id != 1) return TESTFAIL;
-    if (!type_eq(t->type, (typeref_t){
+    if (!type_eq(type_get(cnm, t->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_DOUBLE },
         },
     }, true)) return TESTFAIL;
-    if (!t->next) return TESTFAIL;
-    t = t->next;
+    t = cnm->type.typedefs[t->typedef_id - 1];
 
     // foo_t
-    if (!strview_eq(t->name, SV("foo_t"))) return TESTFAIL;
+    if (!strview_eq(ident_str(cnm, t->name), SV("foo_t"))) return TESTFAIL;
     if (t->typedef_id != 0) return TESTFAIL;
-    if (!type_eq(t->type, (typeref_t){
+    if (!type_eq(type_get(cnm, t->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
         },
     }, true)) return TESTFAIL;
-    if (t->next) return TESTFAIL;
 
     return !test_expect_err;
 }
@@ -2534,8 +2815,8 @@ GENERIC_TEST(test_global_variable1, test_expect_errcb)
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
     if (var->abs_addr != NULL) return TESTFAIL;
-    if (!strview_eq(var->name, SV("a"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("a"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
@@ -2552,8 +2833,8 @@ GENERIC_TEST(test_global_variable2, test_expect_errcb)
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
     if (var->abs_addr != NULL) return TESTFAIL;
-    if (!strview_eq(var->name, SV("c"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("c"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 2 },
@@ -2564,8 +2845,8 @@ GENERIC_TEST(test_global_variable2, test_expect_errcb)
     var = var->next;
 
     // b
-    if (!strview_eq(var->name, SV("b"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("b"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_PTR },
@@ -2576,8 +2857,8 @@ GENERIC_TEST(test_global_variable2, test_expect_errcb)
     var = var->next;
 
     // a
-    if (!strview_eq(var->name, SV("a"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("a"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
@@ -2593,8 +2874,8 @@ GENERIC_TEST(test_global_variable3, test_expect_errcb)
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
     if (var->abs_addr != test_globals_a4 + 0) return TESTFAIL;
-    if (!strview_eq(var->name, SV("a"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("a"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
@@ -2610,8 +2891,8 @@ GENERIC_TEST(test_global_variable4, test_expect_errcb)
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
     if (var->abs_addr != test_globals_a4 + 0) return TESTFAIL;
-    if (!strview_eq(var->name, SV("a"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("a"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_INT, .n = 32 },
@@ -2647,8 +2928,8 @@ GENERIC_TEST(test_global_variable10, test_expect_errcb)
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
-    if (!strview_eq(var->name, SV("str"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("str"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_PTR },
@@ -2667,8 +2948,8 @@ GENERIC_TEST(test_global_variable11, test_expect_errcb)
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
     if (var->abs_addr != test_globals_a8 + 0) return TESTFAIL;
-    if (!strview_eq(var->name, SV("x"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("x"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_ULLONG, .n = 64 },
@@ -2691,8 +2972,8 @@ GENERIC_TEST(test_global_variable13, test_expect_errcb)
     if (!var) return TESTFAIL;
     if (var->scope != 0) return TESTFAIL;
     if (var->abs_addr != test_globals_a8 + 0) return TESTFAIL;
-    if (!strview_eq(var->name, SV("p"))) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!strview_eq(ident_str(cnm, var->name), SV("p"))) return TESTFAIL;
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_PTR },
@@ -2771,7 +3052,7 @@ static bool test_global_variable14(void) {
     if (!cnm_parse(cnm, cnm_csrc_test_util_def1, "test_global_variable14")) return TESTFAIL;
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 1 },
@@ -2785,7 +3066,7 @@ static bool test_global_variable15(void) {
     if (!cnm_parse(cnm, cnm_csrc_test_util_def2, "test_global_variable15")) return TESTFAIL;
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 1,
         .type = (type_t[]){
             (type_t){ .class = TYPE_USER, .n = 1 },
@@ -2799,7 +3080,7 @@ static bool test_global_variable16(void) {
     if (!cnm_parse(cnm, cnm_csrc_test_util_def3, "test_global_variable16")) return TESTFAIL;
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 5 },
@@ -2814,7 +3095,7 @@ static bool test_global_variable17(void) {
     if (!cnm_parse(cnm, cnm_csrc_test_util_def4, "test_global_variable17")) return TESTFAIL;
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 5 },
@@ -2829,7 +3110,7 @@ static bool test_global_variable18(void) {
     if (!cnm_parse(cnm, cnm_csrc_test_util_def5, "test_global_variable18")) return TESTFAIL;
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 3 },
@@ -2843,7 +3124,7 @@ GENERIC_TEST(test_global_variable19, test_errcb)
     if (!cnm_parse(cnm, cnm_csrc_test_util_def6, "test_global_variable19")) return TESTFAIL;
     scope_t *var = cnm->vars;
     if (!var) return TESTFAIL;
-    if (!type_eq(var->type, (typeref_t){
+    if (!type_eq(type_get(cnm, var->type), (typeref_t){
         .size = 2,
         .type = (type_t[]){
             (type_t){ .class = TYPE_ARR, .n = 17 },
@@ -2864,6 +3145,1123 @@ static bool test_global_variable21(void) {
     return test_expect_err;
 }
 
+GENERIC_TEST(test_global_variable22, test_expect_errcb)
+    if (cnm_parse(cnm, "int a; char a;", "test_global_variable22")) return TESTFAIL;
+    return test_expect_err;
+}
+GENERIC_TEST(test_scope_shadow1, test_expect_errcb)
+    if (!cnm_parse(cnm, "int a; char b;", "test_scope_shadow1")) return TESTFAIL;
+    scope_t *const outer_a = cnm->vars->next, *const outer_b = cnm->vars;
+
+    // Shadow a in a new scope
+    if (!scope_push(cnm)) return TESTFAIL;
+    if (!cnm_parse(cnm, "double a; int c;", "test_scope_shadow1")) return TESTFAIL;
+    scope_t *const inner_a = varmap_find(cnm, outer_a->name);
+    if (!inner_a || inner_a == outer_a || inner_a->scope != 1) return TESTFAIL;
+    if (type_get(cnm, inner_a->type).type[0].class != TYPE_DOUBLE) return TESTFAIL;
+    if (varmap_find(cnm, outer_b->name) != outer_b) return TESTFAIL;
+    const ident_t c = cnm->vars->name;
+    if (!varmap_find(cnm, c)) return TESTFAIL;
+
+    // Popping brings back the old a and gets rid of c
+    scope_pop(cnm);
+    if (cnm->scope != 0 || cnm->vars != outer_b) return TESTFAIL;
+    if (varmap_find(cnm, outer_a->name) != outer_a) return TESTFAIL;
+    if (varmap_find(cnm, outer_b->name) != outer_b) return TESTFAIL;
+    if (varmap_find(cnm, c)) return TESTFAIL;
+    return !test_expect_err;
+}
+GENERIC_TEST(test_scope_shadow2, test_expect_errcb)
+    // Redeclaring in the inner scope with a different type is fine
+    if (!cnm_parse(cnm, "int a;", "test_scope_shadow2")) return TESTFAIL;
+    if (!scope_push(cnm)) return TESTFAIL;
+    if (!cnm_parse(cnm, "char a; char a;", "test_scope_shadow2")) return TESTFAIL;
+    if (cnm->vars->next->scope != 0) return TESTFAIL;
+    scope_pop(cnm);
+    return !test_expect_err;
+}
+SIMPLE_TEST(test_scope_depth, test_expect_errcb, "")
+    for (int i = 1; i < MAX_SCOPE_DEPTH; i++) {
+        if (!scope_push(cnm)) return TESTFAIL;
+    }
+    if (scope_push(cnm)) return TESTFAIL;
+    return test_expect_err;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Type ID Tests
+//
+///////////////////////////////////////////////////////////////////////////////
+GENERIC_TEST(test_structid1, test_expect_errcb)
+    if (!cnm_parse(cnm, "struct a { int x; }; struct b { char y; };", "test_structid1")) {
+        return TESTFAIL;
+    }
+    userty_t *const a = userty_get(cnm, 0), *const b = userty_get(cnm, 1);
+    if (!a || !b || a->inf.size != 4 || b->inf.size != 1) return TESTFAIL;
+
+    // Move a to 20, which grows the array but still finds it at 0
+    if (!cnm_set_structid(cnm, 0, 20)) return TESTFAIL;
+    if (a->typeid != 20 || userty_get(cnm, 20) != a) return TESTFAIL;
+    if (userty_get(cnm, 0) != a || userty_get(cnm, 1) != b) return TESTFAIL;
+    if (type_getinf(cnm, &(type_t){ .class = TYPE_USER, .n = 20 }).size != 4) return TESTFAIL;
+
+    // New types get IDs after the highest one
+    if (!cnm_parse(cnm, "struct c { short z; };", "test_structid1")) return TESTFAIL;
+    if (cnm->type.types->typeid != 21) return TESTFAIL;
+    return !test_expect_err;
+}
+GENERIC_TEST(test_structid2, test_expect_errcb)
+    if (!cnm_parse(cnm, "struct a { int x; }; struct b { char y; };", "test_structid2")) {
+        return TESTFAIL;
+    }
+    userty_t *const a = userty_get(cnm, 0), *const b = userty_get(cnm, 1);
+
+    // Can't take IDs that are owned by other types or are out of bounds
+    if (cnm_set_structid(cnm, 0, 1)) return TESTFAIL;
+    if (cnm_set_structid(cnm, 0, -1)) return TESTFAIL;
+    if (cnm_set_structid(cnm, 0, 1 << 24)) return TESTFAIL;
+    if (cnm_set_structid(cnm, 5, 6)) return TESTFAIL;
+
+    // Swap them through a free ID
+    if (!cnm_set_structid(cnm, 0, 2)) return TESTFAIL;
+    if (!cnm_set_structid(cnm, 1, 0)) return TESTFAIL;
+    if (!cnm_set_structid(cnm, 2, 1)) return TESTFAIL;
+    if (userty_get(cnm, 0) != b || userty_get(cnm, 1) != a) return TESTFAIL;
+    if (a->typeid != 1 || b->typeid != 0) return TESTFAIL;
+
+    // Only the owner of an ID can be moved
+    if (cnm_set_structid(cnm, 2, 5)) return TESTFAIL;
+    return !test_expect_err;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Region testing
+//
+///////////////////////////////////////////////////////////////////////////////
+// Source that uses most of the parser's allocations
+static const char *const test_util_region =
+    "typedef unsigned int handle_t;"
+    "struct test_region_node {"
+    "    handle_t id;"
+    "    struct test_region_node *next;"
+    "    int (*callback)(int a, char *b, void (*c)(float, double));"
+    "    char tag[4 * 2 + 1];"
+    "    unsigned int flags : 3, : 0, mode : 2;"
+    "};"
+    "enum test_region_kind : char { KIND_A, KIND_B = 3 + 4, KIND_C };"
+    "union test_region_val { int i; double d; };"
+    "struct test_region_node test_region_nodes[] = { { 1 }, { 2, .tag = \"two\" } };"
+    "const char *test_region_names[] = { \"alpha\", \"beta\", \"alpha\" };"
+    "handle_t test_region_handles[3] = { 1 << 2, 3 * 3, 'x' };";
+
+// Chunk callback that counts how many chunks are out
+static int test_nchunks;
+static void *test_chunkcb(void *user, void *chunk, size_t size) {
+    if (!size) {
+        test_nchunks--;
+        free(chunk);
+        return NULL;
+    }
+    test_nchunks++;
+    return malloc(size);
+}
+
+// Small enough that everything past the cnm state needs chunks
+static uint8_t test_small_region[sizeof(cnm_t) + 128] __attribute__((aligned(16)));
+
+static bool test_region_chunks1(void) {
+    // Compile in a big enough region first to compare against
+    static uint8_t expected[sizeof(test_globals)];
+    cnm_t *cnm = cnm_init(test_region, sizeof(test_region), test_code_area, test_code_size,
+                          test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_errcb);
+    if (!cnm_parse(cnm, test_util_region, "test_region_chunks1")) return TESTFAIL;
+    const size_t global_size = cnm_get_global_size(cnm);
+    const int ntypes = cnm->type.gid;
+    typeinf_t infs[8];
+    for (int i = 0; i < ntypes && i < arrlen(infs); i++) {
+        infs[i] = userty_get(cnm, i)->inf;
+    }
+    memcpy(expected, test_globals, sizeof(test_globals));
+
+    // Then with tiny chunks so that types, lists and strings all cross chunks
+    cnm = cnm_init(test_small_region, sizeof(test_small_region), test_code_area,
+                   test_code_size, test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_errcb);
+    cnm_set_chunkcb(cnm, test_chunkcb, NULL, 64);
+    bool result = true;
+    if (!cnm_parse(cnm, test_util_region, "test_region_chunks1")) {
+        result = TESTFAIL;
+    } else if (cnm_get_global_size(cnm) != global_size || cnm->type.gid != ntypes) {
+        result = TESTFAIL;
+    } else if (memcmp(expected, test_globals, sizeof(test_globals)) != 0) {
+        result = TESTFAIL;
+    } else {
+        for (int i = 0; i < ntypes && i < arrlen(infs); i++) {
+            const typeinf_t inf = userty_get(cnm, i)->inf;
+            if (inf.size != infs[i].size || inf.align != infs[i].align) result = TESTFAIL;
+        }
+    }
+    if (test_nchunks < 10) result = TESTFAIL;
+
+    cnm_free_chunks(cnm);
+    if (test_nchunks != 0) return TESTFAIL;
+    return result;
+}
+GENERIC_TEST(test_region_chunks2, test_expect_errcb)
+    // Without a chunk callback the region can still run out
+    cnm = cnm_init(test_small_region, sizeof(test_small_region), test_code_area,
+                   test_code_size, test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_expect_errcb);
+    if (cnm_parse(cnm, test_util_region, "test_region_chunks2")) return TESTFAIL;
+    return test_expect_err;
+}
+// Compile the same declarations over and over and get the region peak
+static size_t test_region_repeat(int n) {
+    static char src[8192];
+    size_t len = snprintf(src, sizeof(src), "typedef unsigned long long u64_t;\n");
+    for (int i = 0; i < n; i++) {
+        len += snprintf(src + len, sizeof(src) - len,
+                        "int arr[4 * 2 + 1]; u64_t (*fns[2])(int a, char *b);\n");
+    }
+
+    cnm_t *cnm = cnm_init(test_region, sizeof(test_region), test_code_area, test_code_size,
+                          test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_errcb);
+    if (!cnm_parse(cnm, src, "test_region_flat")) return 0;
+    return cnm_get_region_peak(cnm);
+}
+static bool test_region_flat(void) {
+    // Temporaries are freed after each declaration, so region usage only
+    // depends on what was declared and not on how long the file is
+    const size_t peak = test_region_repeat(1);
+    if (!peak) return TESTFAIL;
+    if (test_region_repeat(10) != peak) return TESTFAIL;
+    if (test_region_repeat(80) != peak) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_region_peak, test_errcb)
+    if (!cnm_parse(cnm, test_util_region, "test_region_peak")) return TESTFAIL;
+    const size_t peak = cnm_get_region_peak(cnm);
+    if (peak <= sizeof(cnm_t) || peak > sizeof(test_region)) return TESTFAIL;
+
+    // The peak is how big the region needs to be, give or take some alignment
+    cnm = cnm_init(test_region, peak + 64, test_code_area, test_code_size,
+                   test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_errcb);
+    if (!cnm_parse(cnm, test_util_region, "test_region_peak")) return TESTFAIL;
+
+    cnm = cnm_init(test_region, peak - 64, test_code_area, test_code_size,
+                   test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_expect_errcb);
+    if (cnm_parse(cnm, test_util_region, "test_region_peak")) return TESTFAIL;
+    return test_expect_err;
+}
+GENERIC_TEST(test_memstats1, test_errcb)
+    cnm_memstats_t st;
+    cnm_get_memstats(cnm, &st);
+    if (st.statics.used == 0 || st.globals.used || st.strings.used || st.code.used) {
+        return TESTFAIL;
+    }
+
+    if (!cnm_parse(cnm, test_util_region, "test_memstats1")) return TESTFAIL;
+    cnm_get_memstats(cnm, &st);
+    if (st.globals.used != cnm_get_global_size(cnm)) return TESTFAIL;
+    if (st.globals.used == 0 || st.globals.peak < st.globals.used) return TESTFAIL;
+    if (st.strings.used < sizeof("two") + sizeof("alpha") + sizeof("beta")) return TESTFAIL;
+    if (st.scratch.peak == 0 || st.scratch.peak < st.scratch.used) return TESTFAIL;
+    if (st.statics.peak != st.statics.used) return TESTFAIL;
+    if (!st.by.types || !st.by.fields || !st.by.typedefs || !st.by.idents) return TESTFAIL;
+
+    // Categories only count what was asked for, not alignment padding
+    const size_t bysum = st.by.types + st.by.fields + st.by.typedefs + st.by.funcs
+        + st.by.vars + st.by.strings + st.by.idents;
+    if (bysum > st.statics.used) return TESTFAIL;
+
+    // Everything in the region is either scratch or static
+    const size_t peak = cnm_get_region_peak(cnm) - sizeof(cnm_t);
+    if (st.scratch.peak > peak || st.statics.used > peak) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_type_canon1, test_errcb)
+    // Declarations with the same type share the same layers
+    if (!cnm_parse(cnm, "int a; int b[3]; char *c; int d; int e[3]; const char *f;",
+                   "test_type_canon1")) return TESTFAIL;
+    scope_t *vars[6], *var = cnm->vars;
+    for (int i = arrlen(vars) - 1; i >= 0; i--, var = var->next) {
+        if (!var) return TESTFAIL;
+        vars[i] = var;
+    }
+    if (vars[0]->type != vars[3]->type || vars[1]->type != vars[4]->type) return TESTFAIL;
+    if (vars[2]->type == vars[5]->type) return TESTFAIL;
+    if (type_eq(type_get(cnm, vars[2]->type), type_get(cnm, vars[5]->type), true)) {
+        return TESTFAIL;
+    }
+    return true;
+}
+GENERIC_TEST(test_type_canon2, test_errcb)
+    // Implied array lengths don't change the canonical layers they came from
+    if (!cnm_parse(cnm, "char s1[] = \"ab\"; char s2[] = \"cd\"; char s3[] = \"xyz\";"
+                        "char s4[] = { 1, 2, 3, 4 };", "test_type_canon2")) return TESTFAIL;
+    scope_t *const s4 = cnm->vars, *const s3 = s4->next, *const s2 = s3->next,
+        *const s1 = s2->next;
+    if (s1->type != s2->type || type_get(cnm, s1->type).type[0].n != 3) return TESTFAIL;
+    if (s3->type != s4->type || type_get(cnm, s3->type).type[0].n != 4) return TESTFAIL;
+    return true;
+}
+
+GENERIC_TEST(test_type_fields1, test_errcb)
+    // Fields are kept in one array in declaration order
+    if (!cnm_parse(cnm, "struct test_fields_s {"
+                        "    char a; int b : 3, : 0, c : 5; double d; struct test_fields_s *next;"
+                        "};"
+                        "struct test_fields_p { int x, y, z; double w; };"
+                        "struct test_fields_p test_fields_p1 = { .y = 2, 3, .x = 1, .w = 4.5 };",
+                   "test_type_fields1")) return TESTFAIL;
+    const userty_t *const u = cnm->type.types->next;
+    const field_list_t *const s = (const field_list_t *)u->data;
+    if (s->nfields != 5 || u->inf.size != 32 || u->inf.align != 8) return TESTFAIL;
+
+    static const struct {
+        const char *name;
+        uint32_t offs;
+    } expected[] = { { "a", 0 }, { "b", 4 }, { "c", 8 }, { "d", 16 }, { "next", 24 } };
+    for (int i = 0; i < arrlen(expected); i++) {
+        const field_t *const f = &s->fields[i];
+        const strview_t name = ident_str(cnm, f->name);
+        if (name.len != strlen(expected[i].name)) return TESTFAIL;
+        if (memcmp(name.str, expected[i].name, name.len) != 0) return TESTFAIL;
+        if (f->offs != expected[i].offs || f->bit_offs != 0) return TESTFAIL;
+    }
+
+    // Designators jump around in the array and positional fields follow them
+    const struct { int x, y, z; double w; } *p = cnm_get_global(cnm, "test_fields_p1");
+    if (!p || p->x != 1 || p->y != 2 || p->z != 3 || p->w != 4.5) return TESTFAIL;
+    return true;
+}
+
+static const char *const test_util_rtti =
+    "struct test_rtti_pt { int x, y; };"
+    "enum test_rtti_dir : char { DIR_N, DIR_S };"
+    "union test_rtti_val { int i; double d; };"
+    "struct test_rtti_fwd;"
+    "int test_rtti_add(int a, int b);"
+    "struct test_rtti_pt test_rtti_origin = { 1, 2 };"
+    "int test_rtti_count = 3;"
+    "int test_rtti_decl;";
+
+GENERIC_TEST(test_rtti1, test_errcb)
+    if (!cnm_parse(cnm, test_util_rtti, "test_rtti1")) return TESTFAIL;
+
+    const cnm_struct_t *pt = cnm_get_struct(cnm, "test_rtti_pt");
+    if (!pt || cnm_struct_get_size(pt) != 2 * sizeof(int)) return TESTFAIL;
+    if (cnm_struct_get_id(pt) != cnm->type.types->next->next->next->typeid) return TESTFAIL;
+    const cnm_struct_t *val = cnm_get_struct(cnm, "test_rtti_val");
+    if (!val || cnm_struct_get_size(val) != sizeof(double)) return TESTFAIL;
+    if (cnm_struct_get_id(val) == cnm_struct_get_id(pt)) return TESTFAIL;
+    if (!cnm_get_struct(cnm, "test_rtti_fwd")) return TESTFAIL;
+    if (cnm_get_struct(cnm, "test_rtti_dir") || cnm_get_enum(cnm, "test_rtti_pt")) {
+        return TESTFAIL;
+    }
+
+    const cnm_enum_t *dir = cnm_get_enum(cnm, "test_rtti_dir");
+    if (!dir || cnm_enum_get_size(dir) != sizeof(char)) return TESTFAIL;
+
+    const cnm_fn_t *add = cnm_get_fn(cnm, "test_rtti_add");
+    if (!add || cnm_fn_addr(add)) return TESTFAIL;
+    if (cnm_get_fn(cnm, "test_rtti_count") || cnm_get_fn(cnm, "test_rtti_nope")) return TESTFAIL;
+
+    const int *origin = cnm_get_global(cnm, "test_rtti_origin");
+    const int *count = cnm_get_global(cnm, "test_rtti_count");
+    if (!origin || origin[0] != 1 || origin[1] != 2 || !count || *count != 3) return TESTFAIL;
+    if (cnm_get_global(cnm, "test_rtti_decl") || cnm_get_global(cnm, "test_rtti_add")) {
+        return TESTFAIL;
+    }
+    return true;
+}
+GENERIC_TEST(test_rtti_snap1, test_errcb)
+    if (!cnm_parse(cnm, test_util_rtti, "test_rtti_snap1")) return TESTFAIL;
+    const int pt_id = cnm_struct_get_id(cnm_get_struct(cnm, "test_rtti_pt"));
+    const int dir_id = cnm_enum_get_id(cnm_get_enum(cnm, "test_rtti_dir"));
+
+    static void *buf[128], *moved[128];
+    const size_t size = cnm_compact_size(cnm);
+    if (size > sizeof(buf) || size >= cnm_get_region_peak(cnm)) return TESTFAIL;
+    if (cnm_compact(cnm, buf, size - 1)) return TESTFAIL;
+    if (cnm_compact(cnm, (uint8_t *)buf + 1, sizeof(buf) - 1)) return TESTFAIL;
+    const cnm_snap_t *snap = cnm_compact(cnm, buf, size);
+    if (!snap || cnm_snap_size(snap) != size) return TESTFAIL;
+
+    // The snapshot does not need the region or itself to stay in place
+    memcpy(moved, buf, size);
+    memset(buf, 0xAA, sizeof(buf));
+    memset(test_region, 0xAA, sizeof(test_region));
+    snap = (const cnm_snap_t *)moved;
+
+    const cnm_struct_t *pt = cnm_snap_get_struct(snap, "test_rtti_pt");
+    if (!pt || cnm_struct_get_id(pt) != pt_id) return TESTFAIL;
+    if (cnm_struct_get_size(pt) != 2 * sizeof(int)) return TESTFAIL;
+    const cnm_struct_t *val = cnm_snap_get_struct(snap, "test_rtti_val");
+    if (!val || cnm_struct_get_size(val) != sizeof(double)) return TESTFAIL;
+    if (!cnm_snap_get_struct(snap, "test_rtti_fwd")) return TESTFAIL;
+    if (cnm_snap_get_struct(snap, "test_rtti_dir") || cnm_snap_get_enum(snap, "test_rtti_pt")) {
+        return TESTFAIL;
+    }
+
+    const cnm_enum_t *dir = cnm_snap_get_enum(snap, "test_rtti_dir");
+    if (!dir || cnm_enum_get_id(dir) != dir_id || cnm_enum_get_size(dir) != 1) return TESTFAIL;
+
+    const cnm_fn_t *add = cnm_snap_get_fn(snap, "test_rtti_add");
+    if (!add || cnm_fn_addr(add)) return TESTFAIL;
+    if (cnm_snap_get_fn(snap, "test_rtti_count")) return TESTFAIL;
+
+    const int *origin = cnm_snap_get_global(snap, "test_rtti_origin");
+    const int *count = cnm_snap_get_global(snap, "test_rtti_count");
+    if (!origin || origin[0] != 1 || origin[1] != 2 || !count || *count != 3) return TESTFAIL;
+    if (cnm_snap_get_global(snap, "test_rtti_decl")) return TESTFAIL;
+    if (cnm_snap_get_global(snap, "test_rtti")) return TESTFAIL;
+    return true;
+}
+
+static const char *const test_util_pack =
+    "struct test_pack_pt { int x, y; };"
+    "char test_pack_c1 = 'a';"
+    "double test_pack_d1 = 1.5;"
+    "char test_pack_tbl[3] = { 1, 2, 3 };"
+    "short test_pack_s1 = 7;"
+    "struct test_pack_pt test_pack_pt1 = { 4, 5 };"
+    "char test_pack_c2 = 'b';"
+    "double test_pack_d2 = 2.5;";
+
+// Scalars move to the front, everything keeps its value and the padding goes
+GENERIC_TEST(test_pack_globals1, test_errcb)
+    if (!cnm_parse(cnm, test_util_pack, "test_pack_globals1")) return TESTFAIL;
+    const size_t before = cnm_get_global_size(cnm);
+    const size_t saved = cnm_pack_globals(cnm);
+    if (!saved || cnm_get_global_size(cnm) != before - saved) return TESTFAIL;
+
+    const char *c1 = cnm_get_global(cnm, "test_pack_c1");
+    const char *c2 = cnm_get_global(cnm, "test_pack_c2");
+    const double *d1 = cnm_get_global(cnm, "test_pack_d1");
+    const double *d2 = cnm_get_global(cnm, "test_pack_d2");
+    const short *s1 = cnm_get_global(cnm, "test_pack_s1");
+    const char *tbl = cnm_get_global(cnm, "test_pack_tbl");
+    const int *pt = cnm_get_global(cnm, "test_pack_pt1");
+    if (*c1 != 'a' || *c2 != 'b' || *d1 != 1.5 || *d2 != 2.5 || *s1 != 7) return TESTFAIL;
+    if (tbl[0] != 1 || tbl[1] != 2 || tbl[2] != 3 || pt[0] != 4 || pt[1] != 5) return TESTFAIL;
+
+    // Biggest alignment first, declaration order within the same alignment
+    if ((const void *)d1 != cnm->globals.buf || d2 != d1 + 1) return TESTFAIL;
+    if ((const char *)s1 != (const char *)(d2 + 1) || c1 != (const char *)(s1 + 1)) return TESTFAIL;
+    if (c2 != c1 + 1) return TESTFAIL;
+    if ((const char *)pt <= c2 || tbl != (const char *)(pt + 2)) return TESTFAIL;
+    return true;
+}
+
+// Packing again or with nothing to pack changes nothing
+GENERIC_TEST(test_pack_globals2, test_errcb)
+    if (cnm_pack_globals(cnm)) return TESTFAIL;
+    if (!cnm_parse(cnm, test_util_pack, "test_pack_globals2")) return TESTFAIL;
+    if (!cnm_pack_globals(cnm)) return TESTFAIL;
+    const size_t size = cnm_get_global_size(cnm);
+    if (cnm_pack_globals(cnm) || cnm_get_global_size(cnm) != size) return TESTFAIL;
+    const double *d2 = cnm_get_global(cnm, "test_pack_d2");
+    if (!d2 || *d2 != 2.5) return TESTFAIL;
+    return true;
+}
+
+// States that share the type environment of the one in test_region
+static uint8_t test_copy_region[2][4096] __attribute__((aligned(16)));
+static uint8_t test_copy_globals[2][256] __attribute__((aligned(16)));
+
+static cnm_t *test_copy_init(int i) {
+    cnm_t *cnm = cnm_init(test_copy_region[i], sizeof(test_copy_region[i]), test_code_area,
+                          test_code_size, test_copy_globals[i], sizeof(test_copy_globals[i]));
+    cnm_set_errcb(cnm, test_errcb);
+    return cnm;
+}
+
+static const char *const test_util_copy =
+    "typedef int test_copy_int;"
+    "struct test_copy_pt { test_copy_int x, y; };"
+    "enum test_copy_dir { COPY_N, COPY_S };"
+    "struct test_copy_fwd;"
+    "int test_copy_add(int a, int b);"
+    "int test_copy_v;";
+
+// Declarations from the base are shared, new ones only go into the copy
+GENERIC_TEST(test_copy1, test_errcb)
+    if (!cnm_parse(cnm, test_util_copy, "test_copy1")) return TESTFAIL;
+    const uint32_t nidents = cnm->idents.count, ntypes = cnm->types.count;
+    const int gid = cnm->type.gid;
+
+    cnm_t *to = test_copy_init(0);
+    if (!cnm_copy(to, cnm)) return TESTFAIL;
+    if (!cnm_parse(to, "struct test_copy_pt test_copy_origin = { 1, 2 };"
+                       "test_copy_int test_copy_n = 3;"
+                       "struct test_copy_line { struct test_copy_pt a, b; };"
+                       "struct test_copy_fwd { int v; };"
+                       "struct test_copy_v { char c; };"
+                       "int test_copy_add(int a, int b);", "test_copy1")) return TESTFAIL;
+    if (cnm->idents.count != nidents || cnm->types.count != ntypes) return TESTFAIL;
+    if (cnm->type.gid != gid) return TESTFAIL;
+
+    // The same objects are seen from both states
+    const cnm_struct_t *pt = cnm_get_struct(cnm, "test_copy_pt");
+    if (!pt || cnm_get_struct(to, "test_copy_pt") != pt) return TESTFAIL;
+    if (cnm_get_enum(to, "test_copy_dir") != cnm_get_enum(cnm, "test_copy_dir")) return TESTFAIL;
+    const cnm_fn_t *add = cnm_get_fn(cnm, "test_copy_add");
+    if (!add || cnm_get_fn(to, "test_copy_add") != add) return TESTFAIL;
+
+    // Only the copy has the new types
+    const cnm_struct_t *line = cnm_get_struct(to, "test_copy_line");
+    if (!line || cnm_get_struct(cnm, "test_copy_line")) return TESTFAIL;
+    if (cnm_struct_get_id(line) != gid || cnm_struct_get_size(line) != 4 * sizeof(int)) {
+        return TESTFAIL;
+    }
+    const cnm_struct_t *v = cnm_get_struct(to, "test_copy_v");
+    if (!v || cnm_struct_get_size(v) != 1 || cnm_get_struct(cnm, "test_copy_v")) return TESTFAIL;
+
+    // Forward declarations are defined in the copy without touching the base
+    const cnm_struct_t *fwd = cnm_get_struct(to, "test_copy_fwd");
+    const cnm_struct_t *basefwd = cnm_get_struct(cnm, "test_copy_fwd");
+    if (!fwd || !basefwd || fwd == basefwd) return TESTFAIL;
+    if (cnm_struct_get_size(fwd) != sizeof(int) || cnm_struct_get_size(basefwd)) return TESTFAIL;
+    if (cnm_struct_get_id(fwd) != cnm_struct_get_id(basefwd)) return TESTFAIL;
+
+    const int *origin = cnm_get_global(to, "test_copy_origin");
+    const int *n = cnm_get_global(to, "test_copy_n");
+    if (!origin || origin[0] != 1 || origin[1] != 2 || !n || *n != 3) return TESTFAIL;
+
+    // Nothing that was already in the base is stored again
+    cnm_memstats_t st;
+    cnm_get_memstats(to, &st);
+    if (st.by.typedefs || st.by.funcs) return TESTFAIL;
+    return true;
+}
+
+// Copies can be copied, are snapshotted like any other state and can't be made
+// once something was parsed
+GENERIC_TEST(test_copy2, test_errcb)
+    if (!cnm_parse(cnm, test_util_copy, "test_copy2")) return TESTFAIL;
+    if (cnm_copy(cnm, cnm)) return TESTFAIL;
+
+    cnm_t *mid = test_copy_init(0);
+    if (!cnm_copy(mid, cnm)) return TESTFAIL;
+    if (!cnm_parse(mid, "struct test_copy_v { char c; };"
+                        "typedef struct test_copy_pt test_copy_pt_t;", "test_copy2")) {
+        return TESTFAIL;
+    }
+    if (cnm_copy(mid, cnm)) return TESTFAIL;
+
+    cnm_t *to = test_copy_init(1);
+    if (!cnm_copy(to, mid)) return TESTFAIL;
+    if (!cnm_parse(to, "test_copy_pt_t test_copy_origin = { 3, 4 };"
+                       "struct test_copy_fwd { double d; };"
+                       "test_copy_int test_copy_n = 5;"
+                       "int test_copy_add(int a, int b) {}", "test_copy2")) {
+        return TESTFAIL;
+    }
+    const int *origin = cnm_get_global(to, "test_copy_origin");
+    if (!origin || origin[0] != 3 || origin[1] != 4) return TESTFAIL;
+    if (cnm_struct_get_size(cnm_get_struct(to, "test_copy_v")) != 1) return TESTFAIL;
+    if (cnm_struct_get_size(cnm_get_struct(to, "test_copy_fwd")) != sizeof(double)) {
+        return TESTFAIL;
+    }
+    if (cnm_struct_get_size(cnm_get_struct(mid, "test_copy_fwd"))) return TESTFAIL;
+    const cnm_fn_t *add = cnm_get_fn(to, "test_copy_add");
+    if (!add || add == cnm_get_fn(cnm, "test_copy_add")) return TESTFAIL;
+
+    // The struct copied into the last state hides the one from the base
+    static void *buf[256];
+    cnm_snap_t *snap = cnm_compact(to, buf, sizeof(buf));
+    if (!snap) return TESTFAIL;
+    const cnm_struct_t *fwd = cnm_snap_get_struct(snap, "test_copy_fwd");
+    if (!fwd || cnm_struct_get_size(fwd) != sizeof(double)) return TESTFAIL;
+    const cnm_struct_t *v = cnm_snap_get_struct(snap, "test_copy_v");
+    if (!v || cnm_struct_get_size(v) != 1) return TESTFAIL;
+    if (!cnm_snap_get_fn(snap, "test_copy_add") || !cnm_snap_get_enum(snap, "test_copy_dir")) {
+        return TESTFAIL;
+    }
+    const int *n = cnm_snap_get_global(snap, "test_copy_n");
+    if (!n || *n != 5) return TESTFAIL;
+    return true;
+}
+
+// Parse an expression into the IR of a function that returns it and dump it
+static bool test_ir_expr(cnm_t *cnm, const char *expr, char *buf, size_t len) {
+    cnm_set_src(cnm, expr, "test_ir");
+    token_next(cnm);
+    valref_t val;
+    if (!ir_begin(cnm, 0) || !expr_parse(cnm, &val, true, false, PREC_FULL, NULL)) return false;
+    const ir_val_t ret = valref_ir(cnm, &val);
+    if (!ret || !ir_emit(cnm, IR_RET, TYPE_VOID, ret, 0, 0) || !ir_finish(cnm)) return false;
+    return ir_dump(cnm, &cnm->ir.f, buf, len) < len;
+}
+
+static const char *const test_util_ir =
+    "int test_ir_a = 1;"
+    "char test_ir_c = 2;"
+    "double test_ir_d = 1.5;";
+
+// Variables are loaded and operands are promoted before the operation
+GENERIC_TEST(test_ir_expr1, test_errcb)
+    if (!cnm_parse(cnm, test_util_ir, "test_ir_expr1")) return TESTFAIL;
+    char buf[512];
+    if (!test_ir_expr(cnm, "test_ir_a + 2 * -test_ir_c", buf, sizeof(buf))) return TESTFAIL;
+    if (strcmp(buf, "b0:\n"
+                    "    %1 = global ptr +0\n"
+                    "    %2 = load int %1\n"
+                    "    %3 = global ptr +4\n"
+                    "    %4 = load char %3\n"
+                    "    %5 = cast int %4\n"
+                    "    %6 = neg int %5\n"
+                    "    %7 = const int 2\n"
+                    "    %8 = mul int %7, %6\n"
+                    "    %9 = add int %2, %8\n"
+                    "    ret %9\n") != 0) return TESTFAIL;
+
+    if (!test_ir_expr(cnm, "test_ir_d * 2 - (float)test_ir_c", buf, sizeof(buf))) {
+        return TESTFAIL;
+    }
+    if (strcmp(buf, "b0:\n"
+                    "    %1 = global ptr +8\n"
+                    "    %2 = load double %1\n"
+                    "    %3 = const double 2\n"
+                    "    %4 = mul double %2, %3\n"
+                    "    %5 = global ptr +4\n"
+                    "    %6 = load char %5\n"
+                    "    %7 = cast float %6\n"
+                    "    %8 = cast double %7\n"
+                    "    %9 = sub double %4, %8\n"
+                    "    ret %9\n") != 0) return TESTFAIL;
+    return true;
+}
+
+// Literals are still folded and variables can't be read at file scope
+GENERIC_TEST(test_ir_expr2, test_expect_errcb)
+    if (!cnm_parse(cnm, test_util_ir, "test_ir_expr2")) return TESTFAIL;
+    char buf[128];
+    if (!test_ir_expr(cnm, "~1 + 2 * 3", buf, sizeof(buf))) return TESTFAIL;
+    if (strcmp(buf, "b0:\n"
+                    "    %1 = const int 4\n"
+                    "    ret %1\n") != 0) return TESTFAIL;
+    if (test_expect_err) return TESTFAIL;
+
+    if (test_ir_expr(cnm, "test_ir_a + test_ir_none", buf, sizeof(buf))) return TESTFAIL;
+    if (!test_expect_err) return TESTFAIL;
+    test_expect_err = false;
+    if (cnm_parse(cnm, "int test_ir_b = test_ir_a;", "test_ir_expr2")) return TESTFAIL;
+    return test_expect_err;
+}
+
+// Phis get one argument per predecessor in the same order as the predecessors
+GENERIC_TEST(test_ir_phi1, test_errcb)
+    uint32_t then, other, join;
+    if (!ir_begin(cnm, 1)) return TESTFAIL;
+    const ir_val_t p = ir_emit(cnm, IR_PARAM, TYPE_INT, 0, 0, 0);
+    const ir_val_t zero = ir_emit_imm(cnm, IR_CONST, TYPE_INT, 0);
+    const ir_val_t cond = ir_emit(cnm, IR_GT, TYPE_BOOL, p, zero, 0);
+    if (!ir_block_new(cnm, &then) || !ir_block_new(cnm, &other)
+        || !ir_block_new(cnm, &join)) return TESTFAIL;
+    ir_emit(cnm, IR_BR, TYPE_VOID, cond, then, other);
+
+    ir_block_start(cnm, then);
+    const ir_val_t neg = ir_emit(cnm, IR_NEG, TYPE_INT, p, 0, 0);
+    ir_emit(cnm, IR_JMP, TYPE_VOID, join, 0, 0);
+    ir_block_start(cnm, other);
+    ir_emit(cnm, IR_JMP, TYPE_VOID, join, 0, 0);
+
+    ir_block_start(cnm, join);
+    const ir_val_t phi = ir_phi(cnm, TYPE_INT);
+    if (!ir_phi_add(cnm, phi, other, p) || !ir_phi_add(cnm, phi, then, neg)) return TESTFAIL;
+    ir_emit(cnm, IR_RET, TYPE_VOID, phi, 0, 0);
+    if (!ir_finish(cnm)) return TESTFAIL;
+
+    char buf[512];
+    if (ir_dump(cnm, &cnm->ir.f, buf, sizeof(buf)) >= sizeof(buf)) return TESTFAIL;
+    if (strcmp(buf, "b0:\n"
+                    "    %1 = param int 0\n"
+                    "    %2 = const int 0\n"
+                    "    %3 = gt bool %1, %2\n"
+                    "    br %3, b1, b2\n"
+                    "b1: <- b0\n"
+                    "    %5 = neg int %1\n"
+                    "    jmp b3\n"
+                    "b2: <- b0\n"
+                    "    jmp b3\n"
+                    "b3: <- b1, b2\n"
+                    "    %8 = phi int [b1 %5], [b2 %1]\n"
+                    "    ret %8\n") != 0) return TESTFAIL;
+
+    // A dump that doesn't fit is cut short but still says how long it is
+    char small[16];
+    if (ir_dump(cnm, &cnm->ir.f, small, sizeof(small)) != strlen(buf)) return TESTFAIL;
+    if (strlen(small) != sizeof(small) - 1) return TESTFAIL;
+    return true;
+}
+
+// A loop phi that only ever has one value is replaced by it and values that
+// aren't used are dropped, along with what only they used
+GENERIC_TEST(test_ir_opt1, test_errcb)
+    uint32_t loop, body, done;
+    if (!ir_begin(cnm, 1)) return TESTFAIL;
+    const ir_val_t p = ir_emit(cnm, IR_PARAM, TYPE_INT, 0, 0, 0);
+    const ir_val_t one = ir_emit_imm(cnm, IR_CONST, TYPE_INT, 1);
+    ir_emit(cnm, IR_NEG, TYPE_INT, ir_emit(cnm, IR_ADD, TYPE_INT, p, one, 0), 0, 0);
+    if (!ir_block_new(cnm, &loop) || !ir_block_new(cnm, &body)
+        || !ir_block_new(cnm, &done)) return TESTFAIL;
+    ir_emit(cnm, IR_JMP, TYPE_VOID, loop, 0, 0);
+
+    ir_block_start(cnm, loop);
+    const ir_val_t phi = ir_phi(cnm, TYPE_INT);
+    const ir_val_t zero = ir_emit_imm(cnm, IR_CONST, TYPE_INT, 0);
+    const ir_val_t cond = ir_emit(cnm, IR_GT, TYPE_BOOL, phi, zero, 0);
+    ir_emit(cnm, IR_BR, TYPE_VOID, cond, body, done);
+    ir_block_start(cnm, body);
+    ir_emit(cnm, IR_JMP, TYPE_VOID, loop, 0, 0);
+    ir_block_start(cnm, done);
+    ir_emit(cnm, IR_RET, TYPE_VOID, phi, 0, 0);
+    if (!ir_phi_add(cnm, phi, 0, p) || !ir_phi_add(cnm, phi, body, phi)) return TESTFAIL;
+    if (!ir_finish(cnm) || !ir_optimize(cnm)) return TESTFAIL;
+
+    char buf[512];
+    if (ir_dump(cnm, &cnm->ir.f, buf, sizeof(buf)) >= sizeof(buf)) return TESTFAIL;
+    if (strcmp(buf, "b0:\n"
+                    "    %1 = param int 0\n"
+                    "    jmp b1\n"
+                    "b1: <- b0, b2\n"
+                    "    %3 = const int 0\n"
+                    "    %4 = gt bool %1, %3\n"
+                    "    br %4, b2, b3\n"
+                    "b2: <- b1\n"
+                    "    jmp b1\n"
+                    "b3: <- b1\n"
+                    "    ret %1\n") != 0) return TESTFAIL;
+    return true;
+}
+
+// Compiled functions
+#define TEST_FN(_cnm, _name, _type) ((_type)cnm_fn_addr(cnm_get_fn(_cnm, _name)))
+GENERIC_TEST(test_fn_arith1, test_errcb)
+    if (!cnm_parse(cnm, "int test_fn_add(int a, int b) { return a + b; }"
+                        "long test_fn_mix(char a, unsigned short b, long c) { return a * b - c; }"
+                        "unsigned char test_fn_wrap(int a) { unsigned char c = a; c += 10; return c; }"
+                        "double test_fn_fp(double a, float b) { return a * b - 1.5; }"
+                        "unsigned long test_fn_u2d(unsigned long x) { double d = x; return d; }",
+                   "test_fn_arith1")) {
+        return TESTFAIL;
+    }
+    int (*add)(int, int) = TEST_FN(cnm, "test_fn_add", int (*)(int, int));
+    long (*mix)(char, unsigned short, long) =
+        TEST_FN(cnm, "test_fn_mix", long (*)(char, unsigned short, long));
+    unsigned char (*wrap)(int) = TEST_FN(cnm, "test_fn_wrap", unsigned char (*)(int));
+    double (*fp)(double, float) = TEST_FN(cnm, "test_fn_fp", double (*)(double, float));
+    unsigned long (*u2d)(unsigned long) = TEST_FN(cnm, "test_fn_u2d", unsigned long (*)(unsigned long));
+    if (!add || !mix || !wrap || !fp || !u2d) return TESTFAIL;
+    if (add(2, 3) != 5 || add(-7, 3) != -4) return TESTFAIL;
+    if (mix(-3, 60000, 5) != -180005) return TESTFAIL;
+    if (wrap(250) != 4) return TESTFAIL;
+    if (fp(2.0, 1.5f) != 1.5) return TESTFAIL;
+    if (u2d(18446744073709549568ul) != 18446744073709549568ul) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_fn_flow1, test_errcb)
+    if (!cnm_parse(cnm, "int test_fn_abs(int a) { if (a < 0) a = -a; return a; }"
+                        "int test_fn_sum(int n) {"
+                        "    int s = 0;"
+                        "    for (int i = 0; i < n; i++) { if (i % 3 == 0) continue; s += i; }"
+                        "    return s;"
+                        "}"
+                        "int test_fn_loop(int n) { int i = 0; while (1) { i++; if (i >= n) break; } return i; }"
+                        "int test_fn_dow(int n) { int i = 0; do { i += 2; } while (i < n); return i; }"
+                        "int test_fn_swap(int n) {"
+                        "    int a = 1, b = 2;"
+                        "    while (n-- > 0) { int t = a; a = b; b = t; }"
+                        "    return a * 10 + b;"
+                        "}"
+                        "bool test_fn_logic(int a, int b) { return a > 0 && b > 0 || a == -1; }"
+                        "int test_fn_none(void) { }",
+                   "test_fn_flow1")) {
+        return TESTFAIL;
+    }
+    int (*abs_)(int) = TEST_FN(cnm, "test_fn_abs", int (*)(int));
+    int (*sum)(int) = TEST_FN(cnm, "test_fn_sum", int (*)(int));
+    int (*loop)(int) = TEST_FN(cnm, "test_fn_loop", int (*)(int));
+    int (*dow)(int) = TEST_FN(cnm, "test_fn_dow", int (*)(int));
+    int (*swap)(int) = TEST_FN(cnm, "test_fn_swap", int (*)(int));
+    bool (*logic)(int, int) = TEST_FN(cnm, "test_fn_logic", bool (*)(int, int));
+    int (*none)(void) = TEST_FN(cnm, "test_fn_none", int (*)(void));
+    if (!abs_ || !sum || !loop || !dow || !swap || !logic || !none) return TESTFAIL;
+    if (abs_(-5) != 5 || abs_(6) != 6) return TESTFAIL;
+    if (sum(10) != 27 || sum(0) != 0) return TESTFAIL;
+    if (loop(7) != 7 || dow(7) != 8 || dow(0) != 2) return TESTFAIL;
+    if (swap(3) != 21 || swap(4) != 12) return TESTFAIL;
+    if (!logic(1, 1) || logic(1, 0) || !logic(-1, 0)) return TESTFAIL;
+    if (none() != 0) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_fn_cmp1, test_errcb)
+    if (!cnm_parse(cnm, "int test_fn_cmpf(double a, double b) {"
+                        "    return (a < b) + (a <= b) * 2 + (a > b) * 4 + (a >= b) * 8"
+                        "         + (a == b) * 16 + (a != b) * 32;"
+                        "}"
+                        "int test_fn_cmpu(unsigned a, int b) { return (a < 1u) + (b < 1) * 2; }",
+                   "test_fn_cmp1")) {
+        return TESTFAIL;
+    }
+    int (*cmpf)(double, double) = TEST_FN(cnm, "test_fn_cmpf", int (*)(double, double));
+    int (*cmpu)(unsigned, int) = TEST_FN(cnm, "test_fn_cmpu", int (*)(unsigned, int));
+    if (!cmpf || !cmpu) return TESTFAIL;
+    if (cmpf(1, 2) != 35 || cmpf(2, 2) != 26 || cmpf(3, 2) != 44) return TESTFAIL;
+
+    // Only != is true if either side is NaN
+    if (cmpf(0.0 / 0.0, 1) != 32 || cmpf(1, 0.0 / 0.0) != 32) return TESTFAIL;
+    if (cmpu(0, 0) != 3 || cmpu(-1u, -1) != 2) return TESTFAIL;
+    return true;
+}
+
+static long test_fn_ext_add(long a, long b) { return a + b; }
+static double test_fn_ext_mix(int a, double b, int c, float d, long e, long f, long g, long h,
+                              long i, double j) {
+    return a + b + c + d + e + f + g + h + i + j;
+}
+static void *test_fn_addrcb(cnm_t *cnm, const char *fn) {
+    if (strcmp(fn, "test_fn_ext_add") == 0) return (void *)test_fn_ext_add;
+    if (strcmp(fn, "test_fn_ext_mix") == 0) return (void *)test_fn_ext_mix;
+    return NULL;
+}
+GENERIC_TEST(test_fn_call1, test_errcb)
+    cnm_set_fnaddrcb(cnm, test_fn_addrcb);
+    if (!cnm_parse(cnm, "int test_fn_g = 3;"
+                        "long test_fn_ext_add(long a, long b);"
+                        "double test_fn_ext_mix(int a, double b, int c, float d, long e, long f,"
+                        "                       long g, long h, long i, double j);"
+                        "int test_fn_fib(int n) {"
+                        "    if (n < 2) return n;"
+                        "    return test_fn_fib(n - 1) + test_fn_fib(n - 2);"
+                        "}"
+                        "void test_fn_setg(int v) { test_fn_g = v * 2; }"
+                        "long test_fn_add(long a) { return test_fn_ext_add(a, 100); }"
+                        "double test_fn_mix(void) {"
+                        "    return test_fn_ext_mix(1, 2.0, 3, 4.0f, 5, 6, 7, 8, 9, 10.0);"
+                        "}",
+                   "test_fn_call1")) {
+        return TESTFAIL;
+    }
+    int (*fib)(int) = TEST_FN(cnm, "test_fn_fib", int (*)(int));
+    void (*setg)(int) = TEST_FN(cnm, "test_fn_setg", void (*)(int));
+    long (*add)(long) = TEST_FN(cnm, "test_fn_add", long (*)(long));
+    double (*mix)(void) = TEST_FN(cnm, "test_fn_mix", double (*)(void));
+    const int *g = cnm_get_global(cnm, "test_fn_g");
+    if (!fib || !setg || !add || !mix || !g) return TESTFAIL;
+    if (fib(20) != 6765) return TESTFAIL;
+    setg(21);
+    if (*g != 42) return TESTFAIL;
+    if (add(5) != 105 || mix() != 55) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_fn_call2, test_expect_errcb)
+    // Nothing gives the address of an external function
+    if (cnm_parse(cnm, "long test_fn_ext_add(long a, long b);"
+                       "long test_fn_add(long a) { return test_fn_ext_add(a, 100); }",
+                  "test_fn_call2")) {
+        return TESTFAIL;
+    }
+    return test_expect_err;
+}
+GENERIC_TEST(test_fn_call3, test_expect_errcb)
+    cnm_set_fnaddrcb(cnm, test_fn_addrcb);
+    if (cnm_parse(cnm, "long test_fn_ext_add(long a, long b);"
+                       "long test_fn_add(long a) { return test_fn_ext_add(a); }",
+                  "test_fn_call3")) {
+        return TESTFAIL;
+    }
+    return test_expect_err;
+}
+GENERIC_TEST(test_fn_regs1, test_errcb)
+    // More values are live at once than there are registers, some of them across a call
+    cnm_set_fnaddrcb(cnm, test_fn_addrcb);
+    if (!cnm_parse(cnm, "long test_fn_ext_add(long a, long b);"
+                        "long test_fn_many(long a, long b) {"
+                        "    long c = a + 1, d = b + 2, e = a * b, f = a - b, g = a ^ b, h = a | 7;"
+                        "    long i = b & 12, j = c + d, k = e + f, l = g + h, m = i + j;"
+                        "    long s = test_fn_ext_add(c, d);"
+                        "    return a + b + c + d + e + f + g + h + i + j + k + l + m + s;"
+                        "}",
+                   "test_fn_regs1")) {
+        return TESTFAIL;
+    }
+    long (*many)(long, long) = TEST_FN(cnm, "test_fn_many", long (*)(long, long));
+    if (!many) return TESTFAIL;
+
+    const long a = 37, b = -5;
+    const long c = a + 1, d = b + 2, e = a * b, f = a - b, g = a ^ b, h = a | 7;
+    const long i = b & 12, j = c + d, k = e + f, l = g + h, m = i + j;
+    if (many(a, b) != a + b + c + d + e + f + g + h + i + j + k + l + m + c + d) {
+        return TESTFAIL;
+    }
+    return true;
+}
+GENERIC_TEST(test_fn_regs2, test_errcb)
+    if (!cnm_parse(cnm, "double test_fn_many_fp(double a) {"
+                        "    double b = a + 1, c = a * 2, d = b * c, e = d - a, f = e + b, g = f * 0.5;"
+                        "    double h = g + c, i = h - d, j = i * i, k = j + a, l = k - b, m = l * c;"
+                        "    double n = m + d, o = n - e, p = o + f;"
+                        "    return a + b + c + d + e + f + g + h + i + j + k + l + m + n + o + p;"
+                        "}",
+                   "test_fn_regs2")) {
+        return TESTFAIL;
+    }
+    double (*many_fp)(double) = TEST_FN(cnm, "test_fn_many_fp", double (*)(double));
+    if (!many_fp) return TESTFAIL;
+
+    const double a = 1.25, b = a + 1, c = a * 2, d = b * c, e = d - a, f = e + b;
+    const double g = f * 0.5, h = g + c, i = h - d, j = i * i, k = j + a;
+    const double l = k - b, m = l * c, n = m + d, o = n - e, p = o + f;
+    if (many_fp(a) != a + b + c + d + e + f + g + h + i + j + k + l + m + n + o + p) {
+        return TESTFAIL;
+    }
+    return true;
+}
+GENERIC_TEST(test_fn_regs3, test_errcb)
+    // Phis that rotate around a loop need a cycle broken on the back edge
+    if (!cnm_parse(cnm, "int test_fn_rot(int n) {"
+                        "    int a = 1, b = 2, c = 3;"
+                        "    while (n-- > 0) { int t = a; a = b; b = c; c = t; }"
+                        "    return a * 100 + b * 10 + c;"
+                        "}",
+                   "test_fn_regs3")) {
+        return TESTFAIL;
+    }
+    int (*rot)(int) = TEST_FN(cnm, "test_fn_rot", int (*)(int));
+    if (!rot) return TESTFAIL;
+    if (rot(0) != 123 || rot(1) != 231 || rot(2) != 312 || rot(4) != 231) return TESTFAIL;
+    return true;
+}
+// The baseline tier makes code that does the same in one pass, which keeps
+// every value in memory and so comes out bigger
+static const char *const test_util_tier =
+    "int test_fn_sum(int n) {"
+    "    int s = 0, k = 3;"
+    "    for (int i = 0; i < n; i++) { if (i % k == 0) continue; s += i; }"
+    "    return s;"
+    "}"
+    "int test_fn_rot(int n) {"
+    "    int a = 1, b = 2, c = 3;"
+    "    while (n-- > 0) { int t = a; a = b; b = c; c = t; }"
+    "    return a * 100 + b * 10 + c;"
+    "}";
+GENERIC_TEST(test_fn_tier1, test_errcb)
+    if (!cnm_set_tier(cnm, CNM_TIER_BASELINE) || cnm_set_tier(cnm, (cnm_tier_t)2)) return TESTFAIL;
+    if (!cnm_parse(cnm, test_util_tier, "test_fn_tier1")) return TESTFAIL;
+    if (cnm_set_tier(cnm, CNM_TIER_OPTIMIZE)) return TESTFAIL;
+    int (*sum)(int) = TEST_FN(cnm, "test_fn_sum", int (*)(int));
+    int (*rot)(int) = TEST_FN(cnm, "test_fn_rot", int (*)(int));
+    if (!sum || !rot || sum(10) != 27 || rot(2) != 312 || rot(4) != 231) return TESTFAIL;
+    cnm_memstats_t st;
+    cnm_get_memstats(cnm, &st);
+    const size_t baseline = st.code.used;
+
+    cnm = cnm_init(test_region, sizeof(test_region), test_code_area, test_code_size,
+                   test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_errcb);
+    if (!cnm_parse(cnm, test_util_tier, "test_fn_tier1")) return TESTFAIL;
+    sum = TEST_FN(cnm, "test_fn_sum", int (*)(int));
+    rot = TEST_FN(cnm, "test_fn_rot", int (*)(int));
+    if (!sum || !rot || sum(10) != 27 || rot(2) != 312 || rot(4) != 231) return TESTFAIL;
+    cnm_get_memstats(cnm, &st);
+    if (st.code.used >= baseline) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_fn_err1, test_expect_errcb)
+    if (cnm_parse(cnm, "void test_fn_f(void) { return 1; }", "test_fn_err1")) return TESTFAIL;
+    return test_expect_err;
+}
+GENERIC_TEST(test_fn_err2, test_expect_errcb)
+    if (cnm_parse(cnm, "int test_fn_f(int a) { if (a) break; return a; }", "test_fn_err2")) return TESTFAIL;
+    return test_expect_err;
+}
+GENERIC_TEST(test_fn_err3, test_expect_errcb)
+    if (cnm_parse(cnm, "int test_fn_f(int a) { return test_fn_nope(a); }", "test_fn_err3")) return TESTFAIL;
+    return test_expect_err;
+}
+GENERIC_TEST(test_fn_err4, test_expect_errcb)
+    if (cnm_parse(cnm, "int test_fn_f(const int a) { a = 1; return a; }", "test_fn_err4")) return TESTFAIL;
+    return test_expect_err;
+}
+
+// Interpreter
+static uint8_t test_interp_code[16384] __attribute__((aligned(16)));
+#define TEST_INTERP(_name) \
+    static bool _name(void) { \
+        cnm_t *cnm = cnm_init(test_region, sizeof(test_region), \
+                              test_interp_code, sizeof(test_interp_code), \
+                              test_globals, sizeof(test_globals)); \
+        cnm_set_errcb(cnm, test_errcb); \
+        if (!cnm_set_interp(cnm, true)) return TESTFAIL;
+#define TEST_CALL(_cnm, _name, ...) \
+    cnm_interp_call(cnm_fn_addr(cnm_get_fn(_cnm, _name)), (cnm_val_t[]){ __VA_ARGS__ })
+#define TEST_I(_v) ((cnm_val_t){ .i = (_v) })
+TEST_INTERP(test_interp1)
+    if (!cnm_parse(cnm, "int test_fn_fib(int n) {"
+                        "    if (n < 2) return n;"
+                        "    return test_fn_fib(n - 1) + test_fn_fib(n - 2);"
+                        "}"
+                        "int test_fn_sum(int n) {"
+                        "    int s = 0;"
+                        "    for (int i = 0; i < n; i++) { if (i % 3 == 0) continue; s += i; }"
+                        "    return s;"
+                        "}"
+                        "int test_fn_swap(int n) {"
+                        "    int a = 1, b = 2;"
+                        "    while (n-- > 0) { int t = a; a = b; b = t; }"
+                        "    return a * 10 + b;"
+                        "}"
+                        "unsigned char test_fn_wrap(int a) { unsigned char c = a; c += 10; return c; }"
+                        "int test_fn_shr(int a, unsigned b) { return (a >> 2) + (b >> 2) + -7 / 2 + -7 % 2; }",
+                   "test_interp1")) {
+        return TESTFAIL;
+    }
+
+    // Handles point into the code buffer, which is never executed
+    const uint8_t *const fib = cnm_fn_addr(cnm_get_fn(cnm, "test_fn_fib"));
+    if (fib < test_interp_code || fib >= test_interp_code + sizeof(test_interp_code)) {
+        return TESTFAIL;
+    }
+    if (TEST_CALL(cnm, "test_fn_fib", TEST_I(20)).i != 6765) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_sum", TEST_I(10)).i != 27) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_swap", TEST_I(3)).i != 21) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_swap", TEST_I(4)).i != 12) return TESTFAIL;
+
+    // Narrow parameters are extended even if the caller left junk above them
+    if (TEST_CALL(cnm, "test_fn_wrap", TEST_I(250)).i != 4) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_shr", TEST_I(-20), { .u = 0xFFFFFFFF0FFFFFFF }).i != 67108854) {
+        return TESTFAIL;
+    }
+    return true;
+}
+TEST_INTERP(test_interp2)
+    cnm_set_fnaddrcb(cnm, test_fn_addrcb);
+    if (!cnm_parse(cnm, "int test_fn_g = 3;"
+                        "long test_fn_ext_add(long a, long b);"
+                        "void test_fn_setg(int v) { test_fn_g = v * 2; }"
+                        "long test_fn_add(long a) { return test_fn_ext_add(a, 100); }"
+                        "double test_fn_fp(double a, float b) { return a * b - 1.5; }"
+                        "float test_fn_half(int a) { float f = a; return f / 2; }",
+                   "test_interp2")) {
+        return TESTFAIL;
+    }
+    const int *g = cnm_get_global(cnm, "test_fn_g");
+    TEST_CALL(cnm, "test_fn_setg", TEST_I(21));
+    if (!g || *g != 42) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_add", TEST_I(5)).i != 105) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_fp", { .d = 2.0 }, { .f = 1.5f }).d != 1.5) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_half", TEST_I(-3)).f != -1.5f) return TESTFAIL;
+    return true;
+}
+TEST_INTERP(test_interp3)
+    if (!cnm_parse(cnm, "int test_fn_cmpf(double a, double b) {"
+                        "    return (a < b) + (a <= b) * 2 + (a > b) * 4 + (a >= b) * 8"
+                        "         + (a == b) * 16 + (a != b) * 32;"
+                        "}"
+                        "unsigned long test_fn_u2d(unsigned long x) { double d = x; return d; }",
+                   "test_interp3")) {
+        return TESTFAIL;
+    }
+    if (TEST_CALL(cnm, "test_fn_cmpf", { .d = 1 }, { .d = 2 }).i != 35) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_cmpf", { .d = 0.0 / 0.0 }, { .d = 1 }).i != 32) return TESTFAIL;
+    const unsigned long long big = 18446744073709549568ull;
+    if (TEST_CALL(cnm, "test_fn_u2d", { .u = big }).u != big) return TESTFAIL;
+    return true;
+}
+TEST_INTERP(test_interp4)
+    // The engine can't change once code is generated
+    if (!cnm_parse(cnm, "int test_fn_one(void) { return 1; }", "test_interp4")) return TESTFAIL;
+    if (cnm_set_interp(cnm, false) || !cnm_set_interp(cnm, true)) return TESTFAIL;
+    if (TEST_CALL(cnm, "test_fn_one", TEST_I(0)).i != 1) return TESTFAIL;
+
+    cnm = cnm_init(test_region, sizeof(test_region), test_interp_code, 64,
+                   test_globals, sizeof(test_globals));
+    cnm_set_errcb(cnm, test_expect_errcb);
+    if (!cnm_set_interp(cnm, true)) return TESTFAIL;
+    if (cnm_parse(cnm, "int test_fn_sum(int n) { int s = 0; while (n) s += n--; return s; }",
+                  "test_interp4")) {
+        return TESTFAIL;
+    }
+    return test_expect_err;
+}
+
+// Only the first len bytes are parsed, even if valid code comes after them
+GENERIC_TEST(test_parse_n1, test_errcb)
+    static const char src[] = "int test_n1 = 12; int test_n2 = 34; int test_n3 = 56;";
+    if (!cnm_parse_n(cnm, src, strlen("int test_n1 = 12; int test_n2 = 34;"), "test_parse_n1")) {
+        return TESTFAIL;
+    }
+    const int *n1 = cnm_get_global(cnm, "test_n1"), *n2 = cnm_get_global(cnm, "test_n2");
+    if (!n1 || *n1 != 12 || !n2 || *n2 != 34) return TESTFAIL;
+    if (cnm_get_global(cnm, "test_n3")) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_parse_n2, test_expect_errcb)
+    // The number ends where the source does, not where the digits do
+    if (cnm_parse_n(cnm, "int test_n1 = 123;", strlen("int test_n1 = 12"), "test_parse_n2")) {
+        return TESTFAIL;
+    }
+    return test_expect_err;
+}
+
+// Writes a file that is exactly size bytes long (padded with spaces in front of
+// src) so that the source ends on a page boundary
+static bool test_write_file(char *path, const char *src, size_t size) {
+    const int fd = mkstemp(path);
+    if (fd < 0) return false;
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) return false;
+    for (size_t i = strlen(src); i < size; i++) fputc(i % 64 ? ' ' : '\n', fp);
+    fputs(src, fp);
+    return fclose(fp) == 0;
+}
+GENERIC_TEST(test_parse_file1, test_errcb)
+    char path[] = "/tmp/test_parse_file1_XXXXXX";
+    if (!test_write_file(path, "int test_file_x = 5; int test_file_y = 6;", 8192)) {
+        return TESTFAIL;
+    }
+
+    cnm_file_t file;
+    const bool parsed = cnm_parse_file(cnm, path, &file);
+    remove(path);
+    if (!parsed || file.len != 8192) return TESTFAIL;
+
+    // Names point into the file, so look them up before it is unmapped
+    const int *x = cnm_get_global(cnm, "test_file_x"), *y = cnm_get_global(cnm, "test_file_y");
+    if (!x || *x != 5 || !y || *y != 6) return TESTFAIL;
+    cnm_unmap_file(&file);
+    if (file.src) return TESTFAIL;
+    return true;
+}
+GENERIC_TEST(test_parse_file2, test_expect_errcb)
+    // Identifier right at the end of the file
+    char path[] = "/tmp/test_parse_file2_XXXXXX";
+    if (!test_write_file(path, "int test_file_x = 5; int test_file_with_a_long_name", 4096)) {
+        return TESTFAIL;
+    }
+
+    cnm_file_t file;
+    const bool parsed = cnm_parse_file(cnm, path, &file);
+    remove(path);
+    if (parsed || !file.src) return TESTFAIL;
+    cnm_unmap_file(&file);
+
+    // Files that don't exist can't be parsed
+    if (cnm_parse_file(cnm, "/tmp/test_parse_file2_does_not_exist", &file) || file.src) {
+        return TESTFAIL;
+    }
+    return test_expect_err;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // Tester
@@ -2885,7 +4283,22 @@ typedef struct test_s {
 static test_t tests[] = {
     // Lexer Tests
     TEST(test_lexer_uninitialized),
+    TEST(test_lexer_error_line1),
+    TEST(test_lexer_error_line2),
+    TEST(test_lexer_error_line3),
+    TEST(test_lexer_error_line4),
+    TEST(test_lexer_error_line5),
     TEST(test_lexer_ident),
+    TEST(test_lexer_whitespace),
+    TEST(test_lexer_unknown_char),
+    TEST(test_lexer_scanners1),
+    TEST(test_lexer_scanners2),
+    TEST(test_lexer_scanners3),
+    TEST(test_lexer_scanners4),
+    TEST(test_lexer_keywords),
+    TEST(test_lexer_keywords_near_miss),
+    TEST(test_lexer_ident_intern1),
+    TEST(test_lexer_ident_intern2),
     TEST(test_lexer_string1),
     TEST(test_lexer_string2),
     TEST(test_lexer_string3),
@@ -2893,6 +4306,14 @@ static test_t tests[] = {
     TEST(test_lexer_string5),
     TEST(test_lexer_string6),
     TEST(test_lexer_string7),
+    TEST(test_lexer_string_dedup1),
+    TEST(test_lexer_string_dedup2),
+    TEST(test_lexer_string_utf8_1),
+    TEST(test_lexer_string_utf8_2),
+    TEST(test_lexer_string_utf8_3),
+    TEST(test_lexer_string_utf8_4),
+    TEST(test_lexer_string_fill1),
+    TEST(test_lexer_string_fill2),
     TEST(test_lexer_char1),
     TEST(test_lexer_char2),
     TEST(test_lexer_char3),
@@ -3084,12 +4505,68 @@ static test_t tests[] = {
     TEST(test_global_variable19),
     TEST(test_global_variable20),
     TEST(test_global_variable21),
+    TEST(test_global_variable22),
+    TEST(test_scope_shadow1),
+    TEST(test_scope_shadow2),
+    TEST(test_scope_depth),
+    TEST_PADDING,
+    TEST(test_structid1),
+    TEST(test_structid2),
+    TEST_PADDING,
+    TEST(test_region_chunks1),
+    TEST(test_region_chunks2),
+    TEST(test_region_flat),
+    TEST(test_region_peak),
+    TEST(test_memstats1),
+    TEST_PADDING,
+    TEST(test_type_canon1),
+    TEST(test_type_canon2),
+    TEST(test_type_fields1),
+    TEST_PADDING,
+    TEST(test_rtti1),
+    TEST(test_rtti_snap1),
+    TEST_PADDING,
+    TEST(test_pack_globals1),
+    TEST(test_pack_globals2),
+    TEST_PADDING,
+    TEST(test_copy1),
+    TEST(test_copy2),
+    TEST_PADDING,
+    TEST(test_ir_expr1),
+    TEST(test_ir_expr2),
+    TEST(test_ir_phi1),
+    TEST(test_ir_opt1),
+    TEST_PADDING,
+    TEST(test_fn_arith1),
+    TEST(test_fn_flow1),
+    TEST(test_fn_cmp1),
+    TEST(test_fn_call1),
+    TEST(test_fn_call2),
+    TEST(test_fn_call3),
+    TEST(test_fn_regs1),
+    TEST(test_fn_regs2),
+    TEST(test_fn_regs3),
+    TEST(test_fn_tier1),
+    TEST(test_fn_err1),
+    TEST(test_fn_err2),
+    TEST(test_fn_err3),
+    TEST(test_fn_err4),
+    TEST_PADDING,
+    TEST(test_interp1),
+    TEST(test_interp2),
+    TEST(test_interp3),
+    TEST(test_interp4),
+    TEST_PADDING,
+    TEST(test_parse_n1),
+    TEST(test_parse_n2),
+    TEST(test_parse_file1),
+    TEST(test_parse_file2),
 };
 
 int main(int argc, char **argv) {
     printf("cnm tester\n");
    
-    test_code_size = 2048;
+    test_code_size = 16384;
     test_code_area = mmap(NULL, test_code_size, PROT_EXEC | PROT_READ | PROT_WRITE,
                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 